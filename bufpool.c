@@ -0,0 +1,84 @@
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+#define BUFPOOL_CHUNK   (1u << BUFPOOL_CHUNK_BITS)
+
+struct bufpool {
+    size_t size;                // bytes per buffer, rounded up to keep the free links aligned
+    unsigned char **chunks;
+    uint32_t nchunks;
+    uint32_t first;             // first free buffer, BUFPOOL_NONE if all are lent
+    size_t lent;
+};
+
+
+int bufpool_create(bufpool_t **pool, size_t size) {
+    bufpool_t *p = malloc(sizeof(bufpool_t));
+    if (p == NULL) return BUFPOOL_MEMORY_ERROR;
+    p->size = (size + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+    p->chunks = NULL;
+    p->nchunks = 0;
+    p->first = BUFPOOL_NONE;
+    p->lent = 0;
+    *pool = p;
+    return BUFPOOL_NO_ERROR;
+}
+
+
+void bufpool_free(bufpool_t **pool) {
+    if (pool == NULL || *pool == NULL) return;
+    for (uint32_t i = 0; i < (*pool)->nchunks; i++) free((*pool)->chunks[i]);
+    free((*pool)->chunks);
+    free(*pool);
+    *pool = NULL;
+}
+
+
+static inline uint32_t *bufpool_link(bufpool_t *p, uint32_t index) {
+    return (uint32_t *) bufpool_at(p, index);
+}
+
+uint32_t bufpool_get(bufpool_t *p) {
+    if (p->first == BUFPOOL_NONE) {
+        if ((uint64_t) (p->nchunks + 1) << BUFPOOL_CHUNK_BITS >= BUFPOOL_NONE) return BUFPOOL_NONE;
+        unsigned char **c = realloc(p->chunks, sizeof(unsigned char *) * (p->nchunks + 1));
+        if (c == NULL) return BUFPOOL_NONE;
+        p->chunks = c;
+        c[p->nchunks] = malloc(p->size * BUFPOOL_CHUNK);
+        if (c[p->nchunks] == NULL) return BUFPOOL_NONE;
+        // chain the new buffers, lowest index first
+        uint32_t base = p->nchunks++ << BUFPOOL_CHUNK_BITS;
+        for (uint32_t i = 0; i < BUFPOOL_CHUNK; i++) {
+            *bufpool_link(p, base + i) = i + 1 < BUFPOOL_CHUNK ? base + i + 1 : BUFPOOL_NONE;
+        }
+        p->first = base;
+    }
+    uint32_t index = p->first;
+    p->first = *bufpool_link(p, index);
+    p->lent++;
+    return index;
+}
+
+
+void bufpool_put(bufpool_t *p, uint32_t index) {
+    if (index == BUFPOOL_NONE) return;
+    *bufpool_link(p, index) = p->first;
+    p->first = index;
+    p->lent--;
+}
+
+
+void *bufpool_at(bufpool_t *p, uint32_t index) {
+    return p->chunks[index >> BUFPOOL_CHUNK_BITS] + (size_t) (index & (BUFPOOL_CHUNK - 1)) * p->size;
+}
+
+
+size_t bufpool_lent(bufpool_t *p) {
+    return p->lent;
+}
+
+
+size_t bufpool_bytes(bufpool_t *p) {
+    return sizeof(bufpool_t) + (sizeof(unsigned char *) + p->size * BUFPOOL_CHUNK) * p->nchunks;
+}
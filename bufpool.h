@@ -0,0 +1,69 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUFPOOL_NO_ERROR        0
+#define BUFPOOL_MEMORY_ERROR    1  // mem alloc error
+
+#define BUFPOOL_NONE            UINT32_MAX  // no buffer
+#define BUFPOOL_CHUNK_BITS      10          // buffers per allocation: 1024
+
+/*
+ * Pool of equal buffers lent out by a 32 bit index, for state most users
+ * only hold for a moment: a connection borrows one while it has data
+ * pending and gives it back after, an idle one holds nothing but the
+ * index. The pool grows in chunks and never moves a buffer, so a pointer
+ * from bufpool_at() stays valid until the buffer is put back. Free buffers
+ * are chained through their first bytes, a buffer is at least 4 bytes.
+ * One pool belongs to one thread.
+ */
+
+typedef struct bufpool bufpool_t;
+
+
+int bufpool_create(bufpool_t **pool, size_t size);
+
+/* Creates an empty pool of buffers of 'size' bytes
+ * If memory allocation fails, BUFPOOL_MEMORY_ERROR is returned
+ */
+
+
+void bufpool_free(bufpool_t **pool);
+
+/* Frees all buffers, lent or not, and sets '*pool' to NULL
+ */
+
+
+uint32_t bufpool_get(bufpool_t *pool);
+
+/* Lends a buffer and returns its index, or BUFPOOL_NONE if the pool can't grow; the content is undefined
+ */
+
+
+void bufpool_put(bufpool_t *pool, uint32_t index);
+
+/* Gives back the buffer 'index', BUFPOOL_NONE is ignored
+ */
+
+
+void *bufpool_at(bufpool_t *pool, uint32_t index);
+
+/* Returns the buffer 'index' of a lent buffer
+ */
+
+
+size_t bufpool_lent(bufpool_t *pool);
+
+/* Returns the number of buffers lent out
+ */
+
+
+size_t bufpool_bytes(bufpool_t *pool);
+
+/* Returns the memory the pool holds, lent or free
+ */
+
+
+#endif  //__BUFPOOL_H__
@@ -0,0 +1,291 @@
+/*
+ * Connection churn against the server: starts it with a short idle
+ * timeout and keeps opening connections that end every way a sensor can
+ * go - a clean close, a half close waiting for the server's close, a
+ * reset, a close in the middle of a record, and silence until the timeout
+ * closes it - while one live sensor keeps sending. Idle connections time
+ * out in the middle of the churn, so their timers race with descriptors
+ * being reused by new connections; the live sensor must never be closed.
+ *
+ * Checks that every accepted connection is closed exactly once for one
+ * reason, that the idle ones are the timed out ones, and that descriptors
+ * and resident memory of the server are back to where they were after the
+ * first round.
+ *
+ * Usage: churn_test server port [rounds]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "config.h"
+
+#define CHURN_TIMEOUT       2       // idle timeout of the server, seconds
+#define CHURN_ROUND_MS      3000    // connections are opened for this long per round
+#define CHURN_BURST         10      // connections opened every CHURN_BURST_MS
+#define CHURN_BURST_MS      20
+#define CHURN_LIVE_MS       200     // the live sensor sends this often
+#define CHURN_MAX_IDLE      4096
+#define CHURN_RSS_SLACK_KB  1024    // allocator noise tolerated after the first round
+
+enum {
+    CHURN_CLOSE, CHURN_HALF, CHURN_RESET, CHURN_PARTIAL, CHURN_IDLE, CHURN_KINDS
+};
+
+static int port;
+static int live = -1;
+static uint64_t live_at;
+static sensor_ts_t live_ts;
+static uint64_t connects, idles;
+
+static uint64_t churn_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static long churn_rss_kb(int pid) {
+    char path[64], line[256];
+    long kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static int churn_fds(int pid) {
+    char path[64];
+    int n = 0;
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *d = opendir(path);
+    if (d == NULL) return -1;
+    while (readdir(d) != NULL) n++;
+    closedir(d);
+    return n - 2;
+}
+
+static int churn_connect() {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t) port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0) return -1;
+    if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sd);
+        return -1;
+    }
+    connects++;
+    return sd;
+}
+
+static int churn_send(int sd, sensor_id_t id, int records, size_t extra) {
+    unsigned char buf[16 * SENSOR_DATA_WIRE_SIZE];
+    for (int i = 0; i < records; i++) {
+        sensor_data_t data = {.id = id, .value = 20.0 + i, .ts = ++live_ts};
+        sensor_data_pack(buf + i * SENSOR_DATA_WIRE_SIZE, &data);
+    }
+    size_t len = (size_t) records * SENSOR_DATA_WIRE_SIZE + extra;
+    return send(sd, buf, len, MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+/*
+ * Keeps the live sensor sending; fails if the server closed it.
+ */
+static int churn_feed() {
+    if (churn_clock() - live_at < CHURN_LIVE_MS) return 0;
+    live_at = churn_clock();
+    char c;
+    if (recv(live, &c, 1, MSG_DONTWAIT) == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return -1;
+    return churn_send(live, 1, 1, 0);
+}
+
+static int churn_sleep(int ms) {
+    uint64_t end = churn_clock() + (uint64_t) ms;
+    while (churn_clock() < end) {
+        if (churn_feed() != 0) return -1;
+        usleep(5000);
+    }
+    return 0;
+}
+
+/*
+ * Waits until the server closed 'sd' (EOF or reset), at most 'ms'.
+ */
+static int churn_closed(int sd, int ms) {
+    uint64_t end = churn_clock() + (uint64_t) ms;
+    char buf[64];
+    while (churn_clock() < end) {
+        struct pollfd pfd = {.fd = sd, .events = POLLIN};
+        if (poll(&pfd, 1, 10) > 0) {
+            ssize_t n = recv(sd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno == ECONNRESET)) return 0;
+        }
+        if (churn_feed() != 0) return -1;
+    }
+    return -1;
+}
+
+static int churn_one(int kind, int *idle, int *nidle) {
+    int sd = churn_connect();
+    if (sd < 0) return -1;
+    sensor_id_t id = (sensor_id_t) (100 + connects % 1000);
+    int res = 0;
+    switch (kind) {
+        case CHURN_CLOSE:
+            res = churn_send(sd, id, 5, 0);
+            break;
+        case CHURN_HALF:
+            // the server sees EOF, drains and closes its end
+            res = churn_send(sd, id, 3, 0);
+            shutdown(sd, SHUT_WR);
+            if (res == 0) res = churn_closed(sd, 1000);
+            break;
+        case CHURN_RESET: {
+            struct linger lg = {.l_onoff = 1, .l_linger = 0};
+            res = churn_send(sd, id, 1, 0);
+            setsockopt(sd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            break;
+        }
+        case CHURN_PARTIAL:
+            res = churn_send(sd, id, 2, SENSOR_DATA_WIRE_SIZE / 2);
+            break;
+        default:
+            if (*nidle == CHURN_MAX_IDLE) break;
+            // silent until the server times it out, its descriptor is reused meanwhile
+            idle[(*nidle)++] = sd;
+            idles++;
+            return 0;
+    }
+    close(sd);
+    return res;
+}
+
+static int churn_round(int *idle, int *nidle) {
+    uint64_t end = churn_clock() + CHURN_ROUND_MS;
+    int kind = 0;
+    while (churn_clock() < end) {
+        for (int i = 0; i < CHURN_BURST; i++) {
+            if (churn_one(kind, idle, nidle) != 0) return -1;
+            kind = (kind + 1) % CHURN_KINDS;
+        }
+        if (churn_sleep(CHURN_BURST_MS) != 0) return -1;
+    }
+    // the idle ones opened last time out about CHURN_TIMEOUT seconds later
+    for (int i = 0; i < *nidle; i++) {
+        if (churn_closed(idle[i], (CHURN_TIMEOUT + 3) * 1000) != 0) {
+            fprintf(stderr, "FAIL: an idle connection was not timed out\n");
+            return -1;
+        }
+        close(idle[i]);
+    }
+    *nidle = 0;
+    // let the server see the last closes
+    return churn_sleep(300);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s server port [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    port = atoi(argv[2]);
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    char dir[] = "/tmp/churn_test.XXXXXX", out[64], timeout[16], portarg[16];
+    int pipefd[2];
+    if (mkdtemp(dir) == NULL || pipe(pipefd) != 0) {
+        perror("churn_test");
+        return EXIT_FAILURE;
+    }
+    snprintf(out, sizeof(out), "%s/out", dir);
+    snprintf(timeout, sizeof(timeout), "%d", CHURN_TIMEOUT);
+    snprintf(portarg, sizeof(portarg), "%d", port);
+    int pid = fork();
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        execl(argv[1], argv[1], "-p", portarg, "-t", timeout, "-q", "-o", out, (char *) NULL);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    for (int i = 0; i < 100 && live < 0; i++) {
+        live = churn_connect();
+        if (live < 0) usleep(10000);
+    }
+    int *idle = calloc(CHURN_MAX_IDLE, sizeof(int));
+    int nidle = 0, fail = live < 0 || idle == NULL;
+    if (fail) fprintf(stderr, "FAIL: the server doesn't accept on port %d\n", port);
+    int fds = -1;
+    long rss = -1;
+    for (int r = 0; r < rounds && !fail; r++) {
+        fail = churn_round(idle, &nidle) != 0;
+        if (fail) fprintf(stderr, "FAIL: round %d, the live sensor or a connection was lost\n", r);
+        // the first round warms up pools and tables, later ones must give back what they take
+        if (r == 0) {
+            fds = churn_fds(pid);
+            rss = churn_rss_kb(pid);
+        }
+    }
+    int fds_end = churn_fds(pid);
+    long rss_end = churn_rss_kb(pid);
+    printf("%"PRIu64" connections (%"PRIu64" idle), descriptors %d -> %d, resident %ld -> %ld kB\n", connects,
+           idles, fds, fds_end, rss, rss_end);
+    if (!fail && fds_end != fds) {
+        fprintf(stderr, "FAIL: the server holds %d descriptors more than after the first round\n", fds_end - fds);
+        fail = 1;
+    }
+    if (!fail && rss_end - rss > CHURN_RSS_SLACK_KB) {
+        fprintf(stderr, "FAIL: the server grew by %ld kB after the first round\n", rss_end - rss);
+        fail = 1;
+    }
+    // without connections the server shuts down after the idle timeout and reports
+    if (live >= 0) close(live);
+    if (fail) kill(pid, SIGKILL);
+    int status;
+    waitpid(pid, &status, 0);
+    char line[512];
+    uint64_t accepted = 0, adopted, attached, peer = 0, timedout = 0, failed = 0, handedoff = 0;
+    int found = 0;
+    FILE *f = fdopen(pipefd[0], "r");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        found |= sscanf(line, "Connections: %"SCNu64" accepted, %"SCNu64" adopted, %"SCNu64" rings attached, %"
+                              SCNu64" closed by peer, %"SCNu64" timed out, %"SCNu64" failed, %"SCNu64" handed off",
+                        &accepted, &adopted, &attached, &peer, &timedout, &failed, &handedoff) == 7;
+    }
+    if (f != NULL) fclose(f);
+    unlink(out);
+    rmdir(dir);
+    free(idle);
+    if (fail) return EXIT_FAILURE;
+    printf("server: %"PRIu64" accepted, %"PRIu64" closed by peer, %"PRIu64" timed out, %"PRIu64" failed\n", accepted,
+           peer, timedout, failed);
+    if (!found) {
+        fprintf(stderr, "FAIL: the server didn't report its connections\n");
+        return EXIT_FAILURE;
+    }
+    if (accepted != connects || peer + timedout + failed + handedoff != accepted) {
+        fprintf(stderr, "FAIL: %"PRIu64" connections, %"PRIu64" accepted, %"PRIu64" closed\n", connects, accepted,
+                peer + timedout + failed + handedoff);
+        return EXIT_FAILURE;
+    }
+    if (timedout != idles) {
+        fprintf(stderr, "FAIL: %"PRIu64" idle connections, %"PRIu64" timed out\n", idles, timedout);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
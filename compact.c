@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "compact.h"
+#include "retain.h"
+
+#define COMPACT_READ_MIN    (64u << 10)     // smallest read buffer of a run being merged
+#define COMPACT_FANIN_MAX   1024            // runs merged at once, bounds the open descriptors
+#define COMPACT_WRITE_BYTES (1u << 20)      // output buffer of a merge
+#define COMPACT_SENSORS     (UINT16_MAX + 1)
+
+/*
+ * A record while its run is sorted: same size as a sensor_data_t, with its
+ * position in the run in the padding so equal keys keep their order.
+ */
+typedef struct {
+    sensor_ts_t ts;
+    sensor_value_t value;
+    sensor_id_t id;
+    uint32_t seq;
+} compact_rec_t;
+
+#define COMPACT_RECORD_COST (sizeof(compact_rec_t) + SENSOR_DATA_WIRE_SIZE)   // memory per record of a run
+
+typedef struct {
+    int in_fd;
+    uint64_t in_start;          // first record of the input kept by its retention, the ones before are holes
+    uint64_t records;           // in the input, from 'in_start' on
+    uint64_t run_records;       // per run, the last one may be shorter
+    uint32_t nruns;
+    int spill;                  // runs go to files, otherwise they stay in 'mem'
+    char **paths;
+    unsigned char **mem;
+    uint64_t *lens;             // records per run
+    _Atomic uint32_t next;      // next run to sort
+    _Atomic int error;
+} compact_job_t;
+
+typedef struct {
+    int fd;                     // -1 for a run in memory
+    unsigned char *buf;
+    size_t size;                // bytes of 'buf', a multiple of the record size
+    size_t len;
+    size_t pos;
+    uint32_t run;               // order of the run in the input, breaks ties
+    sensor_data_t cur;
+} compact_reader_t;
+
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    int error;
+    uint64_t records;
+    compact_entry_t *entries;   // NULL for an intermediate run
+    uint32_t nentries;
+} compact_writer_t;
+
+
+static uint64_t compact_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static int compact_write_all(int fd, const void *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *) data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+static int compact_read_at(int fd, void *data, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *) data + done, len - done, offset + (off_t) done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+static int compact_cmp(const void *a, const void *b) {
+    const compact_rec_t *x = (const compact_rec_t *) a, *y = (const compact_rec_t *) b;
+    if (x->id != y->id) return x->id < y->id ? -1 : 1;
+    if (x->ts != y->ts) return x->ts < y->ts ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void *compact_worker(void *arg) {
+    compact_job_t *job = (compact_job_t *) arg;
+    uint32_t run;
+    while (!atomic_load(&job->error) && (run = atomic_fetch_add(&job->next, 1)) < job->nruns) {
+        uint64_t first = (uint64_t) run * job->run_records;
+        uint64_t n = job->records - first < job->run_records ? job->records - first : job->run_records;
+        size_t bytes = (size_t) n * SENSOR_DATA_WIRE_SIZE;
+        unsigned char *raw = malloc(bytes ? bytes : 1);
+        compact_rec_t *recs = malloc(sizeof(compact_rec_t) * (n ? n : 1));
+        if (raw == NULL || recs == NULL) {
+            free(raw);
+            free(recs);
+            atomic_store(&job->error, COMPACT_MEMORY_ERROR);
+            break;
+        }
+        off_t offset = (off_t) ((job->in_start + first) * SENSOR_DATA_WIRE_SIZE);
+        int res = compact_read_at(job->in_fd, raw, bytes, offset);
+        for (uint64_t i = 0; res == 0 && i < n; i++) {
+            sensor_data_t data;
+            sensor_data_unpack(&data, raw + i * SENSOR_DATA_WIRE_SIZE);
+            recs[i] = (compact_rec_t) {.ts = data.ts, .value = data.value, .id = data.id, .seq = (uint32_t) i};
+        }
+        if (res == 0) qsort(recs, n, sizeof(compact_rec_t), &compact_cmp);
+        for (uint64_t i = 0; res == 0 && i < n; i++) {
+            sensor_data_t data = {.id = recs[i].id, .value = recs[i].value, .ts = recs[i].ts};
+            sensor_data_pack(raw + i * SENSOR_DATA_WIRE_SIZE, &data);
+        }
+        free(recs);
+        job->lens[run] = n;
+        if (res == 0 && job->spill) {
+            int fd = open(job->paths[run], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            res = fd < 0 || compact_write_all(fd, raw, bytes) != 0;
+            if (fd >= 0) close(fd);
+            free(raw);
+        } else if (res == 0) job->mem[run] = raw;
+        else free(raw);
+        if (res != 0) atomic_store(&job->error, COMPACT_FILE_ERROR);
+    }
+    return NULL;
+}
+
+static int compact_next(compact_reader_t *r) {
+    if (r->pos + SENSOR_DATA_WIRE_SIZE > r->len) {
+        if (r->fd < 0) return 0;
+        ssize_t n;
+        do n = read(r->fd, r->buf, r->size);
+        while (n < 0 && errno == EINTR);
+        if (n < (ssize_t) SENSOR_DATA_WIRE_SIZE) return n < 0 ? -1 : 0;
+        // runs are written in whole records, a short read still ends on a record
+        r->len = (size_t) n;
+        r->pos = 0;
+    }
+    sensor_data_unpack(&r->cur, r->buf + r->pos);
+    r->pos += SENSOR_DATA_WIRE_SIZE;
+    return 1;
+}
+
+static inline int compact_less(const compact_reader_t *a, const compact_reader_t *b) {
+    if (a->cur.id != b->cur.id) return a->cur.id < b->cur.id;
+    if (a->cur.ts != b->cur.ts) return a->cur.ts < b->cur.ts;
+    return a->run < b->run;
+}
+
+static void compact_sift(compact_reader_t **heap, int n, int i) {
+    while (1) {
+        int l = 2 * i + 1, m = i;
+        if (l < n && compact_less(heap[l], heap[m])) m = l;
+        if (l + 1 < n && compact_less(heap[l + 1], heap[m])) m = l + 1;
+        if (m == i) return;
+        compact_reader_t *t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+static void compact_emit(compact_writer_t *w, const sensor_data_t *data) {
+    if (w->len + SENSOR_DATA_WIRE_SIZE > COMPACT_WRITE_BYTES) {
+        if (compact_write_all(w->fd, w->buf, w->len) != 0) w->error = 1;
+        w->len = 0;
+    }
+    sensor_data_pack(w->buf + w->len, data);
+    w->len += SENSOR_DATA_WIRE_SIZE;
+    if (w->entries != NULL) {
+        compact_entry_t *e = w->nentries ? &w->entries[w->nentries - 1] : NULL;
+        if (e == NULL || e->id != data->id) {
+            e = &w->entries[w->nentries++];
+            memset(e, 0, sizeof(*e));
+            e->id = data->id;
+            e->offset = w->records;
+            e->from = data->ts;
+        }
+        e->count++;
+        e->to = data->ts;
+    }
+    w->records++;
+}
+
+/*
+ * Merges 'n' runs into 'w': runs[i] is either a file or in memory, 'buf'
+ * splits into the read buffers of the files.
+ */
+static int compact_merge(compact_job_t *job, uint32_t first, uint32_t n, unsigned char *buf, size_t bytes,
+                         compact_writer_t *w) {
+    compact_reader_t *readers = calloc(n + 1, sizeof(compact_reader_t));
+    compact_reader_t **heap = calloc(n + 1, sizeof(compact_reader_t *));
+    int res = (readers == NULL || heap == NULL) ? COMPACT_MEMORY_ERROR : COMPACT_NO_ERROR, nheap = 0;
+    size_t size = bytes / (n ? n : 1) / SENSOR_DATA_WIRE_SIZE * SENSOR_DATA_WIRE_SIZE;
+    for (uint32_t i = 0; res == COMPACT_NO_ERROR && i < n; i++) {
+        compact_reader_t *r = &readers[i];
+        r->run = first + i;
+        r->fd = -1;
+        if (job->spill) {
+            r->fd = open(job->paths[first + i], O_RDONLY | O_CLOEXEC);
+            if (r->fd < 0) {
+                res = COMPACT_FILE_ERROR;
+                break;
+            }
+            posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            r->buf = buf + i * size;
+            r->size = size;
+        } else {
+            r->buf = job->mem[first + i];
+            r->len = (size_t) job->lens[first + i] * SENSOR_DATA_WIRE_SIZE;
+        }
+        int more = compact_next(r);
+        if (more < 0) res = COMPACT_FILE_ERROR;
+        else if (more) heap[nheap++] = r;
+    }
+    for (int i = nheap / 2 - 1; i >= 0; i--) compact_sift(heap, nheap, i);
+    while (res == COMPACT_NO_ERROR && nheap > 0) {
+        compact_emit(w, &heap[0]->cur);
+        int more = compact_next(heap[0]);
+        if (more < 0) res = COMPACT_FILE_ERROR;
+        else if (!more) heap[0] = heap[--nheap];
+        compact_sift(heap, nheap, 0);
+    }
+    if (w->len > 0 && compact_write_all(w->fd, w->buf, w->len) != 0) w->error = 1;
+    w->len = 0;
+    if (res == COMPACT_NO_ERROR && w->error) res = COMPACT_FILE_ERROR;
+    for (uint32_t i = 0; readers != NULL && i < n; i++) {
+        if (readers[i].fd >= 0) close(readers[i].fd);
+    }
+    free(readers);
+    free(heap);
+    return res;
+}
+
+static char *compact_run_path(const char *dir, const char *output, int pass, uint32_t run) {
+    char *copy = strdup(output);
+    if (copy == NULL) return NULL;
+    size_t len = strlen(dir) + strlen(copy) + 64;
+    char *path = malloc(len);
+    if (path != NULL) snprintf(path, len, "%s/%s.%d.%d.%u.run", dir, basename(copy), (int) getpid(), pass, run);
+    free(copy);
+    return path;
+}
+
+static void compact_job_free(compact_job_t *job) {
+    for (uint32_t i = 0; i < job->nruns; i++) {
+        if (job->paths != NULL && job->paths[i] != NULL) {
+            unlink(job->paths[i]);
+            free(job->paths[i]);
+        }
+        if (job->mem != NULL) free(job->mem[i]);
+    }
+    free(job->paths);
+    free(job->mem);
+    free(job->lens);
+    job->paths = NULL;
+    job->mem = NULL;
+    job->lens = NULL;
+}
+
+static int compact_sync_rename(int fd, const char *from, const char *to) {
+    int res = fsync(fd);
+    close(fd);
+    if (res != 0 || rename(from, to) != 0) {
+        unlink(from);
+        return COMPACT_FILE_ERROR;
+    }
+    return COMPACT_NO_ERROR;
+}
+
+
+/*
+ * Sorts the runs of the input on up to 'threads' threads; they stay in
+ * memory if the whole input fits, otherwise each is spilled to a file.
+ */
+static int compact_runs(const compact_config_t *config, compact_job_t *job, const char *dir, size_t memory,
+                        int threads) {
+    struct stat sb;
+    uint64_t raw_start;
+    int res = retain_read_start(config->input, &raw_start);
+    if (res != RETAIN_NO_ERROR) return res == RETAIN_MEMORY_ERROR ? COMPACT_MEMORY_ERROR : COMPACT_FILE_ERROR;
+    job->in_fd = open(config->input, O_RDONLY | O_CLOEXEC);
+    if (job->in_fd < 0 || fstat(job->in_fd, &sb) != 0) return COMPACT_FILE_ERROR;
+    job->in_start = raw_start / SENSOR_DATA_WIRE_SIZE;
+    job->records = (uint64_t) sb.st_size / SENSOR_DATA_WIRE_SIZE;
+    job->records = job->records > job->in_start ? job->records - job->in_start : 0;
+    job->spill = job->records * COMPACT_RECORD_COST > memory;
+    job->run_records = job->spill ? memory / (size_t) threads / COMPACT_RECORD_COST
+                                  : (job->records + (uint64_t) threads - 1) / (uint64_t) threads;
+    if (job->run_records == 0) job->run_records = 1;
+    if (job->run_records > UINT32_MAX) job->run_records = UINT32_MAX;
+    job->nruns = (uint32_t) ((job->records + job->run_records - 1) / job->run_records);
+    job->paths = calloc(job->nruns + 1, sizeof(char *));
+    job->mem = calloc(job->nruns + 1, sizeof(unsigned char *));
+    job->lens = calloc(job->nruns + 1, sizeof(uint64_t));
+    if (job->paths == NULL || job->mem == NULL || job->lens == NULL) return COMPACT_MEMORY_ERROR;
+    for (uint32_t i = 0; job->spill && i < job->nruns; i++) {
+        job->paths[i] = compact_run_path(dir, config->output, 0, i);
+        if (job->paths[i] == NULL) return COMPACT_MEMORY_ERROR;
+    }
+    pthread_t tids[COMPACT_MAX_THREADS];
+    int started = 0;
+    for (; started < threads && (uint32_t) started < job->nruns; started++) {
+        if (pthread_create(&tids[started], NULL, &compact_worker, job) != 0) break;
+    }
+    if (started == 0) compact_worker(job);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    close(job->in_fd);
+    job->in_fd = -1;
+    return atomic_load(&job->error);
+}
+
+/*
+ * Merges groups of 'fanin' consecutive runs into new runs until one merge
+ * takes them all; the new runs keep the order of the input.
+ */
+static int compact_passes(const compact_config_t *config, compact_job_t *job, const char *dir, uint32_t fanin,
+                          unsigned char *buf, size_t memory, unsigned char *out, compact_stats_t *st) {
+    for (int pass = 1; job->nruns > fanin; pass++) {
+        uint32_t nruns = (job->nruns + fanin - 1) / fanin;
+        char **paths = calloc(nruns + 1, sizeof(char *));
+        if (paths == NULL) return COMPACT_MEMORY_ERROR;
+        int res = COMPACT_NO_ERROR;
+        compact_writer_t rw = {.buf = out};
+        for (uint32_t g = 0; res == COMPACT_NO_ERROR && g < nruns; g++) {
+            uint32_t first = g * fanin, n = job->nruns - first < fanin ? job->nruns - first : fanin;
+            paths[g] = compact_run_path(dir, config->output, pass, g);
+            rw.fd = paths[g] != NULL ? open(paths[g], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+            if (rw.fd < 0) res = paths[g] == NULL ? COMPACT_MEMORY_ERROR : COMPACT_FILE_ERROR;
+            else {
+                res = compact_merge(job, first, n, buf, memory, &rw);
+                close(rw.fd);
+            }
+            // the merged runs are gone before the next group is written, the disk holds one copy plus a group
+            for (uint32_t i = first; i < first + n; i++) {
+                unlink(job->paths[i]);
+                free(job->paths[i]);
+                job->paths[i] = NULL;
+            }
+        }
+        compact_job_free(job);
+        job->paths = paths;
+        job->nruns = nruns;
+        job->mem = calloc(nruns + 1, sizeof(unsigned char *));
+        if (res == COMPACT_NO_ERROR && job->mem == NULL) res = COMPACT_MEMORY_ERROR;
+        if (res != COMPACT_NO_ERROR) return res;
+        st->passes++;
+    }
+    return COMPACT_NO_ERROR;
+}
+
+/*
+ * The last merge into '<output>.tmp', then the index; the index is renamed
+ * last, so an index always describes the file next to it.
+ */
+static int compact_final(const compact_config_t *config, compact_job_t *job, unsigned char *buf, size_t memory,
+                         compact_writer_t *w) {
+    char tmp[PATH_MAX], idx[PATH_MAX], idx_tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", config->output);
+    snprintf(idx, sizeof(idx), "%s.idx", config->output);
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s.idx.tmp", config->output);
+    w->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) return COMPACT_FILE_ERROR;
+    int res = compact_merge(job, 0, job->nruns, buf, memory, w);
+    if (res != COMPACT_NO_ERROR) {
+        close(w->fd);
+        unlink(tmp);
+        return res;
+    }
+    int fd = open(idx_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    compact_index_t header = {.entries = w->nentries, .records = w->records};
+    memcpy(header.magic, COMPACT_INDEX_MAGIC, sizeof(header.magic));
+    if (fd < 0 || compact_write_all(fd, &header, sizeof(header)) != 0 ||
+        compact_write_all(fd, w->entries, sizeof(compact_entry_t) * w->nentries) != 0) {
+        if (fd >= 0) close(fd);
+        unlink(idx_tmp);
+        close(w->fd);
+        unlink(tmp);
+        return COMPACT_FILE_ERROR;
+    }
+    // the old index must not describe the new file, even for a moment
+    unlink(idx);
+    res = compact_sync_rename(w->fd, tmp, config->output);
+    if (res != COMPACT_NO_ERROR) {
+        close(fd);
+        unlink(idx_tmp);
+        return res;
+    }
+    return compact_sync_rename(fd, idx_tmp, idx);
+}
+
+
+void compact_config_init(compact_config_t *c) {
+    c->input = NULL;
+    c->output = NULL;
+    c->tmp_dir = NULL;
+    c->memory = 256u << 20;
+    c->threads = 4;
+}
+
+
+int compact_sort(const compact_config_t *config, compact_stats_t *stats) {
+    compact_stats_t st = {0};
+    compact_job_t job = {.in_fd = -1};
+    compact_writer_t w = {.fd = -1};
+    size_t memory = config->memory < COMPACT_MIN_MEMORY ? COMPACT_MIN_MEMORY : config->memory;
+    int threads = config->threads < 1 ? 1 : config->threads;
+    if (threads > COMPACT_MAX_THREADS) threads = COMPACT_MAX_THREADS;
+    // the merge reads the runs through buffers that share the whole budget
+    uint32_t fanin = (uint32_t) (memory / COMPACT_READ_MIN);
+    if (fanin > COMPACT_FANIN_MAX) fanin = COMPACT_FANIN_MAX;
+    char *dir_copy = strdup(config->output);
+    unsigned char *buf = NULL;
+    w.buf = malloc(COMPACT_WRITE_BYTES);
+    w.entries = malloc(sizeof(compact_entry_t) * COMPACT_SENSORS);
+    int res = COMPACT_NO_ERROR;
+    if (dir_copy == NULL || w.buf == NULL || w.entries == NULL) res = COMPACT_MEMORY_ERROR;
+    const char *dir = config->tmp_dir != NULL || dir_copy == NULL ? config->tmp_dir : dirname(dir_copy);
+
+    uint64_t start = compact_ms();
+    if (res == COMPACT_NO_ERROR) res = compact_runs(config, &job, dir, memory, threads);
+    st.runs = job.spill ? job.nruns : 0;
+    st.sort_ms = compact_ms() - start;
+    start = compact_ms();
+    if (res == COMPACT_NO_ERROR && job.spill && (buf = malloc(memory)) == NULL) res = COMPACT_MEMORY_ERROR;
+    if (res == COMPACT_NO_ERROR) res = compact_passes(config, &job, dir, fanin, buf, memory, w.buf, &st);
+    if (res == COMPACT_NO_ERROR) res = compact_final(config, &job, buf, memory, &w);
+    if (res == COMPACT_NO_ERROR) {
+        st.passes++;
+        st.records = w.records;
+        st.sensors = w.nentries;
+    }
+    st.merge_ms = compact_ms() - start;
+
+    if (job.in_fd >= 0) close(job.in_fd);
+    compact_job_free(&job);
+    free(buf);
+    free(w.buf);
+    free(w.entries);
+    free(dir_copy);
+    if (stats != NULL) *stats = st;
+    return res;
+}
+
+
+int compact_find(const char *output, sensor_id_t id, compact_entry_t *entry) {
+    char idx[PATH_MAX];
+    snprintf(idx, sizeof(idx), "%s.idx", output);
+    int fd = open(idx, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return COMPACT_FILE_ERROR;
+    compact_index_t header;
+    int res = COMPACT_NOT_FOUND;
+    if (compact_read_at(fd, &header, sizeof(header), 0) != 0) res = COMPACT_FILE_ERROR;
+    else if (memcmp(header.magic, COMPACT_INDEX_MAGIC, sizeof(header.magic)) != 0) res = COMPACT_FORMAT_ERROR;
+    // binary search over the entries, ascending by id
+    uint32_t lo = 0, hi = res == COMPACT_NOT_FOUND ? header.entries : 0;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        compact_entry_t e;
+        if (compact_read_at(fd, &e, sizeof(e), (off_t) (sizeof(header) + sizeof(e) * mid)) != 0) {
+            res = COMPACT_FILE_ERROR;
+            break;
+        }
+        if (e.id == id) {
+            *entry = e;
+            res = COMPACT_NO_ERROR;
+            break;
+        }
+        if (e.id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    close(fd);
+    return res;
+}
@@ -0,0 +1,93 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+
+#define COMPACT_NO_ERROR        0
+#define COMPACT_MEMORY_ERROR    1  // mem alloc error
+#define COMPACT_FILE_ERROR      2  // the input or its retention state can't be read, or a run, the output or the index can't be written
+#define COMPACT_FORMAT_ERROR    3  // not an index, or an index of another version
+#define COMPACT_NOT_FOUND       4  // the sensor has no records in the compacted file
+
+#define COMPACT_INDEX_MAGIC     "CMINDEX1"
+#define COMPACT_MIN_MEMORY      (4u << 20)  // smallest memory budget, a smaller one is raised to it
+#define COMPACT_MAX_THREADS     64
+
+/*
+ * Offline compaction of a record file (the writer output) into one sorted
+ * by (sensor id, ts), records of equal id and ts kept in arrival order:
+ * every sensor is one contiguous segment. Runs of 'memory / threads' bytes
+ * are sorted in parallel and spilled to temporary files, then merged with
+ * buffered readers in as many passes as the memory allows. The records
+ * keep their wire layout, so every reader of the output format reads the
+ * compacted file too. The records a retention deleted from the input
+ * (retain_read_start()) are skipped, the output has no deleted prefix.
+ *
+ * Next to it '<output>.idx' holds a compact_index_t followed by one
+ * compact_entry_t per sensor, ascending by id, so a reader seeks straight
+ * to the segment of one sensor (compact_find()). Output and index are
+ * written to '.tmp' files and renamed into place once complete.
+ */
+
+typedef struct {
+    char magic[8];              // COMPACT_INDEX_MAGIC
+    uint32_t entries;
+    uint32_t reserved;
+    uint64_t records;           // records in the compacted file
+} compact_index_t;
+
+typedef struct {
+    sensor_id_t id;
+    uint16_t reserved;
+    uint32_t reserved2;
+    uint64_t offset;            // first record of the sensor, in records from the start of the file
+    uint64_t count;
+    sensor_ts_t from, to;       // ts of its first and last record
+} compact_entry_t;
+
+typedef struct {
+    const char *input;          // record file to compact, left untouched
+    const char *output;         // sorted file, may not be 'input'
+    const char *tmp_dir;        // directory of the sorted runs, NULL for the directory of 'output'
+    size_t memory;              // bytes for the records being sorted or merged
+    int threads;                // threads sorting runs
+} compact_config_t;
+
+typedef struct {
+    uint64_t records;
+    uint32_t sensors;
+    uint32_t runs;              // sorted runs spilled, 0 if the input fit in memory
+    uint32_t passes;            // merge passes over the data
+    uint64_t sort_ms;           // time spent generating runs
+    uint64_t merge_ms;          // time spent merging
+} compact_stats_t;
+
+
+void compact_config_init(compact_config_t *config);
+/*
+ * Fills 'config' with the defaults: 256 MB and 4 threads, runs next to
+ * the output; 'input' and 'output' still have to be set.
+ */
+
+
+int compact_sort(const compact_config_t *config, compact_stats_t *stats);
+
+/* Writes the sorted copy of 'config->input' and its index, copies the counters to 'stats' if not NULL
+ * A trailing partial record of the input is ignored
+ * If memory allocation fails, COMPACT_MEMORY_ERROR is returned
+ * If a file can't be read, written or renamed, COMPACT_FILE_ERROR is returned and the previous output stays
+ */
+
+
+int compact_find(const char *output, sensor_id_t id, compact_entry_t *entry);
+
+/* Looks up the segment of sensor 'id' in the index of the compacted file 'output'
+ * If the index can't be read, COMPACT_FILE_ERROR is returned
+ * If it isn't an index, COMPACT_FORMAT_ERROR is returned
+ * If the sensor has no records, COMPACT_NOT_FOUND is returned
+ */
+
+
+#endif  //__COMPACT_H__
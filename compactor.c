@@ -0,0 +1,99 @@
+/*
+ * Sorts a record file by sensor id and ts into a compacted copy with a
+ * per sensor index (see compact.h), or looks a sensor up in one. With -b it
+ * runs at the lowest CPU priority and in the idle I/O class, so it can
+ * compact next to a running server without taking from it.
+ *
+ * Usage: compactor [-m MB] [-j threads] [-T dir] [-b] input output
+ *        compactor -f id output
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "compact.h"
+
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-m MB] [-j threads] [-T dir] [-b] input output\n"
+                    "       %s -f id output\n", name, name);
+    fprintf(stderr, "  -m: memory for sorting and merging (default 256), -j: threads sorting runs (default 4)\n");
+    fprintf(stderr, "  -T: directory of the temporary runs (default next to the output)\n");
+    fprintf(stderr, "  -b: background, lowest CPU priority and idle I/O class\n");
+    fprintf(stderr, "  -f: prints where the records of sensor 'id' are in a compacted file\n");
+}
+
+int main(int argc, char *argv[]) {
+    compact_config_t config;
+    compact_config_init(&config);
+    int opt, background = 0;
+    long find = -1;
+    while ((opt = getopt(argc, argv, "m:j:T:bf:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                config.memory = (size_t) atol(optarg) << 20;
+                break;
+            case 'j':
+                config.threads = atoi(optarg);
+                break;
+            case 'T':
+                config.tmp_dir = optarg;
+                break;
+            case 'b':
+                background = 1;
+                break;
+            case 'f':
+                find = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (find >= 0) {
+        compact_entry_t e;
+        if (argc - optind != 1 || find > UINT16_MAX) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        int res = compact_find(argv[optind], (sensor_id_t) find, &e);
+        if (res == COMPACT_NOT_FOUND) printf("sensor %ld: no records\n", find);
+        else if (res != COMPACT_NO_ERROR) fprintf(stderr, "Cannot read the index of %s: %d\n", argv[optind], res);
+        else {
+            printf("sensor %ld: %"PRIu64" records from record %"PRIu64" (byte %"PRIu64"), ts %ld to %ld\n", find,
+                   e.count, e.offset, e.offset * (uint64_t) SENSOR_DATA_WIRE_SIZE, (long) e.from, (long) e.to);
+        }
+        return res == COMPACT_NO_ERROR || res == COMPACT_NOT_FOUND ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    config.input = argv[optind];
+    config.output = argv[optind + 1];
+    if (background) {
+        setpriority(PRIO_PROCESS, 0, 19);
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+            perror("ioprio_set");
+        }
+    }
+    compact_stats_t st;
+    int res = compact_sort(&config, &st);
+    if (res != COMPACT_NO_ERROR) {
+        fprintf(stderr, "Compaction of %s failed: %d\n", config.input, res);
+        return EXIT_FAILURE;
+    }
+    printf("Compacted %"PRIu64" records of %"PRIu32" sensors into %s: %"PRIu32" runs spilled, %"PRIu32
+           " merge passes, %"PRIu64" ms sorting, %"PRIu64" ms merging\n", st.records, st.sensors, config.output,
+           st.runs, st.passes, st.sort_ms, st.merge_ms);
+    return EXIT_SUCCESS;
+}
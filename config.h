@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <time.h>
+#include <string.h>
 
 typedef uint16_t sensor_id_t;
 typedef double sensor_value_t;
@@ -14,6 +15,21 @@ typedef struct {
     sensor_ts_t ts;
 } sensor_data_t;
 
+// On the wire (and in the sensor_data files) a record is the packed sequence id, value, ts in host byte order
+#define SENSOR_DATA_WIRE_SIZE   (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+static inline void sensor_data_unpack(sensor_data_t *data, const unsigned char *buf) {
+    memcpy(&data->id, buf, sizeof(sensor_id_t));
+    memcpy(&data->value, buf + sizeof(sensor_id_t), sizeof(sensor_value_t));
+    memcpy(&data->ts, buf + sizeof(sensor_id_t) + sizeof(sensor_value_t), sizeof(sensor_ts_t));
+}
+
+static inline void sensor_data_pack(unsigned char *buf, const sensor_data_t *data) {
+    memcpy(buf, &data->id, sizeof(sensor_id_t));
+    memcpy(buf + sizeof(sensor_id_t), &data->value, sizeof(sensor_value_t));
+    memcpy(buf + sizeof(sensor_id_t) + sizeof(sensor_value_t), &data->ts, sizeof(sensor_ts_t));
+}
+
 
 #endif /* _CONFIG_H_ */
 
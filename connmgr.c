@@ -4,20 +4,37 @@
 
 // Referenced tcpsock.c from Toledo
 
-#include <sys/socket.h>
-#include <netinet/in.h>
 #include <memory.h>
-#include <arpa/inet.h>
-#include <sys/epoll.h>
+#include <errno.h>
 #include <time.h>
 #include <stdio.h>
-#include <zconf.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "connmgr.h"
 #include "config.h"
-#include "dplist.h"
+#include "tcpsock.h"
+#include "evloop.h"
+#include "writer.h"
+#include "rules.h"
+#include "query.h"
+#include "pubsub.h"
+#include "handoff.h"
+#include "shmring.h"
+#include "sketch.h"
+#include "wheel.h"
+#include "bufpool.h"
+#include "trace.h"
+#include "retain.h"
 
 
 #define MAGIC_COOKIE    (long)(0xA2E1CF37D35)    // used to check if a socket is bounded
@@ -45,51 +62,235 @@
         }                    \
     } while(0)
 
-sensor_data_t data;
-
-int epollfd = 0;
-int result = 0;
-int server_sock, client_sock;
-struct epoll_event event, *my_events;
-
-typedef struct timer timer;
-struct timer {
-    int fd;
-    time_t time;
-};
+/*
+ * Connection lifecycle: CONN_OPEN when accepted, CONN_ACTIVE after the
+ * first data, CONN_DRAINING once the peer hung up but buffered data is
+ * still read, and CONN_CLOSED after connmgr_close() released everything.
+ */
+#define CONN_OPEN       0
+#define CONN_ACTIVE     1
+#define CONN_DRAINING   2
+#define CONN_CLOSED     3
 
-dplist_t *list_time = NULL;
+typedef struct reactor reactor_t;
 
-void timer_free(void **);
+/*
+ * Token bucket of a rate limit, in thousandths of a record: a rate in
+ * records per second refills exactly 'rate' per millisecond of loop clock.
+ */
+typedef struct {
+    int64_t tokens;             // below 0 while a paused connection pays off the records it already read
+    uint64_t last;              // loop clock of the last refill, 0 for a full bucket never used
+} bucket_t;
 
-void *timer_copy(void *);
+typedef struct conn conn_t;
 
-int timer_compare(void *, void *);
+/*
+ * State only some connections need, allocated with the connection when the
+ * write-ahead log or a rate limit is configured, or a ring is attached.
+ */
+typedef struct {
+    uint64_t epoch;                             // last ack epoch the connection joined
+    uint64_t acked;                             // records acknowledged to the sensor
+    shmring_t *ring;                            // shared-memory ring of a local producer, NULL for a sensor
+    bucket_t bucket;                            // rate limit of the connection
+    uint64_t resume_at;                         // CONNMGR_LIMIT_PAUSE: held in the paused list until then
+    conn_t *paused_prev, *paused_next;
+    uint8_t limited;                            // over a limit with CONNMGR_LIMIT_DISCONNECT, closed after this read
+    uint8_t paused;                             // CONNMGR_LIMIT_PAUSE: 1 stop reading after this buffer, 2 held
+} conn_ext_t;
 
-void remove_by_fd(int fd);
+/*
+ * Most sensors stay connected and idle, so a connection is packed into one
+ * cache line: no socket object, a partial record lives in a buffer of the
+ * reactor's pool only until it is complete, and the idle timer is a node
+ * of the reactor's timer wheel that is not even moved on a read.
+ */
+struct conn {
+    wheel_node_t timer;                         // in the timer wheel, CONNMGR_TIMEOUT_SWEEP only
+    conn_ext_t *ext;                            // NULL without any of its features
+    uint64_t records;
+    int fd;
+    uint32_t serial;                            // tells a reused descriptor from this connection
+    uint32_t last_active;                       // loop clock (ms, wrapping) of the last read
+    uint32_t rate_start;                        // loop clock at the start of the byte rate window
+    uint32_t rate_bytes;                        // bytes read in that window
+    uint32_t partial;                           // pool buffer of a partial record, BUFPOOL_NONE without one
+    uint16_t reactor;                           // index in 'reactors'
+    uint8_t state;
+    uint8_t len;                                // number of bytes of the partial record
+};
 
 /*
- * The real definition of struct node
+ * The connections that handed records to the writer in one or more reactor
+ * iterations, acknowledged together once the writer marks are durable.
  */
+typedef struct {
+    int fd;
+    uint32_t serial;
+    uint64_t records;
+} ack_t;
 
-struct dplist_node {
-    dplist_node_t *prev, *next;
-    void *element;
-};
+typedef struct {
+    uint64_t *marks;            // writer_mark() when the epoch was closed
+    ack_t *acks;
+    int nacks;
+    int size;
+    int *samples;               // trace slots of the sampled records, stamped TRACE_PERSISTED with the acks
+    int nsamples;
+    int samples_size;
+} epoch_t;
 
 /*
- * The real definition of struct list
+ * A reactor is one thread with its own event loop, its own SO_REUSEPORT
+ * listener and its own connections and timers; nothing of it is shared.
+ * Reactor 0 runs on the thread that called connmgr_run().
  */
+struct reactor {
+    int id;
+    pthread_t thread;
+    evloop_t *loop;
+    tcpsock_t *servers[CONNMGR_MAX_LISTENERS];
+    int nservers;
+    int wake_fd;                // eventfd to interrupt epoll_wait on shutdown
+    // Connections indexed by socket descriptor
+    conn_t **conns;
+    int conns_size;
+    int nconns;
+    wheel_t *wheel;             // CONNMGR_TIMEOUT_SWEEP: idle timers of the connections
+    bufpool_t *partials;        // buffers of the partial records
+    // CONNMGR_TIMEOUT_TIMERFD: single idle timer, armed while there are connections
+    int timer_fd;
+    int timer_armed;
+    // Write-ahead log acks: a ring of closed epochs, the open one is epochs[(head + count) % ACK_EPOCHS]
+    epoch_t *epochs;
+    int epoch_head;
+    int epoch_count;
+    uint64_t epoch;             // id of the open epoch
+    uint32_t serial;
+    sketch_t *sketch;           // records per sensor in the current and the previous RATE_WINDOW
+    bucket_t *sensor_buckets;   // rate limit per sensor id, NULL without one
+    conn_t *paused;             // connections held by CONNMGR_LIMIT_PAUSE
+    uint64_t readable;          // trace_now() when the loop reported the connection being read, with a trace
+    connmgr_stats_t stats;
+};
 
-struct dplist {
-    dplist_node_t *head;
+_Thread_local int result = 0;    // every reactor thread checks its own return codes
+connmgr_config_t config;
+tcp_tuning_t tuning;
+reactor_t *reactors = NULL;
+writer_t *writer = NULL;
+writer_stats_t written;         // final writer statistics, kept after connmgr_free()
+rules_t *rules = NULL;
+int reload_fd = -1;             // signalfd for SIGHUP, reloads the rules on reactor 0
+query_t *query = NULL;          // served by a thread of its own
+pubsub_t *pubsub = NULL;
+pubsub_stats_t published;       // final subscriber statistics, kept after connmgr_free()
+_Atomic int stopping;
+_Atomic int open_total;         // open connections over all reactors
+_Atomic uint64_t accepted_total;
+int handoff_fd = -1;            // listener for the next instance, on reactor 0
+int handoff_conn = -1;          // the next instance once it asked to take over
+handoff_msg_t *taken = NULL;    // sockets handed over by the previous instance, until the reactors adopt them
+int *taken_sd = NULL;
+int ntaken = 0;
+tcpsock_t *attach = NULL;       // listener for local producers attaching a shared-memory ring, on reactor 0
+trace_t *trace = NULL;          // sampled record trace, NULL without one
+trace_stats_t traced;           // final trace statistics, kept after connmgr_free()
+retain_t *retain = NULL;        // rolls the output into aggregate tiers, NULL without retention
+retain_stats_t retained;        // final retention statistics, kept after connmgr_free()
 
-    void *(*element_copy)(void *src_element);
+static int reactor_init(reactor_t *r, int id);
 
-    void (*element_free)(void **element);
+static void *reactor_run(void *arg);
 
-    int (*element_compare)(void *x, void *y);
-};
+static void reactor_free(reactor_t *r);
+
+static void reactor_wake(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static int connmgr_load_rules();
+
+static void connmgr_sink(int shard, const sensor_data_t *data, void *arg);
+
+static void connmgr_sink_flush(int shard, void *arg);
+
+static void connmgr_commit(int producer, void *arg);
+
+static void connmgr_save(int shard, snapshot_t *snap, void *arg);
+
+static void connmgr_load(int shard, uint32_t tag, const void *data, size_t len, void *arg);
+
+static int connmgr_owns(sensor_id_t id, void *arg);
+
+static void connmgr_epoch_close(reactor_t *r);
+
+static void connmgr_ack(reactor_t *r);
+
+static void connmgr_send_ack(conn_t *conn, uint64_t records);
+
+static void connmgr_reload(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static void connmgr_accept(tcpsock_t *sock, uint32_t events, void *arg);
+
+static conn_t *connmgr_add(reactor_t *r, tcpsock_t *client);
+
+static int connmgr_listen_local();
+
+static int connmgr_serves(const connmgr_listener_t *listener, int id);
+
+static int connmgr_sharers(const connmgr_listener_t *listener);
+
+static tcpsock_t *connmgr_taken_listener(const connmgr_listener_t *listener);
+
+static void connmgr_spread_taken();
+
+static int connmgr_serve(reactor_t *r, tcpsock_t *server);
+
+static void connmgr_attach(tcpsock_t *sock, uint32_t events, void *arg);
+
+static void connmgr_shm_event(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static void connmgr_shm_read(conn_t *conn, uint32_t budget);
+
+static void connmgr_touch(conn_t *conn);
+
+static void connmgr_takeover();
+
+static void connmgr_adopt(reactor_t *r, const handoff_msg_t *msg, int sd);
+
+static void connmgr_handoff(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static void connmgr_handoff_send();
+
+static void connmgr_event(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static int connmgr_read(conn_t *conn);
+
+static void connmgr_rate(conn_t *conn, int n);
+
+static int connmgr_flood(reactor_t *r, sensor_data_t *data);
+
+static int connmgr_limit(conn_t *conn, sensor_data_t *data);
+
+static void connmgr_hold(conn_t *conn);
+
+static void connmgr_unhold(conn_t *conn);
+
+static void connmgr_resume(reactor_t *r);
+
+static void connmgr_process(conn_t *conn, sensor_data_t *data);
+
+static void connmgr_sample(reactor_t *r, int slot);
+
+static void connmgr_close(conn_t *conn, int reason);
+
+static int connmgr_sweep(reactor_t *r, uint64_t now);
+
+static void connmgr_expire(wheel_node_t *node, void *arg);
+
+static void connmgr_timer_arm(reactor_t *r, uint64_t deadline);
+
+static void connmgr_timer_expired(evloop_t *l, int fd, uint32_t events, void *arg);
 
 /*
  * This method holds the core functionality of your connmgr.
@@ -99,209 +300,1383 @@ struct dplist {
  * file in assignment 6 and 7.
 */
 void connmgr_listen(int port_number) {
-    // Check if port number is valid
-    TCP_ERR_HANDLER(((port_number < MIN_PORT) || (port_number > MAX_PORT)),
-                    fprintf(stderr, "ERROR: %d", TCP_ADDRESS_ERROR));
-    // Create server socket
-    server_sock = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
-    TCP_DEBUG_PRINTF(server_sock < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(server_sock < 0, fprintf(stderr, "ERROR: %d", TCP_SOCKET_ERROR));
-    // Construct the server address structure
-    struct sockaddr_in server_address;
-    // Set all bytes to zero
-    memset(&server_address, 0, sizeof(server_address));
-    // Use IPv4 address
-    server_address.sin_family = PROTOCOLFAMILY;
-    // IP address, use localhost loopback to test
-    server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server_address.sin_port = htons(port_number);
-    // Bind struct with socket
-    result = bind(server_sock, (struct sockaddr *) &server_address, sizeof(server_address));
-    TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, fprintf(stderr, "ERROR: %d", TCP_SOCKET_ERROR));
-    // Start listening for clients
-    result = listen(server_sock, MAX_PENDING);
-    TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, fprintf(stderr, "ERROR: %d", TCP_SOCKET_ERROR));
-    //Create epoll
-    epollfd = epoll_create(MAX_EPOLL);
-    TCP_ERR_HANDLER(epollfd < 0, close(epollfd);
-            close(server_sock);
-            fprintf(stderr, "ERROR: %d", TCP_EPOLL_CREATE_ERROR));
+    connmgr_config_t c;
+    connmgr_config_init(&c);
+    c.port = port_number;
+    connmgr_run(&c);
+}
 
+void connmgr_config_init(connmgr_config_t *c) {
+    memset(c, 0, sizeof(connmgr_config_t));
+    // use localhost loopback to test
+    c->ip = "127.0.0.1";
+    c->port = 5678;
+    c->profile = TCP_PROFILE_DEFAULT;
+    c->idle_timeout = TIME_OUT;
+    c->timeout_mode = CONNMGR_TIMEOUT_SWEEP;
+    c->reactors = 1;
+    c->shards = 1;
+    c->output = "sensor_data_recv";
+    c->reorder_window = 16;
+    c->reorder_lag = 2;
+    c->rules = NULL;
+    c->alerts = "sensor_alerts";
+    c->query_port = 0;
+    c->pubsub_port = 0;
+    c->pubsub_lag = 4 * 1024 * 1024;
+    c->pubsub_policy = PUBSUB_LAG_DROP;
+    c->wal_dir = NULL;
+    c->wal_segment_bytes = 64 * 1024 * 1024;
+    c->wal_interval = 0;
+    c->checkpoint_interval = 60;
+    c->handoff = NULL;
+    c->local = NULL;
+    c->shm = NULL;
+    c->shm_records = 65536;
+    c->flood_rate = 0;
+    c->flood_drop = 0;
+    c->conn_rate = 0;
+    c->conn_burst = 0;
+    c->sensor_rate = 0;
+    c->sensor_burst = 0;
+    c->limit_action = CONNMGR_LIMIT_DROP;
+    c->spin_us = 0;
+    c->trace = NULL;
+    c->trace_rate = 1024;
+    c->raw_age = 0;
+    c->retain_rate = 0;
+    c->verbose = 1;
+}
 
-    //Add server sock to epoll
-    event.events = EPOLLIN;
-    event.data.fd = server_sock;
-    result = epoll_ctl(epollfd, EPOLL_CTL_ADD, server_sock, &event);
-    TCP_ERR_HANDLER(result < 0, close(epollfd);
-            close(server_sock);
-            fprintf(stderr, "ERROR: %d", TCP_EPOLL_CTL_ADD_ERROR));
+void connmgr_run(const connmgr_config_t *c) {
+    config = *c;
+    if (config.reactors < 1) config.reactors = 1;
+    if (config.shards < 1) config.shards = 1;
+    if (config.shards > WRITER_MAX_SHARDS) config.shards = WRITER_MAX_SHARDS;
+    // every sensor is a descriptor: take all the system allows, not the usual 1024
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    if (config.nlisteners == 0) {
+        // the single listener of old: every reactor on 'ip':'port'
+        TCP_ERR_HANDLER(config.ip != NULL && strlen(config.ip) >= TCP_ADDR_STRLEN,
+                        fprintf(stderr, "ERROR: %d", TCP_ADDRESS_ERROR);
+                return);
+        memset(&config.listeners[0], 0, sizeof(connmgr_listener_t));
+        if (config.ip != NULL) strcpy(config.listeners[0].ip, config.ip);
+        config.listeners[0].port = config.port;
+        config.nlisteners = 1;
+    }
+    if (config.nlisteners > CONNMGR_MAX_LISTENERS) config.nlisteners = CONNMGR_MAX_LISTENERS;
+    // Check if port numbers are valid and every listener has a reactor
+    for (int i = 0; i < config.nlisteners; i++) {
+        TCP_ERR_HANDLER(((config.listeners[i].port < MIN_PORT) || (config.listeners[i].port > MAX_PORT)) ||
+                        connmgr_sharers(&config.listeners[i]) == 0,
+                        fprintf(stderr, "ERROR: %d", TCP_ADDRESS_ERROR);
+                return);
+    }
+    // Accepted sockets inherit the options of the listening socket
+    tcp_get_profile(config.profile, &tuning);
+    if (config.timeout_mode == CONNMGR_TIMEOUT_TIMERFD && tuning.keepalive_idle == 0) {
+        // let the kernel detect dead peers, the idle timer only handles silent but alive sensors
+        tuning.keepalive_idle = config.idle_timeout;
+        tuning.keepalive_intvl = 1;
+        tuning.keepalive_cnt = 3;
+        tuning.user_timeout_ms = config.idle_timeout * 1000;
+    }
+    atomic_store(&stopping, 0);
+    atomic_store(&open_total, 0);
+    atomic_store(&accepted_total, 0);
+    // the previous instance stops its writer and listeners before we open ours
+    if (config.handoff != NULL) connmgr_takeover();
 
-    my_events = malloc(sizeof(struct epoll_event) * MAX_EPOLL);
-    list_time = dpl_create(&timer_copy, &timer_free, &timer_compare);
+    if (config.rules != NULL) {
+        TCP_ERR_HANDLER(rules_create(&rules) != RULES_NO_ERROR, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                return);
+        TCP_ERR_HANDLER(connmgr_load_rules() != RULES_NO_ERROR, rules_free(&rules);
+                return);
+        // every thread created from here on inherits the blocked SIGHUP, only the signalfd sees it
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        reload_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
 
-    while (1) {
-        // Start epoll wait
-        int active_fds = 0;
-        int timeout = 0;
-        if (dpl_size(list_time) == 0) {
-            if (epoll_wait(epollfd, my_events, MAX_EPOLL, TIME_OUT * 1000) == 0) {
-                printf("No active connection in %d seconds!\n", TIME_OUT);
-                printf("Shutting down...\n");
+    if (config.query_port != 0) {
+        result = query_create(&query, config.output);
+        TCP_ERR_HANDLER(result == QUERY_FILE_ERROR, connmgr_free();
+                fprintf(stderr, "Cannot read the retention state of %s\n", config.output);
+                return);
+        TCP_ERR_HANDLER(result != QUERY_NO_ERROR, connmgr_free();
+                fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                return);
+    }
+    if (config.raw_age != 0) {
+        retain_config_t rc;
+        retain_config_init(&rc);
+        rc.path = config.output;
+        rc.raw_age = config.raw_age;
+        if (config.retain_rate != 0) rc.io_rate = config.retain_rate;
+        result = retain_create(&retain, &rc);
+        TCP_ERR_HANDLER(result != RETAIN_NO_ERROR, fprintf(stderr, "Cannot keep the retention tiers of %s\n",
+                                                           config.output);
                 connmgr_free();
-                close(server_sock);
-                printf("Server is closed!\n");
-                exit(1);
-            }
-        } else timeout = (*(timer *) list_time->head->element).time - time(NULL);
-        active_fds = epoll_wait(epollfd, my_events, MAX_EPOLL, timeout);
-
-        for (int i = 0; i < active_fds; i++) {
-            // if the current fd equals server socket
-            if (my_events[i].data.fd == server_sock) {
-                // Accept this client and add to the epoll events
-                int client_size = sizeof(client_sock);
-                client_sock = accept(server_sock, (struct sockaddr *) &(client_sock), (socklen_t *) &client_size);
-                TCP_ERR_HANDLER(client_sock < 0, fprintf(stderr, "ERROR: %d", TCP_ACCEPT_ERROR));
-                // Enable edge trigger
-                event.events = EPOLLIN | EPOLLET;
-                event.data.fd = client_sock;
-                epoll_ctl(epollfd, EPOLL_CTL_ADD, client_sock, &event);
-
-                struct timer temp;
-                temp.fd = client_sock;
-                temp.time = time(NULL) + TIME_OUT;
-                printf("Client %d added at time: %ld\n", client_sock, time(NULL));
-                timer *t = malloc(sizeof(timer));
-                *t = temp;
-                list_time = dpl_insert_at_index(list_time, t, dpl_size(list_time) + 1, true);
-                free(t);
-            } else if (my_events[i].events & EPOLLIN) {
-                // Create client socket
-                client_sock = my_events[i].data.fd;
-                // Update the last-modified timer
-                for (dplist_node_t *dummy = list_time->head; dummy != NULL; dummy = dummy->next) {
-                    if ((*(timer *) dummy->element).fd == client_sock) {
-                        (*(timer *) dummy->element).time = time(NULL) + TIME_OUT;
-                    }
-                }
-                // Read the ID data out of client socket
-                int n = read(client_sock, (void *) &data.id, sizeof(data.id));
-                // Check if read is successful
-                TCP_ERR_HANDLER(n < 0, fprintf(stderr, "ERROR: %d", TCP_READ_ERROR));
-                // Handle client exit
-                if (n == 0) {
-                    epoll_ctl(epollfd, EPOLL_CTL_DEL, client_sock, &event);
-                    close(client_sock);
-                    //remove_by_fd(client_sock);
-                    break;
-                }
-                    // Print out the ID received
-                else {
-                    printf("Client fd: %d\n", client_sock);
-                    printf("[Sensor ID]: %"PRIu16"\n", data.id);
-                }
+                return);
+        if (query != NULL) query_set_retain(query, retain);
+    }
 
-                // Read the temperature data out of client socket
-                n = read(client_sock, (void *) &data.value, sizeof(data.value));
-                // Check if read is successful
-                TCP_ERR_HANDLER(n < 0, fprintf(stderr, "ERROR: %d", TCP_READ_ERROR));
-                // Handle client exit
-                if (n == 0) {
-                    epoll_ctl(epollfd, EPOLL_CTL_DEL, client_sock, &event);
-                    close(client_sock);
-                    //remove_by_fd(client_sock);
-                    break;
-                }
-                    // Print out the ID received
-                else {
-                    printf("[Temperature]: %g\n", data.value);
+    // Every reactor is a producer with private queues to every writer shard
+    writer_config_t wc;
+    writer_config_init(&wc);
+    wc.shards = config.shards;
+    wc.producers = config.reactors;
+    wc.path = config.output;
+    wc.reorder_window = config.reorder_window;
+    wc.reorder_lag = config.reorder_lag;
+    wc.rules = rules;
+    wc.alerts = config.alerts;
+    if (config.pubsub_port != 0) {
+        // the writer shards publish what they write
+        result = pubsub_create(&pubsub, config.ip, config.pubsub_port, config.shards, config.pubsub_lag,
+                               config.pubsub_policy);
+        TCP_ERR_HANDLER(result != PUBSUB_NO_ERROR, fprintf(stderr, "ERROR: %d", TCP_SOCKET_ERROR);
+                connmgr_free();
+                return);
+    }
+    if (config.wal_dir != NULL) {
+        wc.wal_dir = config.wal_dir;
+        wc.wal_segment_bytes = config.wal_segment_bytes;
+        wc.wal_interval = config.wal_interval;
+        wc.commit = &connmgr_commit;
+        wc.checkpoint_interval = config.checkpoint_interval;
+        wc.save = &connmgr_save;
+        wc.load = &connmgr_load;
+    }
+    if (config.trace != NULL) {
+        // the stages of a sampled record are stamped by its reactor and, once written, by its shard
+        result = trace_create(&trace, config.trace, config.trace_rate, config.wal_dir != NULL);
+        TCP_ERR_HANDLER(result != TRACE_NO_ERROR, fprintf(stderr, "Cannot create the trace file %s\n", config.trace);
+                connmgr_free();
+                return);
+    }
+    if (query != NULL || pubsub != NULL || trace != NULL) {
+        wc.sink = &connmgr_sink;
+        wc.sink_flush = &connmgr_sink_flush;
+    }
+    result = writer_create(&writer, &wc);
+    TCP_ERR_HANDLER(result != WRITER_NO_ERROR, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+            connmgr_free();
+            return);
+    reactors = calloc(config.reactors, sizeof(reactor_t));
+    TCP_ERR_HANDLER(reactors == NULL, connmgr_free();
+            fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+            return);
+    for (int i = 0; i < config.reactors; i++) {
+        result = reactor_init(&reactors[i], i);
+        TCP_ERR_HANDLER(result != TCP_NO_ERROR, fprintf(stderr, "ERROR: %d", result);
+                connmgr_free();
+                return);
+    }
+    connmgr_spread_taken();
+    for (int i = 0, k = 0; i < ntaken; i++) {
+        if (taken[i].kind != HANDOFF_CLIENT) continue;
+        connmgr_adopt(&reactors[k++ % config.reactors], &taken[i], taken_sd[i]);
+        taken_sd[i] = -1;
+    }
+    if (config.local != NULL) {
+        result = connmgr_listen_local();
+        TCP_ERR_HANDLER(result != TCP_NO_ERROR, fprintf(stderr, "ERROR: %d", result);
+                connmgr_free();
+                return);
+    }
+    if (config.shm != NULL) {
+        TCP_ERR_HANDLER(tcp_passive_open_local(&attach, config.shm, TCP_FLAG_NONBLOCK) != TCP_NO_ERROR ||
+                        tcp_register(attach, reactors[0].loop, EPOLLIN, &connmgr_attach, &reactors[0]) !=
+                        TCP_NO_ERROR, fprintf(stderr, "ERROR: %d", TCP_SOCKET_ERROR);
+                connmgr_free();
+                return);
+    }
+    if (config.handoff != NULL) {
+        TCP_ERR_HANDLER(handoff_listen(&handoff_fd, config.handoff) != HANDOFF_NO_ERROR ||
+                        evloop_add(reactors[0].loop, handoff_fd, EPOLLIN, &connmgr_handoff, NULL) != 0,
+                        fprintf(stderr, "ERROR: %d", TCP_SOCKET_ERROR);
+                connmgr_free();
+                return);
+    }
+    if (query != NULL) {
+        result = query_listen(query, config.ip, config.query_port);
+        TCP_ERR_HANDLER(result != QUERY_NO_ERROR, fprintf(stderr, "ERROR: %d",
+                                                          result == QUERY_SOCKET_ERROR ? TCP_SOCKET_ERROR
+                                                                                       : TCP_MEMORY_ERROR);
+                connmgr_free();
+                return);
+    }
+    for (int i = 1; i < config.reactors; i++) {
+        result = pthread_create(&reactors[i].thread, NULL, &reactor_run, &reactors[i]);
+        TCP_ERR_HANDLER(result != 0, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                atomic_store(&stopping, 1);
+                for (int j = 1; j < i; j++) {
+                    reactor_wake(NULL, -1, 0, &reactors[j]);
+                    pthread_join(reactors[j].thread, NULL);
                 }
+                connmgr_free();
+                return);
+    }
+    reactor_run(&reactors[0]);
+    for (int i = 1; i < config.reactors; i++) pthread_join(reactors[i].thread, NULL);
 
-                // Read the timestamp data out of client socket
-                n = read(client_sock, (void *) &data.ts, sizeof(data.ts));
-                // Check if read is successful
-                TCP_ERR_HANDLER(n < 0, fprintf(stderr, "ERROR: %d", TCP_READ_ERROR));
-                // Handle client exit
-                if (n == 0) {
-
-                    epoll_ctl(epollfd, EPOLL_CTL_DEL, client_sock, &event);
-                    close(client_sock);
-                    //remove_by_fd(client_sock);
-                    break;
-                }
-                    // Print out the timestamp received
-                else {
-                    printf("[Timestamp]: %ld\n", data.ts);
-                }
+    if (handoff_conn >= 0) {
+        printf("Handing off to the new instance...\n");
+        connmgr_handoff_send();
+    } else printf("No active connection in %d seconds!\n", config.idle_timeout);
+    printf("Shutting down...\n");
+    connmgr_stats_t st;
+    connmgr_get_stats(&st);
+    printf("Connections: %"PRIu64" accepted, %"PRIu64" adopted, %"PRIu64" rings attached, %"PRIu64
+           " closed by peer, %"PRIu64" timed out, %"PRIu64" failed, %"PRIu64" handed off\n", st.accepted, st.adopted,
+           st.attached, st.closed[CONNMGR_CLOSE_PEER], st.closed[CONNMGR_CLOSE_TIMEOUT],
+           st.closed[CONNMGR_CLOSE_ERROR], st.closed[CONNMGR_CLOSE_HANDOFF]);
+    printf("Records: %"PRIu64" (%"PRIu64" bytes, %"PRIu64" truncated)\n", st.records, st.bytes,
+           st.truncated);
+    sketch_hitter_t top[SKETCH_TOP];
+    int ntop = connmgr_get_hitters(top, 5);
+    printf("Rates: peak %"PRIu64" bytes/s on a connection, %"PRIu64" floods, %"PRIu64" records throttled, "
+           "heaviest sensors", st.peak_byte_rate, st.flooding, st.throttled);
+    for (int i = 0; i < ntop; i++) printf("%s %"PRIu16" (%"PRIu32"/s)", i ? "," : "", top[i].id, top[i].count);
+    printf("%s\n", ntop ? "" : " none");
+    if (config.conn_rate != 0 || config.sensor_rate != 0) {
+        printf("Limits: %"PRIu64" records over a connection limit, %"PRIu64" over a sensor limit, %"PRIu64
+               " dropped, %"PRIu64" pauses, %"PRIu64" disconnected\n", st.over_conn, st.over_sensor,
+               st.limit_dropped, st.limit_paused, st.closed[CONNMGR_CLOSE_LIMIT]);
+    }
+    printf("Loop: %"PRIu64" wakeups, %"PRIu64" caught busy polling (%"PRIu64" ms spun, %"PRIu64
+           " budgets missed), %"PRIu64" ms reactor CPU\n", st.wakeups, st.spin_hits, st.spin_us / 1000,
+           st.spin_misses, st.cpu_us / 1000);
+    connmgr_free();
+    if (config.trace != NULL) {
+        printf("Trace: %"PRIu64" records sampled, %"PRIu64" traced to %s, %"PRIu64" skipped\n", traced.sampled,
+               traced.traced, config.trace, traced.skipped);
+    }
+    printf("Written: %"PRIu64" records (%"PRIu64" duplicates dropped, %"PRIu64" late, %"PRIu64" alerts)\n",
+           written.records, written.duplicates, written.late, written.alerts);
+    if (config.wal_dir != NULL) {
+        printf("Logged: %"PRIu64" bytes in %"PRIu64" commits (%"PRIu64" failed), %"PRIu64" checkpoints, %"PRIu64
+               " records replayed after %"PRIu64" restored shards\n", written.logged, written.commits,
+               written.log_errors, written.checkpoints, written.replayed, written.restored);
+    }
+    if (config.raw_age != 0) {
+        printf("Retained: %"PRIu64" records rolled into %"PRIu64" minute and %"PRIu64" hour aggregates, %"PRIu64
+               " kB of raw records deleted\n", retained.rolled, retained.aggregates[RETAIN_MINUTE],
+               retained.aggregates[RETAIN_HOUR], retained.deleted / 1024);
+    }
+    if (config.pubsub_port != 0) {
+        printf("Published: %"PRIu64" records (%"PRIu64" bytes sent, %"PRIu64" dropped, %"PRIu64
+               " subscribers disconnected)\n", published.published, published.sent, published.dropped + published.overflows,
+               published.disconnected);
+    }
+    printf("Server is closed!\n");
+    exit(1);
+}
+
+/*
+ * This method should be called to clean up the connmgr, and
+ * to free all used memory. After this no new connections
+ * will be accepted
+*/
+void connmgr_free() {
+    // no more queries, the latest values stay until the writer is gone
+    if (query != NULL) query_close(query);
+    // the last commits of the writer no longer wake the reactors
+    atomic_store(&stopping, 1);
+    for (int i = 0; reactors != NULL && i < config.reactors; i++) reactor_free(&reactors[i]);
+    // flushes everything the reactors handed off
+    if (writer != NULL) {
+        writer_stop(writer);
+        writer_get_stats(writer, &written);
+    }
+    writer_free(&writer);
+    // the shards stamped their last records, what is still in flight never completes
+    trace_free(&trace, &traced);
+    // rolls up what the writer flushed last; the query connections that read the tiers are closed
+    retain_free(&retain, &retained);
+    free(reactors);
+    reactors = NULL;
+    if (reload_fd >= 0) close(reload_fd);
+    reload_fd = -1;
+    rules_free(&rules);
+    query_free(&query);
+    if (pubsub != NULL) pubsub_get_stats(pubsub, &published);
+    pubsub_free(&pubsub);
+    for (int i = 0; i < ntaken; i++) {
+        if (taken_sd[i] >= 0) close(taken_sd[i]);
+    }
+    free(taken);
+    free(taken_sd);
+    taken = NULL;
+    taken_sd = NULL;
+    ntaken = 0;
+    // after a handoff the socket files belong to the new instance
+    if (handoff_conn < 0 && config.local != NULL) unlink(config.local);
+    if (handoff_conn < 0 && config.shm != NULL) unlink(config.shm);
+    if (handoff_fd >= 0) {
+        close(handoff_fd);
+        // after a handoff the socket file belongs to the new instance
+        if (handoff_conn < 0) unlink(config.handoff);
+    }
+    handoff_fd = -1;
+    if (handoff_conn >= 0) {
+        // everything we read is written out (and logged), the new instance may start
+        handoff_msg_t msg = {.kind = HANDOFF_DONE};
+        handoff_send(handoff_conn, &msg, -1);
+        close(handoff_conn);
+    }
+    handoff_conn = -1;
+}
+
+void connmgr_get_stats(connmgr_stats_t *s) {
+    memset(s, 0, sizeof(connmgr_stats_t));
+    for (int i = 0; reactors != NULL && i < config.reactors; i++) {
+        connmgr_stats_t *r = &reactors[i].stats;
+        s->accepted += r->accepted;
+        s->adopted += r->adopted;
+        s->attached += r->attached;
+        s->open += reactors[i].nconns;
+        for (int j = 0; j < CONNMGR_CLOSE_REASONS; j++) s->closed[j] += r->closed[j];
+        s->records += r->records;
+        s->bytes += r->bytes;
+        s->truncated += r->truncated;
+        s->flooding += r->flooding;
+        s->throttled += r->throttled;
+        if (r->peak_byte_rate > s->peak_byte_rate) s->peak_byte_rate = r->peak_byte_rate;
+        s->over_conn += r->over_conn;
+        s->over_sensor += r->over_sensor;
+        s->limit_dropped += r->limit_dropped;
+        s->limit_paused += r->limit_paused;
+        s->cpu_us += r->cpu_us;
+        if (reactors[i].loop != NULL) {
+            evloop_stats_t ls;
+            evloop_get_stats(reactors[i].loop, &ls);
+            s->wakeups += ls.spin_hits + ls.block_hits;
+            s->spin_hits += ls.spin_hits;
+            s->spin_misses += ls.spin_misses;
+            s->spin_us += ls.spin_us;
+        }
+    }
+}
+
+int connmgr_get_hitters(sketch_hitter_t *top, int max) {
+    sketch_hitter_t all[SKETCH_TOP * 2];
+    int n = 0;
+    for (int i = 0; reactors != NULL && i < config.reactors; i++) {
+        if (reactors[i].sketch == NULL) continue;
+        // a sensor that reconnected may be on several reactors, its heaviest window counts
+        sketch_hitter_t part[SKETCH_TOP];
+        int np = sketch_top(reactors[i].sketch, part, SKETCH_TOP);
+        for (int j = 0; j < np; j++) {
+            int k = 0;
+            while (k < n && all[k].id != part[j].id) k++;
+            if (k == n) all[n++] = part[j];
+            else if (part[j].count > all[k].count) all[k].count = part[j].count;
+        }
+        // keep the heaviest SKETCH_TOP for the next reactor
+        for (int a = 1; a < n; a++) {
+            sketch_hitter_t h = all[a];
+            int b = a;
+            for (; b > 0 && all[b - 1].count < h.count; b--) all[b] = all[b - 1];
+            all[b] = h;
+        }
+        if (n > SKETCH_TOP) n = SKETCH_TOP;
+    }
+    if (n > max) n = max;
+    memcpy(top, all, sizeof(sketch_hitter_t) * n);
+    return n;
+}
+
+static int reactor_init(reactor_t *r, int id) {
+    r->id = id;
+    r->wake_fd = -1;
+    r->timer_fd = -1;
+    //Create epoll
+    result = evloop_create(&r->loop);
+    TCP_ERR_HANDLER(result != EVLOOP_NO_ERROR, return TCP_EPOLL_CREATE_ERROR);
+    evloop_set_spin(r->loop, config.spin_us);
+    // Every listener assigned to this reactor, the kernel spreads connections over the reactors sharing it
+    // (and over the next instance, which binds its own while we hand off)
+    for (int l = 0; l < config.nlisteners; l++) {
+        connmgr_listener_t *listener = &config.listeners[l];
+        if (!connmgr_serves(listener, id)) continue;
+        tcpsock_t *server = connmgr_taken_listener(listener);
+        if (server == NULL) {
+            int shared = connmgr_sharers(listener) > 1 || config.handoff != NULL;
+            result = tcp_passive_open_ex(&server, listener->ip[0] ? listener->ip : NULL, listener->port,
+                                         TCP_FLAG_NONBLOCK | (shared ? TCP_FLAG_REUSEPORT : 0));
+            TCP_ERR_HANDLER(result != TCP_NO_ERROR, return TCP_SOCKET_ERROR);
+        }
+        result = connmgr_serve(r, server);
+        TCP_ERR_HANDLER(result != TCP_NO_ERROR, return result);
+    }
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    TCP_ERR_HANDLER(r->wake_fd < 0 || evloop_add(r->loop, r->wake_fd, EPOLLIN, &reactor_wake, r) != 0,
+                    return TCP_EPOLL_CTL_ADD_ERROR);
+    if (config.timeout_mode == CONNMGR_TIMEOUT_TIMERFD) {
+        r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        TCP_ERR_HANDLER(r->timer_fd < 0 || evloop_add(r->loop, r->timer_fd, EPOLLIN, &connmgr_timer_expired, r) != 0,
+                        return TCP_EPOLL_CTL_ADD_ERROR);
+    }
+    if (id == 0 && reload_fd >= 0) {
+        TCP_ERR_HANDLER(evloop_add(r->loop, reload_fd, EPOLLIN, &connmgr_reload, NULL) != 0,
+                        return TCP_EPOLL_CTL_ADD_ERROR);
+    }
+    if (config.timeout_mode == CONNMGR_TIMEOUT_SWEEP) {
+        // one second slots: a sensor is disconnected at most a second after its idle timeout
+        TCP_ERR_HANDLER(wheel_create(&r->wheel, (uint32_t) config.idle_timeout * 1000, 1000, evloop_now(r->loop)) !=
+                        WHEEL_NO_ERROR, return TCP_MEMORY_ERROR);
+    }
+    TCP_ERR_HANDLER(bufpool_create(&r->partials, SENSOR_DATA_WIRE_SIZE) != BUFPOOL_NO_ERROR, return TCP_MEMORY_ERROR);
+    TCP_ERR_HANDLER(sketch_create(&r->sketch, RATE_WINDOW) != SKETCH_NO_ERROR, return TCP_MEMORY_ERROR);
+    if (config.sensor_rate != 0) {
+        // a zeroed bucket is a full one, untouched pages of the table cost nothing
+        r->sensor_buckets = calloc(UINT16_MAX + 1, sizeof(bucket_t));
+        TCP_ERR_HANDLER(r->sensor_buckets == NULL, return TCP_MEMORY_ERROR);
+    }
+    if (config.wal_dir != NULL) {
+        r->epoch = 1;
+        r->epochs = calloc(ACK_EPOCHS, sizeof(epoch_t));
+        TCP_ERR_HANDLER(r->epochs == NULL, return TCP_MEMORY_ERROR);
+        for (int i = 0; i < ACK_EPOCHS; i++) {
+            r->epochs[i].marks = calloc(writer_shards(writer), sizeof(uint64_t));
+            TCP_ERR_HANDLER(r->epochs[i].marks == NULL, return TCP_MEMORY_ERROR);
+        }
+    }
+    return TCP_NO_ERROR;
+}
+
+static void *reactor_run(void *arg) {
+    reactor_t *r = (reactor_t *) arg;
+    int timeout = config.idle_timeout * 1000;
+    while (!atomic_load(&stopping)) {
+        // Start epoll wait, without clients wait idle_timeout seconds for a first one
+        int idle = (r->nconns == 0);
+        uint64_t accepted = atomic_load(&accepted_total);
+        int wait_ms = timeout;
+        if (idle) wait_ms = (r->id == 0) ? config.idle_timeout * 1000 : -1;
+        else if (config.timeout_mode == CONNMGR_TIMEOUT_TIMERFD) wait_ms = -1; // the timerfd wakes us up
+        if (r->paused != NULL) {
+            // wake up for the first paused connection that may be read again
+            uint64_t now = evloop_now(r->loop), next = UINT64_MAX;
+            for (conn_t *c = r->paused; c != NULL; c = c->ext->paused_next) {
+                if (c->ext->resume_at < next) next = c->ext->resume_at;
             }
+            int ms = next > now ? (int) (next - now) : 0;
+            if (wait_ms < 0 || ms < wait_ms) wait_ms = ms;
+        }
+        int active_fds = evloop_run_once(r->loop, wait_ms);
+        if (r->paused != NULL) connmgr_resume(r);
+        // Hand the records of this iteration off to the writer shards with one wakeup each
+        writer_signal(writer, r->id);
+        // Acknowledge what the group commits of the writer shards made durable
+        if (r->epochs != NULL) {
+            connmgr_epoch_close(r);
+            connmgr_ack(r);
+        }
+        // Reactor 0 stops the server once no reactor had a connection for idle_timeout seconds
+        if (r->id == 0 && idle && active_fds == 0 && atomic_load(&open_total) == 0 &&
+            atomic_load(&accepted_total) == accepted) {
+            atomic_store(&stopping, 1);
+            for (int i = 1; i < config.reactors; i++) reactor_wake(NULL, -1, 0, &reactors[i]);
             break;
         }
+        // Disconnect timed out clients, the next wakeup is the earliest remaining deadline
+        if (config.timeout_mode == CONNMGR_TIMEOUT_SWEEP) timeout = connmgr_sweep(r, evloop_now(r->loop));
+    }
+    struct timespec cpu;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0) {
+        r->stats.cpu_us = (uint64_t) cpu.tv_sec * 1000000 + (uint64_t) cpu.tv_nsec / 1000;
+    }
+    return NULL;
+}
 
-        dplist_node_t *dummy = NULL;
+static void reactor_wake(evloop_t *l, int fd, uint32_t events, void *arg) {
+    reactor_t *r = (reactor_t *) arg;
+    uint64_t value = 1;
+    if (l == NULL) {
+        // called from another thread to interrupt this reactor
+        if (write(r->wake_fd, &value, sizeof(value)) < 0) {}
+        return;
+    }
+    if (read(fd, &value, sizeof(value)) < 0) {}
+}
 
-        for (dummy = list_time->head; dummy != NULL; dummy = dummy->next) {
-            if ((*(timer *) dummy->element).time < time(NULL)) {
-                client_sock = (*(timer *) dummy->element).fd;
-                printf("Client %d timeout!\n", client_sock);
-                printf("Client time: %ld\n", (long int) (*(timer *) dummy->element).time);
-                printf("Disconnecting from this timeout client...\n");
-                list_time = dpl_remove_at_reference(list_time, dummy, true);
-                printf("Client sock: %d\n", client_sock);
-                epoll_ctl(epollfd, EPOLL_CTL_DEL, client_sock, &event);
-                close(client_sock);
-                printf("Disconnectted!\n");
-            }
-            if (dpl_size(list_time) == 0)break;
+static int connmgr_load_rules() {
+    int line;
+    int res = rules_load(rules, config.rules, &line);
+    if (res == RULES_FILE_ERROR) fprintf(stderr, "Cannot read rules from %s\n", config.rules);
+    else if (res == RULES_SYNTAX_ERROR) fprintf(stderr, "Invalid rule in %s at line %d\n", config.rules, line);
+    else if (res == RULES_LIMIT_ERROR) {
+        fprintf(stderr, "Too many sensors in %s at line %d, at most %d have rules of their own\n", config.rules, line,
+                RULES_MAX_SENSORS);
+    }
+    else if (res != RULES_NO_ERROR) fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+    return res;
+}
+
+static void connmgr_reload(evloop_t *l, int fd, uint32_t events, void *arg) {
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {}
+    // on errors the previous rules stay active
+    if (connmgr_load_rules() == RULES_NO_ERROR) printf("Rules reloaded from %s\n", config.rules);
+}
+
+static void connmgr_sink(int shard, const sensor_data_t *data, void *arg) {
+    if (trace != NULL) trace_written(trace, data);
+    if (query != NULL) query_update(data, query);
+    if (pubsub != NULL) pubsub_publish(pubsub, shard, data);
+}
+
+static void connmgr_sink_flush(int shard, void *arg) {
+    if (pubsub != NULL) pubsub_signal(pubsub, shard);
+}
+
+static void connmgr_send_ack(conn_t *conn, uint64_t records) {
+    // a full send buffer skips this ack, the next one covers it
+    if (send(conn->fd, &records, sizeof(records), MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(records)) {
+        conn->ext->acked = records;
+    }
+}
+
+static void connmgr_commit(int producer, void *arg) {
+    // runs on a writer thread: only wake the reactor, it sends the acks itself
+    if (atomic_load(&stopping)) return;
+    reactor_wake(NULL, -1, 0, &reactors[producer]);
+}
+
+static void connmgr_save(int shard, snapshot_t *snap, void *arg) {
+    // the latest values of the sensors of this shard, the other shards save theirs
+    if (query != NULL) query_save(query, snap, &connmgr_owns, &shard);
+}
+
+static void connmgr_load(int shard, uint32_t tag, const void *data, size_t len, void *arg) {
+    if (tag == SNAPSHOT_LATEST && query != NULL) query_load(query, data, len);
+}
+
+static int connmgr_owns(sensor_id_t id, void *arg) {
+    // also called by the checkpoint the shards take on start, before 'writer' is set
+    return writer_shard_hash(id, config.shards) == *(int *) arg;
+}
+
+/*
+ * Ends the open epoch after an iteration that handed off records; with all
+ * ACK_EPOCHS in flight it stays open and the next iteration joins it.
+ */
+static void connmgr_epoch_close(reactor_t *r) {
+    epoch_t *e = &r->epochs[(r->epoch_head + r->epoch_count) % ACK_EPOCHS];
+    if (e->nacks == 0 || r->epoch_count == ACK_EPOCHS - 1) return;
+    writer_mark(writer, r->id, e->marks);
+    for (int i = 0; i < e->nacks; i++) {
+        conn_t *conn = r->conns[e->acks[i].fd];
+        if (conn != NULL && conn->serial == e->acks[i].serial) e->acks[i].records = conn->records;
+    }
+    r->epoch_count++;
+    r->epoch++;
+}
+
+static void connmgr_ack(reactor_t *r) {
+    while (r->epoch_count > 0) {
+        epoch_t *e = &r->epochs[r->epoch_head];
+        if (!writer_durable(writer, r->id, e->marks)) break;
+        for (int i = 0; i < e->nacks; i++) {
+            conn_t *conn = r->conns[e->acks[i].fd];
+            if (conn == NULL || conn->serial != e->acks[i].serial || e->acks[i].records <= conn->ext->acked) continue;
+            connmgr_send_ack(conn, e->acks[i].records);
+        }
+        TRACE_PROBE3(persist, r->id, r->epoch - r->epoch_count, e->nacks);
+        for (int i = 0; i < e->nsamples; i++) trace_stamp(trace, e->samples[i], TRACE_PERSISTED);
+        e->nsamples = 0;
+        e->nacks = 0;
+        r->epoch_head = (r->epoch_head + 1) % ACK_EPOCHS;
+        r->epoch_count--;
+    }
+}
+
+static void reactor_free(reactor_t *r) {
+    for (int fd = 0; fd < r->conns_size; fd++) {
+        if (r->conns[fd] != NULL) connmgr_close(r->conns[fd], CONNMGR_CLOSE_SHUTDOWN);
+    }
+    // the records read until now are still handed off before the writer stops
+    if (writer != NULL) writer_signal(writer, r->id);
+    free(r->conns);
+    r->conns = NULL;
+    r->conns_size = 0;
+    for (int i = 0; r->epochs != NULL && i < ACK_EPOCHS; i++) {
+        free(r->epochs[i].marks);
+        free(r->epochs[i].acks);
+        free(r->epochs[i].samples);
+    }
+    free(r->epochs);
+    r->epochs = NULL;
+    wheel_free(&r->wheel);
+    bufpool_free(&r->partials);
+    sketch_free(&r->sketch);
+    free(r->sensor_buckets);
+    r->sensor_buckets = NULL;
+    if (r->timer_fd >= 0) {
+        evloop_del(r->loop, r->timer_fd);
+        close(r->timer_fd);
+        r->timer_fd = -1;
+        r->timer_armed = 0;
+    }
+    if (r->id == 0 && reload_fd >= 0 && r->loop != NULL) evloop_del(r->loop, reload_fd);
+    if (r->wake_fd >= 0) {
+        if (r->loop != NULL) evloop_del(r->loop, r->wake_fd);
+        close(r->wake_fd);
+        r->wake_fd = -1;
+    }
+    for (int i = 0; i < r->nservers; i++) {
+        if (r->servers[i] != NULL) tcp_close(&r->servers[i]);
+    }
+    r->nservers = 0;
+    if (r->id == 0 && attach != NULL) tcp_close(&attach);
+    if (r->id == 0 && handoff_fd >= 0 && r->loop != NULL) evloop_del(r->loop, handoff_fd);
+    evloop_free(&r->loop);
+}
+
+static void connmgr_accept(tcpsock_t *sock, uint32_t events, void *arg) {
+    reactor_t *r = (reactor_t *) arg;
+    tcpsock_t *client;
+    // Accept all pending clients and add them to the epoll events
+    while ((result = tcp_wait_for_connection(sock, &client)) != TCP_WOULD_BLOCK) {
+        TCP_ERR_HANDLER(result != TCP_NO_ERROR, fprintf(stderr, "ERROR: %d", TCP_ACCEPT_ERROR);
+                return);
+        if (connmgr_add(r, client) == NULL) continue;
+        r->stats.accepted++;
+        atomic_fetch_add(&accepted_total, 1);
+    }
+}
+
+/*
+ * Makes 'client' a connection of reactor 'r': table slot, loop registration
+ * and idle timer. Only the descriptor of 'client' is kept, the socket object
+ * is released. On failure the socket is closed and NULL returned.
+ */
+static conn_t *connmgr_add(reactor_t *r, tcpsock_t *client) {
+    int client_sock;
+    tcp_get_sd(client, &client_sock);
+    if (client_sock >= r->conns_size) {
+        int size = r->conns_size ? r->conns_size : 64;
+        while (size <= client_sock) size *= 2;
+        conn_t **c = realloc(r->conns, sizeof(conn_t *) * size);
+        TCP_ERR_HANDLER(c == NULL, tcp_close(&client);
+                fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                return NULL);
+        memset(c + r->conns_size, 0, sizeof(conn_t *) * (size - r->conns_size));
+        r->conns = c;
+        r->conns_size = size;
+    }
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    int extended = config.wal_dir != NULL || config.conn_rate != 0 || config.sensor_rate != 0;
+    if (conn != NULL && extended) {
+        conn->ext = calloc(1, sizeof(conn_ext_t));
+        if (conn->ext == NULL) {
+            free(conn);
+            conn = NULL;
         }
     }
+    TCP_ERR_HANDLER(conn == NULL, tcp_close(&client);
+            fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+            return NULL);
+    conn->reactor = (uint16_t) r->id;
+    conn->fd = client_sock;
+    conn->state = CONN_OPEN;
+    conn->serial = ++r->serial;
+    conn->partial = BUFPOOL_NONE;
+    conn->last_active = (uint32_t) evloop_now(r->loop);
+    conn->rate_start = conn->last_active;
+    if (tuning.quickack) tcp_set_tuning(client, &(tcp_tuning_t) {.quickack = 1, .incoming_cpu = -1});
+    tcp_detach(&client, &client_sock);
+    // Enable edge trigger, a peer hang-up is reported as EPOLLRDHUP
+    result = evloop_add(r->loop, client_sock, EPOLLIN | EPOLLRDHUP | EPOLLET, &connmgr_event, conn);
+    TCP_ERR_HANDLER(result != EVLOOP_NO_ERROR, close(client_sock);
+            free(conn->ext);
+            free(conn);
+            fprintf(stderr, "ERROR: %d", TCP_EPOLL_CTL_ADD_ERROR);
+            return NULL);
+    r->conns[client_sock] = conn;
+    r->nconns++;
+    atomic_fetch_add(&open_total, 1);
+    TRACE_PROBE2(accept, client_sock, r->id);
+    if (config.verbose) printf("Client %d added at time: %ld\n", client_sock, time(NULL));
+
+    if (config.timeout_mode == CONNMGR_TIMEOUT_TIMERFD) {
+        if (!r->timer_armed) connmgr_timer_arm(r, evloop_now(r->loop) + config.idle_timeout * 1000);
+        return conn;
+    }
+    // reads only store the clock, connmgr_expire() checks it once the timer is due
+    wheel_add(r->wheel, &conn->timer, evloop_now(r->loop) + (uint64_t) config.idle_timeout * 1000);
+    return conn;
 }
 
 /*
- * This method should be called to clean up the connmgr, and
- * to free all used memory. After this no new connections
- * will be accepted
-*/
-void connmgr_free() {
-    free(my_events);
-    dpl_free(&list_time, true);
-    my_events = NULL;
+ * Opens the Unix listener for local sensors on reactor 0, unless the
+ * previous instance handed its own over. Local connections are served
+ * exactly like TCP ones.
+ */
+static int connmgr_listen_local() {
+    reactor_t *r = &reactors[0];
+    int family;
+    for (int i = 0; i < config.reactors; i++) {
+        for (int k = 0; k < reactors[i].nservers; k++) {
+            tcp_get_family(reactors[i].servers[k], &family);
+            if (family == AF_UNIX) return TCP_NO_ERROR;
+        }
+    }
+    tcpsock_t *server;
+    result = tcp_passive_open_local(&server, config.local, TCP_FLAG_NONBLOCK);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, return TCP_SOCKET_ERROR);
+    return connmgr_serve(r, server);
+}
+
+static int connmgr_serves(const connmgr_listener_t *listener, int id) {
+    return listener->reactors == 0 || (id < CONNMGR_MAX_SET && (listener->reactors >> id & 1));
+}
+
+static int connmgr_sharers(const connmgr_listener_t *listener) {
+    int n = 0;
+    for (int i = 0; i < config.reactors; i++) n += connmgr_serves(listener, i);
+    return n;
 }
 
-void remove_by_fd(int fd) {
-    for (dplist_node_t *dummy = list_time->head; dummy != NULL; dummy = dummy->next) {
-        if ((*(timer *) dummy->element).fd == fd) {
-            dpl_remove_at_reference(list_time, dummy, true);
-            free(dummy);
+/*
+ * One of the listening sockets the previous instance handed over that is
+ * bound to the address of 'listener', or NULL if none is left.
+ */
+static tcpsock_t *connmgr_taken_listener(const connmgr_listener_t *listener) {
+    struct sockaddr_storage want, bound;
+    socklen_t len;
+    tcpsock_t *server;
+    if (tcp_parse_addr(listener->ip[0] ? listener->ip : NULL, listener->port, &want, &len) != TCP_NO_ERROR) {
+        return NULL;
+    }
+    for (int i = 0; i < ntaken; i++) {
+        if (taken[i].kind != HANDOFF_LISTENER || taken_sd[i] < 0) continue;
+        len = sizeof(bound);
+        memset(&bound, 0, sizeof(bound));
+        if (getsockname(taken_sd[i], (struct sockaddr *) &bound, &len) != 0 || !tcp_addr_equal(&want, &bound)) {
+            continue;
         }
+        if (tcp_adopt(&server, taken_sd[i], TCP_FLAG_NONBLOCK) != TCP_NO_ERROR) continue;
+        taken_sd[i] = -1;
+        return server;
     }
+    return NULL;
 }
 
-void timer_free(void **e) {
-    timer **p = (timer **) e;
-    free(*p);
+/*
+ * The handed over listeners no configured listener took, e.g. after the
+ * reactor count or the listeners changed: they still hold queued
+ * connections, so they are served round robin until the next restart.
+ */
+static void connmgr_spread_taken() {
+    tcpsock_t *server;
+    for (int i = 0, k = 0; i < ntaken; i++) {
+        if (taken[i].kind != HANDOFF_LISTENER || taken_sd[i] < 0) continue;
+        if (tcp_adopt(&server, taken_sd[i], TCP_FLAG_NONBLOCK) != TCP_NO_ERROR) continue;
+        taken_sd[i] = -1;
+        // on failure the socket is closed, its queued connections are reset
+        connmgr_serve(&reactors[k++ % config.reactors], server);
+    }
 }
 
-void *timer_copy(void *e) {
-    timer *p = (timer *) malloc(sizeof(timer));
-    assert(p != NULL);
-    *p = *(timer *) e;
-    return (void *) p;
+/*
+ * Adds the listening socket 'server' to reactor 'r'; on failure it is closed.
+ */
+static int connmgr_serve(reactor_t *r, tcpsock_t *server) {
+    TCP_ERR_HANDLER(r->nservers == CONNMGR_MAX_LISTENERS, tcp_close(&server);
+            return TCP_SOCKET_ERROR);
+    char rejected[256];
+    result = tcp_set_tuning_ex(server, &tuning, rejected, sizeof(rejected));
+    // e.g. SO_BUSY_POLL needs CAP_NET_ADMIN, the listener keeps working without it
+    if (result == TCP_SOCKOP_ERROR) {
+        fprintf(stderr, "Warning: profile %s not fully applied, rejected: %s\n", tcp_profile_name(config.profile),
+                rejected);
+    }
+    //Add server sock to epoll
+    result = tcp_register(server, r->loop, EPOLLIN, &connmgr_accept, r);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, tcp_close(&server);
+            return TCP_EPOLL_CTL_ADD_ERROR);
+    r->servers[r->nservers++] = server;
+    return TCP_NO_ERROR;
 }
 
-int timer_compare(void *x, void *y) {
-    timer *p, *q;
-    p = (timer *) x;
-    q = (timer *) y;
-    int *a, *b;
-    a = (int *) &(p->time);
-    b = (int *) &(q->time);
-    if (*a > *b) {
-        return 1;
-    } else if (*a < *b) {
-        return -1;
+int connmgr_parse_listener(const char *spec, connmgr_listener_t *listener) {
+    char buf[TCP_ADDR_STRLEN + 16], *ip, *port, *end;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    memset(listener, 0, sizeof(connmgr_listener_t));
+    const char *at = strchr(spec, '@');
+    size_t n = at != NULL ? (size_t) (at - spec) : strlen(spec);
+    if (n >= sizeof(buf)) return TCP_ADDRESS_ERROR;
+    memcpy(buf, spec, n);
+    buf[n] = '\0';
+    if (buf[0] == '[') {
+        // [IPv6]:port
+        ip = buf + 1;
+        end = strchr(ip, ']');
+        if (end == NULL || end[1] != ':') return TCP_ADDRESS_ERROR;
+        *end = '\0';
+        port = end + 2;
+    } else if ((port = strrchr(buf, ':')) != NULL) {
+        if (strchr(buf, ':') != port) return TCP_ADDRESS_ERROR;    // an IPv6 address needs its brackets
+        *port++ = '\0';
+        ip = buf;
     } else {
-        return 0;
+        ip = buf + n;
+        port = buf;
+    }
+    long p = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || p < MIN_PORT || p > MAX_PORT) return TCP_ADDRESS_ERROR;
+    if (strlen(ip) >= TCP_ADDR_STRLEN) return TCP_ADDRESS_ERROR;
+    if (tcp_parse_addr(ip[0] ? ip : NULL, (int) p, &addr, &len) != TCP_NO_ERROR) return TCP_ADDRESS_ERROR;
+    strcpy(listener->ip, ip);
+    listener->port = (int) p;
+    if (at == NULL) return TCP_NO_ERROR;
+    // reactor numbers and ranges: 0-3,6
+    const char *q = at + 1;
+    do {
+        long first = strtol(q, &end, 10), last = first;
+        if (end == q) return TCP_ADDRESS_ERROR;
+        if (*end == '-') {
+            q = end + 1;
+            last = strtol(q, &end, 10);
+            if (end == q) return TCP_ADDRESS_ERROR;
+        }
+        if (first < 0 || last < first || last >= CONNMGR_MAX_SET) return TCP_ADDRESS_ERROR;
+        for (long i = first; i <= last; i++) listener->reactors |= (uint64_t) 1 << i;
+        q = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? TCP_NO_ERROR : TCP_ADDRESS_ERROR;
+}
+
+/*
+ * A local producer connected to config.shm: it gets a ring of its own and
+ * its connection stays open as a sensor connection for the acks.
+ */
+static void connmgr_attach(tcpsock_t *sock, uint32_t events, void *arg) {
+    reactor_t *r = (reactor_t *) arg;
+    tcpsock_t *client;
+    shmring_t *ring;
+    int sd;
+    while ((result = tcp_wait_for_connection(sock, &client)) != TCP_WOULD_BLOCK) {
+        TCP_ERR_HANDLER(result != TCP_NO_ERROR, fprintf(stderr, "ERROR: %d", TCP_ACCEPT_ERROR);
+                return);
+        TCP_ERR_HANDLER(shmring_create(&ring, config.shm_records) != SHMRING_NO_ERROR, tcp_close(&client);
+                fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                continue);
+        tcp_get_sd(client, &sd);
+        if (shmring_offer(ring, sd) != SHMRING_NO_ERROR) {
+            shmring_free(&ring);
+            tcp_close(&client);
+            continue;
+        }
+        conn_t *conn = connmgr_add(r, client);
+        if (conn == NULL) {
+            shmring_free(&ring);
+            continue;
+        }
+        if (conn->ext == NULL) conn->ext = calloc(1, sizeof(conn_ext_t));
+        TCP_ERR_HANDLER(conn->ext == NULL, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                shmring_free(&ring);
+                connmgr_close(conn, CONNMGR_CLOSE_ERROR);
+                continue);
+        conn->ext->ring = ring;
+        r->stats.attached++;
+        atomic_fetch_add(&accepted_total, 1);
+        TCP_ERR_HANDLER(evloop_add(r->loop, shmring_get_fd(ring), EPOLLIN, &connmgr_shm_event, conn) != 0,
+                        fprintf(stderr, "ERROR: %d", TCP_EPOLL_CTL_ADD_ERROR);
+                connmgr_close(conn, CONNMGR_CLOSE_ERROR));
+    }
+}
+
+/*
+ * Asks the instance running on config.handoff for its sockets and waits
+ * until it has written out everything it read. Without a running instance
+ * there is nothing to take over.
+ */
+static void connmgr_takeover() {
+    int fd, sd, size = 0;
+    handoff_msg_t msg;
+    if (handoff_connect(&fd, config.handoff) != HANDOFF_NO_ERROR) return;
+    printf("Taking over from the running instance...\n");
+    while (handoff_recv(fd, &msg, &sd) == HANDOFF_NO_ERROR && msg.kind != HANDOFF_DONE) {
+        if (ntaken == size) {
+            size = size ? size * 2 : 64;
+            handoff_msg_t *t = realloc(taken, sizeof(handoff_msg_t) * size);
+            if (t != NULL) taken = t;
+            int *d = realloc(taken_sd, sizeof(int) * size);
+            if (d != NULL) taken_sd = d;
+            TCP_ERR_HANDLER(t == NULL || d == NULL, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                    close(sd);
+                    size = ntaken;
+                    continue);
+        }
+        taken[ntaken] = msg;
+        taken_sd[ntaken++] = sd;
+    }
+    close(fd);
+}
+
+static void connmgr_adopt(reactor_t *r, const handoff_msg_t *msg, int sd) {
+    tcpsock_t *client;
+    TCP_ERR_HANDLER(tcp_adopt(&client, sd, TCP_FLAG_NONBLOCK) != TCP_NO_ERROR, close(sd);
+            return);
+    conn_t *conn = connmgr_add(r, client);
+    if (conn == NULL) return;
+    r->stats.adopted++;
+    // continue the record the previous instance was in the middle of
+    if (msg->len > 0 && msg->len < SENSOR_DATA_WIRE_SIZE) {
+        conn->partial = bufpool_get(r->partials);
+        TCP_ERR_HANDLER(conn->partial == BUFPOOL_NONE, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                connmgr_close(conn, CONNMGR_CLOSE_ERROR);
+                return);
+        memcpy(bufpool_at(r->partials, conn->partial), msg->buf, msg->len);
+        conn->len = (uint8_t) msg->len;
+    }
+    conn->records = msg->records;
+    if (conn->records > 0 || conn->len > 0) conn->state = CONN_ACTIVE;
+    if (conn->ext == NULL) return;
+    conn->ext->acked = msg->acked;
+    // the previous instance wrote out everything before it sent HANDOFF_DONE
+    if (config.wal_dir != NULL && conn->records > conn->ext->acked) connmgr_send_ack(conn, conn->records);
+}
+
+static void connmgr_handoff(evloop_t *l, int fd, uint32_t events, void *arg) {
+    int sd = accept(fd, NULL, NULL);    // blocking, the handoff waits for every send
+    if (sd < 0) return;
+    // one successor at a time
+    if (handoff_conn >= 0) {
+        close(sd);
+        return;
+    }
+    handoff_conn = sd;
+    atomic_store(&stopping, 1);
+    for (int i = 1; i < config.reactors; i++) reactor_wake(NULL, -1, 0, &reactors[i]);
+}
+
+/*
+ * Runs after the reactors stopped: passes every listener, then every
+ * connection to the new instance. What fails to go over is closed as usual.
+ */
+static void connmgr_handoff_send() {
+    int ok = 1, sd;
+    for (int i = 0; i < config.reactors && ok; i++) {
+        reactor_t *r = &reactors[i];
+        for (int k = 0; k < r->nservers && ok; k++) {
+            handoff_msg_t msg = {.kind = HANDOFF_LISTENER};
+            tcp_get_sd(r->servers[k], &sd);
+            ok = (handoff_send(handoff_conn, &msg, sd) == HANDOFF_NO_ERROR);
+            // the new instance shares the listener now, a shutdown would stop it for both
+            if (ok && tcp_detach(&r->servers[k], &sd) == TCP_NO_ERROR) close(sd);
+        }
+    }
+    for (int i = 0; i < config.reactors && ok; i++) {
+        reactor_t *r = &reactors[i];
+        for (int fd = 0; fd < r->conns_size && ok; fd++) {
+            conn_t *conn = r->conns[fd];
+            // a ring is drained and detached at shutdown, its producer attaches to the new instance
+            if (conn == NULL || (conn->ext != NULL && conn->ext->ring != NULL)) continue;
+            handoff_msg_t msg = {.kind = HANDOFF_CLIENT, .len = conn->len, .records = conn->records,
+                    .acked = conn->ext != NULL ? conn->ext->acked : 0};
+            if (conn->len > 0) memcpy(msg.buf, bufpool_at(r->partials, conn->partial), conn->len);
+            ok = (handoff_send(handoff_conn, &msg, fd) == HANDOFF_NO_ERROR);
+            if (ok) connmgr_close(conn, CONNMGR_CLOSE_HANDOFF);
+        }
+    }
+}
+
+static void connmgr_event(evloop_t *l, int fd, uint32_t events, void *arg) {
+    conn_t *conn = (conn_t *) arg;
+    conn_ext_t *ext = conn->ext;
+    TRACE_PROBE2(readable, fd, events);
+    if (trace != NULL) reactors[conn->reactor].readable = trace_now();
+    if (events & EPOLLERR) {
+        connmgr_close(conn, CONNMGR_CLOSE_ERROR);
+        return;
+    }
+    // The peer is gone, but what it sent before hanging up is still read
+    if (events & (EPOLLRDHUP | EPOLLHUP)) conn->state = CONN_DRAINING;
+    // a paused sensor that hung up is drained right away, what is left is bounded by the socket buffer
+    if (ext != NULL && ext->paused) {
+        if (conn->state != CONN_DRAINING) return;
+        connmgr_unhold(conn);
+        evloop_mod(l, fd, EPOLLIN | EPOLLRDHUP | EPOLLET);
+    }
+    int reason = connmgr_read(conn);
+    if (reason == CONNMGR_CLOSE_NONE && conn->state == CONN_DRAINING) reason = CONNMGR_CLOSE_PEER;
+    if (reason != CONNMGR_CLOSE_NONE) connmgr_close(conn, reason);
+}
+
+static void connmgr_touch(conn_t *conn) {
+    // Only the clock is stored, the timer wheel or the timerfd sweep compare it when a timeout is due
+    conn->last_active = (uint32_t) evloop_now(reactors[conn->reactor].loop);
+}
+
+/*
+ * Reads until the socket is drained and returns why the connection must be
+ * closed, or CONNMGR_CLOSE_NONE to keep it. Never closes by itself.
+ */
+static int connmgr_read(conn_t *conn) {
+    reactor_t *r = &reactors[conn->reactor];
+    conn_ext_t *ext = conn->ext;
+    char buffer[BUFFER_MAX_LEN];
+    sensor_data_t data;
+    connmgr_touch(conn);
+    // Edge triggered: read until the socket is drained
+    while (1) {
+        ssize_t res = recv(conn->fd, buffer, BUFFER_MAX_LEN, 0);
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CONNMGR_CLOSE_NONE;
+        // Handle client exit
+        if (res == 0 || (res < 0 && errno == ENOTCONN)) return CONNMGR_CLOSE_PEER;
+        // Check if read is successful
+        TCP_ERR_HANDLER(res < 0, if (config.verbose) fprintf(stderr, "ERROR: %d", TCP_READ_ERROR);
+                return CONNMGR_CLOSE_ERROR);
+        int n = (int) res;
+        if (conn->state == CONN_OPEN) conn->state = CONN_ACTIVE;
+        r->stats.bytes += n;
+        connmgr_rate(conn, n);
+        // Complete the partial record of the previous read first, then every full record in the buffer
+        int pos = 0;
+        if (conn->len > 0) {
+            unsigned char *buf = bufpool_at(r->partials, conn->partial);
+            int missing = (int) SENSOR_DATA_WIRE_SIZE - conn->len;
+            int take = n < missing ? n : missing;
+            memcpy(buf + conn->len, buffer, take);
+            conn->len += take;
+            pos = take;
+            if (conn->len < SENSOR_DATA_WIRE_SIZE) continue;
+            sensor_data_unpack(&data, buf);
+            // the buffer goes back to the pool as soon as the record is complete
+            bufpool_put(r->partials, conn->partial);
+            conn->partial = BUFPOOL_NONE;
+            conn->len = 0;
+            connmgr_process(conn, &data);
+        }
+        for (; pos + (int) SENSOR_DATA_WIRE_SIZE <= n; pos += SENSOR_DATA_WIRE_SIZE) {
+            sensor_data_unpack(&data, (unsigned char *) buffer + pos);
+            connmgr_process(conn, &data);
+        }
+        if (pos < n) {
+            conn->partial = bufpool_get(r->partials);
+            TCP_ERR_HANDLER(conn->partial == BUFPOOL_NONE, fprintf(stderr, "ERROR: %d", TCP_MEMORY_ERROR);
+                    return CONNMGR_CLOSE_ERROR);
+            memcpy(bufpool_at(r->partials, conn->partial), buffer + pos, n - pos);
+            conn->len = (uint8_t) (n - pos);
+        }
+        if (ext == NULL) continue;
+        if (ext->limited) return CONNMGR_CLOSE_LIMIT;
+        if (ext->paused) {
+            connmgr_hold(conn);
+            return CONNMGR_CLOSE_NONE;
+        }
+    }
+}
+
+static void connmgr_shm_event(evloop_t *l, int fd, uint32_t events, void *arg) {
+    conn_t *conn = (conn_t *) arg;
+    TRACE_PROBE2(readable, fd, events);
+    if (trace != NULL) reactors[conn->reactor].readable = trace_now();
+    connmgr_touch(conn);
+    // a busy producer must not starve the sockets of this reactor
+    connmgr_shm_read(conn, SHM_BUDGET);
+    if (conn->ext->limited) {
+        connmgr_close(conn, CONNMGR_CLOSE_LIMIT);
+        return;
+    }
+    // a held ring keeps its doorbell quiet, connmgr_resume() reads it again
+    if (conn->ext->paused) {
+        connmgr_hold(conn);
+        return;
+    }
+    shmring_wait(conn->ext->ring);
+}
+
+static void connmgr_shm_read(conn_t *conn, uint32_t budget) {
+    conn_ext_t *ext = conn->ext;
+    sensor_data_t batch[SHM_BATCH];
+    uint32_t n, total = 0;
+    while (total < budget && !ext->paused && !ext->limited && (n = shmring_pop(ext->ring, batch, SHM_BATCH)) > 0) {
+        if (conn->state == CONN_OPEN) conn->state = CONN_ACTIVE;
+        for (uint32_t i = 0; i < n; i++) connmgr_process(conn, &batch[i]);
+        total += n;
+    }
+}
+
+static void connmgr_rate(conn_t *conn, int n) {
+    // closes the byte rate window of the connection once it is over, a short one counts as a full window
+    reactor_t *r = &reactors[conn->reactor];
+    uint32_t elapsed = (uint32_t) evloop_now(r->loop) - conn->rate_start;
+    if (n < 0 || elapsed >= RATE_WINDOW) {
+        uint64_t rate = (uint64_t) conn->rate_bytes * 1000 / (elapsed > RATE_WINDOW ? elapsed : RATE_WINDOW);
+        if (rate > r->stats.peak_byte_rate) r->stats.peak_byte_rate = rate;
+        conn->rate_start += elapsed;
+        conn->rate_bytes = 0;
+    }
+    if (n > 0) conn->rate_bytes += (uint32_t) n;
+}
+
+static int connmgr_flood(reactor_t *r, sensor_data_t *data) {
+    // counts the record in the sketch, returns 1 if it must be dropped
+    uint32_t n = sketch_add(r->sketch, data->id, evloop_now(r->loop));
+    uint32_t limit = (uint32_t) ((uint64_t) config.flood_rate * RATE_WINDOW / 1000);
+    if (config.flood_rate == 0 || n <= limit) return 0;
+    int before;
+    if (sketch_mark(r->sketch, data->id, &before)) {
+        r->stats.flooding++;
+        // a sensor that keeps flooding is reported when it starts
+        if (!before) printf("Sensor %"PRIu16" floods: over %"PRIu32" records/s\n", data->id, config.flood_rate);
+    }
+    if (!config.flood_drop) return 0;
+    r->stats.throttled++;
+    return 1;
+}
+
+static int connmgr_take(bucket_t *b, uint32_t rate, uint32_t burst, uint64_t now, int debt) {
+    // refills 'b' up to its burst and takes a record; returns 0 if it had none, then it is only taken with 'debt'
+    int64_t cap = (int64_t) (burst ? burst : rate) * 1000;
+    if (b->last == 0) b->tokens = cap;
+    else if (now > b->last) {
+        b->tokens += (int64_t) (now - b->last) * rate;
+        if (b->tokens > cap) b->tokens = cap;
+    }
+    b->last = now;
+    int ok = b->tokens >= 1000;
+    if (ok || debt) b->tokens -= 1000;
+    return ok;
+}
+
+static void connmgr_pause(conn_t *conn, const bucket_t *b, uint32_t rate, uint64_t now) {
+    // the connection is read again once the bucket holds a record
+    conn_ext_t *ext = conn->ext;
+    uint64_t at = now + (uint64_t) ((1000 - b->tokens + rate - 1) / rate);
+    if (!ext->paused || at > ext->resume_at) ext->resume_at = at;
+    if (!ext->paused) ext->paused = 1;
+}
+
+static int connmgr_limit(conn_t *conn, sensor_data_t *data) {
+    // checks the record against the rate limits, returns 1 if it must be dropped
+    reactor_t *r = &reactors[conn->reactor];
+    conn_ext_t *ext = conn->ext;
+    if (config.conn_rate == 0 && config.sensor_rate == 0) return 0;
+    if (ext->limited) return 1;
+    uint64_t now = evloop_now(r->loop);
+    // a draining connection is not paused, what is left of it is bounded by the socket buffer or the ring
+    int debt = config.limit_action == CONNMGR_LIMIT_PAUSE && conn->state != CONN_DRAINING;
+    int over = 0;
+    if (config.conn_rate != 0 && !connmgr_take(&ext->bucket, config.conn_rate, config.conn_burst, now, debt)) {
+        r->stats.over_conn++;
+        over = 1;
+        if (debt) connmgr_pause(conn, &ext->bucket, config.conn_rate, now);
+    }
+    bucket_t *b = r->sensor_buckets != NULL ? &r->sensor_buckets[data->id] : NULL;
+    if (b != NULL && !connmgr_take(b, config.sensor_rate, config.sensor_burst, now, debt)) {
+        r->stats.over_sensor++;
+        over = 1;
+        if (debt) connmgr_pause(conn, b, config.sensor_rate, now);
+    }
+    if (!over || config.limit_action == CONNMGR_LIMIT_PAUSE) return 0;
+    if (config.limit_action == CONNMGR_LIMIT_DISCONNECT) ext->limited = 1;
+    else r->stats.limit_dropped++;
+    return 1;
+}
+
+static void connmgr_hold(conn_t *conn) {
+    // stops reading a paused connection and puts it in the paused list of its reactor
+    reactor_t *r = &reactors[conn->reactor];
+    conn_ext_t *ext = conn->ext;
+    if (ext->ring != NULL) evloop_mod(r->loop, shmring_get_fd(ext->ring), 0);
+    else evloop_mod(r->loop, conn->fd, EPOLLRDHUP | EPOLLET);
+    ext->paused = 2;
+    ext->paused_prev = NULL;
+    ext->paused_next = r->paused;
+    if (r->paused != NULL) r->paused->ext->paused_prev = conn;
+    r->paused = conn;
+    r->stats.limit_paused++;
+}
+
+static void connmgr_unhold(conn_t *conn) {
+    // takes the connection out of the paused list, the caller reads it again
+    reactor_t *r = &reactors[conn->reactor];
+    conn_ext_t *ext = conn->ext;
+    if (ext->paused == 2) {
+        if (ext->paused_prev != NULL) ext->paused_prev->ext->paused_next = ext->paused_next;
+        else r->paused = ext->paused_next;
+        if (ext->paused_next != NULL) ext->paused_next->ext->paused_prev = ext->paused_prev;
+    }
+    ext->paused = 0;
+    ext->paused_prev = ext->paused_next = NULL;
+}
+
+static void connmgr_resume(reactor_t *r) {
+    // reads the paused connections whose buckets refilled, edge triggered: what arrived meanwhile is read now
+    uint64_t now = evloop_now(r->loop);
+    conn_t *conn = r->paused;
+    while (conn != NULL) {
+        // a connection paused again goes to the head of the list, behind us
+        conn_t *next = conn->ext->paused_next;
+        if (conn->ext->resume_at <= now) {
+            connmgr_unhold(conn);
+            if (conn->ext->ring != NULL) {
+                int fd = shmring_get_fd(conn->ext->ring);
+                evloop_mod(r->loop, fd, EPOLLIN);
+                connmgr_shm_event(r->loop, fd, EPOLLIN, conn);
+            } else {
+                evloop_mod(r->loop, conn->fd, EPOLLIN | EPOLLRDHUP | EPOLLET);
+                connmgr_event(r->loop, conn->fd, EPOLLIN, conn);
+            }
+        }
+        conn = next;
+    }
+}
+
+static void connmgr_process(conn_t *conn, sensor_data_t *data) {
+    reactor_t *r = &reactors[conn->reactor];
+    conn->records++;
+    r->stats.records++;
+    TRACE_PROBE3(record, conn->fd, data->id, data->ts);
+    if (config.verbose) {
+        // one call per record keeps the lines of concurrent reactors together
+        printf("Client fd: %d\n[Sensor ID]: %"PRIu16"\n[Temperature]: %g\n[Timestamp]: %ld\n",
+               conn->fd, data->id, data->value, data->ts);
+    }
+    if (connmgr_flood(r, data) || connmgr_limit(conn, data)) return;
+    int slot = trace != NULL ? trace_begin(trace, data, r->id, r->readable) : -1;
+    // The shard of the sensor id writes it, readings of one sensor stay in order
+    writer_push(writer, r->id, data);
+    TRACE_PROBE3(enqueue, r->id, writer_shard_of(writer, data->id), data->id);
+    if (slot >= 0) connmgr_sample(r, slot);
+    if (r->epochs == NULL || conn->ext->epoch == r->epoch) return;
+    // first record of this connection in the open epoch
+    epoch_t *e = &r->epochs[(r->epoch_head + r->epoch_count) % ACK_EPOCHS];
+    if (e->nacks == e->size) {
+        int size = e->size ? e->size * 2 : 16;
+        ack_t *a = realloc(e->acks, sizeof(ack_t) * size);
+        if (a == NULL) return;      // no ack for this connection until its next epoch
+        e->acks = a;
+        e->size = size;
+    }
+    e->acks[e->nacks++] = (ack_t) {.fd = conn->fd, .serial = conn->serial};
+    conn->ext->epoch = r->epoch;
+}
+
+static void connmgr_sample(reactor_t *r, int slot) {
+    trace_stamp(trace, slot, TRACE_ENQUEUED);
+    if (r->epochs == NULL) return;
+    // durable together with the other records of the open epoch
+    epoch_t *e = &r->epochs[(r->epoch_head + r->epoch_count) % ACK_EPOCHS];
+    if (e->nsamples == e->samples_size) {
+        int size = e->samples_size ? e->samples_size * 2 : 4;
+        int *a = realloc(e->samples, sizeof(int) * size);
+        if (a == NULL) {
+            // the record completes without a persisted time rather than never
+            trace_stamp(trace, slot, TRACE_PERSISTED);
+            return;
+        }
+        e->samples = a;
+        e->samples_size = size;
     }
-}
\ No newline at end of file
+    e->samples[e->nsamples++] = slot;
+}
+
+/*
+ * The only place where a connection is torn down: the socket leaves the
+ * loop before it is closed, its timer, partial record and table slot are
+ * released and its counters are folded into the totals, all exactly once.
+ */
+static void connmgr_close(conn_t *conn, int reason) {
+    reactor_t *r = &reactors[conn->reactor];
+    conn_ext_t *ext = conn->ext;
+    assert(conn->state != CONN_CLOSED && r->conns[conn->fd] == conn);
+    TRACE_PROBE3(close, conn->fd, reason, conn->records);
+    connmgr_rate(conn, -1);
+    if (ext != NULL && ext->paused) connmgr_unhold(conn);
+    if (ext != NULL && ext->ring != NULL) {
+        // what the producer queued before it went is still taken, without pausing
+        conn->state = CONN_DRAINING;
+        connmgr_shm_read(conn, UINT32_MAX);
+        evloop_del(r->loop, shmring_get_fd(ext->ring));
+        shmring_free(&ext->ring);
+    }
+    conn->state = CONN_CLOSED;
+    r->conns[conn->fd] = NULL;
+    r->nconns--;
+    atomic_fetch_sub(&open_total, 1);
+    if (r->wheel != NULL) wheel_remove(r->wheel, &conn->timer);
+    r->stats.closed[reason]++;
+    // after a handoff the partial record went along, and the new instance shares the socket: no shutdown
+    if (conn->len > 0 && reason != CONNMGR_CLOSE_HANDOFF) r->stats.truncated++;
+    bufpool_put(r->partials, conn->partial);
+    evloop_del(r->loop, conn->fd);
+    if (reason != CONNMGR_CLOSE_HANDOFF) shutdown(conn->fd, SHUT_RDWR);
+    close(conn->fd);
+    free(ext);
+    free(conn);
+}
+
+static int connmgr_sweep(reactor_t *r, uint64_t now) {
+    // Disconnects the connections whose timer is due, returns the ms until the next one is
+    int64_t next = wheel_advance(r->wheel, now, &connmgr_expire, r);
+    return next < 0 ? config.idle_timeout * 1000 : (int) next;
+}
+
+static void connmgr_expire(wheel_node_t *node, void *arg) {
+    reactor_t *r = (reactor_t *) arg;
+    conn_t *conn = (conn_t *) node;     // the timer is the first member
+    uint32_t timeout_ms = (uint32_t) config.idle_timeout * 1000;
+    uint32_t idle = (uint32_t) evloop_now(r->loop) - conn->last_active;
+    if (idle < timeout_ms) {
+        // read since the timer was set: due again a timeout after that read
+        wheel_add(r->wheel, node, evloop_now(r->loop) + (timeout_ms - idle));
+        return;
+    }
+    if (config.verbose) {
+        printf("Client %d timeout!\n", conn->fd);
+        printf("Idle for: %"PRIu32" ms\n", idle);
+        printf("Disconnecting from this timeout client...\n");
+    }
+    connmgr_close(conn, CONNMGR_CLOSE_TIMEOUT);
+    if (config.verbose) printf("Disconnectted!\n");
+}
+
+static void connmgr_timer_arm(reactor_t *r, uint64_t deadline) {
+    // coarse grained: round up to the next second so sweeps of nearby deadlines are merged
+    deadline = (deadline / 1000 + 1) * 1000;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t) (deadline / 1000);
+    timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    r->timer_armed = 1;
+}
+
+static void connmgr_timer_expired(evloop_t *l, int fd, uint32_t events, void *arg) {
+    reactor_t *r = (reactor_t *) arg;
+    uint64_t expirations, now = evloop_now(l), next = UINT64_MAX;
+    uint32_t timeout_ms = (uint32_t) config.idle_timeout * 1000;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) return;
+    r->timer_armed = 0;
+    // Reads only stored the loop clock, the whole idle bookkeeping happens here, once per deadline
+    for (int client_sock = 0; client_sock < r->conns_size; client_sock++) {
+        conn_t *conn = r->conns[client_sock];
+        if (conn == NULL) continue;
+        uint32_t idle = (uint32_t) now - conn->last_active;
+        if (idle >= timeout_ms) {
+            if (config.verbose) {
+                printf("Client %d timeout!\n", client_sock);
+                printf("Disconnecting from this timeout client...\n");
+            }
+            connmgr_close(conn, CONNMGR_CLOSE_TIMEOUT);
+            if (config.verbose) printf("Disconnectted!\n");
+        } else if (now + (timeout_ms - idle) < next) next = now + (timeout_ms - idle);
+    }
+    if (next != UINT64_MAX) connmgr_timer_arm(r, next);
+}
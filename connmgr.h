@@ -5,28 +5,152 @@
 #ifndef CONNMGR_H
 #define CONNMGR_H
 
-#define MIN_PORT    1024
-#define MAX_PORT    65536
-#define MAX_PENDING 10
-#define CHAR_IP_ADDR_LENGTH 16        // 4 numbers of 3 digits, 3 dots and \0
-#define    PROTOCOLFAMILY    AF_INET        // internet protocol suite
+#include <stdint.h>
+#include "tcpsock.h"
+#include "pubsub.h"
+#include "sketch.h"
+
 #define    TYPE        SOCK_STREAM    // streaming protool type
 #define    PROTOCOL    IPPROTO_TCP    // TCP protocol
 #define MAX_EPOLL 3
 #define BUFFER_MAX_LEN  4096
+#define ACK_EPOCHS      256     // reactor iterations waiting for their group commit
+#define SHM_BATCH       256     // records popped from a shared-memory ring at once
+#define SHM_BUDGET      4096    // records taken from one ring per reactor iteration, the rest waits a round
+#define RATE_WINDOW     1000    // ms per window of the sensor and connection rates
+
+/*
+ * With a write-ahead log a sensor receives acks: the total number of its
+ * records on this connection that are durable, as a uint64_t in host byte
+ * order. Acks are cumulative, a lost one is covered by the next.
+ */
 
+#define CONNMGR_TIMEOUT_SWEEP   0   // walk the timer list after every epoll_wait
+#define CONNMGR_TIMEOUT_TIMERFD 1   // one timerfd armed at the earliest possible expiry, plus TCP keepalive
 
-#define    TCP_NO_ERROR        0
-#define    TCP_SOCKET_ERROR    1  // invalid socket
-#define    TCP_ADDRESS_ERROR    2  // invalid port and/or IP address
-#define    TCP_SOCKOP_ERROR    3  // socket operator (socket, listen, bind, accept,...) error
-#define TCP_CONNECTION_CLOSED    4  // send/receive indicate connection is closed
-#define    TCP_MEMORY_ERROR    5  // mem alloc error
+// beyond the tcpsock.h codes, connection manager only
 #define TCP_ACCEPT_ERROR 6
 #define TCP_READ_ERROR 7
 #define TCP_EPOLL_CREATE_ERROR 8
 #define TCP_EPOLL_CTL_ADD_ERROR 9
 
+#define CONNMGR_CLOSE_NONE      0   // connection stays open
+#define CONNMGR_CLOSE_PEER      1   // orderly close or hang-up by the sensor
+#define CONNMGR_CLOSE_TIMEOUT   2   // idle timeout
+#define CONNMGR_CLOSE_ERROR     3   // socket error, including dead peers reported by keepalive
+#define CONNMGR_CLOSE_SHUTDOWN  4   // server shutdown
+#define CONNMGR_CLOSE_HANDOFF   5   // handed to a new server instance, still open there
+#define CONNMGR_CLOSE_LIMIT     6   // went over a rate limit with CONNMGR_LIMIT_DISCONNECT
+#define CONNMGR_CLOSE_REASONS   7
+
+/*
+ * Rate limits are token buckets checked for every record at parse time:
+ * one per connection and one per sensor id and reactor. A bucket refills at
+ * its rate from the loop clock and holds at most its burst.
+ */
+#define CONNMGR_LIMIT_DROP          0   // records over a limit are dropped
+#define CONNMGR_LIMIT_PAUSE         1   // the connection is not read until its buckets refilled, nothing is lost
+#define CONNMGR_LIMIT_DISCONNECT    2   // the connection is closed
+
+#define CONNMGR_MAX_LISTENERS   16  // sensor listeners in a configuration, and listening sockets per reactor
+#define CONNMGR_MAX_SET         64  // reactors a listener can be assigned to by number
+
+typedef struct {
+    uint64_t accepted;
+    uint64_t adopted;           // connections taken over from the previous instance
+    uint64_t attached;          // local producers that attached a shared-memory ring
+    uint64_t open;
+    uint64_t closed[CONNMGR_CLOSE_REASONS];
+    uint64_t records;
+    uint64_t bytes;             // read from sockets, records taken from rings are not counted
+    uint64_t truncated;         // connections closed in the middle of a record
+    uint64_t flooding;          // windows in which a sensor went over the flood rate
+    uint64_t throttled;         // records of flooding sensors dropped
+    uint64_t peak_byte_rate;    // highest bytes per second one connection sent in a window
+    uint64_t over_conn;         // records over the rate limit of their connection
+    uint64_t over_sensor;       // records over the rate limit of their sensor
+    uint64_t limit_dropped;     // records dropped by CONNMGR_LIMIT_DROP
+    uint64_t limit_paused;      // times a connection was paused by CONNMGR_LIMIT_PAUSE
+    uint64_t wakeups;           // reactor iterations that had events
+    uint64_t spin_hits;         // of which found by busy polling (see evloop_set_spin())
+    uint64_t spin_misses;       // spin budgets used up without events
+    uint64_t spin_us;           // time the reactors spent busy polling
+    uint64_t cpu_us;            // CPU time of the reactor threads, once they stopped
+} connmgr_stats_t;
+
+typedef struct {
+    char ip[TCP_ADDR_STRLEN];   // IPv4 or IPv6 address, empty for any IPv4 interface
+    int port;
+    uint64_t reactors;          // bit i set: reactor i takes a share of the connections, 0 for every reactor
+} connmgr_listener_t;
+
+typedef struct {
+    char *ip;                   // address the sensor listener binds to, and the query and subscriber listeners
+    int port;
+    connmgr_listener_t listeners[CONNMGR_MAX_LISTENERS];  // sensor listeners, none is one on 'ip':'port'
+    int nlisteners;                                         // for every reactor
+    tcp_profile_t profile;      // socket tuning of the listening and accepted sockets
+    int idle_timeout;           // seconds without data before a sensor is disconnected
+    int timeout_mode;           // CONNMGR_TIMEOUT_SWEEP or CONNMGR_TIMEOUT_TIMERFD
+    int reactors;               // event loop threads sharing the port through SO_REUSEPORT
+    int shards;                 // writer threads, each owns the sensor ids hashed to it
+    char *output;               // file the writer shards append the received records to
+    int reorder_window;         // records held per sensor to sort them by ts and drop duplicates, 0 disables
+    int reorder_lag;            // seconds a record waits at most for older readings of its sensor
+    char *rules;                // alert rule file (see rules.h), reloaded on SIGHUP; NULL disables alerts
+    char *alerts;               // file the alerts are appended to
+    int query_port;             // port of the query listener (see query.h) on 'ip', 0 disables it
+    int pubsub_port;            // port of the subscriber listener (see pubsub.h) on 'ip', 0 disables it
+    size_t pubsub_lag;          // bytes a subscriber may fall behind
+    int pubsub_policy;          // PUBSUB_LAG_DROP or PUBSUB_LAG_DISCONNECT
+    char *wal_dir;              // write-ahead log directory (see wal.h), NULL disables logging and acks
+    size_t wal_segment_bytes;   // log segment size, the output is synced and older segments dropped per segment
+    int wal_interval;           // ms between group commits under load, 0 commits every writer round
+    int checkpoint_interval;    // seconds between snapshots of the per sensor state, 0 only per log segment
+    char *handoff;              // Unix socket to take over the sockets of a running instance and to hand ours
+                                // to the next one (see handoff.h), NULL disables it
+    char *local;                // Unix socket sensors on this host may stream to instead of TCP, NULL disables it
+    char *shm;                  // Unix socket local producers attach a shared-memory ring on (see shmring.h)
+    uint32_t shm_records;       // records per shared-memory ring
+    uint32_t flood_rate;        // records per second above which a sensor is reported as flooding, 0 disables it
+    int flood_drop;             // drop what a flooding sensor sends above the flood rate
+    uint32_t conn_rate;         // records per second a connection may send, 0 is unlimited
+    uint32_t conn_burst;        // records its bucket holds, 0 is one second worth
+    uint32_t sensor_rate;       // records per second a sensor may send (per reactor), 0 is unlimited
+    uint32_t sensor_burst;      // records its bucket holds, 0 is one second worth
+    int limit_action;           // CONNMGR_LIMIT_DROP, CONNMGR_LIMIT_PAUSE or CONNMGR_LIMIT_DISCONNECT
+    uint32_t spin_us;           // us a reactor busy polls after activity before it blocks, 0 always blocks
+    char *trace;                // file the sampled records are traced to (see trace.h), NULL disables tracing
+    uint32_t trace_rate;        // one record in 'trace_rate' is traced, rounded up to a power of two
+    int raw_age;                // seconds raw records are kept before only their aggregates are (see retain.h),
+                                // 0 disables retention
+    size_t retain_rate;         // bytes per second the retention reads of the output, 0 for the default
+    int verbose;                // print every connection event and record
+} connmgr_config_t;
+
+
+void connmgr_config_init(connmgr_config_t *config);
+/*
+ * Fills 'config' with the defaults: 127.0.0.1, port 5678, the
+ * default (kernel) socket profile, a 5 second sweep timeout and one
+ * reactor and one writer appending to sensor_data_recv, verbose, with
+ * a 16 record reorder window and a 2 second lag per sensor.
+*/
+
+int connmgr_parse_listener(const char *spec, connmgr_listener_t *listener);
+/*
+ * Parses "ip:port[@reactors]" into 'listener'. An IPv6 address is put in
+ * brackets ("[::]:5678"), the ip may be left out for any IPv4 interface
+ * (":5678" or "5678"). 'reactors' is a list of reactor numbers and ranges
+ * like "0-3,6"; without it every reactor serves the listener. Returns
+ * TCP_ADDRESS_ERROR for a malformed spec, an invalid address or port, or
+ * a reactor number of CONNMGR_MAX_SET or more.
+*/
+
+void connmgr_run(const connmgr_config_t *config);
+/*
+ * Same as connmgr_listen() with all settings taken from 'config'.
+*/
 
 void connmgr_listen(int port_number);
 
@@ -38,6 +162,19 @@ void connmgr_listen(int port_number);
  * file in assignment 6 and 7.
 */
 
+void connmgr_get_stats(connmgr_stats_t *stats);
+/*
+ * Copies the connection counters, totals include the open connections.
+*/
+
+int connmgr_get_hitters(sketch_hitter_t *top, int max);
+/*
+ * Copies up to 'max' of the sensors that sent the most records in one
+ * RATE_WINDOW to 'top', heaviest first, and returns how many. The counts
+ * come from the per reactor sketches (see sketch.h): a sensor is never
+ * under-counted. Only valid once the reactors stopped, before connmgr_free().
+*/
+
 void connmgr_free();
 /*
  * This method should be called to clean up the connmgr, and
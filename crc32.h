@@ -0,0 +1,15 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+/* Continues the CRC-32 (IEEE 802.3) 'crc' over 'len' bytes of 'buf', start with 0
+ * Thread safe, the lookup table is built on the first call
+ */
+
+
+#endif  //__CRC32_H__
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <memory.h>
+#include "dparray.h"
+
+/*
+ * definition of error codes
+ *
+ */
+
+#define DPARRAY_NO_ERROR 0
+#define DPARRAY_MEMORY_ERROR 1 // error due to mem alloc failure
+#define DPARRAY_INVALID_ERROR 2 //error due to a list operation applied on a NULL list
+
+#define DPARRAY_MIN_CAPACITY 16
+
+#ifdef DEBUG
+#define DEBUG_PRINTF(...) 									         \
+        do {											         \
+            fprintf(stderr,"\nIn %s - function %s at line %d: ", __FILE__, __func__, __LINE__);	 \
+            fprintf(stderr,__VA_ARGS__);								 \
+            fflush(stderr);                                                                          \
+                } while(0)
+#else
+#define DEBUG_PRINTF(...) (void)0
+#endif
+
+
+#define DPARRAY_ERR_HANDLER(condition, err_code)\
+    do {                                    \
+            if ((condition)) DEBUG_PRINTF(#condition " failed\n");    \
+            assert(!(condition));                                    \
+        } while(0)
+
+/*
+ * The elements are slots[start] .. slots[start + size - 1]; the slots before and after are free room
+ */
+
+struct dparray {
+    void **slots;
+    int capacity;
+    int start;
+    int size;
+
+    void *(*element_copy)(void *src_element);
+
+    void (*element_free)(void **element);
+
+    int (*element_compare)(void *x, void *y);
+};
+
+
+static void dpa_make_room(dparray_t *list) {
+    // Centers the elements with free room at both ends, growing the array first if it is half full or more
+    int capacity = list->capacity;
+    if (list->size >= capacity / 2) capacity = capacity < DPARRAY_MIN_CAPACITY ? DPARRAY_MIN_CAPACITY : capacity * 2;
+    int start = (capacity - list->size) / 2;
+    if (capacity != list->capacity) {
+        void **slots = malloc(sizeof(void *) * capacity);
+        DPARRAY_ERR_HANDLER(slots == NULL, DPARRAY_MEMORY_ERROR);
+        if (list->size > 0) memcpy(slots + start, list->slots + list->start, sizeof(void *) * list->size);
+        free(list->slots);
+        list->slots = slots;
+        list->capacity = capacity;
+    } else {
+        memmove(list->slots + start, list->slots + list->start, sizeof(void *) * list->size);
+    }
+    list->start = start;
+}
+
+static int dpa_clamp(dparray_t *list, int index) {
+    if (index < 0) return 0;
+    return index >= list->size ? list->size - 1 : index;
+}
+
+
+dparray_t *dpa_create(
+        void *(*element_copy)(void *src_element),
+        void (*element_free)(void **element),
+        int (*element_compare)(void *x, void *y)
+) {
+    dparray_t *list = malloc(sizeof(struct dparray));
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_MEMORY_ERROR);
+    memset(list, 0, sizeof(struct dparray));
+    list->element_copy = element_copy;
+    list->element_free = element_free;
+    list->element_compare = element_compare;
+    return list;
+}
+
+void dpa_free(dparray_t **list, bool free_element) {
+    assert(*list != NULL);
+    dparray_t *l = *list;
+    if (free_element == true) {
+        for (int i = 0; i < l->size; i++) l->element_free(&l->slots[l->start + i]);
+    }
+    free(l->slots);
+    free(l);
+    *list = NULL;
+}
+
+dparray_t *dpa_insert_at_index(dparray_t *list, void *element, int index, bool insert_copy) {
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+
+    if (index < 0) index = 0;
+    if (index > list->size) index = list->size;
+    // Shift the shorter side of the array, towards its end with free room
+    bool front = index < list->size - index;
+    if (front ? list->start == 0 : list->start + list->size == list->capacity) dpa_make_room(list);
+    void **slots = list->slots + list->start;
+    if (front) {
+        memmove(slots - 1, slots, sizeof(void *) * index);
+        list->start--;
+    } else {
+        memmove(slots + index + 1, slots + index, sizeof(void *) * (list->size - index));
+    }
+    list->slots[list->start + index] = insert_copy == true ? list->element_copy(element) : element;
+    list->size++;
+    return list;
+}
+
+dparray_t *dpa_remove_at_index(dparray_t *list, int index, bool free_element) {
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+
+    if (list->size == 0) return list;
+    index = dpa_clamp(list, index);
+    void **slots = list->slots + list->start;
+    if (free_element == true) list->element_free(&slots[index]);
+    if (index < list->size - 1 - index) {
+        memmove(slots + 1, slots, sizeof(void *) * index);
+        list->start++;
+    } else {
+        memmove(slots + index, slots + index + 1, sizeof(void *) * (list->size - 1 - index));
+    }
+    list->size--;
+    // An empty list starts again in the middle, with room to grow at both ends
+    if (list->size == 0) list->start = list->capacity / 2;
+    return list;
+}
+
+int dpa_size(dparray_t *list) {
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+    return list->size;
+}
+
+void *dpa_get_element_at_index(dparray_t *list, int index) {
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+    if (list->size == 0) return NULL;
+    return list->slots[list->start + dpa_clamp(list, index)];
+}
+
+int dpa_get_index_of_element(dparray_t *list, void *element) {
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+    for (int i = 0; i < list->size; i++) {
+        if (list->element_compare(list->slots[list->start + i], element) == 0) return i;
+    }
+    return -1;
+}
+
+dparray_t *dpa_insert_sorted(dparray_t *list, void *element, bool insert_copy) {
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+
+    // Binary search for the first element greater than 'element'
+    void **slots = list->slots + list->start;
+    int low = 0, high = list->size;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (list->element_compare(element, slots[mid]) < 0) high = mid;
+        else low = mid + 1;
+    }
+    return dpa_insert_at_index(list, element, low, insert_copy);
+}
+
+dparray_t *dpa_remove_element(dparray_t *list, void *element, bool free_element) {
+    int index = dpa_get_index_of_element(list, element);
+    if (index == -1) return list;
+    return dpa_remove_at_index(list, index, free_element);
+}
+
+dparray_t *dpa_sort(dparray_t *list) {
+    // Bottom-up merge sort, runs of 1, 2, 4, ... elements are merged back and forth between the list
+    // and a temporary array; taking from the left run on ties keeps it stable
+
+    DPARRAY_ERR_HANDLER(list == NULL, DPARRAY_INVALID_ERROR);
+
+    int n = list->size;
+    if (n < 2) return list;
+    void **tmp = malloc(sizeof(void *) * n);
+    DPARRAY_ERR_HANDLER(tmp == NULL, DPARRAY_MEMORY_ERROR);
+    void **src = list->slots + list->start, **dst = tmp;
+    for (int width = 1; width < n; width *= 2) {
+        for (int low = 0; low < n; low += 2 * width) {
+            int mid = low + width < n ? low + width : n;
+            int high = low + 2 * width < n ? low + 2 * width : n;
+            int a = low, b = mid, k = low;
+            while (a < mid && b < high) {
+                dst[k++] = list->element_compare(src[b], src[a]) < 0 ? src[b++] : src[a++];
+            }
+            while (a < mid) dst[k++] = src[a++];
+            while (b < high) dst[k++] = src[b++];
+        }
+        void **swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src == tmp) memcpy(list->slots + list->start, tmp, sizeof(void *) * n);
+    free(tmp);
+    return list;
+}
@@ -0,0 +1,75 @@
+#ifndef _DPARRAY_H_
+#define _DPARRAY_H_
+
+#include "dplist.h"
+
+typedef struct dparray dparray_t; // same callbacks and operators as dplist_t, but the elements live in one array
+
+
+/* An array-backed alternative to dplist_t for lists that are mostly walked by index, searched or sorted.
+ * The element pointers are kept contiguous with free room at both ends, so indexing is O(1), inserting
+ * or removing at either end is amortized O(1) and anywhere else moves the shorter side of the array.
+ * Use dplist_t when list nodes must stay put while others come and go (references), dparray_t otherwise.
+ *
+ * General remark on error handling: like dplist, all functions below will
+ * - use assert() to check if the 'list' parameter is not NULL at the start of the function.
+ * - use assert() to check if memory allocation was successfully.
+ */
+
+
+dparray_t *dpa_create(// callback functions
+        void *(*element_copy)(void *element),    // Duplicate 'element'; If needed allocated new memory for the duplicated element.
+        void (*element_free)(void **element),    // If needed, free memory allocated to element
+        int (*element_compare)(void *x, void *y)    // Compare two element elements; returns -1 if x<y, 0 if x==y, or 1 if x>y
+);
+// Returns a pointer to a newly-allocated and initialized list.
+
+void dpa_free(dparray_t **list, bool free_element);
+// Every element of the list is released, the list itself is freed and '*list' is set to NULL.
+// If free_element == true : call element_free() on every element
+// Extra error handling: use assert() to check if '*list' is not NULL at the start of the function.
+
+dparray_t *dpa_insert_at_index(dparray_t *list, void *element, int index, bool insert_copy);
+// Inserts 'element' in the list at position 'index' and returns a pointer to the list.
+// If insert_copy == true : use element_copy() to make a copy of 'element' and insert the copy
+// If 'index' is 0 or negative, the element is inserted at the start of 'list'.
+// If 'index' is bigger than the number of elements in the list, the element is inserted at the end of the list.
+
+dparray_t *dpa_remove_at_index(dparray_t *list, int index, bool free_element);
+// Removes the element at index 'index' from the list.
+// If free_element == true : call element_free() on the element to remove
+// If 'index' is 0 or negative, the first element is removed.
+// If 'index' is bigger than the number of elements in the list, the last element is removed.
+// If the list is empty, return the unmodified list
+
+int dpa_size(dparray_t *list);
+// Returns the number of elements in the list, in O(1).
+
+void *dpa_get_element_at_index(dparray_t *list, int index);
+// Returns the element at index 'index' in the list, not a copy, in O(1).
+// If 'index' is 0 or negative, the first element is returned.
+// If 'index' is bigger than the number of elements in the list, the last element is returned.
+// If the list is empty, (void *)0 is returned.
+
+int dpa_get_index_of_element(dparray_t *list, void *element);
+// Returns the index of the first element in the list for which 'element_compare()' returns 0.
+// If 'element' is not found in the list, -1 is returned.
+
+dparray_t *dpa_insert_sorted(dparray_t *list, void *element, bool insert_copy);
+// Inserts 'element' in the sorted list and returns a pointer to the list.
+// The list must be sorted in ascending order before calling this function; the position is found by binary search.
+// If two members compare as equal, the new one is inserted after the ones already in the list.
+// If insert_copy == true : use element_copy() to make a copy of 'element' and insert the copy
+
+dparray_t *dpa_remove_element(dparray_t *list, void *element, bool free_element);
+// Finds the first element in the list that compares equal to 'element' and removes it from 'list'.
+// If free_element == true : call element_free() on the element to remove
+// If 'element' is not found in 'list', the unmodified 'list' is returned.
+
+dparray_t *dpa_sort(dparray_t *list);
+// Sorts the list in ascending order according to element_compare() and returns a pointer to the sorted list.
+// The sort is a stable merge sort: elements that compare as equal keep their order. It takes O(n log n)
+// compares and a temporary array of n pointers.
+
+
+#endif  // _DPARRAY_H_
@@ -54,7 +54,9 @@ struct dplist {
     int (*element_compare)(void *x, void *y);
 };
 
-dplist_t *dpl_sort(dplist_t *list);
+static void dpl_link(dplist_t *list, dplist_node_t *node, dplist_node_t *prev, dplist_node_t *next);
+
+static dplist_node_t *dpl_new_node(dplist_t *list, void *element, bool insert_copy);
 
 // Returns a pointer to a newly-allocated and initialized list.
 
@@ -106,48 +108,17 @@ dplist_t *dpl_insert_at_index(dplist_t *list, void *element, int index, bool ins
     // Check if the list is NULL
     DPLIST_ERR_HANDLER(list == NULL, DPLIST_INVALID_ERROR);
 
-    // Initialize the reference and list node
-    dplist_node_t *ref_at_index = NULL, *list_node = malloc(sizeof(dplist_node_t));
-    memset(list_node, 0, sizeof(dplist_node_t));
-    DPLIST_ERR_HANDLER(list_node == NULL, DPLIST_MEMORY_ERROR);
-
-    // Check if needed to make a deep copy of the element being inserted
-    if (insert_copy == true) {
-        // Make a copy
-        list_node->element = list->element_copy(element);
-    }
-        // Insert without making a copy
-    else list_node->element = element;
-
-    //
-    if (list->head == NULL) { // List is empty, just insert the node
-        list_node->prev = NULL;
-        list_node->next = NULL;
-        list->head = list_node;
-    } else if (index <= 0)
-        //  List not empty
-    { // Index negative or 0, insert at the beginning
-        list_node->prev = NULL;
-        list_node->next = list->head;
-        list->head->prev = list_node;
-        list->head = list_node;
-    } else { // Index positive
-        // Get the reference at index
-        ref_at_index = dpl_get_reference_at_index(list, index);  //Get the index element in list
-        assert(ref_at_index != NULL);
-
-        if (index < dpl_size(list)) { // Index inside range(smaller than the list size)
-            list_node->prev = ref_at_index->prev;
-            list_node->next = ref_at_index;
-            ref_at_index->prev->next = list_node;
-            ref_at_index->prev = list_node;
-        } else { // Index larger than list size, insert at end
-            assert(ref_at_index->next == NULL);
-            list_node->next = NULL;
-            list_node->prev = ref_at_index;
-            ref_at_index->next = list_node;
-        }
+    dplist_node_t *list_node = dpl_new_node(list, element, insert_copy);
+    if (list->head == NULL || index <= 0) { // List empty, or index negative or 0: insert at the beginning
+        dpl_link(list, list_node, NULL, list->head);
+        return list;
     }
+    // One walk: stop at the node at 'index', or at the last one if the list is shorter
+    dplist_node_t *ref_at_index = list->head;
+    int count;
+    for (count = 0; count < index && ref_at_index->next != NULL; count++) ref_at_index = ref_at_index->next;
+    if (count == index) dpl_link(list, list_node, ref_at_index->prev, ref_at_index);  // Index inside range
+    else dpl_link(list, list_node, ref_at_index, NULL);    // Index larger than list size, insert at end
     return list;
 }
 
@@ -162,15 +133,13 @@ dplist_t *dpl_remove_at_index(dplist_t *list, int index, bool free_element) {
 
     // Check if the list is NULL
     DPLIST_ERR_HANDLER(list == NULL, DPLIST_INVALID_ERROR);
-    // Declare variables to store reference at index and list node
-    dplist_node_t *list_node, *ref_at_index;
 
     if (list->head == NULL) { // Empty list, nothing to remove, return the unmodified list
         return list;
     }
 
-    // Get the reference at index
-    ref_at_index = dpl_get_reference_at_index(list, index);
+    // Get the reference at index, the first or last one if 'index' is out of range
+    dplist_node_t *ref_at_index = dpl_get_reference_at_index(list, index);
     assert(ref_at_index != NULL);
 
     // Check if it's necessary to free the element copy
@@ -178,40 +147,11 @@ dplist_t *dpl_remove_at_index(dplist_t *list, int index, bool free_element) {
         void *pointer_to_element = &(ref_at_index->element);
         list->element_free(pointer_to_element);
     }
-    // List only have one element, just remove it, regardless of the index
-    if (dpl_size(list) == 1) {
-        list->head = NULL;
-        free(ref_at_index);
-        return list;
-    }
-
-    // Index negative or 0
-    if (index <= 0) {
-        // covers case 3----Remove the first element
-        list->head = ref_at_index->next;
-        list->head->prev = NULL;
-        free(ref_at_index);
-    } else {
-        if (index <= dpl_size(list)) {
-            // covers case 4----Remove at index
-            dplist_node_t *prev_node;
-            dplist_node_t *next_node;
-            prev_node = dpl_get_reference_at_index(list, index - 1);
-            next_node = dpl_get_reference_at_index(list, index + 1);
-            prev_node->next = ref_at_index->next;
-            next_node->prev = ref_at_index->prev;
-
-            free(ref_at_index);
-        } else if (index > dpl_size(list)) {
-            // covers case 5----Remove the last element
-            ref_at_index->prev = NULL;
-            list_node = dpl_get_reference_at_index(list, (dpl_size(list) - 2));
-            list_node->next = NULL;
-
-            free(ref_at_index);
-        }
-    }
-
+    // Unlink the node from its neighbours
+    if (ref_at_index->prev != NULL) ref_at_index->prev->next = ref_at_index->next;
+    else list->head = ref_at_index->next;
+    if (ref_at_index->next != NULL) ref_at_index->next->prev = ref_at_index->prev;
+    free(ref_at_index);
     return list;
 }
 
@@ -237,19 +177,8 @@ dplist_node_t *dpl_get_reference_at_index(dplist_t *list, int index) {
 
     if (list->head == NULL) return NULL;
 
-        // Index negative or 0, return the first reference
-    else if (index <= 0) dummy = dpl_get_first_reference(list);
-
-        // Index larger than size, return the last reference
-    else if (index > dpl_size(list)) dummy = dpl_get_last_reference(list);
-
-    else {
-
-        // Return the reference at index
-        for (dummy = list->head, count = 0; dummy->next != NULL; dummy = dummy->next, count++) {
-            if (count >= index) return dummy;
-        }
-    }
+    // Walk to 'index', stopping at the last node if the list is shorter
+    for (dummy = list->head, count = 0; count < index && dummy->next != NULL; dummy = dummy->next, count++) {}
     return dummy;
 }
 
@@ -427,24 +356,19 @@ dplist_t *dpl_insert_sorted(dplist_t *list, void *element, bool insert_copy) {
     // Inserts a new list node containing 'element' in the sorted list and returns a pointer to the new list.
     // The list must be sorted before calling this function.
     // The sorting is done in ascending order according to a comparison function.
-    // If two members compare as equal, their order in the sorted array is undefined.
+    // If two members compare as equal, the new one is inserted after the ones already in the list.
     // If insert_copy == true : use element_copy() to make a copy of 'element' and use the copy in the new list node
     // If insert_copy == false : insert 'element' in the new list node without taking a copy of 'element' with element_copy()
 
     DPLIST_ERR_HANDLER(list == NULL, DPLIST_INVALID_ERROR);
 
-    if (list->head == NULL) dpl_insert_at_index(list, element, 0, insert_copy);
-
-    dplist_node_t *dummy = list->head;
-    while (dummy != NULL) {
-        if (list->element_compare(element, dummy->element) == -1) {
-            list = dpl_insert_at_reference(list, element, dummy, insert_copy);
-            return list;
-        } else if (dummy->next == NULL) {
-            list = dpl_insert_at_index(list, element, dpl_size(list) + 1, insert_copy);
-            return list;
-        } else dummy = dummy->next;
+    // One walk: the new node goes before the first greater element, after any equal ones
+    dplist_node_t *dummy = list->head, *last = NULL;
+    while (dummy != NULL && list->element_compare(element, dummy->element) >= 0) {
+        last = dummy;
+        dummy = dummy->next;
     }
+    dpl_link(list, dpl_new_node(list, element, insert_copy), last, dummy);
     return list;
 }
 
@@ -480,4 +404,69 @@ dplist_t *dpl_remove_element(dplist_t *list, void *element, bool free_element) {
     }
 }
 
+dplist_t *dpl_sort(dplist_t *list) {
+    // Bottom-up merge sort on the next pointers: runs of 1, 2, 4, ... elements are merged pairwise,
+    // no recursion and no extra memory; the prev pointers are restored in one final pass
+
+    DPLIST_ERR_HANDLER(list == NULL, DPLIST_INVALID_ERROR);
+
+    dplist_node_t *head = list->head;
+    if (head == NULL || head->next == NULL) return list;
+    for (int width = 1;; width *= 2) {
+        dplist_node_t *rest = head, *tail = NULL;
+        int merges = 0;
+        head = NULL;
+        while (rest != NULL) {
+            // split off two runs of at most 'width' nodes
+            dplist_node_t *a = rest, *b = rest;
+            int na = 0, nb = width;
+            while (na < width && b != NULL) {
+                b = b->next;
+                na++;
+            }
+            merges++;
+            // merge them, taking from 'a' on ties so equal elements keep their order
+            while (na > 0 || (nb > 0 && b != NULL)) {
+                dplist_node_t *next;
+                if (na == 0 || (nb > 0 && b != NULL && list->element_compare(b->element, a->element) < 0)) {
+                    next = b;
+                    b = b->next;
+                    nb--;
+                } else {
+                    next = a;
+                    a = a->next;
+                    na--;
+                }
+                if (tail != NULL) tail->next = next;
+                else head = next;
+                tail = next;
+            }
+            rest = b;
+        }
+        tail->next = NULL;
+        if (merges <= 1) break;
+    }
+    dplist_node_t *prev = NULL;
+    for (dplist_node_t *dummy = head; dummy != NULL; prev = dummy, dummy = dummy->next) dummy->prev = prev;
+    list->head = head;
+    return list;
+}
+
+static dplist_node_t *dpl_new_node(dplist_t *list, void *element, bool insert_copy) {
+    dplist_node_t *list_node = malloc(sizeof(dplist_node_t));
+    DPLIST_ERR_HANDLER(list_node == NULL, DPLIST_MEMORY_ERROR);
+    memset(list_node, 0, sizeof(dplist_node_t));
+    // Check if needed to make a deep copy of the element being inserted
+    if (insert_copy == true) list_node->element = list->element_copy(element);
+    else list_node->element = element;
+    return list_node;
+}
 
+static void dpl_link(dplist_t *list, dplist_node_t *node, dplist_node_t *prev, dplist_node_t *next) {
+    // Puts 'node' between the adjacent nodes 'prev' and 'next', NULL at either end of the list
+    node->prev = prev;
+    node->next = next;
+    if (prev != NULL) prev->next = node;
+    else list->head = node;
+    if (next != NULL) next->prev = node;
+}
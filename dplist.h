@@ -131,7 +131,7 @@ dplist_t *dpl_insert_sorted(dplist_t *list, void *element, bool insert_copy);
 // Inserts a new list node containing 'element' in the sorted list and returns a pointer to the new list. 
 // The list must be sorted before calling this function. 
 // The sorting is done in ascending order according to a comparison function.  
-// If two members compare as equal, their order in the sorted array is undefined.
+// If two members compare as equal, the new one is inserted after the ones already in the list.
 // If insert_copy == true : use element_copy() to make a copy of 'element' and use the copy in the new list node
 // If insert_copy == false : insert 'element' in the new list node without taking a copy of 'element' with element_copy() 
 
@@ -152,6 +152,11 @@ dplist_t *dpl_remove_element(dplist_t *list, void *element, bool free_element);
 
 // ---- you can add your extra operators here ----//
 
+dplist_t *dpl_sort(dplist_t *list);
+// Sorts the list in ascending order according to element_compare() and returns a pointer to the sorted list.
+// The sort is stable: list nodes that compare as equal keep their order. It takes O(n log n) compares and
+// no extra memory; the list nodes are relinked, so existing references stay valid and keep their element.
+
 
 #endif  // _DPLIST_H_
 
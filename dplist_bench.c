@@ -0,0 +1,193 @@
+/*
+ * Microbenchmark of the two list layouts behind the dplist callback interface: dplist_t (doubly linked
+ * nodes) and dparray_t (one array of element pointers). Every operation is timed on lists of 10^3 .. 10^6
+ * elements and printed in ns per element.
+ *
+ * Usage: dplist_bench [max_n [max_quadratic_n]]
+ * Runs whose total cost grows with n^2 for a layout (e.g. walking a linked list by index) are only done
+ * up to max_quadratic_n elements (default 10^4) and printed as '-' above that.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dplist.h"
+#include "dparray.h"
+
+#define BENCH_MAX_N             1000000
+#define BENCH_MAX_QUADRATIC_N   10000
+
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *list);
+    void (*insert)(void *list, void *element, int index);
+    void (*remove)(void *list, int index);
+    void *(*get)(void *list, int index);
+    long (*iterate)(void *list);
+    void (*insert_sorted)(void *list, void *element);
+    void (*sort)(void *list);
+} layout_t;
+
+typedef enum {
+    OP_APPEND, OP_PREPEND, OP_INSERT_SORTED, OP_GET, OP_ITERATE, OP_SORT, OP_REMOVE_FRONT, OP_REMOVE_BACK, OP_COUNT
+} op_t;
+
+static const char *op_names[OP_COUNT] = {
+        "append", "prepend", "insert_sorted", "get_at_index", "iterate", "sort", "remove_front", "remove_back"
+};
+
+static int compare_int(void *x, void *y) {
+    int a = *(int *) x, b = *(int *) y;
+    return a < b ? -1 : a > b;
+}
+
+// ---- dplist_t ----//
+
+static void *l_create(void) { return dpl_create(NULL, NULL, compare_int); }
+
+static void l_destroy(void *list) { dpl_free((dplist_t **) &list, false); }
+
+static void l_insert(void *list, void *element, int index) { dpl_insert_at_index(list, element, index, false); }
+
+static void l_remove(void *list, int index) { dpl_remove_at_index(list, index, false); }
+
+static void *l_get(void *list, int index) { return dpl_get_element_at_index(list, index); }
+
+static long l_iterate(void *list) {
+    long sum = 0;
+    for (dplist_node_t *ref = dpl_get_first_reference(list); ref != NULL; ref = dpl_get_next_reference(list, ref)) {
+        sum += *(int *) dpl_get_element_at_reference(list, ref);
+    }
+    return sum;
+}
+
+static void l_insert_sorted(void *list, void *element) { dpl_insert_sorted(list, element, false); }
+
+static void l_sort(void *list) { dpl_sort(list); }
+
+// ---- dparray_t ----//
+
+static void *a_create(void) { return dpa_create(NULL, NULL, compare_int); }
+
+static void a_destroy(void *list) { dpa_free((dparray_t **) &list, false); }
+
+static void a_insert(void *list, void *element, int index) { dpa_insert_at_index(list, element, index, false); }
+
+static void a_remove(void *list, int index) { dpa_remove_at_index(list, index, false); }
+
+static void *a_get(void *list, int index) { return dpa_get_element_at_index(list, index); }
+
+static long a_iterate(void *list) {
+    long sum = 0;
+    for (int i = 0, n = dpa_size(list); i < n; i++) sum += *(int *) dpa_get_element_at_index(list, i);
+    return sum;
+}
+
+static void a_insert_sorted(void *list, void *element) { dpa_insert_sorted(list, element, false); }
+
+static void a_sort(void *list) { dpa_sort(list); }
+
+static const layout_t layouts[] = {
+        {"dplist",  l_create, l_destroy, l_insert, l_remove, l_get, l_iterate, l_insert_sorted, l_sort},
+        {"dparray", a_create, a_destroy, a_insert, a_remove, a_get, a_iterate, a_insert_sorted, a_sort},
+};
+
+// For each layout, the operations whose total cost is O(n^2)
+static const int quadratic[][OP_COUNT] = {
+        // dplist: appending, indexing and (checked) reference walks are linear per element
+        {[OP_APPEND] = 1, [OP_INSERT_SORTED] = 1, [OP_GET] = 1, [OP_ITERATE] = 1, [OP_REMOVE_BACK] = 1},
+        // dparray: a sorted insert moves on average half the array
+        {[OP_INSERT_SORTED] = 1},
+};
+
+static int *keys;
+static int max_quadratic_n = BENCH_MAX_QUADRATIC_N;
+static volatile long sink;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double bench(const layout_t *l, op_t op, int n) {
+    // Builds the list the operation needs untimed, then returns the time of the operation in ns per element
+    void *list = l->create();
+    if (op != OP_APPEND && op != OP_PREPEND && op != OP_INSERT_SORTED) {
+        for (int i = 0; i < n; i++) l->insert(list, &keys[i], 0);
+    }
+    long sum = 0;
+    double start = now_ns();
+    switch (op) {
+        case OP_APPEND:
+            for (int i = 0; i < n; i++) l->insert(list, &keys[i], i);
+            break;
+        case OP_PREPEND:
+            for (int i = 0; i < n; i++) l->insert(list, &keys[i], 0);
+            break;
+        case OP_INSERT_SORTED:
+            for (int i = 0; i < n; i++) l->insert_sorted(list, &keys[i]);
+            break;
+        case OP_GET:
+            for (int i = 0; i < n; i++) sum += *(int *) l->get(list, i);
+            break;
+        case OP_ITERATE:
+            sum = l->iterate(list);
+            break;
+        case OP_SORT:
+            l->sort(list);
+            break;
+        case OP_REMOVE_FRONT:
+            for (int i = 0; i < n; i++) l->remove(list, 0);
+            break;
+        case OP_REMOVE_BACK:
+            for (int i = n - 1; i >= 0; i--) l->remove(list, i);
+            break;
+        default:
+            break;
+    }
+    double elapsed = now_ns() - start;
+    if (op == OP_SORT || op == OP_INSERT_SORTED) {
+        // check the result, a broken sort must not pass for a fast one
+        for (int i = 1; i < n; i++) {
+            if (*(int *) l->get(list, i - 1) > *(int *) l->get(list, i)) {
+                fprintf(stderr, "%s: %s left the list unsorted at %d\n", l->name, op_names[op], i);
+                exit(EXIT_FAILURE);
+            }
+            if (quadratic[l - layouts][OP_GET] && i > max_quadratic_n) break;
+        }
+    }
+    sink = sum;
+    l->destroy(list);
+    return elapsed / n;
+}
+
+int main(int argc, char *argv[]) {
+    int max_n = argc > 1 ? atoi(argv[1]) : BENCH_MAX_N;
+    if (argc > 2) max_quadratic_n = atoi(argv[2]);
+    int layout_count = sizeof(layouts) / sizeof(layouts[0]);
+
+    keys = malloc(sizeof(int) * (max_n > 0 ? max_n : 1));
+    if (keys == NULL) return EXIT_FAILURE;
+    srand(42);
+    for (int i = 0; i < max_n; i++) keys[i] = rand() % (max_n > 0 ? max_n : 1);
+
+    printf("%-14s %8s", "ns/element", "n");
+    for (int j = 0; j < layout_count; j++) printf(" %12s", layouts[j].name);
+    printf("\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int n = 1000; n <= max_n; n *= 10) {
+            printf("%-14s %8d", op_names[op], n);
+            for (int j = 0; j < layout_count; j++) {
+                if (quadratic[j][op] && n > max_quadratic_n) printf(" %12s", "-");
+                else printf(" %12.1f", bench(&layouts[j], op, n));
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+    free(keys);
+    return EXIT_SUCCESS;
+}
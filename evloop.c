@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "evloop.h"
+
+#define EVLOOP_MIN_HANDLERS 64
+
+typedef struct {
+    evloop_cb_t cb;     // NULL if the descriptor is not registered
+    void *arg;
+    uint32_t events;
+    uint32_t gen;       // bumped on every add/del so stale events of a recycled fd are dropped
+} evloop_handler_t;
+
+struct evloop {
+    int epfd;
+    int size;                       // number of slots in 'handlers'
+    evloop_handler_t *handlers;     // indexed by file descriptor
+    uint64_t now;                   // cached monotonic clock in ms
+    uint32_t spin_max;              // busy-poll budget limit in us, 0 always blocks
+    uint32_t budget;                // current busy-poll budget in us
+    uint64_t last;                  // us clock of the last wakeup with events
+    evloop_stats_t stats;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+};
+
+
+static int evloop_reserve(evloop_t *loop, int fd);
+
+static int evloop_wait(evloop_t *loop, int timeout_ms);
+
+static uint64_t evloop_clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static inline uint64_t evloop_pack(int fd, uint32_t gen) {
+    return ((uint64_t) gen << 32) | (uint32_t) fd;
+}
+
+
+int evloop_create(evloop_t **loop) {
+    evloop_t *l = malloc(sizeof(evloop_t));
+    if (l == NULL) return EVLOOP_MEMORY_ERROR;
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (l->epfd < 0) {
+        free(l);
+        return EVLOOP_CREATE_ERROR;
+    }
+    l->size = 0;
+    l->handlers = NULL;
+    l->last = evloop_clock_us();
+    l->now = l->last / 1000;
+    l->spin_max = 0;
+    l->budget = 0;
+    memset(&l->stats, 0, sizeof(l->stats));
+    *loop = l;
+    return EVLOOP_NO_ERROR;
+}
+
+
+void evloop_free(evloop_t **loop) {
+    if (loop == NULL || *loop == NULL) return;
+    close((*loop)->epfd);
+    free((*loop)->handlers);
+    free(*loop);
+    *loop = NULL;
+}
+
+
+int evloop_add(evloop_t *loop, int fd, uint32_t events, evloop_cb_t cb, void *arg) {
+    struct epoll_event ev;
+    if (fd < 0 || cb == NULL) return EVLOOP_CTL_ERROR;
+    if (evloop_reserve(loop, fd) != EVLOOP_NO_ERROR) return EVLOOP_MEMORY_ERROR;
+    evloop_handler_t *h = &loop->handlers[fd];
+    if (h->cb != NULL) return EVLOOP_CTL_ERROR;
+    h->gen++;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = evloop_pack(fd, h->gen);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) return EVLOOP_CTL_ERROR;
+    h->cb = cb;
+    h->arg = arg;
+    h->events = events;
+    return EVLOOP_NO_ERROR;
+}
+
+
+int evloop_mod(evloop_t *loop, int fd, uint32_t events) {
+    struct epoll_event ev;
+    if (fd < 0 || fd >= loop->size || loop->handlers[fd].cb == NULL) return EVLOOP_CTL_ERROR;
+    evloop_handler_t *h = &loop->handlers[fd];
+    if (h->events == events) return EVLOOP_NO_ERROR;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = evloop_pack(fd, h->gen);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) != 0) return EVLOOP_CTL_ERROR;
+    h->events = events;
+    return EVLOOP_NO_ERROR;
+}
+
+
+int evloop_del(evloop_t *loop, int fd) {
+    if (fd < 0 || fd >= loop->size || loop->handlers[fd].cb == NULL) return EVLOOP_CTL_ERROR;
+    evloop_handler_t *h = &loop->handlers[fd];
+    // the descriptor may already be closed by a peer hang-up, the handler is dropped anyway
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    h->cb = NULL;
+    h->arg = NULL;
+    h->events = 0;
+    h->gen++;
+    return EVLOOP_NO_ERROR;
+}
+
+
+int evloop_run_once(evloop_t *loop, int timeout_ms) {
+    int n = evloop_wait(loop, timeout_ms);
+    if (n < 0) return (errno == EINTR) ? 0 : -EVLOOP_WAIT_ERROR;
+    for (int i = 0; i < n; i++) {
+        int fd = (int) (uint32_t) loop->events[i].data.u64;
+        uint32_t gen = (uint32_t) (loop->events[i].data.u64 >> 32);
+        if (fd >= loop->size) continue;
+        evloop_handler_t *h = &loop->handlers[fd];
+        // skip descriptors removed (or removed and re-added) by an earlier callback of this batch
+        if (h->cb == NULL || h->gen != gen) continue;
+        h->cb(loop, fd, loop->events[i].events, h->arg);
+    }
+    return n;
+}
+
+
+void evloop_set_spin(evloop_t *loop, uint32_t max_us) {
+    loop->spin_max = max_us;
+    loop->budget = max_us;
+}
+
+
+void evloop_get_stats(evloop_t *loop, evloop_stats_t *stats) {
+    *stats = loop->stats;
+    stats->budget_us = loop->budget;
+}
+
+
+uint64_t evloop_now(evloop_t *loop) {
+    return loop->now;
+}
+
+
+int evloop_get_fd(evloop_t *loop) {
+    return loop->epfd;
+}
+
+
+static int evloop_wait(evloop_t *loop, int timeout_ms) {
+    uint64_t start = evloop_clock_us(), t = start;
+    int n = 0, spun = 0;
+    // spin only within the budget after the last activity, and never past the timeout
+    uint64_t end = loop->last + loop->budget;
+    if (timeout_ms >= 0 && end > start + (uint64_t) timeout_ms * 1000) end = start + (uint64_t) timeout_ms * 1000;
+    if (loop->spin_max != 0 && timeout_ms != 0 && t < end) {
+        spun = 1;
+        do {
+            n = epoll_wait(loop->epfd, loop->events, EVLOOP_MAX_EVENTS, 0);
+            t = evloop_clock_us();
+            loop->stats.polls++;
+        } while (n == 0 && t < end);
+        loop->stats.spin_us += t - start;
+        if (n > 0) loop->stats.spin_hits++;
+        else if (n == 0) {
+            // nothing came in time, the gaps grew: spin half as long next time
+            loop->stats.spin_misses++;
+            loop->budget /= 2;
+            if (timeout_ms > 0) {
+                timeout_ms -= (int) ((t - start) / 1000);
+                if (timeout_ms <= 0) timeout_ms = 0;
+            }
+        }
+    }
+    if (n == 0 && !(spun && timeout_ms == 0)) {
+        if (timeout_ms != 0) loop->stats.blocks++;
+        n = epoll_wait(loop->epfd, loop->events, EVLOOP_MAX_EVENTS, timeout_ms);
+        t = evloop_clock_us();
+        if (n > 0 && timeout_ms != 0) {
+            loop->stats.block_hits++;
+            // a gap the budget could have covered: spin a bit longer than it from now on
+            uint64_t gap = t - loop->last;
+            if (loop->spin_max != 0 && gap <= loop->spin_max && gap + gap / 2 > loop->budget) {
+                loop->budget = gap + gap / 2 < loop->spin_max ? (uint32_t) (gap + gap / 2) : loop->spin_max;
+            }
+        }
+    }
+    if (n > 0) {
+        // moving average of the gaps between activity, 1/8 weight for the newest
+        uint64_t gap = t - loop->last;
+        loop->stats.gap_us += ((int64_t) gap - (int64_t) loop->stats.gap_us) / 8;
+        loop->last = t;
+    }
+    loop->now = t / 1000;
+    return n;
+}
+
+static int evloop_reserve(evloop_t *loop, int fd) {
+    if (fd < loop->size) return EVLOOP_NO_ERROR;
+    int size = loop->size ? loop->size : EVLOOP_MIN_HANDLERS;
+    while (size <= fd) size *= 2;
+    evloop_handler_t *h = realloc(loop->handlers, sizeof(evloop_handler_t) * size);
+    if (h == NULL) return EVLOOP_MEMORY_ERROR;
+    memset(h + loop->size, 0, sizeof(evloop_handler_t) * (size - loop->size));
+    loop->handlers = h;
+    loop->size = size;
+    return EVLOOP_NO_ERROR;
+}
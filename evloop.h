@@ -0,0 +1,114 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EVLOOP_NO_ERROR         0
+#define EVLOOP_CREATE_ERROR     1  // epoll_create failed
+#define EVLOOP_CTL_ERROR        2  // epoll_ctl (add, mod, del) failed
+#define EVLOOP_MEMORY_ERROR     3  // mem alloc error
+#define EVLOOP_WAIT_ERROR       4  // epoll_wait failed
+
+#define EVLOOP_MAX_EVENTS   64
+
+/*
+ * Busy polling: with a spin budget set, evloop_run_once() first polls
+ * epoll without timeout for as long as the budget after the last wakeup
+ * that had events, and only then blocks. A burst that arrives while
+ * spinning is dispatched without the sleep and wakeup of the thread, at
+ * the cost of a busy CPU. The budget adapts to the gaps between activity:
+ * a spin that found nothing halves it, a blocking wakeup after a gap
+ * shorter than the limit raises it to one and a half times that gap.
+ */
+typedef struct {
+    uint64_t polls;             // zero timeout epoll_wait calls while spinning
+    uint64_t spin_hits;         // wakeups with events found by spinning
+    uint64_t spin_misses;       // budgets spun without any event
+    uint64_t blocks;            // blocking epoll_wait calls
+    uint64_t block_hits;        // blocking waits that returned events
+    uint64_t spin_us;           // time spent spinning
+    uint64_t gap_us;            // moving average of the time between wakeups with events
+    uint32_t budget_us;         // current spin budget
+} evloop_stats_t;
+
+
+typedef struct evloop evloop_t;
+
+typedef void (*evloop_cb_t)(evloop_t *loop, int fd, uint32_t events, void *arg);
+/* Callback invoked by evloop_run_once() for every ready file descriptor
+ * 'events' is the EPOLL* mask reported by the kernel, 'arg' the pointer given at registration
+ * A callback may add, modify or delete any descriptor, including its own
+ */
+
+
+int evloop_create(evloop_t **loop);
+
+/* Creates a new event loop backed by one epoll instance and returns it as '*loop'
+ * If memory allocation fails, EVLOOP_MEMORY_ERROR is returned
+ * If epoll_create fails, EVLOOP_CREATE_ERROR is returned
+ */
+
+
+void evloop_free(evloop_t **loop);
+
+/* Closes the epoll instance, frees the handler table and sets '*loop' to NULL
+ * Registered descriptors are not closed, this remains the job of their owner
+ */
+
+
+int evloop_add(evloop_t *loop, int fd, uint32_t events, evloop_cb_t cb, void *arg);
+
+/* Registers 'fd' for 'events' (EPOLLIN, EPOLLOUT, EPOLLET, ...) and dispatches them to 'cb' with 'arg'
+ * If the handler table cannot grow, EVLOOP_MEMORY_ERROR is returned
+ * If epoll_ctl fails, EVLOOP_CTL_ERROR is returned
+ */
+
+
+int evloop_mod(evloop_t *loop, int fd, uint32_t events);
+
+/* Changes the event mask of an already registered 'fd', callback and argument are kept
+ * If 'fd' is not registered or epoll_ctl fails, EVLOOP_CTL_ERROR is returned
+ */
+
+
+int evloop_del(evloop_t *loop, int fd);
+
+/* Removes 'fd' from the loop; pending events for 'fd' in the current iteration are discarded
+ * Must be called before 'fd' is closed, so a recycled descriptor never inherits a stale handler
+ * If 'fd' is not registered, EVLOOP_CTL_ERROR is returned
+ */
+
+
+int evloop_run_once(evloop_t *loop, int timeout_ms);
+
+/* Waits at most 'timeout_ms' milliseconds (-1 is forever, 0 polls) and dispatches every ready descriptor
+ * With a spin budget (see evloop_set_spin()) it polls before it blocks, within the same timeout
+ * The cached clock returned by evloop_now() is refreshed once, right after the wait
+ * Returns the number of dispatched events, 0 on timeout or EINTR, or -EVLOOP_WAIT_ERROR on failure
+ */
+
+
+void evloop_set_spin(evloop_t *loop, uint32_t max_us);
+/* Lets evloop_run_once() busy poll for up to 'max_us' microseconds after activity before it blocks,
+ * 0 (the default) always blocks; the budget starts at 'max_us' and adapts below it
+ */
+
+
+void evloop_get_stats(evloop_t *loop, evloop_stats_t *stats);
+/* Copies the wait counters of 'loop' and its current spin budget
+ */
+
+
+uint64_t evloop_now(evloop_t *loop);
+/* Returns the CLOCK_MONOTONIC time in milliseconds, cached when the last evloop_run_once() woke up
+ * Use this instead of time() in callbacks: it costs no clock read per event
+ */
+
+
+int evloop_get_fd(evloop_t *loop);
+/* Returns the epoll descriptor, e.g. to nest this loop inside another one
+ */
+
+
+#endif  //__EVLOOP_H__
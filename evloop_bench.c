@@ -0,0 +1,176 @@
+/*
+ * Wakeup latency against CPU of the event loop with and without busy
+ * polling (evloop_set_spin()). A sender thread writes its clock to a
+ * socket pair every 'interval' microseconds, the loop thread measures how
+ * long each message took to be dispatched and how much CPU it used for it.
+ * A short interval is a busy sensor the spin budget covers, a long one
+ * lets the budget shrink to nothing and the loop sleep like without it.
+ *
+ * With -P the pair is a loopback TCP connection on 'port' instead, both
+ * ends tuned with the socket profile (tcp_get_profile()), or with each
+ * profile in turn for "all", so the profiles can be compared; options the
+ * kernel rejects (SO_BUSY_POLL without CAP_NET_ADMIN) are reported.
+ *
+ * Usage: evloop_bench [-P profile|all] [-p port] [interval_us [messages [spin_us]]]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+
+#include "evloop.h"
+#include "tcpsock.h"
+
+#define BENCH_PORT      15690
+#define BENCH_UNIX      -1      // profile of the socket pair
+
+typedef struct {
+    int fd;
+    int interval;
+    int messages;
+} sender_t;
+
+typedef struct {
+    uint64_t *latency;
+    int received;
+} receiver_t;
+
+static uint64_t bench_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void *bench_send(void *arg) {
+    sender_t *s = (sender_t *) arg;
+    struct timespec pause = {.tv_sec = s->interval / 1000000, .tv_nsec = (long) (s->interval % 1000000) * 1000};
+    for (int i = 0; i < s->messages; i++) {
+        nanosleep(&pause, NULL);
+        uint64_t sent = bench_clock(CLOCK_MONOTONIC);
+        if (write(s->fd, &sent, sizeof(sent)) != sizeof(sent)) break;
+    }
+    return NULL;
+}
+
+static void bench_receive(evloop_t *loop, int fd, uint32_t events, void *arg) {
+    receiver_t *r = (receiver_t *) arg;
+    uint64_t sent[64];
+    ssize_t n = read(fd, sent, sizeof(sent));
+    uint64_t now = bench_clock(CLOCK_MONOTONIC);
+    for (ssize_t i = 0; i < n / (ssize_t) sizeof(uint64_t); i++) r->latency[r->received++] = now - sent[i];
+}
+
+static int bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_tune(tcpsock_t *sock, const tcp_tuning_t *tuning, const char *end) {
+    char rejected[256];
+    if (tcp_set_tuning_ex(sock, tuning, rejected, sizeof(rejected)) != TCP_NO_ERROR) {
+        fprintf(stderr, "%s: rejected %s\n", end, rejected);
+    }
+}
+
+/*
+ * Connects sv[0] (receiving end) and sv[1] (sending end), over loopback TCP tuned with 'profile' unless BENCH_UNIX.
+ */
+static int bench_pair(int profile, int port, int sv[2]) {
+    if (profile == BENCH_UNIX) return socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    tcp_tuning_t tuning;
+    tcpsock_t *server, *client, *accepted;
+    tcp_get_profile((tcp_profile_t) profile, &tuning);
+    if (tcp_passive_open_ex(&server, "127.0.0.1", port, 0) != TCP_NO_ERROR) return -1;
+    // buffer sizes must be set before the connection is made to size its window
+    bench_tune(server, &tuning, "server");
+    if (tcp_active_open(&client, port, "127.0.0.1") != TCP_NO_ERROR) {
+        tcp_close(&server);
+        return -1;
+    }
+    bench_tune(client, &tuning, "client");
+    int res = tcp_wait_for_connection(server, &accepted);
+    tcp_close(&server);
+    if (res != TCP_NO_ERROR) {
+        tcp_close(&client);
+        return -1;
+    }
+    if (tuning.quickack) tcp_set_tuning(accepted, &(tcp_tuning_t) {.quickack = 1, .incoming_cpu = -1});
+    tcp_detach(&accepted, &sv[0]);
+    tcp_detach(&client, &sv[1]);
+    return 0;
+}
+
+static void bench_run(int profile, int port, int interval, int messages, uint32_t spin) {
+    int sv[2];
+    evloop_t *loop;
+    if (bench_pair(profile, port, sv) != 0 || evloop_create(&loop) != EVLOOP_NO_ERROR) {
+        fprintf(stderr, "Cannot connect the pair on port %d\n", port);
+        exit(EXIT_FAILURE);
+    }
+    evloop_set_spin(loop, spin);
+    receiver_t r = {.latency = calloc(messages, sizeof(uint64_t)), .received = 0};
+    if (r.latency == NULL || evloop_add(loop, sv[0], EPOLLIN, bench_receive, &r) != EVLOOP_NO_ERROR) exit(EXIT_FAILURE);
+    sender_t s = {.fd = sv[1], .interval = interval, .messages = messages};
+    pthread_t sender;
+    uint64_t cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID), wall = bench_clock(CLOCK_MONOTONIC);
+    pthread_create(&sender, NULL, bench_send, &s);
+    while (r.received < messages) {
+        if (evloop_run_once(loop, 1000) == 0) break;
+    }
+    cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = bench_clock(CLOCK_MONOTONIC) - wall;
+    pthread_join(sender, NULL);
+
+    evloop_stats_t st;
+    evloop_get_stats(loop, &st);
+    qsort(r.latency, r.received, sizeof(uint64_t), bench_compare);
+    if (r.received > 0) {
+        printf("%-16s %8u %10d %10.1f %10.1f %10.1f %8.1f%% %10llu %10llu\n",
+               profile == BENCH_UNIX ? "unix" : tcp_profile_name((tcp_profile_t) profile), spin, interval,
+               r.latency[r.received / 2] / 1000.0, r.latency[r.received * 99 / 100] / 1000.0,
+               r.latency[r.received - 1] / 1000.0, 100.0 * (double) cpu / (double) wall,
+               (unsigned long long) st.spin_hits, (unsigned long long) st.block_hits);
+    }
+    free(r.latency);
+    evloop_free(&loop);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(int argc, char *argv[]) {
+    int first = BENCH_UNIX, last = BENCH_UNIX, port = BENCH_PORT, opt, bad = 0;
+    tcp_profile_t profile;
+    while ((opt = getopt(argc, argv, "P:p:")) != -1) {
+        if (opt == 'P' && strcmp(optarg, "all") == 0) {
+            first = 0;
+            last = TCP_PROFILE_COUNT - 1;
+        } else if (opt == 'P' && tcp_profile_from_name(optarg, &profile) == TCP_NO_ERROR) {
+            first = last = (int) profile;
+        } else if (opt == 'p') {
+            port = atoi(optarg);
+        } else {
+            bad = 1;
+        }
+    }
+    int interval = argc > optind ? atoi(argv[optind]) : 50;
+    int messages = argc > optind + 1 ? atoi(argv[optind + 1]) : 20000;
+    int spin = argc > optind + 2 ? atoi(argv[optind + 2]) : 200;
+    if (bad || interval < 0 || messages < 1 || spin < 1 || port < MIN_PORT) {
+        fprintf(stderr, "Usage: %s [-P profile|all] [-p port] [interval_us [messages [spin_us]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("%-16s %8s %10s %10s %10s %10s %9s %10s %10s\n", "profile", "spin_us", "interval", "p50_us", "p99_us",
+           "max_us", "cpu", "spin_hits", "blocked");
+    for (int p = first; p <= last; p++) {
+        bench_run(p, port, interval, messages, 0);
+        bench_run(p, port, interval, messages, (uint32_t) spin);
+    }
+    return EXIT_SUCCESS;
+}
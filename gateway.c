@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "gateway.h"
+
+#define GW_DISCONNECTED 0
+#define GW_CONNECTING   1
+#define GW_CONNECTED    2
+
+#define GW_QUEUE_BYTES  (GATEWAY_QUEUE_RECORDS * SENSOR_DATA_WIRE_SIZE)
+#define GW_FRAME_BYTES  (GATEWAY_FRAME_RECORDS * SENSOR_DATA_WIRE_SIZE)
+#define GW_RATE_WINDOW_MS 1000
+
+typedef struct gw_conn gw_conn_t;
+struct gw_conn {
+    gateway_t *gw;
+    tcpsock_t *sock;
+    int state;
+    int was_connected;          // a later connection setup counts as a reconnect
+    int want_out;               // EPOLLOUT is enabled because the send buffer was full
+    int attempts;               // failed connection setups since the last success
+    uint64_t next_attempt;      // monotonic ms of the next connection setup while disconnected
+    // bytes [head, tail) of 'buf' are pending, 'buf' itself always starts at a record boundary
+    int head, tail;
+    unsigned char *buf;
+    uint64_t rate_start;
+    uint64_t rate_bytes;
+    gateway_stats_t stats;
+};
+
+struct gateway {
+    evloop_t *loop;
+    int own_loop;
+    int nservers;
+    char ip[GATEWAY_MAX_SERVERS][TCP_ADDR_STRLEN];
+    int port[GATEWAY_MAX_SERVERS];
+    int nconns;
+    gw_conn_t **conns;
+    unsigned int seed;
+    int tuned;
+    tcp_tuning_t tuning;
+};
+
+
+static uint64_t gw_now_ms();
+
+static void gw_connect(gw_conn_t *c, uint64_t now);
+
+static void gw_connected(tcpsock_t *sock, int result, void *arg);
+
+static void gw_event(tcpsock_t *sock, uint32_t events, void *arg);
+
+static void gw_send(gw_conn_t *c);
+
+static void gw_drop(gw_conn_t *c);
+
+static void gw_schedule(gw_conn_t *c, uint64_t now);
+
+
+int gateway_create(gateway_t **gw, evloop_t *loop) {
+    gateway_t *g = calloc(1, sizeof(gateway_t));
+    if (g == NULL) return GATEWAY_MEMORY_ERROR;
+    if (loop == NULL) {
+        if (evloop_create(&loop) != EVLOOP_NO_ERROR) {
+            free(g);
+            return GATEWAY_LOOP_ERROR;
+        }
+        g->own_loop = 1;
+    }
+    g->loop = loop;
+    g->seed = (unsigned int) (gw_now_ms() ^ (uint64_t) getpid());
+    *gw = g;
+    return GATEWAY_NO_ERROR;
+}
+
+
+void gateway_free(gateway_t **gw) {
+    if (gw == NULL || *gw == NULL) return;
+    gateway_t *g = *gw;
+    for (int i = 0; i < g->nconns; i++) {
+        if (g->conns[i]->sock != NULL) tcp_close(&g->conns[i]->sock);
+        free(g->conns[i]->buf);
+        free(g->conns[i]);
+    }
+    free(g->conns);
+    if (g->own_loop) evloop_free(&g->loop);
+    free(g);
+    *gw = NULL;
+}
+
+
+int gateway_add_server(gateway_t *gw, char *ip, int port, int connections) {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    if (ip == NULL || tcp_parse_addr(ip, port, &addr, &len) != TCP_NO_ERROR) return GATEWAY_ADDRESS_ERROR;
+    if (port < MIN_PORT || port > MAX_PORT || connections <= 0) return GATEWAY_ADDRESS_ERROR;
+    if (gw->nservers == GATEWAY_MAX_SERVERS) return GATEWAY_ADDRESS_ERROR;
+    gw_conn_t **conns = realloc(gw->conns, sizeof(gw_conn_t *) * (gw->nconns + connections));
+    if (conns == NULL) return GATEWAY_MEMORY_ERROR;
+    gw->conns = conns;
+    int server = gw->nservers++;
+    strncpy(gw->ip[server], ip, sizeof(gw->ip[server]) - 1);
+    gw->port[server] = port;
+    uint64_t now = gw_now_ms();
+    for (int i = 0; i < connections; i++) {
+        gw_conn_t *c = calloc(1, sizeof(gw_conn_t));
+        if (c != NULL) c->buf = malloc(GW_QUEUE_BYTES);
+        if (c == NULL || c->buf == NULL) {
+            free(c);
+            return GATEWAY_MEMORY_ERROR;
+        }
+        c->gw = gw;
+        c->stats.server = server;
+        c->rate_start = now;
+        gw->conns[gw->nconns++] = c;
+        gw_connect(c, now);
+    }
+    return GATEWAY_NO_ERROR;
+}
+
+
+void gateway_set_tuning(gateway_t *gw, const tcp_tuning_t *tuning) {
+    gw->tuning = *tuning;
+    gw->tuned = 1;
+}
+
+
+int gateway_enqueue(gateway_t *gw, sensor_data_t *data) {
+    if (gw->nconns == 0) return GATEWAY_QUEUE_FULL;
+    // Fibonacci hashing keeps neighbouring sensor ids on different connections
+    gw_conn_t *c = gw->conns[((uint32_t) data->id * 2654435761u) % (uint32_t) gw->nconns];
+    if (c->tail + (int) SENSOR_DATA_WIRE_SIZE > (int) GW_QUEUE_BYTES) {
+        // reclaim the space of sent records, the buffer must stay record aligned
+        int shift = c->head - c->head % (int) SENSOR_DATA_WIRE_SIZE;
+        if (shift == 0) return GATEWAY_QUEUE_FULL;
+        memmove(c->buf, c->buf + shift, c->tail - shift);
+        c->head -= shift;
+        c->tail -= shift;
+    }
+    sensor_data_pack(c->buf + c->tail, data);
+    c->tail += SENSOR_DATA_WIRE_SIZE;
+    c->stats.queued++;
+    if (c->state == GW_CONNECTED && !c->want_out && c->tail - c->head >= (int) GW_FRAME_BYTES) gw_send(c);
+    return GATEWAY_NO_ERROR;
+}
+
+
+void gateway_flush(gateway_t *gw) {
+    for (int i = 0; i < gw->nconns; i++) {
+        gw_conn_t *c = gw->conns[i];
+        if (c->state == GW_CONNECTED && !c->want_out && c->tail > c->head) gw_send(c);
+    }
+}
+
+
+int gateway_poll(gateway_t *gw, int timeout_ms) {
+    int next = gateway_tick(gw);
+    if (next >= 0 && (timeout_ms < 0 || next < timeout_ms)) timeout_ms = next;
+    int n = evloop_run_once(gw->loop, timeout_ms);
+    gateway_tick(gw);
+    return n < 0 ? -GATEWAY_LOOP_ERROR : n;
+}
+
+
+int gateway_tick(gateway_t *gw) {
+    uint64_t now = gw_now_ms();
+    int64_t next = -1;
+    for (int i = 0; i < gw->nconns; i++) {
+        gw_conn_t *c = gw->conns[i];
+        if (c->state == GW_DISCONNECTED) {
+            if (c->next_attempt <= now) gw_connect(c, now);
+            if (c->state == GW_DISCONNECTED && (next < 0 || (int64_t) (c->next_attempt - now) < next))
+                next = (int64_t) (c->next_attempt - now);
+        }
+        if (now - c->rate_start >= GW_RATE_WINDOW_MS) {
+            double rate = (double) c->rate_bytes * 1000.0 / (double) (now - c->rate_start);
+            c->stats.bytes_per_sec = c->stats.bytes_per_sec == 0 ? rate : 0.5 * c->stats.bytes_per_sec + 0.5 * rate;
+            c->rate_bytes = 0;
+            c->rate_start = now;
+        }
+    }
+    return (int) next;
+}
+
+
+int gateway_pending(gateway_t *gw) {
+    int pending = 0;
+    for (int i = 0; i < gw->nconns; i++) pending += gw->conns[i]->stats.queued;
+    return pending;
+}
+
+
+int gateway_connection_count(gateway_t *gw) {
+    return gw->nconns;
+}
+
+
+int gateway_get_stats(gateway_t *gw, int index, gateway_stats_t *stats) {
+    if (index < 0 || index >= gw->nconns) return GATEWAY_INDEX_ERROR;
+    *stats = gw->conns[index]->stats;
+    stats->connected = (gw->conns[index]->state == GW_CONNECTED);
+    return GATEWAY_NO_ERROR;
+}
+
+
+static uint64_t gw_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void gw_connect(gw_conn_t *c, uint64_t now) {
+    gateway_t *gw = c->gw;
+    int server = c->stats.server;
+    int result = tcp_active_open_async(&c->sock, gw->port[server], gw->ip[server], gw->loop, &gw_connected, c);
+    if (result != TCP_NO_ERROR) {
+        c->sock = NULL;
+        c->stats.failures++;
+        gw_schedule(c, now);
+        return;
+    }
+    c->state = GW_CONNECTING;
+}
+
+static void gw_connected(tcpsock_t *sock, int result, void *arg) {
+    gw_conn_t *c = (gw_conn_t *) arg;
+    if (result != TCP_NO_ERROR ||
+        tcp_register(sock, c->gw->loop, EPOLLIN | EPOLLRDHUP, &gw_event, c) != TCP_NO_ERROR) {
+        tcp_close(&c->sock);
+        c->state = GW_DISCONNECTED;
+        c->stats.failures++;
+        gw_schedule(c, gw_now_ms());
+        return;
+    }
+    if (c->gw->tuned) tcp_set_tuning(sock, &c->gw->tuning);
+    c->state = GW_CONNECTED;
+    c->want_out = 0;
+    c->attempts = 0;
+    if (c->was_connected) c->stats.reconnects++;
+    c->was_connected = 1;
+    if (c->tail > c->head) gw_send(c);
+}
+
+static void gw_event(tcpsock_t *sock, uint32_t events, void *arg) {
+    gw_conn_t *c = (gw_conn_t *) arg;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // the server never talks back, readable means closed or broken
+        char scratch[64];
+        int n = sizeof(scratch);
+        int result = tcp_receive(sock, scratch, &n);
+        if (result != TCP_NO_ERROR && result != TCP_WOULD_BLOCK) {
+            gw_drop(c);
+            return;
+        }
+    }
+    if (events & EPOLLOUT) gw_send(c);
+}
+
+static void gw_send(gw_conn_t *c) {
+    while (c->tail > c->head) {
+        int n = c->tail - c->head;
+        int result = tcp_send(c->sock, c->buf + c->head, &n);
+        if (result == TCP_WOULD_BLOCK) {
+            if (!c->want_out && tcp_modify(c->sock, EPOLLIN | EPOLLRDHUP | EPOLLOUT) == TCP_NO_ERROR)
+                c->want_out = 1;
+            return;
+        }
+        if (result != TCP_NO_ERROR) {
+            gw_drop(c);
+            return;
+        }
+        // records are only accounted once their last byte is handed to the kernel
+        int done = (c->head + n) / (int) SENSOR_DATA_WIRE_SIZE - c->head / (int) SENSOR_DATA_WIRE_SIZE;
+        c->head += n;
+        c->stats.bytes_sent += n;
+        c->stats.frames_sent++;
+        c->stats.records_sent += done;
+        c->stats.queued -= done;
+        c->rate_bytes += n;
+    }
+    c->head = c->tail = 0;
+    if (c->want_out && tcp_modify(c->sock, EPOLLIN | EPOLLRDHUP) == TCP_NO_ERROR) c->want_out = 0;
+}
+
+static void gw_drop(gw_conn_t *c) {
+    tcp_close(&c->sock);
+    c->state = GW_DISCONNECTED;
+    c->want_out = 0;
+    c->stats.failures++;
+    // the server discards a partially received record, so it is sent again in full
+    c->head -= c->head % (int) SENSOR_DATA_WIRE_SIZE;
+    gw_schedule(c, gw_now_ms());
+}
+
+static void gw_schedule(gw_conn_t *c, uint64_t now) {
+    // exponential backoff with jitter, so a restarted server isn't hit by all gateways at once
+    int shift = c->attempts < 16 ? c->attempts : 16;
+    uint64_t backoff = (uint64_t) GATEWAY_BACKOFF_MIN_MS << shift;
+    if (backoff > GATEWAY_BACKOFF_MAX_MS) backoff = GATEWAY_BACKOFF_MAX_MS;
+    c->attempts++;
+    c->next_attempt = now + backoff / 2 + (uint64_t) rand_r(&c->gw->seed) % (backoff / 2 + 1);
+}
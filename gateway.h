@@ -0,0 +1,113 @@
+#ifndef __GATEWAY_H__
+#define __GATEWAY_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "evloop.h"
+#include "tcpsock.h"
+
+#define GATEWAY_NO_ERROR        0
+#define GATEWAY_MEMORY_ERROR    1  // mem alloc error
+#define GATEWAY_ADDRESS_ERROR   2  // invalid port and/or IP address
+#define GATEWAY_QUEUE_FULL      3  // the queue of the connection the record maps to is full
+#define GATEWAY_LOOP_ERROR      4  // event loop error
+#define GATEWAY_INDEX_ERROR     5  // no connection with that index
+
+#define GATEWAY_MAX_SERVERS     16
+#define GATEWAY_FRAME_RECORDS   64     // records batched into one send
+#define GATEWAY_QUEUE_RECORDS   4096   // records queued per connection while it is (re)connecting
+#define GATEWAY_BACKOFF_MIN_MS  100
+#define GATEWAY_BACKOFF_MAX_MS  30000
+
+typedef struct gateway gateway_t;
+
+typedef struct {
+    int server;                 // index of the server, in the order of gateway_add_server() calls
+    int connected;
+    uint64_t records_sent;
+    uint64_t bytes_sent;
+    uint64_t frames_sent;       // send calls that transferred data
+    uint64_t reconnects;        // successful connection setups after the first one
+    uint64_t failures;          // failed connection setups and dropped connections
+    int queued;                 // records waiting to be sent
+    double bytes_per_sec;       // smoothed throughput over the last seconds
+} gateway_stats_t;
+
+
+int gateway_create(gateway_t **gw, evloop_t *loop);
+
+/* Creates a gateway whose persistent connections are driven by 'loop'
+ * If 'loop' is NULL, the gateway creates and owns its own loop
+ * If memory allocation fails, GATEWAY_MEMORY_ERROR is returned
+ * If the loop can't be created, GATEWAY_LOOP_ERROR is returned
+ */
+
+
+void gateway_free(gateway_t **gw);
+
+/* Closes all connections, drops queued records, frees all memory and sets '*gw' to NULL
+ * Call gateway_flush() and gateway_poll() until gateway_pending() is 0 first for a graceful stop
+ */
+
+
+int gateway_add_server(gateway_t *gw, char *ip, int port, int connections);
+
+/* Adds 'connections' persistent connections to the server 'ip':'port' to the pool and starts connecting them
+ * If 'ip' or 'port' is invalid, or GATEWAY_MAX_SERVERS is reached, GATEWAY_ADDRESS_ERROR is returned
+ * If memory allocation fails, GATEWAY_MEMORY_ERROR is returned
+ */
+
+
+void gateway_set_tuning(gateway_t *gw, const tcp_tuning_t *tuning);
+
+/* Applies the socket options in 'tuning' (see tcp_get_profile()) to every connection set up from now on
+ */
+
+
+int gateway_enqueue(gateway_t *gw, sensor_data_t *data);
+
+/* Queues a copy of 'data' on the connection its sensor id maps to, so readings of one sensor keep their order
+ * A frame is sent as soon as GATEWAY_FRAME_RECORDS records are queued on a connected connection
+ * If the queue of that connection is full, the record is not queued and GATEWAY_QUEUE_FULL is returned
+ */
+
+
+void gateway_flush(gateway_t *gw);
+
+/* Starts sending all queued records, including incomplete frames, on every connected connection
+ */
+
+
+int gateway_poll(gateway_t *gw, int timeout_ms);
+
+/* Runs the event loop once for at most 'timeout_ms' milliseconds (shortened to the next reconnect attempt),
+ * then starts due reconnects and updates the throughput statistics
+ * Only call this if the gateway owns its loop; with a shared loop call gateway_tick() after each iteration
+ * Returns the number of dispatched events or -GATEWAY_LOOP_ERROR
+ */
+
+
+int gateway_tick(gateway_t *gw);
+
+/* Starts due reconnects and updates the throughput statistics
+ * Returns the number of milliseconds until the next reconnect attempt, or -1 if none is scheduled
+ */
+
+
+int gateway_pending(gateway_t *gw);
+/* Returns the total number of queued records over all connections
+ */
+
+
+int gateway_connection_count(gateway_t *gw);
+/* Returns the number of connections in the pool
+ */
+
+
+int gateway_get_stats(gateway_t *gw, int index, gateway_stats_t *stats);
+/* Copies the statistics of connection 'index' into '*stats'
+ * If 'index' is not between 0 and gateway_connection_count() - 1, GATEWAY_INDEX_ERROR is returned
+ */
+
+
+#endif  //__GATEWAY_H__
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+static int handoff_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return HANDOFF_SOCKET_ERROR;
+    strcpy(addr->sun_path, path);
+    return HANDOFF_NO_ERROR;
+}
+
+
+int handoff_listen(int *fd, const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(&addr, path) != HANDOFF_NO_ERROR) return HANDOFF_SOCKET_ERROR;
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd < 0) return HANDOFF_SOCKET_ERROR;
+    // the previous instance is gone or has handed off, its socket file is stale
+    unlink(path);
+    if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sd, 1) != 0) {
+        close(sd);
+        return HANDOFF_SOCKET_ERROR;
+    }
+    *fd = sd;
+    return HANDOFF_NO_ERROR;
+}
+
+
+int handoff_connect(int *fd, const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(&addr, path) != HANDOFF_NO_ERROR) return HANDOFF_SOCKET_ERROR;
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0) return HANDOFF_SOCKET_ERROR;
+    if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sd);
+        return HANDOFF_SOCKET_ERROR;
+    }
+    *fd = sd;
+    return HANDOFF_NO_ERROR;
+}
+
+
+int handoff_send(int fd, const handoff_msg_t *msg, int sd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = (void *) msg, .iov_len = sizeof(*msg)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (sd >= 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &sd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    // a stream socket takes a message this small whole
+    return n == (ssize_t) sizeof(*msg) ? HANDOFF_NO_ERROR : HANDOFF_CLOSED;
+}
+
+
+int handoff_recv(int fd, handoff_msg_t *msg, int *sd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(*msg)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)};
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    *sd = -1;
+    // after a failed recvmsg the control buffer holds nothing that was received
+    if (n <= 0) return HANDOFF_CLOSED;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+        cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(sd, CMSG_DATA(cm), sizeof(int));
+    }
+    if (n != (ssize_t) sizeof(*msg) || (msg->kind != HANDOFF_DONE && *sd < 0) ||
+        msg->len > SENSOR_DATA_WIRE_SIZE) {
+        if (*sd >= 0) close(*sd);
+        *sd = -1;
+        return HANDOFF_PROTOCOL_ERROR;
+    }
+    return HANDOFF_NO_ERROR;
+}
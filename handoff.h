@@ -0,0 +1,62 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#define HANDOFF_NO_ERROR        0
+#define HANDOFF_SOCKET_ERROR    1  // the Unix socket can't be opened, or no instance listens on it
+#define HANDOFF_CLOSED          2  // the peer closed the handoff connection
+#define HANDOFF_PROTOCOL_ERROR  3  // a message without its descriptor, or of unknown size
+
+/*
+ * A running server listens on a Unix socket. A new instance connects to
+ * it, which is the request to take over: the running one stops reading,
+ * sends every listening and client socket as one message each with the
+ * descriptor attached (SCM_RIGHTS), drains its writer and sends
+ * HANDOFF_DONE. Only then the new instance starts serving; the kernel
+ * keeps queueing connections and data on the shared sockets meanwhile.
+ */
+#define HANDOFF_LISTENER    1   // a listening socket
+#define HANDOFF_CLIENT      2   // a sensor connection, with the state of its last record
+#define HANDOFF_DONE        3   // no descriptor, everything read so far is written out
+
+typedef struct {
+    uint32_t kind;
+    uint32_t len;                           // bytes of a partial record in 'buf'
+    uint64_t records;                       // records read on the connection so far
+    uint64_t acked;                         // records acknowledged to the sensor
+    unsigned char buf[SENSOR_DATA_WIRE_SIZE];
+} handoff_msg_t;
+
+
+int handoff_listen(int *fd, const char *path);
+
+/* Opens a non-blocking Unix listening socket on 'path', replacing a stale socket file left there
+ * If the socket can't be created or bound, HANDOFF_SOCKET_ERROR is returned
+ */
+
+
+int handoff_connect(int *fd, const char *path);
+
+/* Connects to the instance listening on 'path' to take over its sockets
+ * If nothing listens on 'path', HANDOFF_SOCKET_ERROR is returned
+ */
+
+
+int handoff_send(int fd, const handoff_msg_t *msg, int sd);
+
+/* Sends 'msg' with the descriptor 'sd' attached, -1 for none; blocks until it is queued
+ * If the connection is gone, HANDOFF_CLOSED is returned
+ */
+
+
+int handoff_recv(int fd, handoff_msg_t *msg, int *sd);
+
+/* Receives the next message and its descriptor, -1 if it has none; blocks until it arrives
+ * If the sender closed the connection or the receive failed, HANDOFF_CLOSED is returned
+ * If the message is incomplete or a listener or client comes without descriptor, HANDOFF_PROTOCOL_ERROR is returned
+ */
+
+
+#endif  //__HANDOFF_H__
@@ -0,0 +1,229 @@
+/*
+ * Memory per idle sensor connection of a running server: opens the given
+ * number of connections to it, sends nothing, and reports how much the
+ * resident memory of the server process grew per connection, next to the
+ * kernel memory of all TCP sockets on the host (both ends of every
+ * connection, from /proc/net/sockstat). Beyond about 28000 connections the
+ * source addresses cycle through 127.0.0.2, 127.0.0.3, ... so the ephemeral
+ * ports don't run out. The connections are held by child processes of
+ * BENCH_PER_CHILD each, so only the server needs a descriptor limit above
+ * the count; if it holds fewer, the figures are also extrapolated to the
+ * count asked for.
+ *
+ * With -x it starts the server itself (low-memory profile, one hour idle
+ * timeout, output in a temporary directory) and stops it afterwards; this
+ * is how ctest runs it at 100000 connections, and then it fails if the
+ * server grew by more than BENCH_BUDGET bytes per connection.
+ *
+ * Usage: idle_bench pid port [connections [seconds]]
+ *        idle_bench -x server port [connections [seconds]]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BENCH_PER_SOURCE    25000   // connections per source address
+#define BENCH_PER_CHILD     15000   // connections held per child process, below common descriptor limits
+#define BENCH_BUDGET        200     // bytes per idle connection: the 64 byte conn_t, pool and table overhead
+
+static long bench_rss_kb(int pid) {
+    char path[64], line[256];
+    long kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static int bench_fds(int pid) {
+    char path[64];
+    int n = 0;
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *d = opendir(path);
+    if (d == NULL) return -1;
+    while (readdir(d) != NULL) n++;
+    closedir(d);
+    return n - 2;
+}
+
+static long bench_tcp_pages() {
+    char line[256];
+    long inuse, orphan, tw, alloc, mem = -1;
+    FILE *f = fopen("/proc/net/sockstat", "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "TCP: inuse %ld orphan %ld tw %ld alloc %ld mem %ld", &inuse, &orphan, &tw, &alloc,
+                   &mem) == 5) break;
+    }
+    fclose(f);
+    return mem;
+}
+
+/*
+ * Child holding connections 'first' .. 'first + count - 1': reports how
+ * many it opened on 'report' and keeps them until 'release' is closed.
+ */
+static void bench_hold(const struct sockaddr_in *server, int first, int count, int report, int release) {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    int open = 0;
+    for (; open < count; open++) {
+        int sd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sd < 0) break;
+        int one = 1;
+        // a server at its descriptor limit leaves its backlog full, connects would hang
+        struct timeval limit = {.tv_sec = 1};
+        setsockopt(sd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+        struct sockaddr_in source = {.sin_family = AF_INET};
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + (uint32_t) ((first + open) / BENCH_PER_SOURCE));
+        if (bind(sd, (struct sockaddr *) &source, sizeof(source)) != 0 ||
+            connect(sd, (const struct sockaddr *) server, sizeof(*server)) != 0) {
+            close(sd);
+            break;
+        }
+    }
+    if (write(report, &open, sizeof(open)) < 0) {}
+    char c;
+    // the sockets close when the child exits
+    while (read(release, &c, 1) > 0) {}
+    _exit(0);
+}
+
+static int bench_start(const char *server, int port, char *dir) {
+    char out[64], portarg[16];
+    if (mkdtemp(dir) == NULL) return -1;
+    snprintf(out, sizeof(out), "%s/out", dir);
+    snprintf(portarg, sizeof(portarg), "%d", port);
+    int pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        // at its descriptor limit the server reports every failed accept
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(server, server, "-p", portarg, "-P", "low-memory", "-t", "3600", "-q", "-o", out, (char *) NULL);
+        _exit(127);
+    }
+    // wait until it listens
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t) port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int i = 0; i < 100 && pid > 0; i++) {
+        int sd = socket(AF_INET, SOCK_STREAM, 0);
+        int res = connect(sd, (struct sockaddr *) &addr, sizeof(addr));
+        close(sd);
+        if (res == 0) return pid;
+        usleep(20000);
+    }
+    if (pid > 0) kill(pid, SIGKILL);
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    int start = argc > 1 && strcmp(argv[1], "-x") == 0;
+    if (argc < 3 + start) {
+        fprintf(stderr, "Usage: %s pid port [connections [seconds]]\n"
+                        "       %s -x server port [connections [seconds]]\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    argv += start;
+    argc -= start;
+    int port = atoi(argv[2]);
+    int count = argc > 3 ? atoi(argv[3]) : 100000;
+    int seconds = argc > 4 ? atoi(argv[4]) : 2;
+    char dir[] = "/tmp/idle_bench.XXXXXX";
+    int pid = start ? bench_start(argv[1], port, dir) : atoi(argv[1]);
+    if (pid <= 0 || bench_rss_kb(pid) < 0) {
+        fprintf(stderr, start ? "Cannot start %s\n" : "No process %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    // the server closes the probe connections of bench_start() as peers, let it settle
+    usleep(200000);
+    int fds = bench_fds(pid);
+    long rss = bench_rss_kb(pid), pages = bench_tcp_pages();
+
+    struct sockaddr_in server = {.sin_family = AF_INET, .sin_port = htons((uint16_t) port)};
+    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+    int report[2], release[2], open = 0, children = 0;
+    if (pipe(report) != 0 || pipe(release) != 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    for (int first = 0; first < count; first += BENCH_PER_CHILD, children++) {
+        int n = count - first < BENCH_PER_CHILD ? count - first : BENCH_PER_CHILD;
+        if (fork() == 0) {
+            close(report[0]);
+            close(release[1]);
+            bench_hold(&server, first, n, report[1], release[0]);
+        }
+    }
+    close(report[1]);
+    close(release[0]);
+    for (int i = 0; i < children; i++) {
+        int n;
+        if (read(report[0], &n, sizeof(n)) == sizeof(n)) open += n;
+    }
+    if (open < count) fprintf(stderr, "only %d of %d connections opened\n", open, count);
+    // wait until the server took all of them, then let it settle
+    int accepted = 0;
+    for (int i = 0; i < 100 && (accepted = bench_fds(pid) - fds) < open; i++) {
+        usleep(100000);
+        // a server at its descriptor limit takes no more
+        if (i >= 20 && bench_fds(pid) - fds == accepted) break;
+    }
+    sleep(seconds);
+    accepted = bench_fds(pid) - fds;
+    long grown = bench_rss_kb(pid) - rss, kernel = bench_tcp_pages() - pages;
+
+    printf("connections      %d opened, %d held by the server\n", open, accepted);
+    if (accepted > 0) {
+        printf("server memory    %ld kB, %ld bytes per connection\n", grown, grown * 1024 / accepted);
+        printf("kernel sockets   %ld kB, %ld bytes per connection (both ends)\n", kernel * 4,
+               kernel * 4096 / accepted);
+    }
+    if (accepted > 0 && accepted < count) {
+        struct rlimit lim;
+        getrlimit(RLIMIT_NOFILE, &lim);
+        printf("extrapolated     %d connections: %ld kB server memory, %ld kB kernel sockets (measured at %d, "
+               "descriptor limit %ld)\n", count, grown * count / accepted, kernel * 4 * count / accepted, accepted,
+               (long) lim.rlim_max);
+    }
+    close(release[1]);
+    for (int i = 0; i < children; i++) wait(NULL);
+    if (start) {
+        char out[64];
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        snprintf(out, sizeof(out), "%s/out", dir);
+        unlink(out);
+        rmdir(dir);
+    }
+    if (accepted <= 0) return EXIT_FAILURE;
+    // e.g. a receive buffer allocated for every connection instead of taken from the pool while reading
+    if (start && grown * 1024 / accepted > BENCH_BUDGET) {
+        fprintf(stderr, "FAIL: %ld bytes per idle connection, the budget is %d\n", grown * 1024 / accepted,
+                BENCH_BUDGET);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
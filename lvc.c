@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "lvc.h"
+
+#define LVC_CACHE_LINE      64
+
+/*
+ * 'seq' is 0 while the slot is empty, odd during an update. The record is
+ * stored in relaxed atomics so a reader racing with the writer reads stale
+ * or mixed bits, never undefined ones; the sequence tells it to retry.
+ */
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint64_t value;             // the bits of the sensor_value_t
+    _Atomic int64_t ts;
+    char pad[LVC_CACHE_LINE - 3 * sizeof(uint64_t)];
+} lvc_slot_t;
+
+struct lvc {
+    lvc_slot_t *slots;
+};
+
+
+int lvc_create(lvc_t **cache) {
+    lvc_t *c = malloc(sizeof(lvc_t));
+    if (c == NULL) return LVC_MEMORY_ERROR;
+    // a zeroed allocation this size comes straight from the kernel: untouched sensors cost no memory
+    c->slots = calloc(LVC_SENSORS, sizeof(lvc_slot_t));
+    if (c->slots == NULL) {
+        free(c);
+        return LVC_MEMORY_ERROR;
+    }
+    *cache = c;
+    return LVC_NO_ERROR;
+}
+
+
+void lvc_free(lvc_t **cache) {
+    if (cache == NULL || *cache == NULL) return;
+    free((*cache)->slots);
+    free(*cache);
+    *cache = NULL;
+}
+
+
+void lvc_update(lvc_t *cache, const sensor_data_t *data) {
+    lvc_slot_t *slot = &cache->slots[data->id];
+    uint64_t value;
+    memcpy(&value, &data->value, sizeof(value));
+    // the only writer of this slot: no read-modify-write needed
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    // the odd sequence must be visible before any of the new record
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+    atomic_store_explicit(&slot->ts, (int64_t) data->ts, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+
+int lvc_read(lvc_t *cache, sensor_id_t id, sensor_data_t *data) {
+    lvc_slot_t *slot = &cache->slots[id];
+    uint32_t seq;
+    uint64_t value;
+    int64_t ts;
+    while (1) {
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == 0) return 0;
+        if (seq & 1) continue;
+        value = atomic_load_explicit(&slot->value, memory_order_relaxed);
+        ts = atomic_load_explicit(&slot->ts, memory_order_relaxed);
+        // the record must be read before the sequence is checked again
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) break;
+    }
+    data->id = id;
+    memcpy(&data->value, &value, sizeof(value));
+    data->ts = (sensor_ts_t) ts;
+    return 1;
+}
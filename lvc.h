@@ -0,0 +1,54 @@
+#ifndef __LVC_H__
+#define __LVC_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#define LVC_NO_ERROR        0
+#define LVC_MEMORY_ERROR    1  // mem alloc error
+
+#define LVC_SENSORS         (UINT16_MAX + 1)    // one slot for every sensor_id_t
+
+/*
+ * Last value cache: the latest record of every sensor in a dense table
+ * indexed by sensor id. Each slot is a seqlock: the writer makes the
+ * sequence odd, stores the record and makes it even again, a reader copies
+ * the record between two equal even reads of the sequence and retries
+ * otherwise. Writers never wait for readers and readers take no lock and
+ * write nothing shared, so any number of threads can read while the writer
+ * shards update. Slots are a cache line each, the sensors of different
+ * shards don't share one. The table is allocated zeroed, pages of sensors
+ * that never report stay untouched.
+ */
+
+typedef struct lvc lvc_t;
+
+
+int lvc_create(lvc_t **cache);
+
+/* Creates an empty cache
+ * If memory allocation fails, LVC_MEMORY_ERROR is returned
+ */
+
+
+void lvc_free(lvc_t **cache);
+
+/* Frees all memory and sets '*cache' to NULL
+ */
+
+
+void lvc_update(lvc_t *cache, const sensor_data_t *data);
+
+/* Stores 'data' as the latest value of its sensor; lock free and wait free for the writer
+ * Concurrent updates must be for different sensors, the writer shards own disjoint sets of sensors
+ */
+
+
+int lvc_read(lvc_t *cache, sensor_id_t id, sensor_data_t *data);
+
+/* Copies a consistent snapshot of the latest value of sensor 'id' to 'data', from any thread
+ * Returns 1, or 0 if the sensor has no value yet
+ */
+
+
+#endif  //__LVC_H__
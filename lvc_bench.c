@@ -0,0 +1,159 @@
+/*
+ * Concurrent read/write benchmark of the last value cache (lvc.h) against a
+ * table of mutex protected pages of 256 sensors, the layout it replaced.
+ * Writer threads update disjoint sets of sensors like the writer shards do,
+ * reader threads look up random sensors and check that every record they
+ * get is one a writer stored, never a mix of two updates.
+ *
+ * Usage: lvc_bench [writers [readers [sensors [seconds]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lvc.h"
+
+#define BENCH_PAGE_BITS     8
+#define BENCH_PAGE_SIZE     (1 << BENCH_PAGE_BITS)
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint8_t valid[BENCH_PAGE_SIZE];
+    sensor_data_t data[BENCH_PAGE_SIZE];
+} bench_page_t;
+
+typedef struct {
+    const char *name;
+    void (*update)(const sensor_data_t *data);
+    int (*read)(sensor_id_t id, sensor_data_t *data);
+} table_t;
+
+typedef struct {
+    const table_t *table;
+    int index, count;                   // writer 'index' of 'count' owns the sensors id % count == index
+    uint64_t ops, torn;
+    pthread_t thread;
+} worker_t;
+
+static lvc_t *cache;
+static bench_page_t pages[LVC_SENSORS / BENCH_PAGE_SIZE];
+static int sensors = 1024;
+static atomic_int running;
+
+
+static void lvc_table_update(const sensor_data_t *data) { lvc_update(cache, data); }
+
+static int lvc_table_read(sensor_id_t id, sensor_data_t *data) { return lvc_read(cache, id, data); }
+
+static void mutex_table_update(const sensor_data_t *data) {
+    bench_page_t *page = &pages[data->id >> BENCH_PAGE_BITS];
+    int i = data->id & (BENCH_PAGE_SIZE - 1);
+    pthread_mutex_lock(&page->lock);
+    page->data[i] = *data;
+    page->valid[i] = 1;
+    pthread_mutex_unlock(&page->lock);
+}
+
+static int mutex_table_read(sensor_id_t id, sensor_data_t *data) {
+    bench_page_t *page = &pages[id >> BENCH_PAGE_BITS];
+    int i = id & (BENCH_PAGE_SIZE - 1);
+    pthread_mutex_lock(&page->lock);
+    int found = page->valid[i];
+    if (found) *data = page->data[i];
+    pthread_mutex_unlock(&page->lock);
+    return found;
+}
+
+static const table_t tables[] = {
+        {"seqlock", lvc_table_update,   lvc_table_read},
+        {"mutex",   mutex_table_update, mutex_table_read},
+};
+
+
+// a writer stores value = ts * 3 + id, anything else is a torn read
+static sensor_value_t bench_value(sensor_id_t id, sensor_ts_t ts) {
+    return (sensor_value_t) ts * 3 + id;
+}
+
+static void *bench_writer(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    sensor_data_t data;
+    sensor_ts_t ts = 0;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        ts++;
+        for (int id = w->index; id < sensors; id += w->count) {
+            data.id = (sensor_id_t) id;
+            data.ts = ts;
+            data.value = bench_value(data.id, ts);
+            w->table->update(&data);
+            w->ops++;
+        }
+    }
+    return NULL;
+}
+
+static void *bench_reader(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    sensor_data_t data;
+    uint32_t x = 2463534242u + (uint32_t) w->index;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        for (int i = 0; i < 1024; i++) {
+            // xorshift, cheaper than rand() and private to the thread
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            sensor_id_t id = (sensor_id_t) (x % (uint32_t) sensors);
+            if (w->table->read(id, &data) && (data.id != id || data.value != bench_value(id, data.ts))) w->torn++;
+            w->ops++;
+        }
+    }
+    return NULL;
+}
+
+static void bench_run(const table_t *table, int writers, int readers, int seconds) {
+    worker_t *w = calloc(writers + readers, sizeof(worker_t));
+    if (w == NULL) exit(EXIT_FAILURE);
+    atomic_store(&running, 1);
+    for (int i = 0; i < writers + readers; i++) {
+        w[i].table = table;
+        w[i].index = i < writers ? i : i - writers;
+        w[i].count = writers;
+        pthread_create(&w[i].thread, NULL, i < writers ? bench_writer : bench_reader, &w[i]);
+    }
+    sleep(seconds);
+    atomic_store(&running, 0);
+    uint64_t updates = 0, reads = 0, torn = 0;
+    for (int i = 0; i < writers + readers; i++) {
+        pthread_join(w[i].thread, NULL);
+        if (i < writers) updates += w[i].ops;
+        else reads += w[i].ops;
+        torn += w[i].torn;
+    }
+    printf("%-8s %8d %8d %14.0f %14.0f %8llu\n", table->name, writers, readers, (double) updates / seconds,
+           (double) reads / seconds, (unsigned long long) torn);
+    free(w);
+}
+
+int main(int argc, char *argv[]) {
+    int writers = argc > 1 ? atoi(argv[1]) : 2;
+    int readers = argc > 2 ? atoi(argv[2]) : 2;
+    if (argc > 3) sensors = atoi(argv[3]);
+    int seconds = argc > 4 ? atoi(argv[4]) : 2;
+    if (writers < 1 || readers < 0 || sensors < 1 || sensors > LVC_SENSORS || seconds < 1) {
+        fprintf(stderr, "Usage: %s [writers [readers [sensors [seconds]]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (lvc_create(&cache) != LVC_NO_ERROR) return EXIT_FAILURE;
+    for (int p = 0; p < LVC_SENSORS / BENCH_PAGE_SIZE; p++) pthread_mutex_init(&pages[p].lock, NULL);
+
+    printf("%-8s %8s %8s %14s %14s %8s\n", "table", "writers", "readers", "updates/s", "reads/s", "torn");
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) bench_run(&tables[t], writers, readers, seconds);
+
+    for (int p = 0; p < LVC_SENSORS / BENCH_PAGE_SIZE; p++) pthread_mutex_destroy(&pages[p].lock);
+    lvc_free(&cache);
+    return EXIT_SUCCESS;
+}
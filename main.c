@@ -3,8 +3,207 @@
 //
 #include "connmgr.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int parse_rate(const char *spec, uint32_t *rate, uint32_t *burst) {
+    // "rate[:burst]", records per second and records
+    char *end;
+    unsigned long r = strtoul(spec, &end, 10), b = 0;
+    if (end == spec) return -1;
+    if (*end == ':') b = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || r > UINT32_MAX || b > UINT32_MAX) return -1;
+    *rate = (uint32_t) r;
+    *burst = (uint32_t) b;
+    return 0;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-a ip] [-p port] [-B ip:port[@reactors]]... [-P profile]\n"
+                    "          [-t seconds] [-T mode]\n"
+                    "          [-r reactors] [-s shards] [-o file] [-w records] [-L seconds]\n"
+                    "          [-R rules] [-A alerts] [-Q port] [-S port] [-l bytes] [-D]\n"
+                    "          [-W dir] [-G bytes] [-I ms] [-C seconds] [-H path] [-U path]\n"
+                    "          [-M path] [-m records] [-F records] [-x] [-c rate[:burst]]\n"
+                    "          [-n rate[:burst]] [-X action] [-b usec] [-Y file] [-y rate]\n"
+                    "          [-K seconds] [-k bytes] [-q]\n", name);
+    fprintf(stderr, "  -B: sensor listener, repeatable, replaces -a and -p; IPv6 in brackets, e.g.\n"
+                    "      [::]:5678@0-1 for reactors 0 and 1 (all reactors without @)\n");
+    fprintf(stderr, "  profile: default, low-latency, high-throughput, low-memory\n");
+    fprintf(stderr, "  -t: idle timeout, -T: timeout mode sweep or timerfd\n");
+    fprintf(stderr, "  -r: event loop threads, -s: writer threads, -o: output file, -q: quiet\n");
+    fprintf(stderr, "  -w: reorder window per sensor (0 disables reordering and dedup), -L: reorder lag\n");
+    fprintf(stderr, "  -R: alert rule file, reloaded on SIGHUP, -A: alert output file\n");
+    fprintf(stderr, "  -Q: port of the query listener, -S: port of the subscriber listener\n");
+    fprintf(stderr, "  -l: bytes a subscriber may lag behind, -D: disconnect instead of dropping records\n");
+    fprintf(stderr, "  -W: write-ahead log directory, sensors get acks once their records are durable\n");
+    fprintf(stderr, "  -G: log segment size, -I: group commit interval in ms (0 syncs every batch)\n");
+    fprintf(stderr, "  -C: seconds between checkpoints of the sensor state, restarts replay only the log after it\n");
+    fprintf(stderr, "  -H: handoff socket, a new instance started with the same path takes over all sockets\n");
+    fprintf(stderr, "  -U: Unix socket for sensors on this host, -M: Unix socket local producers attach a\n"
+                    "      shared-memory ring on, -m: records per ring\n");
+    fprintf(stderr, "  -F: records per second that make a sensor reported as flooding, -x: drop what it\n"
+                    "      sends above that rate\n");
+    fprintf(stderr, "  -c: records per second per connection, -n: per sensor id, each with the records a\n"
+                    "      burst may take (default one second worth); -X: what happens above a limit,\n"
+                    "      drop (default), pause reading the connection, or disconnect\n");
+    fprintf(stderr, "  -b: microseconds a reactor busy polls after activity before it sleeps, the budget\n"
+                    "      adapts to the traffic below that; trades CPU for wakeup latency\n");
+    fprintf(stderr, "  -Y: trace file, every stage of a sample of the records is timestamped into it for\n"
+                    "      trace_report, -y: one record in how many is sampled (default 1024)\n");
+    fprintf(stderr, "  -K: seconds raw records are kept, older ones only as 1 minute and 1 hour aggregates\n"
+                    "      next to the output (at least 2 hours), -k: bytes per second retention reads;\n"
+                    "      the output then starts with a deleted prefix of zeros, which the query service,\n"
+                    "      compactor and replay skip by the offset in <output>.retain\n");
+}
 
 int main(int argc, char **argv) {
-    printf("Start listening on port 5678\n");
-    connmgr_listen(5678);
-}
\ No newline at end of file
+    connmgr_config_t config;
+    int opt;
+    connmgr_config_init(&config);
+    while ((opt = getopt(argc, argv, "a:p:B:P:t:T:r:s:o:w:L:R:A:Q:S:l:DW:G:I:C:H:U:M:m:F:xc:n:X:b:Y:y:K:k:qh")) != -1) {
+        switch (opt) {
+            case 'a':
+                config.ip = optarg;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'B':
+                if (config.nlisteners == CONNMGR_MAX_LISTENERS ||
+                    connmgr_parse_listener(optarg, &config.listeners[config.nlisteners]) != TCP_NO_ERROR) {
+                    fprintf(stderr, "Invalid listener %s\n", optarg);
+                    return 1;
+                }
+                config.nlisteners++;
+                break;
+            case 'P':
+                if (tcp_profile_from_name(optarg, &config.profile) != TCP_NO_ERROR) {
+                    fprintf(stderr, "Unknown profile %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                config.idle_timeout = atoi(optarg);
+                break;
+            case 'T':
+                if (strcmp(optarg, "sweep") == 0) config.timeout_mode = CONNMGR_TIMEOUT_SWEEP;
+                else if (strcmp(optarg, "timerfd") == 0) config.timeout_mode = CONNMGR_TIMEOUT_TIMERFD;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r':
+                config.reactors = atoi(optarg);
+                break;
+            case 's':
+                config.shards = atoi(optarg);
+                break;
+            case 'o':
+                config.output = optarg;
+                break;
+            case 'w':
+                config.reorder_window = atoi(optarg);
+                break;
+            case 'L':
+                config.reorder_lag = atoi(optarg);
+                break;
+            case 'R':
+                config.rules = optarg;
+                break;
+            case 'A':
+                config.alerts = optarg;
+                break;
+            case 'Q':
+                config.query_port = atoi(optarg);
+                break;
+            case 'S':
+                config.pubsub_port = atoi(optarg);
+                break;
+            case 'l':
+                config.pubsub_lag = (size_t) atol(optarg);
+                break;
+            case 'D':
+                config.pubsub_policy = PUBSUB_LAG_DISCONNECT;
+                break;
+            case 'W':
+                config.wal_dir = optarg;
+                break;
+            case 'G':
+                config.wal_segment_bytes = (size_t) atol(optarg);
+                break;
+            case 'I':
+                config.wal_interval = atoi(optarg);
+                break;
+            case 'C':
+                config.checkpoint_interval = atoi(optarg);
+                break;
+            case 'H':
+                config.handoff = optarg;
+                break;
+            case 'U':
+                config.local = optarg;
+                break;
+            case 'M':
+                config.shm = optarg;
+                break;
+            case 'm':
+                config.shm_records = (uint32_t) atol(optarg);
+                break;
+            case 'F':
+                config.flood_rate = (uint32_t) atol(optarg);
+                break;
+            case 'x':
+                config.flood_drop = 1;
+                break;
+            case 'c':
+            case 'n':
+                if (parse_rate(optarg, opt == 'c' ? &config.conn_rate : &config.sensor_rate,
+                               opt == 'c' ? &config.conn_burst : &config.sensor_burst) != 0) {
+                    fprintf(stderr, "Invalid rate %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'X':
+                if (strcmp(optarg, "drop") == 0) config.limit_action = CONNMGR_LIMIT_DROP;
+                else if (strcmp(optarg, "pause") == 0) config.limit_action = CONNMGR_LIMIT_PAUSE;
+                else if (strcmp(optarg, "disconnect") == 0) config.limit_action = CONNMGR_LIMIT_DISCONNECT;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                config.spin_us = (uint32_t) atol(optarg);
+                break;
+            case 'Y':
+                config.trace = optarg;
+                break;
+            case 'y':
+                config.trace_rate = (uint32_t) atol(optarg);
+                break;
+            case 'K':
+                config.raw_age = atoi(optarg);
+                break;
+            case 'k':
+                config.retain_rate = (size_t) atol(optarg);
+                break;
+            case 'q':
+                config.verbose = 0;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (config.nlisteners == 0) printf("Start listening on port %d", config.port);
+    for (int i = 0; i < config.nlisteners; i++) {
+        printf("%s %s%s%s:%d", i == 0 ? "Start listening on" : ",", strchr(config.listeners[i].ip, ':') ? "[" : "",
+               config.listeners[i].ip, strchr(config.listeners[i].ip, ':') ? "]" : "", config.listeners[i].port);
+    }
+    printf(" (%s profile, %d reactors, %d writers)\n", tcp_profile_name(config.profile), config.reactors,
+           config.shards);
+    connmgr_run(&config);
+}
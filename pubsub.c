@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "pubsub.h"
+#include "ring.h"
+#include "evloop.h"
+#include "tcpsock.h"
+
+#define PUBSUB_DRAIN_RECORDS    4096    // records taken from one producer per batch
+#define PUBSUB_IOV              64      // ranges per sendmsg()
+
+/*
+ * Records of one drain round, encoded once and shared by every subscriber
+ * that has a range of it queued. Only the hub thread touches batches.
+ */
+typedef struct {
+    int refs;
+    size_t len;
+    unsigned char data[];
+} pubsub_batch_t;
+
+typedef struct {
+    pubsub_batch_t *batch;
+    uint32_t off;
+    uint32_t len;
+} pubsub_range_t;
+
+typedef struct pubsub_sub pubsub_sub_t;
+struct pubsub_sub {
+    pubsub_t *pubsub;
+    tcpsock_t *sock;
+    int fd;
+    pubsub_sub_t *prev, *next;
+    int active;                                 // a filter was registered
+    uint64_t filter[(UINT16_MAX + 1) / 64];     // one bit per sensor id
+    int in_len;
+    unsigned char in[3 + 2 * PUBSUB_MAX_FILTER_IDS];
+    pubsub_range_t pending[PUBSUB_MAX_PENDING];
+    uint32_t head;
+    uint32_t count;
+    size_t pending_bytes;
+    int writing;                                // registered for EPOLLOUT
+};
+
+struct pubsub {
+    pthread_t thread;
+    int started;
+    evloop_t *loop;
+    tcpsock_t *server;
+    int efd;                    // doorbell, written by producers only while 'sleeping' is set
+    _Atomic int sleeping;
+    _Atomic int stop;
+    _Atomic int nsubs;          // producers skip publishing without subscribers
+    int nproducers;
+    ring_t **rings;             // one queue per producer
+    unsigned char *dirty;       // per producer, set by publish, cleared by signal
+    uint64_t *overflows;        // per producer
+    size_t max_lag;
+    int policy;
+    pubsub_sub_t *subs;
+    sensor_data_t *scratch;
+    pubsub_stats_t stats;
+};
+
+
+static void *pubsub_run(void *arg);
+
+static void pubsub_drain(pubsub_t *ps);
+
+static void pubsub_wake(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static void pubsub_accept(tcpsock_t *sock, uint32_t events, void *arg);
+
+static void pubsub_event(tcpsock_t *sock, uint32_t events, void *arg);
+
+static int pubsub_parse(pubsub_sub_t *sub);
+
+static int pubsub_queue(pubsub_sub_t *sub, pubsub_batch_t *batch, uint32_t off, uint32_t len);
+
+static int pubsub_send(pubsub_sub_t *sub);
+
+static void pubsub_sub_close(pubsub_sub_t *sub);
+
+static inline void pubsub_release(pubsub_batch_t *batch) {
+    if (--batch->refs == 0) free(batch);
+}
+
+
+int pubsub_create(pubsub_t **pubsub, char *ip, int port, int producers, size_t max_lag, int policy) {
+    pubsub_t *ps = calloc(1, sizeof(pubsub_t));
+    if (ps == NULL) return PUBSUB_MEMORY_ERROR;
+    ps->efd = -1;
+    ps->nproducers = producers;
+    ps->max_lag = max_lag;
+    ps->policy = policy;
+    atomic_init(&ps->sleeping, 0);
+    atomic_init(&ps->stop, 0);
+    atomic_init(&ps->nsubs, 0);
+    ps->rings = calloc(producers, sizeof(ring_t *));
+    ps->dirty = calloc(producers, 1);
+    ps->overflows = calloc(producers, sizeof(uint64_t));
+    ps->scratch = malloc(sizeof(sensor_data_t) * PUBSUB_DRAIN_RECORDS);
+    if (ps->rings == NULL || ps->dirty == NULL || ps->overflows == NULL || ps->scratch == NULL) {
+        pubsub_free(&ps);
+        return PUBSUB_MEMORY_ERROR;
+    }
+    for (int p = 0; p < producers; p++) {
+        ps->rings[p] = ring_create(PUBSUB_RING_RECORDS, sizeof(sensor_data_t));
+        if (ps->rings[p] == NULL) {
+            pubsub_free(&ps);
+            return PUBSUB_MEMORY_ERROR;
+        }
+    }
+    if (evloop_create(&ps->loop) != EVLOOP_NO_ERROR) {
+        pubsub_free(&ps);
+        return PUBSUB_THREAD_ERROR;
+    }
+    if (tcp_passive_open_ex(&ps->server, ip, port, TCP_FLAG_NONBLOCK) != TCP_NO_ERROR ||
+        tcp_register(ps->server, ps->loop, EPOLLIN, &pubsub_accept, ps) != TCP_NO_ERROR) {
+        pubsub_free(&ps);
+        return PUBSUB_SOCKET_ERROR;
+    }
+    ps->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ps->efd < 0 || evloop_add(ps->loop, ps->efd, EPOLLIN, &pubsub_wake, ps) != EVLOOP_NO_ERROR ||
+        pthread_create(&ps->thread, NULL, &pubsub_run, ps) != 0) {
+        pubsub_free(&ps);
+        return PUBSUB_THREAD_ERROR;
+    }
+    ps->started = 1;
+    *pubsub = ps;
+    return PUBSUB_NO_ERROR;
+}
+
+
+void pubsub_free(pubsub_t **pubsub) {
+    if (pubsub == NULL || *pubsub == NULL) return;
+    pubsub_t *ps = *pubsub;
+    if (ps->started) {
+        uint64_t one = 1;
+        atomic_store(&ps->stop, 1);
+        if (write(ps->efd, &one, sizeof(one)) < 0) {}
+        pthread_join(ps->thread, NULL);
+    }
+    while (ps->subs != NULL) pubsub_sub_close(ps->subs);
+    if (ps->server != NULL) tcp_close(&ps->server);
+    if (ps->efd >= 0) {
+        evloop_del(ps->loop, ps->efd);
+        close(ps->efd);
+    }
+    evloop_free(&ps->loop);
+    for (int p = 0; ps->rings != NULL && p < ps->nproducers; p++) {
+        if (ps->rings[p] != NULL) ring_free(&ps->rings[p]);
+    }
+    free(ps->rings);
+    free(ps->dirty);
+    free(ps->overflows);
+    free(ps->scratch);
+    free(ps);
+    *pubsub = NULL;
+}
+
+
+void pubsub_publish(pubsub_t *ps, int producer, const sensor_data_t *data) {
+    if (atomic_load_explicit(&ps->nsubs, memory_order_relaxed) == 0) return;
+    // ingestion never waits for subscribers
+    if (!ring_push(ps->rings[producer], data)) ps->overflows[producer]++;
+    ps->dirty[producer] = 1;
+}
+
+
+void pubsub_signal(pubsub_t *ps, int producer) {
+    if (!ps->dirty[producer]) return;
+    ps->dirty[producer] = 0;
+    if (atomic_exchange(&ps->sleeping, 0)) {
+        uint64_t one = 1;
+        if (write(ps->efd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+
+void pubsub_get_stats(pubsub_t *ps, pubsub_stats_t *stats) {
+    *stats = ps->stats;
+    stats->subscribers = (uint64_t) atomic_load(&ps->nsubs);
+    stats->overflows = 0;
+    for (int p = 0; p < ps->nproducers; p++) stats->overflows += ps->overflows[p];
+}
+
+
+static void *pubsub_run(void *arg) {
+    pubsub_t *ps = (pubsub_t *) arg;
+    while (!atomic_load(&ps->stop)) {
+        pubsub_drain(ps);
+        atomic_store(&ps->sleeping, 1);
+        int pending = 0;
+        for (int p = 0; p < ps->nproducers && !pending; p++) pending = ring_count(ps->rings[p]) > 0;
+        if (pending) {
+            atomic_store(&ps->sleeping, 0);
+            continue;
+        }
+        evloop_run_once(ps->loop, -1);
+        atomic_store(&ps->sleeping, 0);
+    }
+    return NULL;
+}
+
+static void pubsub_drain(pubsub_t *ps) {
+    for (int p = 0; p < ps->nproducers; p++) {
+        uint32_t n = ring_pop(ps->rings[p], ps->scratch, PUBSUB_DRAIN_RECORDS);
+        if (n == 0) continue;
+        ps->stats.published += n;
+        if (ps->subs == NULL) continue;
+        // one encode for all subscribers
+        pubsub_batch_t *batch = malloc(sizeof(pubsub_batch_t) + (size_t) n * SENSOR_DATA_WIRE_SIZE);
+        if (batch == NULL) continue;
+        batch->refs = 1;
+        batch->len = (size_t) n * SENSOR_DATA_WIRE_SIZE;
+        for (uint32_t i = 0; i < n; i++) sensor_data_pack(batch->data + i * SENSOR_DATA_WIRE_SIZE, &ps->scratch[i]);
+        pubsub_sub_t *sub = ps->subs;
+        while (sub != NULL) {
+            pubsub_sub_t *next = sub->next;
+            int res = 0;
+            // queue the runs of matching records as ranges of the shared batch
+            for (uint32_t i = 0; i < n && res == 0 && sub->active;) {
+                sensor_id_t id = ps->scratch[i].id;
+                if (!(sub->filter[id >> 6] & (1ull << (id & 63)))) {
+                    i++;
+                    continue;
+                }
+                uint32_t first = i++;
+                while (i < n && (sub->filter[ps->scratch[i].id >> 6] & (1ull << (ps->scratch[i].id & 63)))) i++;
+                res = pubsub_queue(sub, batch, first * SENSOR_DATA_WIRE_SIZE, (i - first) * SENSOR_DATA_WIRE_SIZE);
+            }
+            if (res == 0 && sub->count > 0 && !sub->writing) res = pubsub_send(sub);
+            if (res != 0) pubsub_sub_close(sub);
+            sub = next;
+        }
+        pubsub_release(batch);
+    }
+}
+
+static void pubsub_wake(evloop_t *l, int fd, uint32_t events, void *arg) {
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0) {}
+}
+
+static void pubsub_accept(tcpsock_t *sock, uint32_t events, void *arg) {
+    pubsub_t *ps = (pubsub_t *) arg;
+    tcpsock_t *client;
+    while (tcp_wait_for_connection(sock, &client) == TCP_NO_ERROR) {
+        pubsub_sub_t *sub = calloc(1, sizeof(pubsub_sub_t));
+        if (sub == NULL) {
+            tcp_close(&client);
+            continue;
+        }
+        sub->pubsub = ps;
+        sub->sock = client;
+        tcp_get_sd(client, &sub->fd);
+        if (tcp_register(client, ps->loop, EPOLLIN | EPOLLRDHUP, &pubsub_event, sub) != TCP_NO_ERROR) {
+            tcp_close(&client);
+            free(sub);
+            continue;
+        }
+        sub->next = ps->subs;
+        if (ps->subs != NULL) ps->subs->prev = sub;
+        ps->subs = sub;
+        atomic_fetch_add(&ps->nsubs, 1);
+    }
+}
+
+static void pubsub_event(tcpsock_t *sock, uint32_t events, void *arg) {
+    pubsub_sub_t *sub = (pubsub_sub_t *) arg;
+    if (events & EPOLLERR) {
+        pubsub_sub_close(sub);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        int n = (int) sizeof(sub->in) - sub->in_len;
+        int res = tcp_receive(sock, sub->in + sub->in_len, &n);
+        // a subscriber that hangs up is gone, nothing is sent to a half closed socket
+        if (res != TCP_NO_ERROR && res != TCP_WOULD_BLOCK) {
+            pubsub_sub_close(sub);
+            return;
+        }
+        sub->in_len += n;
+        if (pubsub_parse(sub) != 0) {
+            pubsub_sub_close(sub);
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && pubsub_send(sub) != 0) pubsub_sub_close(sub);
+}
+
+static int pubsub_parse(pubsub_sub_t *sub) {
+    int pos = 0;
+    while (sub->in_len - pos >= 3) {
+        unsigned char *msg = sub->in + pos;
+        uint16_t a, b;
+        memcpy(&a, msg + 1, sizeof(a));
+        if (msg[0] == PUBSUB_FILTER_RANGE) {
+            if (sub->in_len - pos < 5) break;
+            memcpy(&b, msg + 3, sizeof(b));
+            for (uint32_t id = a; id <= b; id++) sub->filter[id >> 6] |= 1ull << (id & 63);
+            pos += 5;
+        } else if (msg[0] == PUBSUB_FILTER_SET) {
+            if (a > PUBSUB_MAX_FILTER_IDS) return -1;
+            if (sub->in_len - pos < 3 + 2 * a) break;
+            for (int i = 0; i < a; i++) {
+                memcpy(&b, msg + 3 + 2 * i, sizeof(b));
+                sub->filter[b >> 6] |= 1ull << (b & 63);
+            }
+            pos += 3 + 2 * a;
+        } else return -1;
+        sub->active = 1;
+    }
+    memmove(sub->in, sub->in + pos, sub->in_len - pos);
+    sub->in_len -= pos;
+    return 0;
+}
+
+/*
+ * Applies the lag policy, returns -1 if the subscriber must be disconnected.
+ */
+static int pubsub_queue(pubsub_sub_t *sub, pubsub_batch_t *batch, uint32_t off, uint32_t len) {
+    pubsub_t *ps = sub->pubsub;
+    if (sub->pending_bytes + len > ps->max_lag || sub->count == PUBSUB_MAX_PENDING) {
+        if (ps->policy == PUBSUB_LAG_DISCONNECT) {
+            ps->stats.disconnected++;
+            return -1;
+        }
+        ps->stats.dropped += len / SENSOR_DATA_WIRE_SIZE;
+        return 0;
+    }
+    pubsub_range_t *r = &sub->pending[(sub->head + sub->count) % PUBSUB_MAX_PENDING];
+    r->batch = batch;
+    r->off = off;
+    r->len = len;
+    batch->refs++;
+    sub->count++;
+    sub->pending_bytes += len;
+    return 0;
+}
+
+/*
+ * Sends the queued ranges with as few system calls as possible, waits for
+ * EPOLLOUT (level triggered) while the socket is full.
+ */
+static int pubsub_send(pubsub_sub_t *sub) {
+    pubsub_t *ps = sub->pubsub;
+    while (sub->count > 0) {
+        struct iovec iov[PUBSUB_IOV];
+        int n = 0;
+        for (uint32_t i = 0; i < sub->count && n < PUBSUB_IOV; i++, n++) {
+            pubsub_range_t *r = &sub->pending[(sub->head + i) % PUBSUB_MAX_PENDING];
+            iov[n].iov_base = r->batch->data + r->off;
+            iov[n].iov_len = r->len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(sub->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            break;
+        }
+        ps->stats.sent += (uint64_t) sent;
+        sub->pending_bytes -= (size_t) sent;
+        while (sent > 0) {
+            pubsub_range_t *r = &sub->pending[sub->head];
+            if ((size_t) sent < r->len) {
+                r->off += (uint32_t) sent;
+                r->len -= (uint32_t) sent;
+                break;
+            }
+            sent -= r->len;
+            pubsub_release(r->batch);
+            sub->head = (sub->head + 1) % PUBSUB_MAX_PENDING;
+            sub->count--;
+        }
+    }
+    int writing = sub->count > 0;
+    if (writing != sub->writing) {
+        if (tcp_modify(sub->sock, EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0)) != TCP_NO_ERROR) return -1;
+        sub->writing = writing;
+    }
+    return 0;
+}
+
+static void pubsub_sub_close(pubsub_sub_t *sub) {
+    pubsub_t *ps = sub->pubsub;
+    if (sub->prev != NULL) sub->prev->next = sub->next;
+    else ps->subs = sub->next;
+    if (sub->next != NULL) sub->next->prev = sub->prev;
+    for (; sub->count > 0; sub->count--) {
+        pubsub_release(sub->pending[sub->head].batch);
+        sub->head = (sub->head + 1) % PUBSUB_MAX_PENDING;
+    }
+    tcp_close(&sub->sock);
+    atomic_fetch_sub(&ps->nsubs, 1);
+    free(sub);
+}
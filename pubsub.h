@@ -0,0 +1,78 @@
+#ifndef __PUBSUB_H__
+#define __PUBSUB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+
+#define PUBSUB_NO_ERROR         0
+#define PUBSUB_MEMORY_ERROR     1  // mem alloc error
+#define PUBSUB_SOCKET_ERROR     2  // the subscriber listener can't be opened
+#define PUBSUB_THREAD_ERROR     3  // the hub thread, its loop or doorbell can't be created
+
+#define PUBSUB_LAG_DROP         0  // a subscriber that is too far behind misses the new records
+#define PUBSUB_LAG_DISCONNECT   1  // a subscriber that is too far behind is disconnected
+
+#define PUBSUB_RING_RECORDS     65536   // records queued per producer for the hub
+#define PUBSUB_MAX_PENDING      1024    // queued send ranges per subscriber
+#define PUBSUB_MAX_FILTER_IDS   1024    // ids in one PUBSUB_FILTER_SET message
+
+/*
+ * Subscriber protocol: after connecting, a subscriber sends filter messages
+ * and from then on receives every matching record as a raw stream of
+ * SENSOR_DATA_WIRE_SIZE records. Filters add up, nothing is sent before the
+ * first one. Integers are in host byte order like the records.
+ *   PUBSUB_FILTER_RANGE  type (1), first id (2), last id (2)
+ *   PUBSUB_FILTER_SET    type (1), count (2), count ids (2 each)
+ */
+#define PUBSUB_FILTER_RANGE     1
+#define PUBSUB_FILTER_SET       2
+
+typedef struct pubsub pubsub_t;
+
+typedef struct {
+    uint64_t subscribers;   // currently connected
+    uint64_t published;     // records taken from the producers
+    uint64_t overflows;     // records lost because the hub fell behind the producers
+    uint64_t sent;          // bytes sent to subscribers
+    uint64_t dropped;       // records not sent to a lagging subscriber (PUBSUB_LAG_DROP)
+    uint64_t disconnected;  // subscribers disconnected for lagging (PUBSUB_LAG_DISCONNECT)
+} pubsub_stats_t;
+
+
+int pubsub_create(pubsub_t **pubsub, char *ip, int port, int producers, size_t max_lag, int policy);
+
+/* Starts the hub thread serving subscribers on 'ip':'port', fed by 'producers' producer threads
+ * A subscriber with more than 'max_lag' bytes not yet sent is handled according to 'policy'
+ * If memory allocation fails, PUBSUB_MEMORY_ERROR is returned
+ * If the listener can't be opened, PUBSUB_SOCKET_ERROR is returned
+ * If the thread, its event loop or its eventfd can't be created, PUBSUB_THREAD_ERROR is returned
+ */
+
+
+void pubsub_free(pubsub_t **pubsub);
+
+/* Stops the hub thread, disconnects all subscribers, frees all memory and sets '*pubsub' to NULL
+ * No producer may publish anymore when this is called
+ */
+
+
+void pubsub_publish(pubsub_t *pubsub, int producer, const sensor_data_t *data);
+
+/* Queues 'data' from 'producer' for the subscribers; never blocks, if the hub is behind the record is lost
+ * Only the thread owning 'producer' may call this; the hub is woken by pubsub_signal()
+ */
+
+
+void pubsub_signal(pubsub_t *pubsub, int producer);
+
+/* Wakes the hub if 'producer' published since its previous signal and the hub sleeps
+ */
+
+
+void pubsub_get_stats(pubsub_t *pubsub, pubsub_stats_t *stats);
+/* Copies the counters into '*stats'
+ */
+
+
+#endif  //__PUBSUB_H__
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "query.h"
+#include "lvc.h"
+#include "evloop.h"
+#include "tcpsock.h"
+#include "retain.h"
+
+#define QUERY_SAVE_RECORDS  256     // latest values packed per snapshot write
+#define QUERY_IN_BYTES      (QUERY_REQUEST_SIZE * 64)
+#define QUERY_FRAME_BYTES   (sizeof(uint32_t) + QUERY_FRAME_RECORDS * SENSOR_DATA_WIRE_SIZE)
+#define QUERY_OUT_BYTES     (4 * QUERY_FRAME_BYTES)
+
+typedef struct query_conn query_conn_t;
+struct query_conn {
+    query_t *query;
+    tcpsock_t *sock;
+    query_conn_t *prev, *next;
+    int closing;                        // close once 'out' is sent
+    int eof;                            // the client sent everything, close after the last reply
+    int in_len;
+    unsigned char in[QUERY_IN_BYTES];
+    int out_pos, out_len;
+    unsigned char out[QUERY_OUT_BYTES];
+    // request in progress (QUERY_STATS or QUERY_SCAN), op is 0 when idle
+    int op;
+    sensor_id_t id;
+    sensor_ts_t from, to;
+    const unsigned char *map;           // snapshot of the record file taken when the request started
+    size_t map_records;
+    size_t pos;
+    // QUERY_STATS of a range reaching before the retention horizon: aggregates of a tier first
+    const retain_agg_t *tier_map;
+    size_t tier_aggs;
+    size_t tier_pos;
+    sensor_ts_t tier_from, tier_to;     // starts of the buckets counted
+    uint64_t count;
+    double min, max, sum;
+};
+
+struct query {
+    char *path;
+    pthread_t thread;
+    int started;
+    evloop_t *loop;             // of the query thread, created by query_listen()
+    int efd;                    // doorbell, only rung to stop the thread
+    _Atomic int stop;
+    tcpsock_t *server;
+    query_conn_t *conns;
+    lvc_t *latest;
+    retain_t *retain;           // NULL without a running retention
+    uint64_t raw_start;         // without one, first byte kept by an earlier run with retention
+};
+
+
+static void *query_run(void *arg);
+
+static void query_wake(evloop_t *l, int fd, uint32_t events, void *arg);
+
+static void query_accept(tcpsock_t *sock, uint32_t events, void *arg);
+
+static void query_event(tcpsock_t *sock, uint32_t events, void *arg);
+
+static int query_pump(query_conn_t *conn);
+
+static int query_start(query_conn_t *conn);
+
+static void query_slice(query_conn_t *conn);
+
+static void query_finish(query_conn_t *conn);
+
+static void query_conn_close(query_conn_t *conn);
+
+static void query_tier(query_conn_t *conn, int tier);
+
+static void query_unmap(query_conn_t *conn);
+
+static int query_want(query_conn_t *conn, uint32_t out);
+
+static inline void query_put(query_conn_t *conn, const void *src, size_t len) {
+    memcpy(conn->out + conn->out_len, src, len);
+    conn->out_len += (int) len;
+}
+
+
+int query_create(query_t **query, const char *path) {
+    query_t *q = calloc(1, sizeof(query_t));
+    if (q == NULL) return QUERY_MEMORY_ERROR;
+    q->efd = -1;
+    atomic_init(&q->stop, 0);
+    q->path = strdup(path);
+    if (q->path == NULL || lvc_create(&q->latest) != LVC_NO_ERROR) {
+        free(q->path);
+        free(q);
+        return QUERY_MEMORY_ERROR;
+    }
+    // nothing deletes records without a retention, the prefix deleted before stays as it is
+    int res = retain_read_start(path, &q->raw_start);
+    if (res != RETAIN_NO_ERROR) {
+        lvc_free(&q->latest);
+        free(q->path);
+        free(q);
+        return res == RETAIN_MEMORY_ERROR ? QUERY_MEMORY_ERROR : QUERY_FILE_ERROR;
+    }
+    *query = q;
+    return QUERY_NO_ERROR;
+}
+
+
+void query_free(query_t **query) {
+    if (query == NULL || *query == NULL) return;
+    query_t *q = *query;
+    query_close(q);
+    lvc_free(&q->latest);
+    free(q->path);
+    free(q);
+    *query = NULL;
+}
+
+
+int query_listen(query_t *q, char *ip, int port) {
+    if (evloop_create(&q->loop) != EVLOOP_NO_ERROR) return QUERY_THREAD_ERROR;
+    if (tcp_passive_open_ex(&q->server, ip, port, TCP_FLAG_NONBLOCK) != TCP_NO_ERROR ||
+        tcp_register(q->server, q->loop, EPOLLIN, &query_accept, q) != TCP_NO_ERROR) {
+        query_close(q);
+        return QUERY_SOCKET_ERROR;
+    }
+    q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->efd < 0 || evloop_add(q->loop, q->efd, EPOLLIN, &query_wake, q) != EVLOOP_NO_ERROR ||
+        pthread_create(&q->thread, NULL, &query_run, q) != 0) {
+        query_close(q);
+        return QUERY_THREAD_ERROR;
+    }
+    q->started = 1;
+    return QUERY_NO_ERROR;
+}
+
+
+void query_close(query_t *q) {
+    if (q->started) {
+        uint64_t one = 1;
+        atomic_store(&q->stop, 1);
+        if (write(q->efd, &one, sizeof(one)) < 0) {}
+        pthread_join(q->thread, NULL);
+        q->started = 0;
+    }
+    while (q->conns != NULL) query_conn_close(q->conns);
+    if (q->server != NULL) tcp_close(&q->server);
+    if (q->efd >= 0) {
+        evloop_del(q->loop, q->efd);
+        close(q->efd);
+        q->efd = -1;
+    }
+    evloop_free(&q->loop);
+}
+
+
+void query_set_retain(query_t *q, retain_t *retain) {
+    q->retain = retain;
+}
+
+
+void query_update(const sensor_data_t *data, void *arg) {
+    query_t *q = (query_t *) arg;
+    lvc_update(q->latest, data);
+}
+
+
+void query_save(query_t *q, snapshot_t *snap, query_filter_t filter, void *arg) {
+    unsigned char buf[QUERY_SAVE_RECORDS * SENSOR_DATA_WIRE_SIZE];
+    size_t len = 0;
+    sensor_data_t data;
+    snapshot_begin(snap, SNAPSHOT_LATEST);
+    for (int id = 0; id < LVC_SENSORS; id++) {
+        if (!filter((sensor_id_t) id, arg) || !lvc_read(q->latest, (sensor_id_t) id, &data)) continue;
+        sensor_data_pack(buf + len, &data);
+        len += SENSOR_DATA_WIRE_SIZE;
+        if (len < sizeof(buf)) continue;
+        snapshot_write(snap, buf, len);
+        len = 0;
+    }
+    if (len > 0) snapshot_write(snap, buf, len);
+    snapshot_end(snap);
+}
+
+
+void query_load(query_t *q, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t pos = 0; pos + SENSOR_DATA_WIRE_SIZE <= len; pos += SENSOR_DATA_WIRE_SIZE) {
+        sensor_data_t d;
+        sensor_data_unpack(&d, p + pos);
+        query_update(&d, q);
+    }
+}
+
+
+static void *query_run(void *arg) {
+    query_t *q = (query_t *) arg;
+    while (!atomic_load(&q->stop)) evloop_run_once(q->loop, -1);
+    return NULL;
+}
+
+static void query_wake(evloop_t *l, int fd, uint32_t events, void *arg) {
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0) {}
+}
+
+static void query_accept(tcpsock_t *sock, uint32_t events, void *arg) {
+    query_t *q = (query_t *) arg;
+    tcpsock_t *client;
+    while (tcp_wait_for_connection(sock, &client) == TCP_NO_ERROR) {
+        query_conn_t *conn = calloc(1, sizeof(query_conn_t));
+        if (conn == NULL) {
+            tcp_close(&client);
+            continue;
+        }
+        conn->query = q;
+        conn->sock = client;
+        if (tcp_register(client, q->loop, EPOLLIN | EPOLLRDHUP, &query_event, conn) != TCP_NO_ERROR) {
+            tcp_close(&client);
+            free(conn);
+            continue;
+        }
+        conn->next = q->conns;
+        if (q->conns != NULL) q->conns->prev = conn;
+        q->conns = conn;
+    }
+}
+
+static void query_event(tcpsock_t *sock, uint32_t events, void *arg) {
+    query_conn_t *conn = (query_conn_t *) arg;
+    if (events & EPOLLERR) {
+        query_conn_close(conn);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !conn->eof) {
+        int n = QUERY_IN_BYTES - conn->in_len;
+        // a full request buffer is read again once the queued requests are answered
+        if (n > 0) {
+            int res = tcp_receive(sock, conn->in + conn->in_len, &n);
+            if (res == TCP_CONNECTION_CLOSED) conn->eof = 1;
+            else if (res != TCP_NO_ERROR && res != TCP_WOULD_BLOCK) {
+                query_conn_close(conn);
+                return;
+            }
+            conn->in_len += n;
+        }
+    }
+    if (query_pump(conn) != 0) query_conn_close(conn);
+}
+
+/*
+ * Sends what is queued and makes progress on the requests, at most one
+ * slice of a scan per call. Waits for EPOLLOUT while there is more to do,
+ * level triggered, so a long scan is resumed on every loop iteration.
+ * Returns -1 if the connection must be closed.
+ */
+static int query_pump(query_conn_t *conn) {
+    int sliced = 0;
+    while (1) {
+        while (conn->out_pos < conn->out_len) {
+            int n = conn->out_len - conn->out_pos;
+            int res = tcp_send(conn->sock, conn->out + conn->out_pos, &n);
+            if (res == TCP_WOULD_BLOCK) return query_want(conn, EPOLLOUT);
+            if (res != TCP_NO_ERROR) return -1;
+            conn->out_pos += n;
+        }
+        conn->out_pos = conn->out_len = 0;
+        if (conn->closing) return -1;
+        if (conn->op != 0) {
+            if (sliced) break;
+            query_slice(conn);
+            sliced = 1;
+            continue;
+        }
+        if (conn->in_len < (int) QUERY_REQUEST_SIZE) {
+            if (conn->eof) return -1;
+            break;
+        }
+        if (query_start(conn) != 0) conn->closing = 1;
+        memmove(conn->in, conn->in + QUERY_REQUEST_SIZE, conn->in_len - QUERY_REQUEST_SIZE);
+        conn->in_len -= QUERY_REQUEST_SIZE;
+    }
+    return query_want(conn, conn->op != 0 ? EPOLLOUT : 0);
+}
+
+static int query_want(query_conn_t *conn, uint32_t out) {
+    // level triggered: only ask for input there is room for
+    uint32_t in = (!conn->eof && conn->in_len < (int) QUERY_IN_BYTES) ? EPOLLIN | EPOLLRDHUP : 0;
+    return tcp_modify(conn->sock, in | out) == TCP_NO_ERROR ? 0 : -1;
+}
+
+static int query_start(query_conn_t *conn) {
+    unsigned char status = QUERY_STATUS_OK;
+    unsigned char *req = conn->in;
+    conn->op = req[0];
+    memcpy(&conn->id, req + 1, sizeof(sensor_id_t));
+    memcpy(&conn->from, req + 1 + sizeof(sensor_id_t), sizeof(sensor_ts_t));
+    memcpy(&conn->to, req + 1 + sizeof(sensor_id_t) + sizeof(sensor_ts_t), sizeof(sensor_ts_t));
+    if (conn->op == QUERY_LATEST) {
+        unsigned char record[SENSOR_DATA_WIRE_SIZE];
+        sensor_data_t data;
+        memset(&data, 0, sizeof(data));
+        status = lvc_read(conn->query->latest, conn->id, &data) ? QUERY_STATUS_OK : QUERY_STATUS_NOT_FOUND;
+        sensor_data_pack(record, &data);
+        query_put(conn, &status, 1);
+        query_put(conn, record, SENSOR_DATA_WIRE_SIZE);
+        conn->op = 0;
+        return 0;
+    }
+    if (conn->op != QUERY_STATS && conn->op != QUERY_SCAN) {
+        status = QUERY_STATUS_BAD_REQUEST;
+        query_put(conn, &status, 1);
+        conn->op = 0;
+        return -1;
+    }
+    // only the records written so far are visible, a missing file is an empty one
+    conn->map = NULL;
+    conn->map_records = 0;
+    conn->pos = 0;
+    conn->count = 0;
+    conn->sum = 0;
+    int fd = open(conn->query->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) SENSOR_DATA_WIRE_SIZE) {
+        conn->map_records = (size_t) st.st_size / SENSOR_DATA_WIRE_SIZE;
+        void *map = mmap(NULL, conn->map_records * SENSOR_DATA_WIRE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) conn->map_records = 0;
+        else {
+            madvise(map, conn->map_records * SENSOR_DATA_WIRE_SIZE, MADV_SEQUENTIAL);
+            conn->map = map;
+        }
+    }
+    if (fd >= 0) close(fd);
+    // the deleted prefix reads back as zeros
+    conn->pos = conn->query->raw_start / SENSOR_DATA_WIRE_SIZE;
+    if (conn->pos > conn->map_records) conn->pos = conn->map_records;
+    if (conn->query->retain != NULL) {
+        // the raw records before the retention horizon may be gone, their aggregates are not
+        uint64_t raw_start;
+        sensor_ts_t horizon;
+        retain_horizon(conn->query->retain, &raw_start, &horizon);
+        conn->pos = raw_start / SENSOR_DATA_WIRE_SIZE;
+        if (conn->pos > conn->map_records) conn->pos = conn->map_records;
+        if (conn->op == QUERY_STATS && conn->from < horizon) {
+            // long ranges from the coarse tier, a bucket counts whole if part of it is in the range
+            int tier = conn->from < conn->to - RETAIN_HOUR_QUERY ? RETAIN_HOUR : RETAIN_MINUTE;
+            sensor_ts_t span = tier == RETAIN_HOUR ? 3600 : 60;
+            conn->tier_from = conn->from - ((conn->from % span) + span) % span;
+            conn->tier_to = conn->to < horizon ? conn->to : horizon - 1;
+            query_tier(conn, tier);
+            if (conn->to < horizon) conn->pos = conn->map_records;
+            conn->from = horizon;
+        }
+    }
+    if (conn->op == QUERY_SCAN) query_put(conn, &status, 1);
+    return 0;
+}
+
+static void query_tier(query_conn_t *conn, int tier) {
+    conn->tier_map = NULL;
+    conn->tier_aggs = 0;
+    conn->tier_pos = 0;
+    int fd = open(retain_tier_path(conn->query->retain, tier), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(retain_agg_t)) {
+        conn->tier_aggs = (size_t) st.st_size / sizeof(retain_agg_t);
+        void *map = mmap(NULL, conn->tier_aggs * sizeof(retain_agg_t), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) conn->tier_aggs = 0;
+        else conn->tier_map = map;
+    }
+    if (fd >= 0) close(fd);
+}
+
+static void query_slice(query_conn_t *conn) {
+    if (conn->tier_pos < conn->tier_aggs) {
+        // a slice of the tier, the raw records follow in the next slices
+        size_t end = conn->tier_pos + QUERY_SCAN_BUDGET;
+        if (end > conn->tier_aggs) end = conn->tier_aggs;
+        for (; conn->tier_pos < end; conn->tier_pos++) {
+            const retain_agg_t *agg = &conn->tier_map[conn->tier_pos];
+            if (agg->id != conn->id || agg->start < conn->tier_from || agg->start > conn->tier_to) continue;
+            if (conn->count == 0 || agg->min < conn->min) conn->min = agg->min;
+            if (conn->count == 0 || agg->max > conn->max) conn->max = agg->max;
+            conn->sum += agg->sum;
+            conn->count += agg->count;
+        }
+        return;
+    }
+    size_t end = conn->pos + QUERY_SCAN_BUDGET;
+    if (end > conn->map_records) end = conn->map_records;
+    sensor_data_t data;
+    uint32_t n = 0;
+    int frame = conn->out_len;
+    if (conn->op == QUERY_SCAN) conn->out_len += sizeof(uint32_t);
+    for (; conn->pos < end; conn->pos++) {
+        const unsigned char *rec = conn->map + conn->pos * SENSOR_DATA_WIRE_SIZE;
+        sensor_id_t id;
+        memcpy(&id, rec, sizeof(id));
+        if (id != conn->id) continue;
+        sensor_data_unpack(&data, rec);
+        if (data.ts < conn->from || data.ts > conn->to) continue;
+        if (conn->op == QUERY_STATS) {
+            if (conn->count == 0 || data.value < conn->min) conn->min = data.value;
+            if (conn->count == 0 || data.value > conn->max) conn->max = data.value;
+            conn->sum += data.value;
+            conn->count++;
+            continue;
+        }
+        query_put(conn, rec, SENSOR_DATA_WIRE_SIZE);
+        if (++n < QUERY_FRAME_RECORDS) continue;
+        memcpy(conn->out + frame, &n, sizeof(n));
+        // the out buffer is sent before the next frame if it can't hold it
+        if (conn->out_len + QUERY_FRAME_BYTES > QUERY_OUT_BYTES) {
+            conn->pos++;
+            return;
+        }
+        frame = conn->out_len;
+        conn->out_len += sizeof(uint32_t);
+        n = 0;
+    }
+    // an empty frame would end the scan, drop it
+    if (conn->op == QUERY_SCAN) {
+        if (n > 0) memcpy(conn->out + frame, &n, sizeof(n));
+        else conn->out_len -= sizeof(uint32_t);
+    }
+    if (conn->pos == conn->map_records) query_finish(conn);
+}
+
+static void query_finish(query_conn_t *conn) {
+    if (conn->op == QUERY_STATS) {
+        unsigned char status = conn->count ? QUERY_STATUS_OK : QUERY_STATUS_NOT_FOUND;
+        double mean = conn->count ? conn->sum / (double) conn->count : 0;
+        if (conn->count == 0) conn->min = conn->max = 0;
+        query_put(conn, &status, 1);
+        query_put(conn, &conn->count, sizeof(uint64_t));
+        query_put(conn, &conn->min, sizeof(double));
+        query_put(conn, &conn->max, sizeof(double));
+        query_put(conn, &mean, sizeof(double));
+    } else {
+        uint32_t last = 0;
+        query_put(conn, &last, sizeof(last));
+    }
+    query_unmap(conn);
+    conn->op = 0;
+}
+
+static void query_unmap(query_conn_t *conn) {
+    if (conn->map != NULL) munmap((void *) conn->map, conn->map_records * SENSOR_DATA_WIRE_SIZE);
+    if (conn->tier_map != NULL) munmap((void *) conn->tier_map, conn->tier_aggs * sizeof(retain_agg_t));
+    conn->map = NULL;
+    conn->tier_map = NULL;
+    conn->tier_aggs = conn->tier_pos = 0;
+}
+
+static void query_conn_close(query_conn_t *conn) {
+    query_t *q = conn->query;
+    if (conn->prev != NULL) conn->prev->next = conn->next;
+    else q->conns = conn->next;
+    if (conn->next != NULL) conn->next->prev = conn->prev;
+    query_unmap(conn);
+    tcp_close(&conn->sock);
+    free(conn);
+}
@@ -0,0 +1,107 @@
+#ifndef __QUERY_H__
+#define __QUERY_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "snapshot.h"
+#include "retain.h"
+
+#define QUERY_NO_ERROR          0
+#define QUERY_MEMORY_ERROR      1  // mem alloc error
+#define QUERY_SOCKET_ERROR      2  // the query listener can't be opened or registered
+#define QUERY_THREAD_ERROR      3  // the query thread, its loop or doorbell can't be created
+#define QUERY_FILE_ERROR        4  // the retention state of the record file can't be read
+
+/*
+ * Binary query protocol, all integers in host byte order like the records.
+ * A request is QUERY_REQUEST_SIZE bytes: op (1), sensor id (2), from (8),
+ * to (8); 'from' and 'to' are an inclusive ts range. Requests may be
+ * pipelined, replies come in order and start with a status byte:
+ *   QUERY_LATEST  status, record (SENSOR_DATA_WIRE_SIZE), zeros if not found
+ *   QUERY_STATS   status, count (8), min (8), max (8), mean (8) of the range
+ *   QUERY_SCAN    status, then frames of count (4) and count records, the
+ *                 last frame has count 0
+ * An unknown op gets a QUERY_STATUS_BAD_REQUEST byte and the connection closed.
+ *
+ * The records a retention deleted from the record file are never read,
+ * also without a running retention. With retention (query_set_retain())
+ * the raw records before the horizon may be deleted: QUERY_SCAN returns the raw records still kept, and
+ * QUERY_STATS answers the part of its range before the horizon from the
+ * aggregates, the hour tier for more than RETAIN_HOUR_QUERY seconds and
+ * the minute tier otherwise. An aggregate counts whole if its bucket
+ * overlaps the range, so the edges of that part are rounded out to buckets.
+ */
+#define QUERY_LATEST    1
+#define QUERY_STATS     2
+#define QUERY_SCAN      3
+
+#define QUERY_STATUS_OK             0
+#define QUERY_STATUS_NOT_FOUND      1
+#define QUERY_STATUS_BAD_REQUEST    2
+
+#define QUERY_REQUEST_SIZE      (1 + sizeof(sensor_id_t) + 2 * sizeof(sensor_ts_t))
+#define QUERY_FRAME_RECORDS     256     // records per scan frame
+#define QUERY_SCAN_BUDGET       65536   // stored records examined per connection and loop iteration
+
+typedef struct query query_t;
+
+typedef int (*query_filter_t)(sensor_id_t id, void *arg);
+/* Selects the sensors of query_save(), returns 1 to keep 'id'
+ */
+
+
+int query_create(query_t **query, const char *path);
+
+/* Creates the query service over the record file 'path' with an empty latest value table; the records before
+ * the start saved by its retention (retain_read_start()) are skipped
+ * If memory allocation fails, QUERY_MEMORY_ERROR is returned
+ * If the retention state of 'path' can't be read, QUERY_FILE_ERROR is returned
+ */
+
+
+void query_free(query_t **query);
+
+/* Closes the listener and all query connections, frees all memory and sets '*query' to NULL
+ */
+
+
+int query_listen(query_t *query, char *ip, int port);
+
+/* Opens the query listener on 'ip':'port' and starts the query thread serving it from a loop of its own,
+ * so scans of the record file never block ingestion; scans and stats are done in slices of QUERY_SCAN_BUDGET
+ * records so the other query connections keep being served
+ * If the listener can't be opened or registered, QUERY_SOCKET_ERROR is returned
+ * If the thread, its event loop or its eventfd can't be created, QUERY_THREAD_ERROR is returned
+ */
+
+
+void query_close(query_t *query);
+
+/* Stops the query thread, closes the listener and all connections, the latest values are kept
+ */
+
+
+void query_set_retain(query_t *query, retain_t *retain);
+/* Serves the ranges before the horizon of 'retain' from its tiers, see above; 'retain' must outlive
+ * the query connections (query_close())
+ */
+
+
+void query_update(const sensor_data_t *data, void *query);
+/* Stores 'data' as the latest value of its sensor in the last value cache (lvc.h); lock free,
+ * concurrent updates must be for different sensors, readers on other threads never block it
+ */
+
+
+void query_save(query_t *query, snapshot_t *snap, query_filter_t filter, void *arg);
+
+/* Adds a SNAPSHOT_LATEST section with the latest value of every sensor 'filter' selects to 'snap'
+ */
+
+
+void query_load(query_t *query, const void *data, size_t len);
+/* Stores the latest values of a SNAPSHOT_LATEST section, same rules as query_update()
+ */
+
+
+#endif  //__QUERY_H__
@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reorder.h"
+
+#define REORDER_PAGE_BITS   8
+#define REORDER_PAGE_SIZE   (1 << REORDER_PAGE_BITS)
+#define REORDER_PAGES       ((UINT16_MAX + 1) / REORDER_PAGE_SIZE)
+#define REORDER_NONE        UINT64_MAX
+
+typedef struct {
+    sensor_ts_t last_ts;                // largest ts emitted so far
+    int emitted;
+    uint32_t seen[REORDER_SEEN];        // fingerprints of the last emitted records, 0 is empty
+    uint32_t seen_pos;
+    uint32_t first;                     // window is pending[first .. first + count - 1], sorted by ts
+    uint32_t count;
+    uint64_t *due;                      // wall clock deadline of every pending record, same positions
+    sensor_data_t pending[];
+} reorder_sensor_t;
+
+// snapshot entry of a sensor, followed by its 'count' held records
+typedef struct {
+    sensor_id_t id;
+    uint32_t emitted;
+    uint32_t seen_pos;
+    uint32_t count;
+    sensor_ts_t last_ts;
+    uint32_t seen[REORDER_SEEN];
+} reorder_entry_t;
+
+struct reorder {
+    uint32_t window;
+    sensor_ts_t lag;
+    uint64_t now;                       // ms, clock of the last reorder_expire(), reorder_create() or reorder_load()
+    uint64_t next_due;                  // no held record expires before, REORDER_NONE with none held
+    // two level table indexed by sensor id, pages are allocated on first use
+    reorder_sensor_t **pages[REORDER_PAGES];
+    reorder_stats_t stats;
+};
+
+
+static reorder_sensor_t *reorder_sensor(reorder_t *r, sensor_id_t id);
+
+static void reorder_emit_first(reorder_t *r, reorder_sensor_t *s, reorder_emit_t emit, void *arg);
+
+static void reorder_release(reorder_t *r, reorder_sensor_t *s, reorder_emit_t emit, void *arg);
+
+static void reorder_hold(reorder_t *r, reorder_sensor_t *s, uint32_t pos, const sensor_data_t *data);
+
+static void reorder_compact(reorder_sensor_t *s);
+
+static uint64_t reorder_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static inline uint32_t reorder_fingerprint(const sensor_data_t *data) {
+    uint64_t v;
+    memcpy(&v, &data->value, sizeof(v));
+    v ^= (uint64_t) data->ts * 0x9E3779B97F4A7C15u;
+    v *= 0xFF51AFD7ED558CCDu;
+    uint32_t f = (uint32_t) (v >> 32);
+    return f ? f : 1;
+}
+
+
+int reorder_create(reorder_t **reorder, int window, int lag) {
+    reorder_t *r = calloc(1, sizeof(reorder_t));
+    if (r == NULL) return REORDER_MEMORY_ERROR;
+    if (window < 1) window = 1;
+    if (window > REORDER_MAX_WINDOW) window = REORDER_MAX_WINDOW;
+    r->window = (uint32_t) window;
+    r->lag = lag < 0 ? 0 : lag;
+    r->next_due = REORDER_NONE;
+    // records pushed before the first reorder_expire(), e.g. replayed at startup, wait from here
+    r->now = reorder_clock();
+    *reorder = r;
+    return REORDER_NO_ERROR;
+}
+
+
+void reorder_free(reorder_t **reorder) {
+    if (reorder == NULL || *reorder == NULL) return;
+    reorder_t *r = *reorder;
+    for (int p = 0; p < REORDER_PAGES; p++) {
+        if (r->pages[p] == NULL) continue;
+        for (int i = 0; i < REORDER_PAGE_SIZE; i++) free(r->pages[p][i]);
+        free(r->pages[p]);
+    }
+    free(r);
+    *reorder = NULL;
+}
+
+
+int reorder_push(reorder_t *r, const sensor_data_t *data, reorder_emit_t emit, void *arg) {
+    reorder_sensor_t *s = reorder_sensor(r, data->id);
+    if (s == NULL) {
+        emit(data, arg);
+        return REORDER_MEMORY_ERROR;
+    }
+    // a retransmission of something already written out
+    if (s->emitted && data->ts <= s->last_ts) {
+        uint32_t f = reorder_fingerprint(data);
+        for (int i = 0; i < REORDER_SEEN; i++) {
+            if (s->seen[i] == f) {
+                r->stats.duplicates++;
+                return REORDER_NO_ERROR;
+            }
+        }
+    }
+    // readings mostly arrive in order: search the insert position from the newest end
+    sensor_data_t *w = s->pending + s->first;
+    uint32_t pos = s->count;
+    while (pos > 0 && w[pos - 1].ts > data->ts) pos--;
+    // readings of the same second keep their arrival order, unless one is identical
+    for (uint32_t i = pos; i > 0 && w[i - 1].ts == data->ts; i--) {
+        if (w[i - 1].value == data->value) {
+            r->stats.duplicates++;
+            return REORDER_NO_ERROR;
+        }
+    }
+    if (s->first + s->count == r->window + 1) reorder_compact(s);
+    reorder_hold(r, s, pos, data);
+    reorder_release(r, s, emit, arg);
+    return REORDER_NO_ERROR;
+}
+
+
+void reorder_flush(reorder_t *r, reorder_emit_t emit, void *arg) {
+    for (int p = 0; p < REORDER_PAGES; p++) {
+        if (r->pages[p] == NULL) continue;
+        for (int i = 0; i < REORDER_PAGE_SIZE; i++) {
+            reorder_sensor_t *s = r->pages[p][i];
+            while (s != NULL && s->count > 0) reorder_emit_first(r, s, emit, arg);
+        }
+    }
+}
+
+
+int reorder_expire(reorder_t *r, uint64_t now, reorder_emit_t emit, void *arg) {
+    r->now = now;
+    if (r->stats.held == 0) r->next_due = REORDER_NONE;
+    if (r->next_due == REORDER_NONE) return -1;
+    if (now < r->next_due) return (int) (r->next_due - now);
+    uint64_t next = REORDER_NONE;
+    for (int p = 0; p < REORDER_PAGES && r->stats.held > 0; p++) {
+        if (r->pages[p] == NULL) continue;
+        for (int i = 0; i < REORDER_PAGE_SIZE; i++) {
+            reorder_sensor_t *s = r->pages[p][i];
+            if (s == NULL || s->count == 0) continue;
+            // an expired record takes the older readings it waited behind along
+            uint32_t n = 0;
+            for (uint32_t k = 0; k < s->count; k++) {
+                if (s->due[s->first + k] <= now) n = k + 1;
+            }
+            while (n-- > 0) reorder_emit_first(r, s, emit, arg);
+            for (uint32_t k = 0; k < s->count; k++) {
+                if (s->due[s->first + k] < next) next = s->due[s->first + k];
+            }
+        }
+    }
+    // sweeping every sensor is cheap, but not for every record that falls due
+    if (next != REORDER_NONE && next < now + REORDER_SWEEP_MS) next = now + REORDER_SWEEP_MS;
+    r->next_due = next;
+    return next == REORDER_NONE ? -1 : (int) (next - now);
+}
+
+
+void reorder_save(reorder_t *r, snapshot_t *snap) {
+    uint32_t layout = sizeof(reorder_entry_t);
+    snapshot_begin(snap, SNAPSHOT_REORDER);
+    snapshot_write(snap, &layout, sizeof(layout));
+    for (int p = 0; p < REORDER_PAGES; p++) {
+        if (r->pages[p] == NULL) continue;
+        for (int i = 0; i < REORDER_PAGE_SIZE; i++) {
+            reorder_sensor_t *s = r->pages[p][i];
+            if (s == NULL) continue;
+            reorder_entry_t e = {.id = (sensor_id_t) (p << REORDER_PAGE_BITS | i), .emitted = (uint32_t) s->emitted,
+                    .seen_pos = s->seen_pos, .count = s->count, .last_ts = s->last_ts};
+            memcpy(e.seen, s->seen, sizeof(e.seen));
+            snapshot_write(snap, &e, sizeof(e));
+            snapshot_write(snap, s->pending + s->first, s->count * sizeof(sensor_data_t));
+        }
+    }
+    snapshot_end(snap);
+}
+
+
+int reorder_load(reorder_t *r, const void *data, size_t len, reorder_emit_t emit, void *arg) {
+    const unsigned char *p = data, *end = p + len;
+    uint32_t layout;
+    if (len < sizeof(layout)) return REORDER_FORMAT_ERROR;
+    memcpy(&layout, p, sizeof(layout));
+    if (layout != sizeof(reorder_entry_t)) return REORDER_FORMAT_ERROR;
+    p += sizeof(layout);
+    // the restored records wait 'lag' seconds from now, not from the last sweep before the restart
+    r->now = reorder_clock();
+    while ((size_t) (end - p) >= sizeof(reorder_entry_t)) {
+        reorder_entry_t e;
+        memcpy(&e, p, sizeof(e));
+        p += sizeof(e);
+        if (e.count > REORDER_MAX_WINDOW + 1 || (size_t) (end - p) < e.count * sizeof(sensor_data_t)) {
+            return REORDER_FORMAT_ERROR;
+        }
+        reorder_sensor_t *s = reorder_sensor(r, e.id);
+        if (s == NULL) return REORDER_MEMORY_ERROR;
+        s->emitted = (int) e.emitted;
+        s->seen_pos = e.seen_pos;
+        s->last_ts = e.last_ts;
+        memcpy(s->seen, e.seen, sizeof(s->seen));
+        // a smaller window than before: the oldest records go out as if the window overflowed
+        for (uint32_t i = 0; i < e.count; i++, p += sizeof(sensor_data_t)) {
+            sensor_data_t held;
+            if (s->first + s->count == r->window + 1) reorder_compact(s);
+            memcpy(&held, p, sizeof(held));
+            // the wait restarts, the time the records already waited isn't saved
+            reorder_hold(r, s, s->count, &held);
+            while (s->count > r->window) reorder_emit_first(r, s, emit, arg);
+        }
+        reorder_release(r, s, emit, arg);
+    }
+    return REORDER_NO_ERROR;
+}
+
+
+void reorder_get_stats(reorder_t *r, reorder_stats_t *stats) {
+    *stats = r->stats;
+}
+
+
+static reorder_sensor_t *reorder_sensor(reorder_t *r, sensor_id_t id) {
+    reorder_sensor_t **page = r->pages[id >> REORDER_PAGE_BITS];
+    if (page == NULL) {
+        page = calloc(REORDER_PAGE_SIZE, sizeof(reorder_sensor_t *));
+        if (page == NULL) return NULL;
+        r->pages[id >> REORDER_PAGE_BITS] = page;
+    }
+    reorder_sensor_t **s = &page[id & (REORDER_PAGE_SIZE - 1)];
+    if (*s == NULL) {
+        // one slot more than the window: a record is inserted before the oldest one is released
+        *s = calloc(1, sizeof(reorder_sensor_t) + (r->window + 1) * (sizeof(sensor_data_t) + sizeof(uint64_t)));
+        if (*s == NULL) return NULL;
+        (*s)->due = (uint64_t *) ((*s)->pending + r->window + 1);
+        r->stats.sensors++;
+    }
+    return *s;
+}
+
+/*
+ * Inserts 'data' at 'pos' of the window, due 'lag' seconds from now.
+ */
+static void reorder_hold(reorder_t *r, reorder_sensor_t *s, uint32_t pos, const sensor_data_t *data) {
+    sensor_data_t *w = s->pending + s->first;
+    uint64_t *due = s->due + s->first;
+    memmove(w + pos + 1, w + pos, (s->count - pos) * sizeof(sensor_data_t));
+    memmove(due + pos + 1, due + pos, (s->count - pos) * sizeof(uint64_t));
+    w[pos] = *data;
+    due[pos] = r->now + (uint64_t) r->lag * 1000;
+    if (due[pos] < r->next_due) r->next_due = due[pos];
+    s->count++;
+    r->stats.held++;
+}
+
+static void reorder_compact(reorder_sensor_t *s) {
+    memmove(s->pending, s->pending + s->first, s->count * sizeof(sensor_data_t));
+    memmove(s->due, s->due + s->first, s->count * sizeof(uint64_t));
+    s->first = 0;
+}
+
+/*
+ * Releases what can no longer be overtaken: overflow of the window, or older than the lag.
+ */
+static void reorder_release(reorder_t *r, reorder_sensor_t *s, reorder_emit_t emit, void *arg) {
+    while (s->count > r->window) reorder_emit_first(r, s, emit, arg);
+    while (s->count > 1 && s->pending[s->first + s->count - 1].ts - s->pending[s->first].ts > r->lag) {
+        reorder_emit_first(r, s, emit, arg);
+    }
+}
+
+static void reorder_emit_first(reorder_t *r, reorder_sensor_t *s, reorder_emit_t emit, void *arg) {
+    sensor_data_t *data = &s->pending[s->first];
+    if (s->emitted && data->ts < s->last_ts) r->stats.late++;
+    else s->last_ts = data->ts;
+    s->emitted = 1;
+    s->seen[s->seen_pos++ % REORDER_SEEN] = reorder_fingerprint(data);
+    emit(data, arg);
+    s->first++;
+    s->count--;
+    if (s->count == 0) s->first = 0;
+    r->stats.held--;
+}
@@ -0,0 +1,89 @@
+#ifndef __REORDER_H__
+#define __REORDER_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "snapshot.h"
+
+#define REORDER_NO_ERROR        0
+#define REORDER_MEMORY_ERROR    1  // mem alloc error
+#define REORDER_FORMAT_ERROR    2  // a snapshot section written by another layout
+
+#define REORDER_MAX_WINDOW      1024
+#define REORDER_SEEN            64      // fingerprints of emitted records remembered per sensor
+#define REORDER_SWEEP_MS        50      // least time between two sweeps of reorder_expire()
+
+typedef struct reorder reorder_t;
+
+typedef void (*reorder_emit_t)(const sensor_data_t *data, void *arg);
+/* Called for every record leaving the window, per sensor in timestamp order
+ */
+
+typedef struct {
+    uint64_t duplicates;    // records dropped because they were already held or emitted
+    uint64_t late;          // records emitted with a ts older than one already emitted by their sensor
+    uint64_t held;          // records currently waiting in a window
+    uint64_t sensors;       // sensors seen so far
+} reorder_stats_t;
+
+
+int reorder_create(reorder_t **reorder, int window, int lag);
+
+/* Creates an empty reorder stage holding up to 'window' records per sensor
+ * A record leaves the window when it is full, when a newer reading of the same sensor is more
+ * than 'lag' seconds ahead of it, or when it was held for 'lag' seconds of wall clock time (see
+ * reorder_expire()), so no reading waits much longer than 'lag' seconds, however slow its sensor
+ * If memory allocation fails, REORDER_MEMORY_ERROR is returned
+ */
+
+
+void reorder_free(reorder_t **reorder);
+
+/* Frees all memory, including held records, and sets '*reorder' to NULL; call reorder_flush() first to keep them
+ */
+
+
+int reorder_push(reorder_t *reorder, const sensor_data_t *data, reorder_emit_t emit, void *arg);
+
+/* Adds 'data' to the window of its sensor and calls 'emit' for every record that leaves it
+ * Exact duplicates (same id, ts and value) of a held or recently emitted record are dropped
+ * Returns REORDER_MEMORY_ERROR if the state of a new sensor can't be allocated; 'data' is then emitted as is
+ */
+
+
+int reorder_expire(reorder_t *reorder, uint64_t now, reorder_emit_t emit, void *arg);
+
+/* Advances the wall clock to 'now' (CLOCK_MONOTONIC ms) and emits the records held for 'lag' seconds, together with the
+ * older readings of their sensors; records pushed afterwards are due 'lag' seconds after 'now'
+ * Returns the ms until the next record falls due, at least REORDER_SWEEP_MS after a sweep, -1 if none is held
+ */
+
+
+void reorder_flush(reorder_t *reorder, reorder_emit_t emit, void *arg);
+
+/* Emits every held record of every sensor, e.g. at shutdown
+ */
+
+
+void reorder_save(reorder_t *reorder, snapshot_t *snap);
+
+/* Adds a SNAPSHOT_REORDER section with the held records and emitted fingerprints of every sensor to 'snap'
+ */
+
+
+int reorder_load(reorder_t *reorder, const void *data, size_t len, reorder_emit_t emit, void *arg);
+
+/* Restores the sensors of a SNAPSHOT_REORDER section into an empty reorder stage
+ * Held records that don't fit a smaller window or lag than when saved are emitted right away, the others
+ * wait 'lag' seconds from the call like records pushed then
+ * If memory allocation fails, REORDER_MEMORY_ERROR is returned and the remaining sensors are skipped
+ * If the section was written with another layout, REORDER_FORMAT_ERROR is returned
+ */
+
+
+void reorder_get_stats(reorder_t *reorder, reorder_stats_t *stats);
+/* Copies the counters into '*stats'
+ */
+
+
+#endif  //__REORDER_H__
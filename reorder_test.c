@@ -0,0 +1,121 @@
+/*
+ * Restart of the reorder stage: a window saved to a snapshot and restored
+ * into a new stage, plus readings replayed into it before the first sweep,
+ * must keep waiting 'lag' seconds of wall clock time from the restore like
+ * new readings, and leave it in ts order once they fall due.
+ *
+ * Usage: reorder_test [lag]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "reorder.h"
+#include "snapshot.h"
+
+#define TEST_WINDOW     16
+#define TEST_SENSORS    4
+#define TEST_HELD       5           // readings held per sensor, out of order
+#define TEST_SLACK_MS   200         // sweeps may come this late
+
+static int emitted, early, inverted;
+static sensor_ts_t last_ts[TEST_SENSORS];
+static uint64_t due = UINT64_MAX;           // nothing may leave the windows before
+
+static uint64_t test_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void test_emit(const sensor_data_t *data, void *arg) {
+    emitted++;
+    if (test_clock() < due) early++;
+    if (data->ts < last_ts[data->id]) inverted++;
+    last_ts[data->id] = data->ts;
+}
+
+static void test_push(reorder_t *r, sensor_ts_t base) {
+    // newest first, all within one second so only the clock releases them
+    for (int i = TEST_HELD - 1; i >= 0; i--) {
+        for (sensor_id_t id = 0; id < TEST_SENSORS; id++) {
+            sensor_data_t data = {.id = id, .value = 20.0 + i, .ts = base + i * 2 / TEST_HELD};
+            reorder_push(r, &data, &test_emit, NULL);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int lag = argc > 1 ? atoi(argv[1]) : 2;
+    char dir[] = "/tmp/reorder_test.XXXXXX", path[64];
+    reorder_t *r;
+    snapshot_t *snap;
+    snapshot_map_t *map;
+    if (lag < 1 || mkdtemp(dir) == NULL) {
+        fprintf(stderr, "Usage: %s [lag]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    snprintf(path, sizeof(path), "%s/snap", dir);
+    sensor_ts_t base = time(NULL);
+    if (reorder_create(&r, TEST_WINDOW, lag) != REORDER_NO_ERROR) return EXIT_FAILURE;
+    test_push(r, base);
+    if (snapshot_create(&snap, path, 1, 0) != SNAPSHOT_NO_ERROR) return EXIT_FAILURE;
+    reorder_save(r, snap);
+    if (snapshot_commit(&snap) != SNAPSHOT_NO_ERROR) return EXIT_FAILURE;
+    reorder_free(&r);
+
+    // a restart some time later: the old clock is long gone
+    if (reorder_create(&r, TEST_WINDOW, lag) != REORDER_NO_ERROR || snapshot_open(&map, path) != SNAPSHOT_NO_ERROR) {
+        return EXIT_FAILURE;
+    }
+    uint32_t tag;
+    const void *data;
+    size_t len;
+    int fail = 0;
+    uint64_t start = test_clock();
+    due = start + (uint64_t) lag * 1000;
+    while (snapshot_next(map, &tag, &data, &len)) {
+        if (tag == SNAPSHOT_REORDER && reorder_load(r, data, len, &test_emit, NULL) != REORDER_NO_ERROR) fail = 1;
+    }
+    snapshot_close(&map);
+    // the log replayed after the snapshot: retransmissions of the held readings and a newer one
+    test_push(r, base);
+    for (sensor_id_t id = 0; id < TEST_SENSORS; id++) {
+        sensor_data_t data = {.id = id, .value = 99.0, .ts = base + 1};
+        reorder_push(r, &data, &test_emit, NULL);
+    }
+    int wait;
+    while ((wait = reorder_expire(r, test_clock(), &test_emit, NULL)) >= 0 && test_clock() < due + TEST_SLACK_MS) {
+        usleep((useconds_t) (wait > 10 ? 10 : wait) * 1000);
+    }
+    reorder_stats_t st;
+    reorder_get_stats(r, &st);
+    printf("%d records emitted %"PRIu64" ms after the restore, %d before the lag of %d s, %"PRIu64" still held, "
+           "%"PRIu64" duplicates\n", emitted, test_clock() - start, early, lag, st.held, st.duplicates);
+    reorder_free(&r);
+    unlink(path);
+    rmdir(dir);
+    if (fail) {
+        fprintf(stderr, "FAIL: the snapshot section wasn't restored\n");
+        return EXIT_FAILURE;
+    }
+    if (early > 0) {
+        fprintf(stderr, "FAIL: %d restored or replayed records left the window before the lag\n", early);
+        return EXIT_FAILURE;
+    }
+    if (st.held > 0 || emitted != TEST_SENSORS * (TEST_HELD + 1) || st.duplicates != TEST_SENSORS * TEST_HELD) {
+        fprintf(stderr, "FAIL: %d records emitted, %d expected\n", emitted, TEST_SENSORS * (TEST_HELD + 1));
+        return EXIT_FAILURE;
+    }
+    if (inverted > 0) {
+        fprintf(stderr, "FAIL: %d records emitted out of ts order\n", inverted);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,401 @@
+/*
+ * Replays a recorded record file (a sensor_data_recv output file, or a
+ * capture of the wire stream, which has the same layout) against a running
+ * server. Every sensor gets its own connection, opened on its first record
+ * like a real sensor, and the records are sent in file order at the times
+ * their ts give, scaled by the speed factor; records sharing a ts second
+ * are spread evenly over it. Speed 0 sends as fast as the server takes it.
+ * The records a retention (retain.h) deleted from the file are skipped.
+ *
+ * With -Q the server's query listener (see query.h) is asked how many
+ * records of every replayed sensor are stored before and after the replay:
+ * what was sent but never stored was dropped by the server (duplicates,
+ * rate limits, flood drops, late records) or is still in flight. That takes
+ * one extra pass over the file and one scan of the output per sensor.
+ *
+ * Usage: replay [-x speed] [-c connections] [-Q port] [-w ms] file ip port
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "query.h"
+#include "retain.h"
+
+#define REPLAY_BUF_BYTES    (512 * SENSOR_DATA_WIRE_SIZE)   // records buffered per connection
+#define REPLAY_GROUP_MAX    (1 << 20)   // records of one ts second spread at most, the rest is sent at once
+#define REPLAY_FLUSH_EVERY  4096        // records queued between flushes of all connections at full speed
+#define REPLAY_SENSORS      (UINT16_MAX + 1)
+#define REPLAY_QUERIES      256         // query requests in flight
+
+#define REPLAY_UNUSED   (-1)    // no record for this connection yet
+#define REPLAY_CLOSED   (-2)    // the server closed it, its records are lost
+
+typedef struct {
+    int fd;
+    int dirty;                  // in the dirty list
+    uint32_t len;
+    unsigned char *buf;
+} replay_conn_t;
+
+typedef struct {
+    uint64_t sent;              // records queued, the ones lost on a closed connection are not counted
+    sensor_ts_t from, to;       // ts range in the file
+    uint64_t before;            // records stored by the server before the replay
+} replay_sensor_t;
+
+static struct addrinfo *server;
+static replay_conn_t *conns;
+static int nconns;
+static int *dirty;
+static int ndirty;
+static replay_sensor_t *sensors;
+static uint64_t lost, failed, opened, stalled_ns;
+
+
+static uint64_t replay_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t ns) {
+    struct timespec ts = {.tv_sec = (time_t) (ns / 1000000000), .tv_nsec = (long) (ns % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+static void replay_drop(replay_conn_t *c) {
+    // the server closed the connection: what is buffered never arrives
+    lost += c->len / SENSOR_DATA_WIRE_SIZE;
+    c->len = 0;
+    if (c->fd >= 0) close(c->fd);
+    c->fd = REPLAY_CLOSED;
+    failed++;
+}
+
+static int replay_connect(replay_conn_t *c) {
+    int fd = socket(server->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, server->ai_addr, server->ai_addrlen) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->fd = fd;
+    c->buf = malloc(REPLAY_BUF_BYTES);
+    if (c->buf == NULL) {
+        close(fd);
+        c->fd = REPLAY_UNUSED;
+        return -1;
+    }
+    opened++;
+    return 0;
+}
+
+/*
+ * Sends what the socket takes without blocking, or everything with 'wait';
+ * returns the bytes still buffered.
+ */
+static uint32_t replay_send(replay_conn_t *c, int wait) {
+    uint32_t done = 0;
+    while (done < c->len) {
+        ssize_t n = send(c->fd, c->buf + done, c->len - done, MSG_NOSIGNAL);
+        if (n > 0) {
+            done += (uint32_t) n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait) break;
+            // the server stopped reading (backpressure or a paused connection)
+            struct pollfd p = {.fd = c->fd, .events = POLLOUT};
+            uint64_t start = replay_now();
+            poll(&p, 1, -1);
+            stalled_ns += replay_now() - start;
+            continue;
+        }
+        c->len -= done;
+        replay_drop(c);
+        return 0;
+    }
+    memmove(c->buf, c->buf + done, c->len - done);
+    c->len -= done;
+    return c->len;
+}
+
+static void replay_flush(int wait) {
+    int kept = 0;
+    for (int i = 0; i < ndirty; i++) {
+        replay_conn_t *c = &conns[dirty[i]];
+        if (c->fd >= 0 && replay_send(c, wait) > 0) dirty[kept++] = dirty[i];
+        else c->dirty = 0;
+    }
+    ndirty = kept;
+}
+
+static void replay_queue(const sensor_data_t *data) {
+    replay_conn_t *c = &conns[data->id % nconns];
+    if (c->fd == REPLAY_UNUSED && replay_connect(c) != 0) {
+        fprintf(stderr, "Cannot connect for sensor %"PRIu16": %s\n", data->id, strerror(errno));
+        c->fd = REPLAY_CLOSED;
+        failed++;
+    }
+    if (c->fd == REPLAY_CLOSED) {
+        lost++;
+        return;
+    }
+    if (c->len + SENSOR_DATA_WIRE_SIZE > REPLAY_BUF_BYTES && replay_send(c, 0) + SENSOR_DATA_WIRE_SIZE >
+                                                               REPLAY_BUF_BYTES) {
+        replay_send(c, 1);
+    }
+    if (c->fd == REPLAY_CLOSED) {
+        lost++;
+        return;
+    }
+    sensor_data_pack(c->buf + c->len, data);
+    c->len += SENSOR_DATA_WIRE_SIZE;
+    sensors[data->id].sent++;
+    if (!c->dirty) {
+        c->dirty = 1;
+        dirty[ndirty++] = (int) (c - conns);
+    }
+}
+
+static int replay_read(FILE *f, sensor_data_t *data) {
+    unsigned char buf[SENSOR_DATA_WIRE_SIZE];
+    if (fread(buf, SENSOR_DATA_WIRE_SIZE, 1, f) != 1) return 0;
+    sensor_data_unpack(data, buf);
+    return 1;
+}
+
+static int replay_recv(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(fd, (char *) buf + done, len - done, 0);
+        if (n <= 0) return -1;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Asks the query listener for the number of stored records of every sensor
+ * in the file, over its ts range; requests are pipelined REPLAY_QUERIES at
+ * a time.
+ */
+static int replay_count(int port, uint64_t *counts) {
+    char service[16], host[NI_MAXHOST];
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *addr;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getnameinfo(server->ai_addr, server->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0 ||
+        getaddrinfo(host, service, &hints, &addr) != 0) return -1;
+    int fd = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(addr);
+        return -1;
+    }
+    freeaddrinfo(addr);
+    int ids[REPLAY_QUERIES], res = 0;
+    for (int id = 0; id < REPLAY_SENSORS && res == 0;) {
+        unsigned char req[REPLAY_QUERIES * QUERY_REQUEST_SIZE], *p = req;
+        int n = 0;
+        for (; id < REPLAY_SENSORS && n < REPLAY_QUERIES; id++) {
+            if (sensors[id].to < sensors[id].from) continue;
+            sensor_id_t sid = (sensor_id_t) id;
+            *p = QUERY_STATS;
+            memcpy(p + 1, &sid, sizeof(sid));
+            memcpy(p + 1 + sizeof(sid), &sensors[id].from, sizeof(sensor_ts_t));
+            memcpy(p + 1 + sizeof(sid) + sizeof(sensor_ts_t), &sensors[id].to, sizeof(sensor_ts_t));
+            p += QUERY_REQUEST_SIZE;
+            ids[n++] = id;
+        }
+        if (n > 0 && send(fd, req, (size_t) (p - req), MSG_NOSIGNAL) != p - req) res = -1;
+        for (int i = 0; i < n && res == 0; i++) {
+            // status, count, min, max, mean
+            unsigned char reply[1 + sizeof(uint64_t) + 3 * sizeof(double)];
+            res = replay_recv(fd, reply, sizeof(reply));
+            memcpy(&counts[ids[i]], reply + 1, sizeof(uint64_t));
+        }
+    }
+    close(fd);
+    return res;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-x speed] [-c connections] [-Q port] [-w ms] file ip port\n", name);
+    fprintf(stderr, "  -x: replay speed, 2 is twice as fast as recorded, 0 as fast as possible (default 1)\n");
+    fprintf(stderr, "  -c: connections, sensors share them by id; default one per sensor\n");
+    fprintf(stderr, "  -Q: query port of the server, counts the records it stored to report drops\n");
+    fprintf(stderr, "  -w: ms the server gets to write the last records before they are counted (default 3000)\n");
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    int query_port = 0, settle_ms = 3000, opt;
+    nconns = REPLAY_SENSORS;
+    while ((opt = getopt(argc, argv, "x:c:Q:w:h")) != -1) {
+        switch (opt) {
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'Q':
+                query_port = atoi(optarg);
+                break;
+            case 'w':
+                settle_ms = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 3 || speed < 0 || nconns < 1 || nconns > REPLAY_SENSORS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    if (getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &server) != 0) {
+        fprintf(stderr, "Invalid address %s:%s\n", argv[optind + 1], argv[optind + 2]);
+        return EXIT_FAILURE;
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    // a retained output file starts with the deleted records, zeros
+    uint64_t raw_start;
+    if (retain_read_start(argv[optind], &raw_start) != RETAIN_NO_ERROR ||
+        fseeko(f, (off_t) raw_start, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot read the retention state of %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    conns = calloc(nconns, sizeof(replay_conn_t));
+    dirty = malloc(sizeof(int) * nconns);
+    sensors = calloc(REPLAY_SENSORS, sizeof(replay_sensor_t));
+    sensor_data_t *group = malloc(sizeof(sensor_data_t) * REPLAY_GROUP_MAX);
+    uint64_t *after = calloc(REPLAY_SENSORS, sizeof(uint64_t));
+    if (conns == NULL || dirty == NULL || sensors == NULL || group == NULL || after == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < nconns; i++) conns[i].fd = REPLAY_UNUSED;
+    for (int id = 0; id < REPLAY_SENSORS; id++) {
+        sensors[id].from = 1;
+        sensors[id].to = 0;
+    }
+    sensor_data_t data = {0};
+    if (query_port != 0) {
+        // the ts range of every sensor, and what the server already stored of it
+        while (replay_read(f, &data)) {
+            replay_sensor_t *s = &sensors[data.id];
+            if (s->to < s->from) s->from = s->to = data.ts;
+            else if (data.ts < s->from) s->from = data.ts;
+            else if (data.ts > s->to) s->to = data.ts;
+        }
+        fseeko(f, (off_t) raw_start, SEEK_SET);
+        if (replay_count(query_port, after) != 0) {
+            fprintf(stderr, "Cannot query the server on port %d\n", query_port);
+            return EXIT_FAILURE;
+        }
+        for (int id = 0; id < REPLAY_SENSORS; id++) sensors[id].before = after[id];
+    }
+
+    uint64_t records = 0, start = replay_now(), late_ns = 0;
+    int more = replay_read(f, &data);
+    sensor_ts_t ts0 = data.ts;
+    while (more) {
+        // the next ts second: every record up to it in file order
+        sensor_ts_t ts = data.ts;
+        int n = 0;
+        do group[n++] = data;
+        while ((more = replay_read(f, &data)) && data.ts <= ts && n < REPLAY_GROUP_MAX);
+        uint64_t window = speed > 0 ? (uint64_t) (1e9 / speed) : 0;
+        uint64_t due = speed > 0 && ts > ts0 ? start + (uint64_t) ((double) (ts - ts0) * 1e9 / speed) : start;
+        for (int i = 0; i < n; i++) {
+            if (speed > 0) {
+                uint64_t at = due + window * (uint64_t) i / (uint64_t) n, now = replay_now();
+                if (at > now) {
+                    replay_flush(0);
+                    replay_sleep_until(at);
+                } else if (now - at > late_ns) late_ns = now - at;
+            }
+            replay_queue(&group[i]);
+            if (++records % REPLAY_FLUSH_EVERY == 0) replay_flush(0);
+        }
+        if (speed > 0) replay_flush(0);
+    }
+    replay_flush(1);
+    uint64_t elapsed = replay_now() - start;
+    fclose(f);
+    // the server sees the hang-ups and reads up to them
+    for (int i = 0; i < nconns; i++) {
+        if (conns[i].fd >= 0) close(conns[i].fd);
+        free(conns[i].buf);
+    }
+
+    double secs = (double) elapsed / 1e9;
+    uint64_t sent = records - lost;
+    printf("replayed    %"PRIu64" records in %.3f s at speed %g, %"PRIu64" connections\n", records, secs, speed,
+           opened);
+    printf("throughput  %.0f records/s, %.2f MB/s\n", secs > 0 ? (double) sent / secs : 0,
+           secs > 0 ? (double) sent * SENSOR_DATA_WIRE_SIZE / secs / 1e6 : 0);
+    printf("behind      %.3f ms at most behind schedule, %.3f ms blocked on full sockets\n", (double) late_ns / 1e6,
+           (double) stalled_ns / 1e6);
+    printf("failed      %"PRIu64" connections refused or closed by the server, %"PRIu64" records not sent\n", failed,
+           lost);
+    if (query_port != 0) {
+        usleep((useconds_t) settle_ms * 1000);
+        if (replay_count(query_port, after) != 0) {
+            fprintf(stderr, "Cannot query the server on port %d\n", query_port);
+            return EXIT_FAILURE;
+        }
+        uint64_t stored = 0, dropped = 0;
+        int worst = -1, nworse = 0;
+        for (int id = 0; id < REPLAY_SENSORS; id++) {
+            uint64_t got = after[id] - sensors[id].before;
+            stored += got;
+            if (got >= sensors[id].sent) continue;
+            dropped += sensors[id].sent - got;
+            nworse++;
+            if (worst < 0 || sensors[id].sent - got > sensors[worst].sent - (after[worst] - sensors[worst].before)) {
+                worst = id;
+            }
+        }
+        printf("stored      %"PRIu64" records, %"PRIu64" dropped by the server (%.2f%%) over %d sensors", stored,
+               dropped, sent ? 100.0 * (double) dropped / (double) sent : 0, nworse);
+        if (worst >= 0) {
+            printf(", most of sensor %d (%"PRIu64" of %"PRIu64")", worst,
+                   sensors[worst].sent - (after[worst] - sensors[worst].before), sensors[worst].sent);
+        }
+        printf("\n");
+    }
+    freeaddrinfo(server);
+    free(conns);
+    free(dirty);
+    free(sensors);
+    free(group);
+    free(after);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "retain.h"
+
+#define RETAIN_MAGIC        "CMRETAN1"
+#define RETAIN_OUT_AGGS     4096    // closed buckets buffered per tier before they are appended
+#define RETAIN_SENSORS      (UINT16_MAX + 1)
+#define RETAIN_PAGE         4096    // holes are punched in whole pages
+
+/*
+ * The state file: this header, then the open buckets of the minute tier
+ * and those of the hour tier.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t consumed;          // bytes of the record file rolled up
+    uint64_t raw_start;         // first byte of the record file kept
+    uint64_t sizes[RETAIN_TIERS];
+    sensor_ts_t horizon;
+    sensor_ts_t newest;
+    uint32_t open[RETAIN_TIERS];
+} retain_state_t;
+
+static const sensor_ts_t retain_span[RETAIN_TIERS] = {60, 3600};
+static const char *retain_suffix[RETAIN_TIERS] = {".1m", ".1h"};
+
+struct retain {
+    retain_config_t config;
+    char *path;
+    char *tier_paths[RETAIN_TIERS];
+    char *state_path;
+    char *state_tmp;
+    int fd;                     // the record file, opened once it exists
+    int tier_fd[RETAIN_TIERS];
+    retain_agg_t *open[RETAIN_TIERS];   // per sensor id, count 0 for none
+    retain_agg_t *out[RETAIN_TIERS];
+    size_t nout[RETAIN_TIERS];
+    unsigned char *chunk;
+    retain_state_t state;
+    pthread_mutex_t lock;       // raw_start and horizon, read by the query service
+    pthread_t thread;
+    int efd;                    // wakes the thread to stop
+    _Atomic int stopping;
+    uint64_t debt_us;           // pacing owed for what was read
+    uint64_t punched;           // holes are punched up to here, 0 after a start to redo what a crash left
+    uint64_t restored;          // raw_start of the restored state, deleted by an earlier run
+    retain_stats_t stats;
+};
+
+
+static void *retain_run(void *arg);
+
+static void retain_round(retain_t *r, int final);
+
+
+static char *retain_name(const char *path, const char *suffix) {
+    size_t len = strlen(path) + strlen(suffix) + 1;
+    char *name = malloc(len);
+    if (name != NULL) snprintf(name, len, "%s%s", path, suffix);
+    return name;
+}
+
+static int retain_write_all(int fd, const void *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *) data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+static ssize_t retain_read_at(int fd, void *data, size_t len, uint64_t offset) {
+    ssize_t n;
+    do n = pread(fd, data, len, (off_t) offset);
+    while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static inline sensor_ts_t retain_floor(sensor_ts_t ts, sensor_ts_t span) {
+    sensor_ts_t m = ts % span;
+    return ts - (m < 0 ? m + span : m);
+}
+
+static void retain_free_all(retain_t *r) {
+    for (int t = 0; t < RETAIN_TIERS; t++) {
+        if (r->tier_fd[t] >= 0) close(r->tier_fd[t]);
+        free(r->tier_paths[t]);
+        free(r->open[t]);
+        free(r->out[t]);
+    }
+    if (r->fd >= 0) close(r->fd);
+    if (r->efd >= 0) close(r->efd);
+    free(r->path);
+    free(r->state_path);
+    free(r->state_tmp);
+    free(r->chunk);
+    free(r);
+}
+
+/*
+ * Restores the progress of the last run: tiers cut back to the sizes the
+ * state recorded, open buckets reloaded. Without a state everything starts
+ * over from the first record.
+ */
+static int retain_load(retain_t *r) {
+    int fd = open(r->state_path, O_RDONLY | O_CLOEXEC);
+    memset(&r->state, 0, sizeof(r->state));
+    memcpy(r->state.magic, RETAIN_MAGIC, sizeof(r->state.magic));
+    if (fd >= 0) {
+        retain_state_t st;
+        int ok = retain_read_at(fd, &st, sizeof(st), 0) == sizeof(st) &&
+                 memcmp(st.magic, RETAIN_MAGIC, sizeof(st.magic)) == 0;
+        uint64_t offset = sizeof(st);
+        for (int t = 0; ok && t < RETAIN_TIERS; t++) {
+            for (uint32_t i = 0; ok && i < st.open[t]; i++) {
+                retain_agg_t agg;
+                ok = retain_read_at(fd, &agg, sizeof(agg), offset) == sizeof(agg);
+                offset += sizeof(agg);
+                if (ok) r->open[t][agg.id] = agg;
+            }
+        }
+        close(fd);
+        if (!ok) return RETAIN_FILE_ERROR;
+        r->state = st;
+        r->restored = st.raw_start / RETAIN_PAGE * RETAIN_PAGE;
+    }
+    for (int t = 0; t < RETAIN_TIERS; t++) {
+        struct stat sb;
+        if (fstat(r->tier_fd[t], &sb) != 0) return RETAIN_FILE_ERROR;
+        // a tier shorter than recorded lost synced data: the state is of another file
+        if ((uint64_t) sb.st_size < r->state.sizes[t]) return RETAIN_FILE_ERROR;
+        if (ftruncate(r->tier_fd[t], (off_t) r->state.sizes[t]) != 0) return RETAIN_FILE_ERROR;
+    }
+    return RETAIN_NO_ERROR;
+}
+
+static int retain_save(retain_t *r) {
+    for (int t = 0; t < RETAIN_TIERS; t++) {
+        r->state.open[t] = 0;
+        for (int id = 0; id < RETAIN_SENSORS; id++) r->state.open[t] += r->open[t][id].count > 0;
+    }
+    int fd = open(r->state_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return RETAIN_FILE_ERROR;
+    int res = retain_write_all(fd, &r->state, sizeof(r->state));
+    for (int t = 0; res == 0 && t < RETAIN_TIERS; t++) {
+        for (int id = 0; res == 0 && id < RETAIN_SENSORS; id++) {
+            if (r->open[t][id].count > 0) res = retain_write_all(fd, &r->open[t][id], sizeof(retain_agg_t));
+        }
+    }
+    if (res == 0) res = fsync(fd);
+    close(fd);
+    if (res != 0 || rename(r->state_tmp, r->state_path) != 0) {
+        unlink(r->state_tmp);
+        return RETAIN_FILE_ERROR;
+    }
+    return RETAIN_NO_ERROR;
+}
+
+
+void retain_config_init(retain_config_t *c) {
+    c->path = NULL;
+    c->raw_age = 7 * 86400;
+    c->grace = 120;
+    c->interval = 10;
+    c->io_rate = 16u << 20;
+}
+
+
+int retain_create(retain_t **retain, const retain_config_t *config) {
+    retain_t *r = calloc(1, sizeof(retain_t));
+    if (r == NULL) return RETAIN_MEMORY_ERROR;
+    r->fd = r->efd = -1;
+    for (int t = 0; t < RETAIN_TIERS; t++) r->tier_fd[t] = -1;
+    r->config = *config;
+    if (r->config.grace < 0) r->config.grace = 0;
+    if (r->config.interval < 1) r->config.interval = 1;
+    // every bucket a deleted record fell in must be closed by then
+    if (r->config.raw_age < RETAIN_MIN_AGE) r->config.raw_age = RETAIN_MIN_AGE;
+    if (r->config.raw_age < r->config.grace + retain_span[RETAIN_HOUR]) {
+        r->config.raw_age = r->config.grace + (int) retain_span[RETAIN_HOUR];
+    }
+    r->path = strdup(config->path);
+    r->state_path = retain_name(config->path, ".retain");
+    r->state_tmp = retain_name(config->path, ".retain.tmp");
+    r->chunk = malloc(RETAIN_CHUNK_BYTES);
+    int ok = r->path != NULL && r->state_path != NULL && r->state_tmp != NULL && r->chunk != NULL;
+    for (int t = 0; ok && t < RETAIN_TIERS; t++) {
+        r->tier_paths[t] = retain_name(config->path, retain_suffix[t]);
+        r->open[t] = calloc(RETAIN_SENSORS, sizeof(retain_agg_t));
+        r->out[t] = malloc(sizeof(retain_agg_t) * RETAIN_OUT_AGGS);
+        ok = r->tier_paths[t] != NULL && r->open[t] != NULL && r->out[t] != NULL;
+    }
+    if (!ok) {
+        retain_free_all(r);
+        return RETAIN_MEMORY_ERROR;
+    }
+    for (int t = 0; t < RETAIN_TIERS; t++) {
+        r->tier_fd[t] = open(r->tier_paths[t], O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (r->tier_fd[t] < 0) {
+            retain_free_all(r);
+            return RETAIN_FILE_ERROR;
+        }
+    }
+    if (retain_load(r) != RETAIN_NO_ERROR) {
+        retain_free_all(r);
+        return RETAIN_FILE_ERROR;
+    }
+    for (int t = 0; t < RETAIN_TIERS; t++) lseek(r->tier_fd[t], 0, SEEK_END);
+    pthread_mutex_init(&r->lock, NULL);
+    atomic_store(&r->stopping, 0);
+    r->efd = eventfd(0, EFD_CLOEXEC);
+    if (r->efd < 0 || pthread_create(&r->thread, NULL, &retain_run, r) != 0) {
+        pthread_mutex_destroy(&r->lock);
+        retain_free_all(r);
+        return RETAIN_MEMORY_ERROR;
+    }
+    *retain = r;
+    return RETAIN_NO_ERROR;
+}
+
+
+void retain_free(retain_t **retain, retain_stats_t *stats) {
+    if (retain == NULL || *retain == NULL) return;
+    retain_t *r = *retain;
+    atomic_store(&r->stopping, 1);
+    uint64_t one = 1;
+    if (write(r->efd, &one, sizeof(one)) < 0) {}
+    pthread_join(r->thread, NULL);
+    if (stats != NULL) *stats = r->stats;
+    pthread_mutex_destroy(&r->lock);
+    retain_free_all(r);
+    *retain = NULL;
+}
+
+
+int retain_read_start(const char *path, uint64_t *raw_start) {
+    retain_state_t st;
+    char *state_path = retain_name(path, ".retain");
+    if (state_path == NULL) return RETAIN_MEMORY_ERROR;
+    int fd = open(state_path, O_RDONLY | O_CLOEXEC), missing = fd < 0 && errno == ENOENT;
+    free(state_path);
+    *raw_start = 0;
+    // without a state nothing was deleted
+    if (fd < 0) return missing ? RETAIN_NO_ERROR : RETAIN_FILE_ERROR;
+    int ok = retain_read_at(fd, &st, sizeof(st), 0) == sizeof(st) &&
+             memcmp(st.magic, RETAIN_MAGIC, sizeof(st.magic)) == 0;
+    close(fd);
+    if (!ok) return RETAIN_FILE_ERROR;
+    *raw_start = st.raw_start / SENSOR_DATA_WIRE_SIZE * SENSOR_DATA_WIRE_SIZE;
+    return RETAIN_NO_ERROR;
+}
+
+
+void retain_horizon(retain_t *r, uint64_t *raw_start, sensor_ts_t *horizon) {
+    pthread_mutex_lock(&r->lock);
+    *raw_start = r->state.raw_start;
+    *horizon = r->state.horizon;
+    pthread_mutex_unlock(&r->lock);
+}
+
+
+const char *retain_tier_path(retain_t *r, int tier) {
+    return r->tier_paths[tier];
+}
+
+
+static void *retain_run(void *arg) {
+    retain_t *r = (retain_t *) arg;
+    while (!atomic_load(&r->stopping)) {
+        retain_round(r, 0);
+        struct pollfd p = {.fd = r->efd, .events = POLLIN};
+        poll(&p, 1, r->config.interval * 1000);
+    }
+    // what the writer flushed before it stopped is rolled up too
+    retain_round(r, 1);
+    return NULL;
+}
+
+/*
+ * Sleeps for the reads of 'bytes' at the configured rate; stopping ends
+ * the pacing, the last round runs at full speed.
+ */
+static void retain_pace(retain_t *r, size_t bytes) {
+    if (r->config.io_rate == 0 || atomic_load(&r->stopping)) return;
+    r->debt_us += (uint64_t) bytes * 1000000 / r->config.io_rate;
+    if (r->debt_us < 10000) return;
+    struct pollfd p = {.fd = r->efd, .events = POLLIN};
+    poll(&p, 1, (int) (r->debt_us / 1000));
+    r->debt_us %= 1000;
+}
+
+static void retain_append(retain_t *r, int t) {
+    size_t len = sizeof(retain_agg_t) * r->nout[t];
+    // a failed append is retried with the next round, the state still has the old size
+    if (len == 0 || retain_write_all(r->tier_fd[t], r->out[t], len) != 0) return;
+    r->state.sizes[t] += len;
+    r->stats.aggregates[t] += r->nout[t];
+    r->nout[t] = 0;
+}
+
+static void retain_emit(retain_t *r, int t, retain_agg_t *b) {
+    if (r->nout[t] == RETAIN_OUT_AGGS) retain_append(r, t);
+    if (r->nout[t] == RETAIN_OUT_AGGS) return;     // the tier can't be written: the bucket stays open
+    r->out[t][r->nout[t]++] = *b;
+    b->count = 0;
+}
+
+static void retain_roll(retain_t *r, const sensor_data_t *data) {
+    for (int t = 0; t < RETAIN_TIERS; t++) {
+        retain_agg_t *b = &r->open[t][data->id];
+        sensor_ts_t start = retain_floor(data->ts, retain_span[t]);
+        if (b->count > 0 && b->start != start) retain_emit(r, t, b);
+        // a tier that can't be written only loses this record, its open bucket stays intact
+        if (b->count > 0 && b->start != start) continue;
+        if (b->count == 0) {
+            *b = (retain_agg_t) {.id = data->id, .count = 1, .start = start, .min = data->value,
+                    .max = data->value, .sum = data->value};
+            continue;
+        }
+        if (data->value < b->min) b->min = data->value;
+        if (data->value > b->max) b->max = data->value;
+        b->sum += data->value;
+        b->count++;
+    }
+    if (data->ts > r->state.newest || r->stats.rolled == 0) r->state.newest = data->ts;
+    r->stats.rolled++;
+}
+
+/*
+ * Moves the start of the raw records past those older than 'cutoff', up to
+ * the first newer one; the pages before it are punched out once the new
+ * start is saved (retain_punch()).
+ */
+static void retain_delete(retain_t *r, sensor_ts_t cutoff) {
+    uint64_t start = r->state.raw_start;
+    int done = 0;
+    while (!done && start < r->state.consumed) {
+        size_t want = r->state.consumed - start < RETAIN_CHUNK_BYTES ? (size_t) (r->state.consumed - start) :
+                      RETAIN_CHUNK_BYTES;
+        ssize_t n = retain_read_at(r->fd, r->chunk, want, start);
+        if (n < (ssize_t) SENSOR_DATA_WIRE_SIZE) break;
+        for (size_t pos = 0; pos + SENSOR_DATA_WIRE_SIZE <= (size_t) n; pos += SENSOR_DATA_WIRE_SIZE) {
+            sensor_data_t data;
+            sensor_data_unpack(&data, r->chunk + pos);
+            if (data.ts >= cutoff) {
+                done = 1;
+                break;
+            }
+            start += SENSOR_DATA_WIRE_SIZE;
+        }
+        retain_pace(r, (size_t) n);
+    }
+    pthread_mutex_lock(&r->lock);
+    r->state.raw_start = start;
+    r->state.horizon = cutoff;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Punches out the pages before the saved start of the raw records, so a
+ * reader going by the state (retain_read_start()) never reads a hole. The
+ * first punch after a start covers the whole prefix again: a run stopped
+ * between saving and punching left it allocated, the existing holes cost
+ * nothing.
+ */
+static void retain_punch(retain_t *r) {
+    uint64_t to = r->state.raw_start / RETAIN_PAGE * RETAIN_PAGE;
+    if (to <= r->punched) return;
+    if (fallocate(r->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) r->punched,
+                  (off_t) (to - r->punched)) != 0) {
+        return;
+    }
+    uint64_t from = r->punched > r->restored ? r->punched : r->restored;
+    if (to > from) r->stats.deleted += to - from;
+    r->punched = to;
+}
+
+static void retain_round(retain_t *r, int final) {
+    if (r->fd < 0) r->fd = open(r->path, O_RDWR | O_CLOEXEC);
+    if (r->fd < 0) return;
+    struct stat sb;
+    if (fstat(r->fd, &sb) != 0) return;
+    uint64_t end = (uint64_t) sb.st_size / SENSOR_DATA_WIRE_SIZE * SENSOR_DATA_WIRE_SIZE;
+    while (r->state.consumed < end && (final || !atomic_load(&r->stopping))) {
+        size_t want = end - r->state.consumed < RETAIN_CHUNK_BYTES ? (size_t) (end - r->state.consumed) :
+                      RETAIN_CHUNK_BYTES;
+        ssize_t n = retain_read_at(r->fd, r->chunk, want, r->state.consumed);
+        if (n < (ssize_t) SENSOR_DATA_WIRE_SIZE) break;
+        n -= n % (ssize_t) SENSOR_DATA_WIRE_SIZE;
+        for (size_t pos = 0; pos < (size_t) n; pos += SENSOR_DATA_WIRE_SIZE) {
+            sensor_data_t data;
+            sensor_data_unpack(&data, r->chunk + pos);
+            retain_roll(r, &data);
+        }
+        r->state.consumed += (uint64_t) n;
+        retain_pace(r, (size_t) n);
+    }
+    // buckets the data clock left behind by the grace period are complete
+    for (int t = 0; t < RETAIN_TIERS; t++) {
+        for (int id = 0; id < RETAIN_SENSORS; id++) {
+            retain_agg_t *b = &r->open[t][id];
+            if (b->count > 0 && b->start + retain_span[t] + r->config.grace <= r->state.newest) retain_emit(r, t, b);
+        }
+        retain_append(r, t);
+        if (fdatasync(r->tier_fd[t]) != 0) return;
+    }
+    // the tiers are durable before the raw records they replace go; on an hour boundary no bucket of
+    // either tier holds records from both sides of the horizon
+    if (r->stats.rolled > 0 || r->state.consumed > 0) {
+        sensor_ts_t cutoff = retain_floor(r->state.newest - r->config.raw_age, retain_span[RETAIN_HOUR]);
+        if (cutoff > r->state.horizon) retain_delete(r, cutoff);
+    }
+    if (retain_save(r) == RETAIN_NO_ERROR) retain_punch(r);
+    r->stats.rounds++;
+}
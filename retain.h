@@ -0,0 +1,115 @@
+#ifndef __RETAIN_H__
+#define __RETAIN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+
+#define RETAIN_NO_ERROR         0
+#define RETAIN_MEMORY_ERROR     1  // mem alloc error
+#define RETAIN_FILE_ERROR       2  // a tier or the state file can't be opened, or the state is corrupt
+
+#define RETAIN_MINUTE           0   // 1 minute aggregates
+#define RETAIN_HOUR             1   // 1 hour aggregates
+#define RETAIN_TIERS            2
+
+#define RETAIN_MIN_AGE          (2 * 3600)  // raw records are kept at least this long, see below
+#define RETAIN_HOUR_QUERY       86400       // ranges longer than this are answered from the hour tier
+#define RETAIN_CHUNK_BYTES      (4096 * SENSOR_DATA_WIRE_SIZE)  // raw bytes read at once
+
+/*
+ * Retention of the record file (the writer output): a background thread
+ * follows the file as it grows and rolls every record into a 1 minute and
+ * a 1 hour aggregate of its sensor, appended to '<path>.1m' and '<path>.1h'
+ * once the bucket is closed. Raw records older than the raw age are then
+ * deleted from the file by punching holes in it, so it keeps its offsets
+ * but no longer its blocks: the record file then has a deleted prefix that
+ * reads back as zeros. Every reader of the file starts at the offset
+ * retain_read_start() returns (the query service, compact.h, replay), the
+ * running query service answers the older part of a range from a tier
+ * (query_set_retain()). The holes are punched only after the new start is
+ * saved, so the saved start never points into a hole.
+ *
+ * Ages are measured on the data clock, the newest ts read, not the wall
+ * clock, so a replayed file ages like the original. The horizon, the ts
+ * below which raw records go, is always on an hour boundary. A bucket closes once the
+ * data clock passed its end by the grace period; a record arriving for a
+ * closed bucket gets a bucket of its own with the same start, a reader
+ * sums all aggregates of a bucket. The raw age is at least RETAIN_MIN_AGE
+ * so every bucket of a deleted record is closed and in its tier.
+ *
+ * Progress (the consumed offset, the tier sizes and the open buckets) goes
+ * to '<path>.retain' after the tiers are synced, every round; a restart
+ * truncates the tiers to it and continues, nothing is counted twice.
+ * Reads of the record file are paced to 'io_rate' bytes per second.
+ */
+
+typedef struct {
+    sensor_id_t id;
+    uint16_t reserved;
+    uint32_t count;
+    sensor_ts_t start;          // ts of the start of the bucket, a multiple of its span
+    double min, max, sum;
+} retain_agg_t;
+
+typedef struct retain retain_t;
+
+typedef struct {
+    const char *path;           // record file
+    int raw_age;                // seconds of raw records kept, raised to RETAIN_MIN_AGE
+    int grace;                  // seconds a bucket stays open after its end, for late records
+    int interval;               // seconds between rounds
+    size_t io_rate;             // bytes read per second, 0 is unlimited
+} retain_config_t;
+
+typedef struct {
+    uint64_t rolled;            // records rolled up
+    uint64_t aggregates[RETAIN_TIERS];
+    uint64_t deleted;           // bytes of raw records deleted
+    uint64_t rounds;
+} retain_stats_t;
+
+
+void retain_config_init(retain_config_t *config);
+/*
+ * Fills 'config' with the defaults: a 7 day raw age, 120 s grace, a round
+ * every 10 s and 16 MB/s; 'path' still has to be set.
+ */
+
+
+int retain_create(retain_t **retain, const retain_config_t *config);
+
+/* Restores the progress of 'config->path' and starts the retention thread
+ * If memory allocation or the thread creation fails, RETAIN_MEMORY_ERROR is returned
+ * If a tier or the state can't be opened, RETAIN_FILE_ERROR is returned
+ */
+
+
+void retain_free(retain_t **retain, retain_stats_t *stats);
+
+/* Runs a last round over what was written until now, stops the thread, copies the counters to 'stats' if
+ * not NULL, frees all memory and sets '*retain' to NULL
+ */
+
+
+int retain_read_start(const char *path, uint64_t *raw_start);
+
+/* Returns in '*raw_start' the byte offset of the first raw record kept in the record file 'path', read from
+ * the state '<path>.retain' of its retention, 0 if it has none; needs no retain_t, e.g. for offline readers
+ * If memory allocation fails, RETAIN_MEMORY_ERROR is returned
+ * If the state can't be read or is corrupt, RETAIN_FILE_ERROR is returned
+ */
+
+
+void retain_horizon(retain_t *retain, uint64_t *raw_start, sensor_ts_t *horizon);
+/* Returns the byte offset of the first raw record kept and the ts below which raw records may be deleted;
+ * every record from 'horizon' on is still in the raw file. Safe from any thread.
+ */
+
+
+const char *retain_tier_path(retain_t *retain, int tier);
+/* Returns the aggregate file of 'tier', RETAIN_MINUTE or RETAIN_HOUR
+ */
+
+
+#endif  //__RETAIN_H__
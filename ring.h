@@ -0,0 +1,77 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Bounded single-producer single-consumer queue of fixed size elements.
+ * Lock free: the producer only writes 'tail', the consumer only writes
+ * 'head', each on its own cache line. The capacity is a power of two.
+ */
+
+#define RING_CACHE_LINE 64
+
+typedef struct {
+    _Atomic uint32_t head;              // next slot to consume
+    char pad1[RING_CACHE_LINE - sizeof(uint32_t)];
+    _Atomic uint32_t tail;              // next slot to produce
+    char pad2[RING_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t mask;
+    uint32_t elem_size;
+    unsigned char slots[];
+} ring_t;
+
+
+static inline ring_t *ring_create(uint32_t capacity, uint32_t elem_size) {
+    uint32_t size = 1;
+    while (size < capacity) size <<= 1;
+    ring_t *r = aligned_alloc(RING_CACHE_LINE,
+                              (sizeof(ring_t) + (size_t) size * elem_size + RING_CACHE_LINE - 1) /
+                              RING_CACHE_LINE * RING_CACHE_LINE);
+    if (r == NULL) return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->mask = size - 1;
+    r->elem_size = elem_size;
+    return r;
+}
+
+static inline void ring_free(ring_t **r) {
+    free(*r);
+    *r = NULL;
+}
+
+// Producer side: copies 'elem' into the ring, returns 0 if the ring is full
+static inline int ring_push(ring_t *r, const void *elem) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - head > r->mask) return 0;
+    memcpy(r->slots + (size_t) (tail & r->mask) * r->elem_size, elem, r->elem_size);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+// Consumer side: copies up to 'max' elements into 'out', returns the number copied
+static inline uint32_t ring_pop(ring_t *r, void *out, uint32_t max) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint32_t n = tail - head;
+    if (n > max) n = max;
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy((unsigned char *) out + (size_t) i * r->elem_size,
+               r->slots + (size_t) ((head + i) & r->mask) * r->elem_size, r->elem_size);
+    }
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+// Either side: number of queued elements (a snapshot)
+static inline uint32_t ring_count(ring_t *r) {
+    return atomic_load_explicit(&r->tail, memory_order_acquire) -
+           atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+#endif  //__RING_H__
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "rules.h"
+
+#define RULES_LINE_LEN      256
+#define RULES_PAGE_BITS     8
+#define RULES_PAGE_SIZE     (1 << RULES_PAGE_BITS)
+#define RULES_PAGES         ((UINT16_MAX + 1) / RULES_PAGE_SIZE)
+
+/*
+ * One compiled rule: every check is a comparison against a bound, disabled
+ * bounds are infinite so the checks never need to know which rules exist.
+ */
+typedef struct {
+    sensor_value_t above;
+    sensor_value_t below;
+    sensor_value_t rate;
+    uint32_t avg_n;                     // 0 disables the running average rule
+    uint32_t avg_m;
+    sensor_value_t avg_low;
+    sensor_value_t avg_high;
+} rule_t;
+
+typedef struct rules_table {
+    uint16_t slot[UINT16_MAX + 1];      // rule of every sensor id, slot 0 holds the '*' defaults
+    uint32_t nslots;
+    struct rules_table *retired;        // next replaced table still waiting to be freed
+    rule_t rules[];
+} rules_table_t;
+
+struct rules {
+    _Atomic(rules_table_t *) table;
+    _Atomic(rules_table_t *) pinned[RULES_MAX_READERS];    // table each evaluator is using, or NULL
+    _Atomic int used[RULES_MAX_READERS];
+    rules_table_t *retired;             // replaced tables, only touched by the loading thread
+};
+
+typedef struct {
+    sensor_value_t last;
+    sensor_ts_t last_ts;
+    uint32_t count;                     // readings seen, saturates at RULES_MAX_WINDOW
+    uint32_t pos;
+    uint32_t violations;                // bit i: the average was out of its band i readings ago
+    sensor_value_t window[RULES_MAX_WINDOW];
+} rules_sensor_t;
+
+struct rules_eval {
+    rules_t *rules;
+    int reader;
+    rules_table_t *table;
+    rules_sensor_t **pages[RULES_PAGES];
+};
+
+
+static rules_table_t *rules_table_create(uint32_t nslots);
+
+static int rules_parse(rule_t *rule, char *args);
+
+static rules_sensor_t *rules_sensor(rules_eval_t *eval, sensor_id_t id);
+
+static void rules_reclaim(rules_t *rules);
+
+static void rule_init(rule_t *rule) {
+    rule->above = INFINITY;
+    rule->below = -INFINITY;
+    rule->rate = INFINITY;
+    rule->avg_n = 0;
+    rule->avg_m = 0;
+    rule->avg_low = -INFINITY;
+    rule->avg_high = INFINITY;
+}
+
+
+int rules_create(rules_t **rules) {
+    rules_t *r = calloc(1, sizeof(rules_t));
+    if (r == NULL) return RULES_MEMORY_ERROR;
+    rules_table_t *t = rules_table_create(1);
+    if (t == NULL) {
+        free(r);
+        return RULES_MEMORY_ERROR;
+    }
+    rule_init(&t->rules[0]);
+    atomic_init(&r->table, t);
+    *rules = r;
+    return RULES_NO_ERROR;
+}
+
+
+void rules_free(rules_t **rules) {
+    if (rules == NULL || *rules == NULL) return;
+    // no evaluator is left, nothing is pinned anymore
+    rules_reclaim(*rules);
+    free(atomic_load(&(*rules)->table));
+    free(*rules);
+    *rules = NULL;
+}
+
+
+int rules_load(rules_t *rules, const char *path, int *line) {
+    char buf[RULES_LINE_LEN];
+    *line = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return RULES_FILE_ERROR;
+    rules_table_t *t = rules_table_create(1);
+    uint16_t *sensors = calloc(UINT16_MAX + 1, sizeof(uint16_t));
+    rule_t *compiled = malloc(sizeof(rule_t));
+    uint32_t nslots = 1, size = 1;
+    int res = (t == NULL || sensors == NULL || compiled == NULL) ? RULES_MEMORY_ERROR : RULES_NO_ERROR;
+    if (res == RULES_NO_ERROR) rule_init(&compiled[0]);
+    // the defaults first, so a sensor line extends them wherever the '*' line is
+    for (int pass = 0; pass < 2 && res == RULES_NO_ERROR; pass++) {
+        rewind(fp);
+        *line = 0;
+        while (res == RULES_NO_ERROR && fgets(buf, sizeof(buf), fp) != NULL) {
+            (*line)++;
+            char *comment = strchr(buf, '#');
+            if (comment != NULL) *comment = '\0';
+            char *rest, *who = strtok_r(buf, " \t\r\n", &rest);
+            if (who == NULL) continue;
+            if (strcmp(who, "*") == 0) {
+                if (pass == 0 && rules_parse(&compiled[0], rest) != 0) res = RULES_SYNTAX_ERROR;
+                continue;
+            }
+            char *end;
+            unsigned long id = strtoul(who, &end, 10);
+            if (*end != '\0' || id > UINT16_MAX) {
+                res = RULES_SYNTAX_ERROR;
+                continue;
+            }
+            if (pass == 0) continue;
+            if (sensors[id] == 0) {
+                // the slot index is 16 bits, one more sensor would wrap onto the defaults
+                if (nslots == RULES_MAX_SENSORS + 1) {
+                    res = RULES_LIMIT_ERROR;
+                    continue;
+                }
+                if (nslots == size) {
+                    rule_t *c = realloc(compiled, sizeof(rule_t) * size * 2);
+                    if (c == NULL) {
+                        res = RULES_MEMORY_ERROR;
+                        continue;
+                    }
+                    compiled = c;
+                    size *= 2;
+                }
+                compiled[nslots] = compiled[0];
+                sensors[id] = (uint16_t) nslots++;
+            }
+            if (rules_parse(&compiled[sensors[id]], rest) != 0) res = RULES_SYNTAX_ERROR;
+        }
+    }
+    fclose(fp);
+    if (res == RULES_NO_ERROR) {
+        rules_table_t *n = realloc(t, sizeof(rules_table_t) + sizeof(rule_t) * nslots);
+        if (n == NULL) res = RULES_MEMORY_ERROR;
+        else t = n;
+    }
+    if (res != RULES_NO_ERROR) {
+        free(t);
+        free(sensors);
+        free(compiled);
+        return res;
+    }
+    memcpy(t->slot, sensors, sizeof(t->slot));
+    memcpy(t->rules, compiled, sizeof(rule_t) * nslots);
+    t->nslots = nslots;
+    free(sensors);
+    free(compiled);
+    // publish without waiting for the evaluators: the old table is retired and freed once none has it pinned
+    rules_table_t *old = atomic_exchange(&rules->table, t);
+    old->retired = rules->retired;
+    rules->retired = old;
+    rules_reclaim(rules);
+    return RULES_NO_ERROR;
+}
+
+
+int rules_eval_create(rules_eval_t **eval, rules_t *rules) {
+    rules_eval_t *e = calloc(1, sizeof(rules_eval_t));
+    if (e == NULL) return RULES_MEMORY_ERROR;
+    e->rules = rules;
+    e->reader = -1;
+    for (int i = 0; i < RULES_MAX_READERS && e->reader < 0; i++) {
+        if (atomic_exchange(&rules->used[i], 1) == 0) e->reader = i;
+    }
+    if (e->reader < 0) {
+        free(e);
+        return RULES_MEMORY_ERROR;
+    }
+    *eval = e;
+    return RULES_NO_ERROR;
+}
+
+
+void rules_eval_free(rules_eval_t **eval) {
+    if (eval == NULL || *eval == NULL) return;
+    rules_eval_t *e = *eval;
+    for (int p = 0; p < RULES_PAGES; p++) {
+        if (e->pages[p] == NULL) continue;
+        for (int i = 0; i < RULES_PAGE_SIZE; i++) free(e->pages[p][i]);
+        free(e->pages[p]);
+    }
+    atomic_store(&e->rules->pinned[e->reader], NULL);
+    atomic_store(&e->rules->used[e->reader], 0);
+    free(e);
+    *eval = NULL;
+}
+
+
+void rules_begin(rules_eval_t *eval) {
+    rules_table_t *t;
+    // re-check after pinning: a reload in between may already have passed our slot
+    do {
+        t = atomic_load(&eval->rules->table);
+        atomic_store(&eval->rules->pinned[eval->reader], t);
+    } while (atomic_load(&eval->rules->table) != t);
+    eval->table = t;
+}
+
+
+void rules_end(rules_eval_t *eval) {
+    atomic_store(&eval->rules->pinned[eval->reader], NULL);
+    eval->table = NULL;
+}
+
+
+void rules_eval_save(rules_eval_t *eval, snapshot_t *snap) {
+    uint32_t layout = sizeof(rules_sensor_t);
+    snapshot_begin(snap, SNAPSHOT_RULES);
+    snapshot_write(snap, &layout, sizeof(layout));
+    for (int p = 0; p < RULES_PAGES; p++) {
+        if (eval->pages[p] == NULL) continue;
+        for (int i = 0; i < RULES_PAGE_SIZE; i++) {
+            if (eval->pages[p][i] == NULL) continue;
+            sensor_id_t id = (sensor_id_t) (p << RULES_PAGE_BITS | i);
+            snapshot_write(snap, &id, sizeof(id));
+            snapshot_write(snap, eval->pages[p][i], sizeof(rules_sensor_t));
+        }
+    }
+    snapshot_end(snap);
+}
+
+
+int rules_eval_load(rules_eval_t *eval, const void *data, size_t len) {
+    const unsigned char *p = data, *end = p + len;
+    uint32_t layout;
+    if (len < sizeof(layout)) return RULES_FORMAT_ERROR;
+    memcpy(&layout, p, sizeof(layout));
+    if (layout != sizeof(rules_sensor_t)) return RULES_FORMAT_ERROR;
+    p += sizeof(layout);
+    for (; (size_t) (end - p) >= sizeof(sensor_id_t) + sizeof(rules_sensor_t);
+           p += sizeof(sensor_id_t) + sizeof(rules_sensor_t)) {
+        sensor_id_t id;
+        memcpy(&id, p, sizeof(id));
+        rules_sensor_t *s = rules_sensor(eval, id);
+        if (s == NULL) return RULES_MEMORY_ERROR;
+        memcpy(s, p + sizeof(id), sizeof(rules_sensor_t));
+    }
+    return RULES_NO_ERROR;
+}
+
+
+uint32_t rules_check(rules_eval_t *eval, const sensor_data_t *data) {
+    const rule_t *r = &eval->table->rules[eval->table->slot[data->id]];
+    sensor_value_t x = data->value;
+    uint32_t mask = (uint32_t) (x > r->above) * RULE_ABOVE | (uint32_t) (x < r->below) * RULE_BELOW;
+    // the remaining rules need the history of the sensor
+    if (r->rate == INFINITY && r->avg_n == 0) return mask;
+    rules_sensor_t *s = rules_sensor(eval, data->id);
+    if (s == NULL) return mask;
+    if (s->count > 0) {
+        sensor_ts_t dt = data->ts - s->last_ts;
+        mask |= (uint32_t) (fabs(x - s->last) > r->rate * (dt > 0 ? dt : 1)) * RULE_RATE;
+    }
+    s->last = x;
+    s->last_ts = data->ts;
+    s->window[s->pos] = x;
+    s->pos = (s->pos + 1) % RULES_MAX_WINDOW;
+    if (s->count < RULES_MAX_WINDOW) s->count++;
+    if (r->avg_n > 0) {
+        uint32_t m = r->avg_m < s->count ? r->avg_m : s->count;
+        sensor_value_t sum = 0;
+        for (uint32_t i = 1; i <= m; i++) sum += s->window[(s->pos + RULES_MAX_WINDOW - i) % RULES_MAX_WINDOW];
+        sensor_value_t avg = sum / m;
+        s->violations = (s->violations << 1) | (uint32_t) (avg < r->avg_low || avg > r->avg_high);
+        uint32_t recent = s->violations & (r->avg_m >= 32 ? UINT32_MAX : (1u << r->avg_m) - 1);
+        mask |= (uint32_t) ((uint32_t) __builtin_popcount(recent) >= r->avg_n) * RULE_AVG;
+    }
+    return mask;
+}
+
+
+const char *rules_name(uint32_t rule) {
+    switch (rule) {
+        case RULE_ABOVE:
+            return "above";
+        case RULE_BELOW:
+            return "below";
+        case RULE_RATE:
+            return "rate";
+        case RULE_AVG:
+            return "avg";
+        default:
+            return "unknown";
+    }
+}
+
+
+/*
+ * Frees the retired tables no evaluator has pinned; an evaluator pins the
+ * active table only, so an unpinned retired table stays unpinned.
+ */
+static void rules_reclaim(rules_t *rules) {
+    rules_table_t **prev = &rules->retired;
+    while (*prev != NULL) {
+        rules_table_t *t = *prev;
+        int pinned = 0;
+        for (int i = 0; i < RULES_MAX_READERS && !pinned; i++) pinned = atomic_load(&rules->pinned[i]) == t;
+        if (pinned) {
+            prev = &t->retired;
+            continue;
+        }
+        *prev = t->retired;
+        free(t);
+    }
+}
+
+static rules_table_t *rules_table_create(uint32_t nslots) {
+    rules_table_t *t = calloc(1, sizeof(rules_table_t) + sizeof(rule_t) * nslots);
+    if (t != NULL) t->nslots = nslots;
+    return t;
+}
+
+static int rules_parse(rule_t *rule, char *args) {
+    char *rest = args, *key, *end;
+    double v[4];
+    while ((key = strtok_r(NULL, " \t\r\n", &rest)) != NULL) {
+        int n = strcmp(key, "avg") == 0 ? 4 : 1;
+        if (n == 1 && strcmp(key, "above") != 0 && strcmp(key, "below") != 0 && strcmp(key, "rate") != 0) return -1;
+        for (int i = 0; i < n; i++) {
+            char *arg = strtok_r(NULL, " \t\r\n", &rest);
+            if (arg == NULL) return -1;
+            v[i] = strtod(arg, &end);
+            if (*end != '\0') return -1;
+        }
+        if (strcmp(key, "above") == 0) rule->above = v[0];
+        else if (strcmp(key, "below") == 0) rule->below = v[0];
+        else if (strcmp(key, "rate") == 0) rule->rate = v[0];
+        else {
+            if (v[0] < 1 || v[1] < v[0] || v[1] > RULES_MAX_WINDOW) return -1;
+            rule->avg_n = (uint32_t) v[0];
+            rule->avg_m = (uint32_t) v[1];
+            rule->avg_low = v[2];
+            rule->avg_high = v[3];
+        }
+    }
+    return 0;
+}
+
+static rules_sensor_t *rules_sensor(rules_eval_t *eval, sensor_id_t id) {
+    rules_sensor_t **page = eval->pages[id >> RULES_PAGE_BITS];
+    if (page == NULL) {
+        page = calloc(RULES_PAGE_SIZE, sizeof(rules_sensor_t *));
+        if (page == NULL) return NULL;
+        eval->pages[id >> RULES_PAGE_BITS] = page;
+    }
+    rules_sensor_t **s = &page[id & (RULES_PAGE_SIZE - 1)];
+    if (*s == NULL) *s = calloc(1, sizeof(rules_sensor_t));
+    return *s;
+}
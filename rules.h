@@ -0,0 +1,110 @@
+#ifndef __RULES_H__
+#define __RULES_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "snapshot.h"
+
+#define RULES_NO_ERROR          0
+#define RULES_MEMORY_ERROR      1  // mem alloc error
+#define RULES_FILE_ERROR        2  // the rule file can't be read
+#define RULES_SYNTAX_ERROR      3  // a line of the rule file is invalid
+#define RULES_FORMAT_ERROR      4  // a snapshot section written by another layout
+#define RULES_LIMIT_ERROR       5  // more than RULES_MAX_SENSORS sensors have lines of their own
+
+#define RULES_MAX_READERS       64
+#define RULES_MAX_WINDOW        32      // largest M of an 'avg' rule
+#define RULES_MAX_SENSORS       UINT16_MAX  // sensors with rules of their own, slot 0 holds the defaults
+
+// Bits of the mask returned by rules_check()
+#define RULE_ABOVE      0x01    // value above the 'above' threshold
+#define RULE_BELOW      0x02    // value below the 'below' threshold
+#define RULE_RATE       0x04    // |change| per second since the previous reading above 'rate'
+#define RULE_AVG        0x08    // running average out of its band in at least N of the last M readings
+
+typedef struct rules rules_t;
+
+typedef struct rules_eval rules_eval_t;
+
+
+int rules_create(rules_t **rules);
+
+/* Creates an empty rule set, every reading passes until rules_load() is called
+ * If memory allocation fails, RULES_MEMORY_ERROR is returned
+ */
+
+
+void rules_free(rules_t **rules);
+
+/* Frees the rule set and sets '*rules' to NULL; all evaluators must be freed before
+ */
+
+
+int rules_load(rules_t *rules, const char *path, int *line);
+
+/* Compiles the rule file 'path' and atomically replaces the active rules, evaluators pick them up at
+ * their next rules_begin(); it never waits for the evaluators, the previous table is retired and freed by
+ * a later rules_load() or rules_free() once no evaluator has it pinned
+ * Every line is '<sensor id | *> <rule> ...' with the rules
+ *   above <value>     below <value>     rate <max change per second>
+ *   avg <N> <M> <low> <high>
+ * A '*' line sets the defaults that the lines of single sensors extend; '#' starts a comment
+ * If the file can't be read, RULES_FILE_ERROR is returned
+ * If a line is invalid, RULES_SYNTAX_ERROR is returned with its number in '*line', the active rules are kept
+ * If a line names a sensor beyond the first RULES_MAX_SENSORS, RULES_LIMIT_ERROR is returned the same way
+ * Only one thread may load rules at a time
+ */
+
+
+int rules_eval_create(rules_eval_t **eval, rules_t *rules);
+
+/* Creates the evaluation state (previous readings per sensor) of one thread
+ * If memory allocation fails or RULES_MAX_READERS evaluators exist, RULES_MEMORY_ERROR is returned
+ */
+
+
+void rules_eval_free(rules_eval_t **eval);
+
+/* Frees the evaluation state and sets '*eval' to NULL
+ */
+
+
+void rules_begin(rules_eval_t *eval);
+
+/* Pins the active rule table for the following rules_check() calls, a replaced table isn't freed before
+ * rules_end(); keep it pinned only while checking readings
+ */
+
+
+void rules_end(rules_eval_t *eval);
+
+/* Releases the table pinned by rules_begin(), call it before blocking
+ */
+
+
+void rules_eval_save(rules_eval_t *eval, snapshot_t *snap);
+
+/* Adds a SNAPSHOT_RULES section with the reading history of every sensor of 'eval' to 'snap'
+ */
+
+
+int rules_eval_load(rules_eval_t *eval, const void *data, size_t len);
+
+/* Restores the reading history of a SNAPSHOT_RULES section into 'eval'
+ * If memory allocation fails, RULES_MEMORY_ERROR is returned and the remaining sensors are skipped
+ * If the section was written with another layout, RULES_FORMAT_ERROR is returned
+ */
+
+
+uint32_t rules_check(rules_eval_t *eval, const sensor_data_t *data);
+/* Evaluates the rules of the sensor of 'data' and returns the RULE_* bits that fire, 0 if none
+ * The readings of one sensor must always be checked by the same evaluator, in ts order
+ */
+
+
+const char *rules_name(uint32_t rule);
+/* Returns the keyword of a single RULE_* bit
+ */
+
+
+#endif  //__RULES_H__
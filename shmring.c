@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shmring.h"
+
+#define SHMRING_MAGIC           0x474E5253      // "SRNG"
+#define SHMRING_CACHE_LINE      64
+
+/*
+ * The shared part, at offset 0 of the memfd. The producer only writes
+ * 'tail', the server only writes 'head', each on its own cache line like
+ * ring.h; 'sleeping' is the server's "ring the doorbell" flag.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;               // sizeof(sensor_data_t) of the server, both sides must agree
+    uint32_t mask;
+    char pad0[SHMRING_CACHE_LINE - 3 * sizeof(uint32_t)];
+    _Atomic uint64_t head;              // next slot to pop
+    char pad1[SHMRING_CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint64_t tail;              // next slot to push
+    char pad2[SHMRING_CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint32_t sleeping;
+    char pad3[SHMRING_CACHE_LINE - sizeof(uint32_t)];
+    sensor_data_t slots[];
+} shmring_hdr_t;
+
+struct shmring {
+    shmring_hdr_t *hdr;
+    size_t size;                        // bytes mapped
+    uint32_t mask;                      // private copy of hdr->mask, the other side may rewrite the shared one
+    int memfd;                          // server side only, -1 on the producer side
+    int efd;
+    int sd;                             // producer side only, -1 on the server side
+};
+
+
+static shmring_t *shmring_alloc() {
+    shmring_t *r = calloc(1, sizeof(shmring_t));
+    if (r == NULL) return NULL;
+    r->memfd = -1;
+    r->efd = -1;
+    r->sd = -1;
+    return r;
+}
+
+
+int shmring_create(shmring_t **ring, uint32_t records) {
+    uint32_t size = SHMRING_MIN_RECORDS;
+    while (size < records && size < SHMRING_MAX_RECORDS) size <<= 1;
+    shmring_t *r = shmring_alloc();
+    if (r == NULL) return SHMRING_MEMORY_ERROR;
+    r->size = sizeof(shmring_hdr_t) + (size_t) size * sizeof(sensor_data_t);
+    r->memfd = memfd_create("sensor-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->memfd < 0 || r->efd < 0 || ftruncate(r->memfd, (off_t) r->size) != 0) {
+        shmring_free(&r);
+        return SHMRING_MEMORY_ERROR;
+    }
+    // a producer that shrank the file would make our reads fault
+    fcntl(r->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    void *base = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->memfd, 0);
+    if (base == MAP_FAILED) {
+        shmring_free(&r);
+        return SHMRING_MEMORY_ERROR;
+    }
+    r->hdr = base;
+    r->hdr->magic = SHMRING_MAGIC;
+    r->hdr->record_size = sizeof(sensor_data_t);
+    r->hdr->mask = size - 1;
+    r->mask = size - 1;
+    atomic_init(&r->hdr->head, 0);
+    atomic_init(&r->hdr->tail, 0);
+    atomic_init(&r->hdr->sleeping, 1);
+    *ring = r;
+    return SHMRING_NO_ERROR;
+}
+
+
+int shmring_offer(shmring_t *ring, int sd) {
+    int fds[2] = {ring->memfd, ring->efd};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    uint32_t records = ring->mask + 1;
+    struct iovec iov = {.iov_base = &records, .iov_len = sizeof(records)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    ssize_t n;
+    do {
+        n = sendmsg(sd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    // the socket was just accepted, its send buffer is empty
+    return n == (ssize_t) sizeof(records) ? SHMRING_NO_ERROR : SHMRING_SOCKET_ERROR;
+}
+
+
+int shmring_attach(shmring_t **ring, const char *path) {
+    struct sockaddr_un addr;
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) return SHMRING_SOCKET_ERROR;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    shmring_t *r = shmring_alloc();
+    if (r == NULL) return SHMRING_MEMORY_ERROR;
+    r->sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->sd < 0 || connect(r->sd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        shmring_free(&r);
+        return SHMRING_SOCKET_ERROR;
+    }
+    int fds[2];
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    uint32_t records;
+    struct iovec iov = {.iov_base = &records, .iov_len = sizeof(records)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)};
+    ssize_t n;
+    do {
+        n = recvmsg(r->sd, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    // after a failed recvmsg the control buffer holds nothing that was received
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        shmring_free(&r);
+        return SHMRING_SOCKET_ERROR;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    // the memfd is only needed for the mapping, the doorbell stays
+    r->efd = fds[1];
+    struct stat st;
+    int res = (n != (ssize_t) sizeof(records) || fstat(fds[0], &st) != 0) ? SHMRING_SOCKET_ERROR : SHMRING_NO_ERROR;
+    if (res == SHMRING_NO_ERROR && (size_t) st.st_size < sizeof(shmring_hdr_t)) res = SHMRING_FORMAT_ERROR;
+    if (res == SHMRING_NO_ERROR) {
+        void *base = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        if (base == MAP_FAILED) res = SHMRING_MEMORY_ERROR;
+        else {
+            r->hdr = base;
+            r->size = (size_t) st.st_size;
+        }
+    }
+    close(fds[0]);
+    if (res == SHMRING_NO_ERROR && (r->hdr->magic != SHMRING_MAGIC || r->hdr->record_size != sizeof(sensor_data_t) ||
+                                    r->hdr->mask + 1 != records ||
+                                    r->size < sizeof(shmring_hdr_t) + (size_t) records * sizeof(sensor_data_t))) {
+        res = SHMRING_FORMAT_ERROR;
+    }
+    if (res != SHMRING_NO_ERROR) {
+        shmring_free(&r);
+        return res;
+    }
+    r->mask = records - 1;
+    *ring = r;
+    return SHMRING_NO_ERROR;
+}
+
+
+void shmring_free(shmring_t **ring) {
+    if (ring == NULL || *ring == NULL) return;
+    shmring_t *r = *ring;
+    if (r->hdr != NULL) munmap(r->hdr, r->size);
+    if (r->memfd >= 0) close(r->memfd);
+    if (r->efd >= 0) close(r->efd);
+    if (r->sd >= 0) close(r->sd);
+    free(r);
+    *ring = NULL;
+}
+
+
+uint32_t shmring_push(shmring_t *ring, const sensor_data_t *data, uint32_t n) {
+    shmring_hdr_t *h = ring->hdr;
+    uint64_t tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+    uint64_t room = (uint64_t) ring->mask + 1 - (tail - head);
+    if (room > (uint64_t) ring->mask + 1) room = 0;
+    if (n > room) n = (uint32_t) room;
+    for (uint32_t i = 0; i < n; i++) h->slots[(tail + i) & ring->mask] = data[i];
+    // seq_cst: the server must either see the new tail or have its 'sleeping' seen here
+    atomic_store(&h->tail, tail + n);
+    if (n > 0 && atomic_load(&h->sleeping) && atomic_exchange(&h->sleeping, 0)) {
+        uint64_t one = 1;
+        if (write(ring->efd, &one, sizeof(one)) < 0) {}
+    }
+    return n;
+}
+
+
+uint32_t shmring_pop(shmring_t *ring, sensor_data_t *data, uint32_t max) {
+    shmring_hdr_t *h = ring->hdr;
+    uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+    uint64_t n = atomic_load_explicit(&h->tail, memory_order_acquire) - head;
+    // the tail comes from another process, never trust it beyond the ring: only our own mask indexes it
+    if (n > (uint64_t) ring->mask + 1) n = (uint64_t) ring->mask + 1;
+    if (n > max) n = max;
+    for (uint32_t i = 0; i < n; i++) data[i] = h->slots[(head + i) & ring->mask];
+    atomic_store_explicit(&h->head, head + n, memory_order_release);
+    return (uint32_t) n;
+}
+
+
+void shmring_wait(shmring_t *ring) {
+    shmring_hdr_t *h = ring->hdr;
+    uint64_t value;
+    if (read(ring->efd, &value, sizeof(value)) < 0) {}
+    atomic_store(&h->sleeping, 1);
+    if (atomic_load(&h->tail) == atomic_load_explicit(&h->head, memory_order_relaxed)) return;
+    // records are left: stay awake and keep the doorbell readable for the next round of the loop
+    atomic_store(&h->sleeping, 0);
+    value = 1;
+    if (write(ring->efd, &value, sizeof(value)) < 0) {}
+}
+
+
+int shmring_get_fd(shmring_t *ring) {
+    return ring->efd;
+}
+
+
+int shmring_get_sd(shmring_t *ring) {
+    return ring->sd;
+}
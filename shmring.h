@@ -0,0 +1,88 @@
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#define SHMRING_NO_ERROR        0
+#define SHMRING_MEMORY_ERROR    1  // mem alloc, memfd or mapping error
+#define SHMRING_SOCKET_ERROR    2  // the descriptors can't be passed over the Unix socket, or no server listens on it
+#define SHMRING_FORMAT_ERROR    3  // the shared memory is not a ring of this layout
+
+#define SHMRING_MIN_RECORDS     1024
+#define SHMRING_MAX_RECORDS     (1 << 22)
+
+/*
+ * A ring of sensor_data_t shared between a server and one local producer.
+ * The server creates it in a memfd and passes that, with an eventfd
+ * doorbell, over a connected Unix socket (SCM_RIGHTS). The producer copies
+ * records straight into the ring; the doorbell is only written when the
+ * server sleeps, so a busy ring costs no system call per batch. The socket
+ * stays open for as long as the producer is attached: the server sends its
+ * acks there, and a hang-up on either side ends the attachment.
+ */
+
+typedef struct shmring shmring_t;
+
+
+int shmring_create(shmring_t **ring, uint32_t records);
+
+/* Server side: creates an empty ring of at least 'records' slots (rounded up to a power of two, clamped
+ * to SHMRING_MIN_RECORDS .. SHMRING_MAX_RECORDS) and its doorbell
+ * If memory allocation, the memfd or the eventfd fails, SHMRING_MEMORY_ERROR is returned
+ */
+
+
+int shmring_offer(shmring_t *ring, int sd);
+
+/* Server side: passes the ring and its doorbell to the producer connected on the Unix socket 'sd'
+ * If the descriptors can't be sent, SHMRING_SOCKET_ERROR is returned
+ */
+
+
+int shmring_attach(shmring_t **ring, const char *path);
+
+/* Producer side: connects to the server listening on the Unix socket 'path' and maps the ring it offers
+ * If nothing listens on 'path' or no ring comes back, SHMRING_SOCKET_ERROR is returned
+ * If the ring can't be mapped, SHMRING_MEMORY_ERROR is returned
+ * If the ring was created by another layout or build, SHMRING_FORMAT_ERROR is returned
+ */
+
+
+void shmring_free(shmring_t **ring);
+
+/* Unmaps the ring, closes its descriptors (on the producer side also the socket) and sets '*ring' to NULL
+ */
+
+
+uint32_t shmring_push(shmring_t *ring, const sensor_data_t *data, uint32_t n);
+
+/* Producer side: copies as many of the 'n' records in 'data' as fit into the ring and rings the doorbell
+ * if the server sleeps; returns the number of records queued, less than 'n' if the ring is full
+ */
+
+
+uint32_t shmring_pop(shmring_t *ring, sensor_data_t *data, uint32_t max);
+
+/* Server side: copies up to 'max' queued records into 'data' and returns how many
+ */
+
+
+void shmring_wait(shmring_t *ring);
+
+/* Server side: call when done popping. If the ring is empty it clears the doorbell and lets the next push
+ * ring it; if records are left, e.g. because popping stopped early, the doorbell stays readable
+ */
+
+
+int shmring_get_fd(shmring_t *ring);
+/* Returns the doorbell eventfd, readable when the server should pop, to register with a loop
+ */
+
+
+int shmring_get_sd(shmring_t *ring);
+/* Producer side: returns the socket of the attachment, the server's acks are read from it
+ */
+
+
+#endif  //__SHMRING_H__
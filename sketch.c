@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sketch.h"
+
+#define SKETCH_WIDTH    (1u << SKETCH_WIDTH_BITS)
+#define SKETCH_WORDS    ((UINT16_MAX + 1) / 64)
+
+// one odd multiplier per row, multiply-shift hashing of the 16 bit ids
+static const uint32_t sketch_seeds[SKETCH_DEPTH] = {0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu};
+
+typedef struct {
+    sketch_hitter_t entries[SKETCH_TOP];
+    int count;
+} sketch_list_t;
+
+struct sketch {
+    uint32_t window;            // ms
+    uint64_t start;             // clock at the start of the current window
+    int cur;                    // 'rows[cur]' counts the current window, the other one the previous
+    uint32_t rows[2][SKETCH_DEPTH][SKETCH_WIDTH];
+    uint64_t marks[2][SKETCH_WORDS];    // sketch_mark() flags, same windows as 'rows'
+    sketch_list_t top;          // heaviest sensors of the current window
+    sketch_list_t peak;         // heaviest window of the heaviest sensors so far
+};
+
+
+static inline uint32_t sketch_hash(int row, sensor_id_t id) {
+    return (((uint32_t) id + 1) * sketch_seeds[row]) >> (32 - SKETCH_WIDTH_BITS);
+}
+
+static void sketch_offer(sketch_list_t *list, sensor_id_t id, uint32_t count) {
+    // raises the entry of 'id', or takes the place of the lightest entry if 'id' is heavier
+    int min = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (list->entries[i].id == id) {
+            if (count > list->entries[i].count) list->entries[i].count = count;
+            return;
+        }
+        if (list->entries[i].count < list->entries[min].count) min = i;
+    }
+    if (list->count < SKETCH_TOP) min = list->count++;
+    else if (list->entries[min].count >= count) return;
+    list->entries[min] = (sketch_hitter_t) {.id = id, .count = count};
+}
+
+static void sketch_rotate(sketch_t *s, uint64_t now) {
+    for (int i = 0; i < s->top.count; i++) sketch_offer(&s->peak, s->top.entries[i].id, s->top.entries[i].count);
+    s->top.count = 0;
+    // after a silent window the previous one is empty as well
+    if (now - s->start >= 2 * (uint64_t) s->window) {
+        memset(s->rows[s->cur], 0, sizeof(s->rows[s->cur]));
+        memset(s->marks[s->cur], 0, sizeof(s->marks[s->cur]));
+    }
+    s->cur ^= 1;
+    memset(s->rows[s->cur], 0, sizeof(s->rows[s->cur]));
+    memset(s->marks[s->cur], 0, sizeof(s->marks[s->cur]));
+    s->start = now - (now - s->start) % s->window;
+}
+
+
+int sketch_create(sketch_t **sketch, uint32_t window_ms) {
+    sketch_t *s = calloc(1, sizeof(sketch_t));
+    if (s == NULL) return SKETCH_MEMORY_ERROR;
+    s->window = window_ms > 0 ? window_ms : 1;
+    *sketch = s;
+    return SKETCH_NO_ERROR;
+}
+
+
+void sketch_free(sketch_t **sketch) {
+    if (sketch == NULL) return;
+    free(*sketch);
+    *sketch = NULL;
+}
+
+
+uint32_t sketch_add(sketch_t *s, sensor_id_t id, uint64_t now) {
+    if (now - s->start >= s->window) sketch_rotate(s, now);
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint32_t *counter = &s->rows[s->cur][row][sketch_hash(row, id)];
+        if (*counter < UINT32_MAX) (*counter)++;
+        if (*counter < estimate) estimate = *counter;
+    }
+    sketch_offer(&s->top, id, estimate);
+    return estimate;
+}
+
+
+uint32_t sketch_last(sketch_t *s, sensor_id_t id) {
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint32_t counter = s->rows[s->cur ^ 1][row][sketch_hash(row, id)];
+        if (counter < estimate) estimate = counter;
+    }
+    return estimate;
+}
+
+
+int sketch_mark(sketch_t *s, sensor_id_t id, int *before) {
+    uint64_t bit = (uint64_t) 1 << (id % 64);
+    *before = (s->marks[s->cur ^ 1][id / 64] & bit) != 0;
+    if (s->marks[s->cur][id / 64] & bit) return 0;
+    s->marks[s->cur][id / 64] |= bit;
+    return 1;
+}
+
+
+int sketch_top(sketch_t *s, sketch_hitter_t *top, int max) {
+    sketch_list_t all = s->peak;
+    for (int i = 0; i < s->top.count; i++) sketch_offer(&all, s->top.entries[i].id, s->top.entries[i].count);
+    // a handful of entries: insertion sort, heaviest first
+    for (int i = 1; i < all.count; i++) {
+        sketch_hitter_t h = all.entries[i];
+        int j = i;
+        for (; j > 0 && all.entries[j - 1].count < h.count; j--) all.entries[j] = all.entries[j - 1];
+        all.entries[j] = h;
+    }
+    int n = all.count < max ? all.count : max;
+    memcpy(top, all.entries, sizeof(sketch_hitter_t) * n);
+    return n;
+}
@@ -0,0 +1,74 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#define SKETCH_NO_ERROR         0
+#define SKETCH_MEMORY_ERROR     1  // mem alloc error
+
+#define SKETCH_DEPTH            4       // rows of the count-min sketch
+#define SKETCH_WIDTH_BITS       10      // 1024 counters per row
+#define SKETCH_TOP              16      // heavy hitters tracked
+
+/*
+ * Streaming per-sensor rates in fixed memory: a count-min sketch of the
+ * records of every sensor in the current time window, and the one of the
+ * previous window. The estimate of a sensor is never below its true count,
+ * and above it only by what sensors sharing its counters sent. Next to it
+ * the SKETCH_TOP heaviest sensors of the window are kept, and the highest
+ * window of each of them as the peak list. An update costs SKETCH_DEPTH
+ * counter increments and a scan of the SKETCH_TOP entries; one sketch
+ * belongs to one thread. Sensor ids are 16 bits, so a flag per sensor and
+ * window fits in a bitmap.
+ */
+
+typedef struct sketch sketch_t;
+
+typedef struct {
+    sensor_id_t id;
+    uint32_t count;             // records in one window
+} sketch_hitter_t;
+
+
+int sketch_create(sketch_t **sketch, uint32_t window_ms);
+
+/* Creates an empty sketch with windows of 'window_ms' milliseconds of a caller's clock
+ * If memory allocation fails, SKETCH_MEMORY_ERROR is returned
+ */
+
+
+void sketch_free(sketch_t **sketch);
+
+/* Frees all memory and sets '*sketch' to NULL
+ */
+
+
+uint32_t sketch_add(sketch_t *sketch, sensor_id_t id, uint64_t now);
+
+/* Counts one record of sensor 'id' at 'now' (ms, monotonic) and returns the estimated number of records
+ * of 'id' in the current window, this one included; a 'now' past the window starts the next one
+ */
+
+
+uint32_t sketch_last(sketch_t *sketch, sensor_id_t id);
+
+/* Returns the estimated number of records of sensor 'id' in the previous window, as of the last sketch_add()
+ */
+
+
+int sketch_mark(sketch_t *sketch, sensor_id_t id, int *before);
+
+/* Flags sensor 'id' in the current window, e.g. once it goes over a limit; flags are exact, one bit per id
+ * Returns 1 if it was not flagged yet in this window, 0 otherwise; '*before' tells if it was in the previous one
+ */
+
+
+int sketch_top(sketch_t *sketch, sketch_hitter_t *top, int max);
+
+/* Copies up to 'max' heavy hitters to 'top', each with the highest window count it reached, the current
+ * window included, heaviest first; returns how many
+ */
+
+
+#endif  //__SKETCH_H__
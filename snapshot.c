@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "crc32.h"
+
+#define SNAPSHOT_HEADER_SIZE    (2 * sizeof(uint32_t) + sizeof(uint64_t))
+#define SNAPSHOT_SECTION_SIZE   (3 * sizeof(uint32_t))
+#define SNAPSHOT_BUF_BYTES      (1024 * 1024)
+
+struct snapshot {
+    char *path;
+    char *tmp;
+    int fd;
+    int failed;
+    unsigned char *buf;
+    size_t len;                 // bytes in 'buf'
+    uint64_t flushed;           // file offset of buf[0]
+    // current section
+    uint32_t tag;
+    uint64_t start;             // file offset of its header
+    uint32_t size;
+    uint32_t crc;
+};
+
+struct snapshot_map {
+    unsigned char *base;
+    size_t size;
+    size_t pos;
+};
+
+
+static void snapshot_flush(snapshot_t *snap);
+
+static void snapshot_put(snapshot_t *snap, const void *data, size_t len);
+
+static void snapshot_free(snapshot_t *snap) {
+    if (snap->fd >= 0) close(snap->fd);
+    free(snap->buf);
+    free(snap->tmp);
+    free(snap->path);
+    free(snap);
+}
+
+
+int snapshot_create(snapshot_t **snap, const char *path, uint32_t nshards, uint64_t seq) {
+    snapshot_t *s = calloc(1, sizeof(snapshot_t));
+    if (s == NULL) return SNAPSHOT_MEMORY_ERROR;
+    s->fd = -1;
+    s->path = strdup(path);
+    s->buf = malloc(SNAPSHOT_BUF_BYTES);
+    if (s->path != NULL && asprintf(&s->tmp, "%s.tmp", path) < 0) s->tmp = NULL;
+    if (s->path == NULL || s->buf == NULL || s->tmp == NULL) {
+        snapshot_free(s);
+        return SNAPSHOT_MEMORY_ERROR;
+    }
+    s->fd = open(s->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s->fd < 0) {
+        snapshot_free(s);
+        return SNAPSHOT_FILE_ERROR;
+    }
+    uint32_t hdr[2] = {SNAPSHOT_MAGIC, nshards};
+    snapshot_put(s, hdr, sizeof(hdr));
+    snapshot_put(s, &seq, sizeof(seq));
+    *snap = s;
+    return SNAPSHOT_NO_ERROR;
+}
+
+
+void snapshot_begin(snapshot_t *snap, uint32_t tag) {
+    snap->tag = tag;
+    snap->start = snap->flushed + snap->len;
+    snap->size = 0;
+    snap->crc = 0;
+    // the header is filled in by snapshot_end()
+    uint32_t hdr[3] = {0, 0, 0};
+    snapshot_put(snap, hdr, sizeof(hdr));
+}
+
+
+void snapshot_write(snapshot_t *snap, const void *data, size_t len) {
+    snap->crc = crc32_update(snap->crc, data, len);
+    snap->size += (uint32_t) len;
+    snapshot_put(snap, data, len);
+}
+
+
+void snapshot_end(snapshot_t *snap) {
+    uint32_t hdr[3] = {snap->tag, snap->size, snap->crc};
+    if (snap->start >= snap->flushed) memcpy(snap->buf + (snap->start - snap->flushed), hdr, sizeof(hdr));
+    else if (pwrite(snap->fd, hdr, sizeof(hdr), (off_t) snap->start) != (ssize_t) sizeof(hdr)) snap->failed = 1;
+}
+
+
+int snapshot_commit(snapshot_t **snap) {
+    snapshot_t *s = *snap;
+    snapshot_flush(s);
+    if (fsync(s->fd) != 0) s->failed = 1;
+    if (!s->failed && rename(s->tmp, s->path) != 0) s->failed = 1;
+    if (s->failed) unlink(s->tmp);
+    else {
+        // make the rename durable
+        char *dir = strdup(s->path);
+        int dfd = dir != NULL ? open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+    int res = s->failed ? SNAPSHOT_FILE_ERROR : SNAPSHOT_NO_ERROR;
+    snapshot_free(s);
+    *snap = NULL;
+    return res;
+}
+
+
+int snapshot_open(snapshot_map_t **map, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return SNAPSHOT_FILE_ERROR;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return SNAPSHOT_FILE_ERROR;
+    }
+    if ((size_t) st.st_size < SNAPSHOT_HEADER_SIZE) {
+        close(fd);
+        return SNAPSHOT_FORMAT_ERROR;
+    }
+    void *base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return SNAPSHOT_FILE_ERROR;
+    snapshot_map_t *m = calloc(1, sizeof(snapshot_map_t));
+    if (m == NULL) {
+        munmap(base, (size_t) st.st_size);
+        return SNAPSHOT_MEMORY_ERROR;
+    }
+    m->base = base;
+    m->size = (size_t) st.st_size;
+    // only a snapshot whose every section is intact is used
+    uint32_t magic;
+    memcpy(&magic, m->base, sizeof(magic));
+    int valid = (magic == SNAPSHOT_MAGIC);
+    m->pos = SNAPSHOT_HEADER_SIZE;
+    while (valid && m->pos < m->size) {
+        uint32_t hdr[3];
+        if (m->size - m->pos < SNAPSHOT_SECTION_SIZE) valid = 0;
+        else {
+            memcpy(hdr, m->base + m->pos, SNAPSHOT_SECTION_SIZE);
+            valid = hdr[1] <= m->size - m->pos - SNAPSHOT_SECTION_SIZE &&
+                    crc32_update(0, m->base + m->pos + SNAPSHOT_SECTION_SIZE, hdr[1]) == hdr[2];
+            m->pos += SNAPSHOT_SECTION_SIZE + hdr[1];
+        }
+    }
+    if (!valid) {
+        snapshot_close(&m);
+        return SNAPSHOT_FORMAT_ERROR;
+    }
+    m->pos = SNAPSHOT_HEADER_SIZE;
+    *map = m;
+    return SNAPSHOT_NO_ERROR;
+}
+
+
+void snapshot_info(snapshot_map_t *map, uint32_t *nshards, uint64_t *seq) {
+    memcpy(nshards, map->base + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(seq, map->base + 2 * sizeof(uint32_t), sizeof(uint64_t));
+}
+
+
+int snapshot_next(snapshot_map_t *map, uint32_t *tag, const void **data, size_t *len) {
+    if (map->pos >= map->size) return 0;
+    uint32_t hdr[3];
+    memcpy(hdr, map->base + map->pos, SNAPSHOT_SECTION_SIZE);
+    *tag = hdr[0];
+    *len = hdr[1];
+    *data = map->base + map->pos + SNAPSHOT_SECTION_SIZE;
+    map->pos += SNAPSHOT_SECTION_SIZE + hdr[1];
+    return 1;
+}
+
+
+void snapshot_close(snapshot_map_t **map) {
+    if (map == NULL || *map == NULL) return;
+    munmap((*map)->base, (*map)->size);
+    free(*map);
+    *map = NULL;
+}
+
+
+static void snapshot_flush(snapshot_t *snap) {
+    size_t done = 0;
+    while (done < snap->len) {
+        ssize_t n = write(snap->fd, snap->buf + done, snap->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            snap->failed = 1;
+            break;
+        }
+        done += (size_t) n;
+    }
+    snap->flushed += snap->len;
+    snap->len = 0;
+}
+
+static void snapshot_put(snapshot_t *snap, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        if (snap->len == SNAPSHOT_BUF_BYTES) snapshot_flush(snap);
+        size_t n = SNAPSHOT_BUF_BYTES - snap->len;
+        if (n > len) n = len;
+        memcpy(snap->buf + snap->len, p, n);
+        snap->len += n;
+        p += n;
+        len -= n;
+    }
+}
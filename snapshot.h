@@ -0,0 +1,88 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SNAPSHOT_NO_ERROR       0
+#define SNAPSHOT_MEMORY_ERROR   1  // mem alloc error
+#define SNAPSHOT_FILE_ERROR     2  // the snapshot can't be created, written, synced, renamed or mapped
+#define SNAPSHOT_FORMAT_ERROR   3  // not a snapshot, another version, or a section fails its CRC
+
+#define SNAPSHOT_MAGIC          0x31504E53u     // "SNP1"
+
+/*
+ * A snapshot is a header, magic (4), nshards (4), seq (8), followed by
+ * sections: tag (4), length (4), CRC-32 of the data (4), then the data.
+ * It is written to '<path>.tmp' and renamed over 'path' once synced, so a
+ * crash leaves either the previous or the new snapshot. Sections are read
+ * in place from a private mapping; their layout belongs to the module that
+ * wrote them and is in host byte order.
+ */
+#define SNAPSHOT_REORDER        1       // reorder windows and emitted fingerprints (reorder.h)
+#define SNAPSHOT_RULES          2       // per sensor rule history (rules.h)
+#define SNAPSHOT_LATEST         3       // latest value per sensor (query.h)
+
+typedef struct snapshot snapshot_t;
+
+typedef struct snapshot_map snapshot_map_t;
+
+
+int snapshot_create(snapshot_t **snap, const char *path, uint32_t nshards, uint64_t seq);
+
+/* Starts writing a new snapshot for 'path'; 'nshards' and 'seq' are stored for snapshot_info()
+ * If memory allocation fails, SNAPSHOT_MEMORY_ERROR is returned
+ * If the temporary file can't be created, SNAPSHOT_FILE_ERROR is returned
+ */
+
+
+void snapshot_begin(snapshot_t *snap, uint32_t tag);
+
+/* Starts a section, its data is everything passed to snapshot_write() until snapshot_end()
+ */
+
+
+void snapshot_write(snapshot_t *snap, const void *data, size_t len);
+
+/* Appends 'len' bytes to the current section; errors are reported by snapshot_commit()
+ */
+
+
+void snapshot_end(snapshot_t *snap);
+/* Completes the current section
+ */
+
+
+int snapshot_commit(snapshot_t **snap);
+
+/* Syncs the snapshot and atomically replaces 'path' with it, frees all memory and sets '*snap' to NULL
+ * If a write, the sync or the rename failed, the previous snapshot stays and SNAPSHOT_FILE_ERROR is returned
+ */
+
+
+int snapshot_open(snapshot_map_t **map, const char *path);
+
+/* Maps the snapshot 'path' and checks every section
+ * If memory allocation fails, SNAPSHOT_MEMORY_ERROR is returned
+ * If 'path' can't be opened or mapped, SNAPSHOT_FILE_ERROR is returned
+ * If 'path' isn't a complete snapshot, SNAPSHOT_FORMAT_ERROR is returned
+ */
+
+
+void snapshot_info(snapshot_map_t *map, uint32_t *nshards, uint64_t *seq);
+/* Returns the values given to snapshot_create()
+ */
+
+
+int snapshot_next(snapshot_map_t *map, uint32_t *tag, const void **data, size_t *len);
+
+/* Returns 1 and the next section, or 0 after the last one; 'data' is valid until snapshot_close()
+ */
+
+
+void snapshot_close(snapshot_map_t **map);
+/* Unmaps the snapshot, frees all memory and sets '*map' to NULL
+ */
+
+
+#endif  //__SNAPSHOT_H__
@@ -3,12 +3,16 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "tcpsock.h"
 
@@ -40,8 +44,6 @@
 
 #define MAGIC_COOKIE    (long)(0xA2E1CF37D35)    // used to check if a socket is bounded
 
-#define CHAR_IP_ADDR_LENGTH 16        // 4 numbers of 3 digits, 3 dots and \0
-#define    PROTOCOLFAMILY    AF_INET        // internet protocol suite
 #define    TYPE        SOCK_STREAM    // streaming protool type
 #define    PROTOCOL    IPPROTO_TCP    // TCP protocol
 
@@ -49,44 +51,118 @@ struct tcpsock {
     long cookie;        // if the socket is bound, cookie should be equal to MAGIC_COOKIE
     // remark: the use of magic cookies doesn't guarantee a 'bullet proof' test
     int sd;        // socket descriptor
-    char *ip_addr;    // socket IP address
+    struct sockaddr_storage addr;   // bound address of a listener, peer of an accepted socket, own one of a client
+    socklen_t addrlen;              // 0 while no address is known
     int port;        // socket port number
+    int flags;       // TCP_FLAG_* the socket was opened with
+    int family;      // AF_INET, AF_INET6, or AF_UNIX for a local socket
+    evloop_t *loop;  // event loop the socket is registered with, NULL if none
+    tcp_event_cb_t cb;
+    tcp_connect_cb_t connect_cb;    // pending tcp_active_open_async() completion
+    void *arg;
 };
 
 
 static tcpsock_t *tcp_sock_create();
 
+static void tcp_loop_dispatch(evloop_t *loop, int fd, uint32_t events, void *arg);
+
+static void tcp_connect_complete(evloop_t *loop, int fd, uint32_t events, void *arg);
+
+static int tcp_fill_peer(tcpsock_t *s);
+
+static void tcp_fill_addr(tcpsock_t *s, const struct sockaddr_storage *addr, socklen_t len);
+
 int tcp_passive_open(tcpsock_t **sock, int port) {
+    return tcp_passive_open_ex(sock, NULL, port, 0);
+}
+
+
+int tcp_passive_open_ex(tcpsock_t **sock, char *ip, int port, int flags) {
     int result;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
 
+    // Construct the server address structure
+    result = tcp_parse_addr(ip, port, &addr, &addrlen);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, return TCP_ADDRESS_ERROR);
+
     tcpsock_t *s = tcp_sock_create();
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
 
-    s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
+    s->sd = socket(addr.ss_family, TYPE | SOCK_CLOEXEC | ((flags & TCP_FLAG_NONBLOCK) ? SOCK_NONBLOCK : 0), PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd < 0, free(s);
             return TCP_SOCKOP_ERROR);
 
-    // Construct the server address structure
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = PROTOCOLFAMILY;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port);
+    // connections of a previous server instance in TIME_WAIT must not block the restart
+    int one = 1;
+    setsockopt(s->sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // an IPv6 listener leaves IPv4 to its own listeners on the same port
+    if (addr.ss_family == AF_INET6) setsockopt(s->sd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    result = (flags & TCP_FLAG_REUSEPORT) ? setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) : 0;
+    TCP_DEBUG_PRINTF(result == -1, "SO_REUSEPORT failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd);
+            free(s);
+            return TCP_SOCKOP_ERROR);
+
+    result = bind(s->sd, (struct sockaddr *) &addr, addrlen);
+    TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd);
+            free(s);
+            return TCP_SOCKOP_ERROR);
+
+    result = listen(s->sd, MAX_PENDING);
+    TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, close(s->sd);
+            free(s);
+            return TCP_SOCKOP_ERROR);
 
+    s->flags = flags;
+    tcp_fill_addr(s, &addr, addrlen);
+    s->cookie = MAGIC_COOKIE;
+    *sock = s;
+    return TCP_NO_ERROR;
+}
+
+
+int tcp_passive_open_local(tcpsock_t **sock, const char *path, int flags) {
+    int result;
+    struct sockaddr_un addr;
+    TCP_ERR_HANDLER(path == NULL || strlen(path) >= sizeof(addr.sun_path), return TCP_ADDRESS_ERROR);
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    tcpsock_t *s = tcp_sock_create();
+    TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
+
+    s->sd = socket(AF_UNIX, TYPE | SOCK_CLOEXEC | ((flags & TCP_FLAG_NONBLOCK) ? SOCK_NONBLOCK : 0), 0);
+    TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(s->sd < 0, free(s);
+            return TCP_SOCKOP_ERROR);
+
+    // the socket file of a previous server instance would make bind() fail
+    unlink(path);
     result = bind(s->sd, (struct sockaddr *) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s);
+    TCP_ERR_HANDLER(result != 0, close(s->sd);
+            free(s);
             return TCP_SOCKOP_ERROR);
 
     result = listen(s->sd, MAX_PENDING);
     TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s);
+    TCP_ERR_HANDLER(result != 0, close(s->sd);
+            unlink(path);
+            free(s);
             return TCP_SOCKOP_ERROR);
 
-    s->ip_addr = NULL; // address set to INADDR_ANY - not a specific IP address
-    s->port = port;
+    s->flags = flags & TCP_FLAG_NONBLOCK;
+    struct sockaddr_storage bound;
+    memset(&bound, 0, sizeof(bound));
+    memcpy(&bound, &addr, sizeof(addr));
+    tcp_fill_addr(s, &bound, sizeof(addr));
     s->cookie = MAGIC_COOKIE;
     *sock = s;
     return TCP_NO_ERROR;
@@ -94,42 +170,71 @@ int tcp_passive_open(tcpsock_t **sock, int port) {
 
 
 int tcp_active_open(tcpsock_t **sock, int remote_port, char *remote_ip) {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
     tcpsock_t *client;
-    int length, result;
-    char *p;
+    int result;
     TCP_ERR_HANDLER(((remote_port < MIN_PORT) || (remote_port > MAX_PORT)),
                     return TCP_ADDRESS_ERROR);  // server port between 0 and MIN_PORT is allowed
     TCP_ERR_HANDLER(remote_ip == NULL, return TCP_ADDRESS_ERROR);
+    /* Construct the server address structure */
+    result = tcp_parse_addr(remote_ip, remote_port, &addr, &addrlen);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, return TCP_ADDRESS_ERROR);
     client = tcp_sock_create();
     TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
-    client->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
+    client->sd = socket(addr.ss_family, TYPE | SOCK_CLOEXEC, PROTOCOL);
     TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(client->sd < 0, free(client);
             return TCP_SOCKOP_ERROR);
-    /* Construct the server address structure */
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = PROTOCOLFAMILY;
-    result = inet_aton(remote_ip, (struct in_addr *) &addr.sin_addr.s_addr);
-    TCP_ERR_HANDLER(result == 0, free(client);
-            return TCP_ADDRESS_ERROR);
-    addr.sin_port = htons(remote_port);
-    result = connect(client->sd, (struct sockaddr *) &addr, sizeof(addr));
+    result = connect(client->sd, (struct sockaddr *) &addr, addrlen);
     TCP_DEBUG_PRINTF(result == -1, "Connect() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(client);
+    TCP_ERR_HANDLER(result != 0, close(client->sd);
+            free(client);
             return TCP_SOCKOP_ERROR);
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    length = sizeof(addr);
-    result = getsockname(client->sd, (struct sockaddr *) &addr, (socklen_t *) &length);
-    TCP_DEBUG_PRINTF(result == -1, "getsockname() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(client);
+    result = tcp_fill_peer(client);
+    TCP_DEBUG_PRINTF(result != TCP_NO_ERROR, "getsockname() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, close(client->sd);
+            free(client);
             return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr);  //returns addr to statically allocated buffer
-    client->ip_addr = (char *) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(client->ip_addr == NULL, free(client);
-            return TCP_MEMORY_ERROR);
-    client->ip_addr = strncpy(client->ip_addr, p, CHAR_IP_ADDR_LENGTH);
-    client->port = ntohs(addr.sin_port);
+    client->cookie = MAGIC_COOKIE;
+    *sock = client;
+    return TCP_NO_ERROR;
+}
+
+
+int tcp_active_open_async(tcpsock_t **sock, int remote_port, char *remote_ip,
+                          evloop_t *loop, tcp_connect_cb_t cb, void *arg) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    tcpsock_t *client;
+    int result;
+    TCP_ERR_HANDLER(((remote_port < MIN_PORT) || (remote_port > MAX_PORT)), return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(remote_ip == NULL, return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(loop == NULL || cb == NULL, return TCP_LOOP_ERROR);
+    result = tcp_parse_addr(remote_ip, remote_port, &addr, &addrlen);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, return TCP_ADDRESS_ERROR);
+    client = tcp_sock_create();
+    TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
+    client->sd = socket(addr.ss_family, TYPE | SOCK_CLOEXEC | SOCK_NONBLOCK, PROTOCOL);
+    TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(client->sd < 0, free(client);
+            return TCP_SOCKOP_ERROR);
+    client->flags = TCP_FLAG_NONBLOCK;
+    client->family = addr.ss_family;
+    result = connect(client->sd, (struct sockaddr *) &addr, addrlen);
+    TCP_DEBUG_PRINTF(result == -1 && errno != EINPROGRESS, "Connect() failed with errno = %d [%s]", errno,
+                     strerror(errno));
+    TCP_ERR_HANDLER(result != 0 && errno != EINPROGRESS, close(client->sd);
+            free(client);
+            return TCP_SOCKOP_ERROR);
+    // completion (even an immediate one) is always reported through the loop once the socket is writable
+    result = evloop_add(loop, client->sd, EPOLLOUT, &tcp_connect_complete, client);
+    TCP_ERR_HANDLER(result != EVLOOP_NO_ERROR, close(client->sd);
+            free(client);
+            return TCP_LOOP_ERROR);
+    client->loop = loop;
+    client->connect_cb = cb;
+    client->arg = arg;
     client->cookie = MAGIC_COOKIE;
     *sock = client;
     return TCP_NO_ERROR;
@@ -142,52 +247,90 @@ int tcp_close(tcpsock_t **socket) {
     if (*socket == NULL) return TCP_SOCKET_ERROR;
     if ((*socket)->cookie == MAGIC_COOKIE) // socket is bound
     {
-        if ((*socket)->ip_addr != NULL) // then assume memory is allocated and must be freed
-        {
-            free((*socket)->ip_addr);
-        }
+        if ((*socket)->loop != NULL) evloop_del((*socket)->loop, (*socket)->sd);
         if ((*socket)->sd >= 0) {
             // maybe a connection is still open?
             result = shutdown((*socket)->sd, SHUT_RDWR);
-            //if ((result of shutdown==-1)&&(errno!=ENOTCONN)) //socket wasn't connected
-            TCP_DEBUG_PRINTF(result == -1, "Shutdown() failed with errno = %d [%s]", errno, strerror(errno));
-            if (result != -1) {
-                result = close((*socket)->sd); // try to close the socket descriptor
-                TCP_DEBUG_PRINTF(result == -1, "Close() failed with errno = %d [%s]", errno, strerror(errno));
-            }
+            TCP_DEBUG_PRINTF(result == -1 && errno != ENOTCONN, "Shutdown() failed with errno = %d [%s]", errno,
+                             strerror(errno));
+            // whatever shutdown() said, the descriptor goes with the socket struct
+            result = close((*socket)->sd);
+            TCP_DEBUG_PRINTF(result == -1, "Close() failed with errno = %d [%s]", errno, strerror(errno));
         }
     }
     // overwrite memory before free to make socket invalid (even if memory is accidently reused)!
     (*socket)->cookie = 0;
     (*socket)->port = -1;
     (*socket)->sd = -1;
-    (*socket)->ip_addr = NULL;
+    (*socket)->addrlen = 0;
+    (*socket)->loop = NULL;
     free(*socket);
     *socket = NULL;
     return TCP_NO_ERROR;
 }
 
 
+int tcp_adopt(tcpsock_t **sock, int sd, int flags) {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    int listening = 0;
+    socklen_t optlen = sizeof(listening);
+    TCP_ERR_HANDLER(getsockopt(sd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) != 0, return TCP_SOCKOP_ERROR);
+    memset(&addr, 0, sizeof(addr));
+    // listeners know their own address, connections the one of their peer
+    TCP_ERR_HANDLER((listening ? getsockname(sd, (struct sockaddr *) &addr, &length) :
+                     getpeername(sd, (struct sockaddr *) &addr, &length)) != 0, return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(addr.ss_family != AF_INET && addr.ss_family != AF_INET6 && addr.ss_family != AF_UNIX,
+                    return TCP_SOCKOP_ERROR);
+    tcpsock_t *s = tcp_sock_create();
+    TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
+    s->sd = sd;
+    tcp_fill_addr(s, &addr, length);
+    s->cookie = MAGIC_COOKIE;
+    int result = tcp_set_nonblocking(s, (flags & TCP_FLAG_NONBLOCK) != 0);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, free(s);
+            return result);
+    s->flags = flags;
+    *sock = s;
+    return TCP_NO_ERROR;
+}
+
+
+int tcp_detach(tcpsock_t **socket, int *sd) {
+    if (socket == NULL || *socket == NULL) return TCP_SOCKET_ERROR;
+    tcpsock_t *s = *socket;
+    *sd = s->sd;
+    if (s->cookie == MAGIC_COOKIE && s->loop != NULL) evloop_del(s->loop, s->sd);
+    s->cookie = 0;
+    s->port = -1;
+    s->sd = -1;
+    free(s);
+    *socket = NULL;
+    return TCP_NO_ERROR;
+}
+
+
 int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket) {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     tcpsock_t *s;
-    unsigned int length = sizeof(struct sockaddr_in);
-    char *p;
+    socklen_t length = sizeof(addr);
 
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
     s = tcp_sock_create();
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
-    s->sd = accept(socket->sd, (struct sockaddr *) &addr, &length);
+    // sockets accepted on a non-blocking listener are non-blocking too
+    s->sd = accept4(socket->sd, (struct sockaddr *) &addr, &length,
+                    (socket->flags & TCP_FLAG_NONBLOCK) ? SOCK_NONBLOCK : 0);
+    TCP_ERR_HANDLER(s->sd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK), free(s);
+            return TCP_WOULD_BLOCK);
     TCP_DEBUG_PRINTF(s->sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(s->sd == -1, free(s);
             return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr);  //returns addr to statically allocated buffer
-    s->ip_addr = (char *) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(s->ip_addr == NULL, free(s);
-            return TCP_MEMORY_ERROR);
-    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
-    s->port = ntohs(addr.sin_port);
+    s->flags = socket->flags & TCP_FLAG_NONBLOCK;
+    // the peer address is kept as the kernel returned it, no string is made unless asked for
+    tcp_fill_addr(s, &addr, length);
+    s->family = socket->family;
     s->cookie = MAGIC_COOKIE;
     *new_socket = s;
     return TCP_NO_ERROR;
@@ -211,6 +354,8 @@ int tcp_send(tcpsock_t *socket, void *buffer, int *buf_size) {
     TCP_DEBUG_PRINTF(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))),
                      "Send() : no connection to peer\n");
     TCP_ERR_HANDLER(((*buf_size < 0) && ((errno == EPIPE) || (errno == ENOTCONN))), return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER(((*buf_size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))), *buf_size = 0;
+            return TCP_WOULD_BLOCK);
     TCP_DEBUG_PRINTF(*buf_size < 0, "Send() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(*buf_size < 0, return TCP_SOCKOP_ERROR);
     return TCP_NO_ERROR;
@@ -230,6 +375,8 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size) {
     TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
     TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
     TCP_ERR_HANDLER((*buf_size < 0) && (errno == ENOTCONN), return TCP_CONNECTION_CLOSED);
+    TCP_ERR_HANDLER(((*buf_size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))), *buf_size = 0;
+            return TCP_WOULD_BLOCK);
     TCP_DEBUG_PRINTF(*buf_size < 0, "Recv() failed with errno = %d [%s]", errno, strerror(errno));
     TCP_ERR_HANDLER(*buf_size < 0, return TCP_SOCKOP_ERROR);
     return TCP_NO_ERROR;
@@ -237,9 +384,23 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size) {
 
 
 int tcp_get_ip_addr(tcpsock_t *socket, char **ip_addr) {
+    static _Thread_local char buf[TCP_ADDR_STRLEN];
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
-    *ip_addr = socket->ip_addr;
+    *ip_addr = NULL;
+    if (socket->addrlen == 0) return TCP_NO_ERROR;
+    if (socket->family == AF_UNIX) *ip_addr = strcpy(buf, "local");
+    else if (socket->family == AF_INET)
+        *ip_addr = (char *) inet_ntop(AF_INET, &((struct sockaddr_in *) &socket->addr)->sin_addr, buf, sizeof(buf));
+    else *ip_addr = (char *) inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &socket->addr)->sin6_addr, buf, sizeof(buf));
+    return TCP_NO_ERROR;
+}
+
+int tcp_get_addr(tcpsock_t *socket, struct sockaddr_storage *addr, socklen_t *len) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    *addr = socket->addr;
+    *len = socket->addrlen;
     return TCP_NO_ERROR;
 }
 
@@ -258,14 +419,229 @@ int tcp_get_sd(tcpsock_t *socket, int *sd) {
 }
 
 
+int tcp_get_family(tcpsock_t *socket, int *family) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    *family = socket->family;
+    return TCP_NO_ERROR;
+}
+
+
+int tcp_parse_addr(const char *ip, int port, struct sockaddr_storage *addr, socklen_t *len) {
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in *in = (struct sockaddr_in *) addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+    if (ip != NULL && strchr(ip, ':') != NULL) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        TCP_ERR_HANDLER(inet_pton(AF_INET6, ip, &in6->sin6_addr) != 1, return TCP_ADDRESS_ERROR);
+        *len = sizeof(struct sockaddr_in6);
+        return TCP_NO_ERROR;
+    }
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_ANY);
+    in->sin_port = htons(port);
+    // inet_aton() as before, it also takes the short forms like 127.1
+    TCP_ERR_HANDLER(ip != NULL && inet_aton(ip, &in->sin_addr) == 0, return TCP_ADDRESS_ERROR);
+    *len = sizeof(struct sockaddr_in);
+    return TCP_NO_ERROR;
+}
+
+
+int tcp_addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) return 0;
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *) a, *y = (const struct sockaddr_in *) b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *) a, *y = (const struct sockaddr_in6 *) b;
+        return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+    }
+    if (a->ss_family == AF_UNIX) {
+        return strcmp(((const struct sockaddr_un *) a)->sun_path, ((const struct sockaddr_un *) b)->sun_path) == 0;
+    }
+    return 0;
+}
+
+
+int tcp_set_nonblocking(tcpsock_t *socket, int enable) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    int fl = fcntl(socket->sd, F_GETFL, 0);
+    TCP_ERR_HANDLER(fl == -1, return TCP_SOCKOP_ERROR);
+    fl = enable ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK);
+    TCP_ERR_HANDLER(fcntl(socket->sd, F_SETFL, fl) == -1, return TCP_SOCKOP_ERROR);
+    socket->flags = enable ? (socket->flags | TCP_FLAG_NONBLOCK) : (socket->flags & ~TCP_FLAG_NONBLOCK);
+    return TCP_NO_ERROR;
+}
+
+int tcp_register(tcpsock_t *socket, evloop_t *loop, uint32_t events, tcp_event_cb_t cb, void *arg) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->loop != NULL || loop == NULL || cb == NULL, return TCP_LOOP_ERROR);
+    TCP_ERR_HANDLER(evloop_add(loop, socket->sd, events, &tcp_loop_dispatch, socket) != EVLOOP_NO_ERROR,
+                    return TCP_LOOP_ERROR);
+    socket->loop = loop;
+    socket->cb = cb;
+    socket->arg = arg;
+    return TCP_NO_ERROR;
+}
+
+int tcp_modify(tcpsock_t *socket, uint32_t events) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->loop == NULL, return TCP_LOOP_ERROR);
+    TCP_ERR_HANDLER(evloop_mod(socket->loop, socket->sd, events) != EVLOOP_NO_ERROR, return TCP_LOOP_ERROR);
+    return TCP_NO_ERROR;
+}
+
+int tcp_unregister(tcpsock_t *socket) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    if (socket->loop == NULL) return TCP_NO_ERROR;
+    evloop_del(socket->loop, socket->sd);
+    socket->loop = NULL;
+    socket->cb = NULL;
+    socket->connect_cb = NULL;
+    socket->arg = NULL;
+    return TCP_NO_ERROR;
+}
+
+
+static const char *tcp_profile_names[TCP_PROFILE_COUNT] = {
+        "default", "low-latency", "high-throughput", "low-memory"
+};
+
+static const tcp_tuning_t tcp_profiles[TCP_PROFILE_COUNT] = {
+        // rcvbuf, sndbuf, nodelay, quickack, busy_poll_us, incoming_cpu, ka_idle, ka_intvl, ka_cnt, user_timeout_ms
+        {0,          0,          0, 0, 0,  -1, 0,   0,  0, 0},
+        {0,          0,          1, 1, 50, -1, 30,  5,  3, 20000},
+        {4 << 20,    4 << 20,    0, 0, 0,  -1, 60,  10, 5, 60000},
+        {4096,       4096,       0, 0, 0,  -1, 120, 30, 4, 120000},
+};
+
+int tcp_get_profile(tcp_profile_t profile, tcp_tuning_t *tuning) {
+    TCP_ERR_HANDLER(profile < 0 || profile >= TCP_PROFILE_COUNT, *tuning = tcp_profiles[TCP_PROFILE_DEFAULT];
+            return TCP_PROFILE_ERROR);
+    *tuning = tcp_profiles[profile];
+    return TCP_NO_ERROR;
+}
+
+int tcp_profile_from_name(const char *name, tcp_profile_t *profile) {
+    TCP_ERR_HANDLER(name == NULL, return TCP_PROFILE_ERROR);
+    for (int i = 0; i < TCP_PROFILE_COUNT; i++) {
+        if (strcmp(name, tcp_profile_names[i]) == 0) {
+            *profile = (tcp_profile_t) i;
+            return TCP_NO_ERROR;
+        }
+    }
+    return TCP_PROFILE_ERROR;
+}
+
+const char *tcp_profile_name(tcp_profile_t profile) {
+    if (profile < 0 || profile >= TCP_PROFILE_COUNT) return NULL;
+    return tcp_profile_names[profile];
+}
+
+int tcp_set_tuning(tcpsock_t *socket, const tcp_tuning_t *tuning) {
+    return tcp_set_tuning_ex(socket, tuning, NULL, 0);
+}
+
+
+int tcp_set_tuning_ex(tcpsock_t *socket, const tcp_tuning_t *tuning, char *rejected, size_t len) {
+    int failed = 0, one = 1;
+    size_t used = 0;
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    if (rejected != NULL && len > 0) rejected[0] = '\0';
+#define TCP_SETSOCKOPT(level, name, value)                                                          \
+    do {                                                                                            \
+        int v = (value);                                                                            \
+        int r = setsockopt(socket->sd, (level), (name), &v, sizeof(v));                            \
+        TCP_DEBUG_PRINTF(r == -1, #name " failed with errno = %d [%s]", errno, strerror(errno));    \
+        if (r == -1 && rejected != NULL && used < len) {                                            \
+            int n = snprintf(rejected + used, len - used, "%s" #name " (%s)", used ? ", " : "",     \
+                             strerror(errno));                                                      \
+            used += n > 0 ? (size_t) n : 0;                                                         \
+        }                                                                                           \
+        failed |= (r == -1);                                                                        \
+    } while(0)
+    if (tuning->rcvbuf > 0) TCP_SETSOCKOPT(SOL_SOCKET, SO_RCVBUF, tuning->rcvbuf);
+    if (tuning->sndbuf > 0) TCP_SETSOCKOPT(SOL_SOCKET, SO_SNDBUF, tuning->sndbuf);
+    // a local socket has no TCP options: only its buffers are tuned
+    if (socket->family == AF_UNIX) return failed ? TCP_SOCKOP_ERROR : TCP_NO_ERROR;
+    if (tuning->nodelay) TCP_SETSOCKOPT(IPPROTO_TCP, TCP_NODELAY, one);
+    if (tuning->quickack) TCP_SETSOCKOPT(IPPROTO_TCP, TCP_QUICKACK, one);
+#ifdef SO_BUSY_POLL
+    if (tuning->busy_poll_us > 0) TCP_SETSOCKOPT(SOL_SOCKET, SO_BUSY_POLL, tuning->busy_poll_us);
+#endif
+#ifdef SO_INCOMING_CPU
+    if (tuning->incoming_cpu >= 0) TCP_SETSOCKOPT(SOL_SOCKET, SO_INCOMING_CPU, tuning->incoming_cpu);
+#endif
+    if (tuning->keepalive_idle > 0) {
+        TCP_SETSOCKOPT(SOL_SOCKET, SO_KEEPALIVE, one);
+        TCP_SETSOCKOPT(IPPROTO_TCP, TCP_KEEPIDLE, tuning->keepalive_idle);
+        if (tuning->keepalive_intvl > 0) TCP_SETSOCKOPT(IPPROTO_TCP, TCP_KEEPINTVL, tuning->keepalive_intvl);
+        if (tuning->keepalive_cnt > 0) TCP_SETSOCKOPT(IPPROTO_TCP, TCP_KEEPCNT, tuning->keepalive_cnt);
+    }
+    if (tuning->user_timeout_ms > 0) TCP_SETSOCKOPT(IPPROTO_TCP, TCP_USER_TIMEOUT, tuning->user_timeout_ms);
+#undef TCP_SETSOCKOPT
+    return failed ? TCP_SOCKOP_ERROR : TCP_NO_ERROR;
+}
+
+
 static tcpsock_t *tcp_sock_create() {
     tcpsock_t *s = (tcpsock_t *) malloc(sizeof(tcpsock_t));
     if (s) // init the socket to default values
     {
         s->cookie = 0;  // socket is not yet bound!
         s->port = -1;
-        s->ip_addr = NULL;
+        s->addrlen = 0;
         s->sd = -1;
+        s->flags = 0;
+        s->family = AF_INET;
+        s->loop = NULL;
+        s->cb = NULL;
+        s->connect_cb = NULL;
+        s->arg = NULL;
     }
     return s;
-}
\ No newline at end of file
+}
+
+static void tcp_loop_dispatch(evloop_t *loop, int fd, uint32_t events, void *arg) {
+    tcpsock_t *s = (tcpsock_t *) arg;
+    s->cb(s, events, s->arg);
+}
+
+static void tcp_connect_complete(evloop_t *loop, int fd, uint32_t events, void *arg) {
+    tcpsock_t *s = (tcpsock_t *) arg;
+    tcp_connect_cb_t cb = s->connect_cb;
+    void *cb_arg = s->arg;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    int result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    TCP_DEBUG_PRINTF(result == 0 && err != 0, "Connect() failed with errno = %d [%s]", err, strerror(err));
+    tcp_unregister(s);
+    if (result == 0 && err == 0 && tcp_fill_peer(s) == TCP_NO_ERROR) cb(s, TCP_NO_ERROR, cb_arg);
+    else cb(s, TCP_SOCKOP_ERROR, cb_arg);
+}
+
+static int tcp_fill_peer(tcpsock_t *s) {
+    // same bookkeeping as tcp_active_open(): the socket keeps its own local address and port
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    TCP_ERR_HANDLER(getsockname(s->sd, (struct sockaddr *) &addr, &length) != 0, return TCP_SOCKOP_ERROR);
+    tcp_fill_addr(s, &addr, length);
+    return TCP_NO_ERROR;
+}
+
+static void tcp_fill_addr(tcpsock_t *s, const struct sockaddr_storage *addr, socklen_t len) {
+    s->addr = *addr;
+    s->addrlen = len;
+    s->family = addr->ss_family;
+    if (addr->ss_family == AF_INET) s->port = ntohs(((const struct sockaddr_in *) addr)->sin_port);
+    else if (addr->ss_family == AF_INET6) s->port = ntohs(((const struct sockaddr_in6 *) addr)->sin6_port);
+    else s->port = 0;
+}
@@ -11,12 +11,53 @@
 #define    TCP_SOCKOP_ERROR    3  // socket operator (socket, listen, bind, accept,...) error
 #define TCP_CONNECTION_CLOSED    4  // send/receive indicate connection is closed
 #define    TCP_MEMORY_ERROR    5  // mem alloc error
+#define    TCP_WOULD_BLOCK     10 // non-blocking socket: operation can't complete now, retry when ready
+#define    TCP_LOOP_ERROR      11 // event loop registration error
+#define    TCP_PROFILE_ERROR   12 // unknown socket profile (tcp_get_profile(), tcp_profile_from_name())
 
-#define MAX_PENDING 10
+#define TCP_FLAG_NONBLOCK   0x01  // put the socket in non-blocking mode
+#define TCP_FLAG_REUSEPORT  0x02  // let several listening sockets share the port (SO_REUSEPORT)
 
+#define MAX_PENDING SOMAXCONN    // a restart makes a whole fleet of sensors reconnect at once
+
+#define TCP_ADDR_STRLEN     46  // INET6_ADDRSTRLEN: the longest IPv6 address and \0
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "evloop.h"
 
 typedef struct tcpsock tcpsock_t;
 
+typedef enum {
+    TCP_PROFILE_DEFAULT,            // kernel defaults, no options are set
+    TCP_PROFILE_LOW_LATENCY,        // no Nagle, quick acks, busy polling
+    TCP_PROFILE_HIGH_THROUGHPUT,    // large socket buffers, Nagle on
+    TCP_PROFILE_LOW_MEMORY,         // minimal socket buffers for many idle connections
+    TCP_PROFILE_COUNT
+} tcp_profile_t;
+
+typedef struct {
+    int rcvbuf;             // SO_RCVBUF in bytes, 0 keeps the kernel default
+    int sndbuf;             // SO_SNDBUF in bytes, 0 keeps the kernel default
+    int nodelay;            // TCP_NODELAY
+    int quickack;           // TCP_QUICKACK (not sticky, reapplied on every accepted socket)
+    int busy_poll_us;       // SO_BUSY_POLL, 0 disables
+    int incoming_cpu;       // SO_INCOMING_CPU, -1 leaves it unset
+    int keepalive_idle;     // TCP_KEEPIDLE in seconds, 0 disables keepalive
+    int keepalive_intvl;    // TCP_KEEPINTVL in seconds
+    int keepalive_cnt;      // TCP_KEEPCNT
+    int user_timeout_ms;    // TCP_USER_TIMEOUT, 0 keeps the kernel default
+} tcp_tuning_t;
+
+typedef void (*tcp_event_cb_t)(tcpsock_t *socket, uint32_t events, void *arg);
+/* Callback of a socket registered with tcp_register(), 'events' is the EPOLL* mask reported by the loop
+ */
+
+typedef void (*tcp_connect_cb_t)(tcpsock_t *socket, int result, void *arg);
+/* Completion callback of tcp_active_open_async(), 'result' is TCP_NO_ERROR or TCP_SOCKOP_ERROR
+ * When called, the socket is no longer registered with the loop; on error it must still be closed with tcp_close()
+ */
+
 
 // All functions below return TCP_NO_ERROR if no error occurs during execution
 
@@ -33,27 +74,77 @@ int tcp_passive_open(tcpsock_t **socket, int port);
  */
 
 
+int tcp_passive_open_ex(tcpsock_t **socket, char *ip, int port, int flags);
+
+/* Same as tcp_passive_open() but binds to the IPv4 or IPv6 address 'ip' only, or to any IPv4 interface if 'ip' is NULL
+ * An IPv6 listener ("::" for any interface) only takes IPv6 connections, open an IPv4 one on the same port for both
+ * If 'flags' contains TCP_FLAG_NONBLOCK, the socket is non-blocking and so are all sockets accepted on it
+ * If 'flags' contains TCP_FLAG_REUSEPORT, each listener opened on the same 'ip' and 'port' gets a share of the
+ * incoming connections, e.g. one listener per thread
+ * If 'ip' is not a valid IP address, TCP_ADDRESS_ERROR is returned
+ */
+
+
+int tcp_passive_open_local(tcpsock_t **socket, const char *path, int flags);
+
+/* Same as tcp_passive_open_ex() but listens on the Unix domain socket 'path', for clients on the same host
+ * A socket file left at 'path' is replaced; tcp_close() does not remove it, that is up to the caller
+ * Accepted sockets behave like TCP connections, their IP address reads "local" and their port 0
+ * If 'path' is NULL or too long for a socket address, TCP_ADDRESS_ERROR is returned
+ */
+
+
 int tcp_active_open(tcpsock_t **socket, int remote_port, char *remote_ip);
 
 /* Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
  * This function is typically called by a client 
  * If port 'remote_port' is not between MIN_PORT and MAX_PORT, TCP_ADDRESS_ERROR is returned
+ * 'remote_ip' may be an IPv4 or IPv6 address
  * If 'remote_ip' is NULL or an IP address operation (inet_aton, ...) fails, TCP_ADDRESS_ERROR is returned 
  * If memory allocation for the newly created socket fails, TCP_MEMORY_ERROR is returned
  * If a socket operation (socket, listen, bind, accept,...) fails, TCP_SOCKOP_ERROR is returned
  */
 
 
+int tcp_active_open_async(tcpsock_t **socket, int remote_port, char *remote_ip,
+                          evloop_t *loop, tcp_connect_cb_t cb, void *arg);
+
+/* Non-blocking variant of tcp_active_open(): starts the connection setup and returns immediately
+ * The newly created (non-blocking) socket is returned as '*socket', 'cb' is called from 'loop' once the
+ * connection is established or has failed; the callback is never called from within this function
+ * Returns the same errors as tcp_active_open() for failures detected before the connection setup started
+ * If the socket can't be registered with 'loop', TCP_LOOP_ERROR is returned
+ */
+
+
 int tcp_close(tcpsock_t **socket);
 
 /* The socket '*socket' is closed , allocated resources are freed and '*socket' is set to NULL
  * If '*socket' is connected, a TCP shutdown on the connection is executed
+ * If '*socket' is registered with an event loop, it is unregistered first
  * If 'socket' or '*socket' is NULL, nothing is done and TCP_SOCKET_ERROR is returned
  * If '*socket' is not a valid socket, the result of the function is undefined
  */
 
 
+int tcp_adopt(tcpsock_t **socket, int sd, int flags);
+
+/* Wraps the already open listening or connected descriptor 'sd', e.g. one received from another process
+ * With TCP_FLAG_NONBLOCK in 'flags' the descriptor is switched to non-blocking mode
+ * If memory allocation fails, TCP_MEMORY_ERROR is returned and 'sd' stays open
+ * If 'sd' is neither a TCP nor a Unix stream socket, TCP_SOCKOP_ERROR is returned and 'sd' stays open
+ */
+
+
+int tcp_detach(tcpsock_t **socket, int *sd);
+
+/* Frees '*socket' like tcp_close() but leaves the descriptor open and returns it as '*sd'
+ * Use it when another process shares the connection: a shutdown would end it for both
+ * If 'socket' or '*socket' is NULL, nothing is done and TCP_SOCKET_ERROR is returned
+ */
+
+
 int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket);
 
 /* Puts the socket 'socket' in a blocking wait mode
@@ -62,6 +153,7 @@ int tcp_wait_for_connection(tcpsock_t *socket, tcpsock_t **new_socket);
  * If memory allocation for the new socket fails, TCP_MEMORY_ERROR is returned
  * If a socket operation (socket, listen, bind, accept, ...) fails, TCP_SOCKOP_ERROR is returned
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If 'socket' is non-blocking and no connection is pending, TCP_WOULD_BLOCK is returned
  */
 
 
@@ -70,6 +162,7 @@ int tcp_send(tcpsock_t *socket, void *buffer, int *buf_size);
 /* Initiates a send command on the socket 'socket' and tries to send the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than the initial '*buf_size'
  * If a socket error happens while sending the data in 'buffer' or the connection is closed, TCP_SOCKOP_ERROR or TCP_CONNECTION_CLOSED is returned, respectively
+ * If 'socket' is non-blocking and the send buffer is full, '*buf_size' is set to 0 and TCP_WOULD_BLOCK is returned
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
  */
 
@@ -79,6 +172,7 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size);
 /* Initiates a receive command on the socket 'socket' and tries to receive the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really received, which might be less than the inital '*buf_size'
  * If a socket error happens while receiving data or the connection is closed, TCP_SOCKOP_ERROR or TCP_CONNECTION_CLOSED is returned, respectively
+ * If 'socket' is non-blocking and no data is available, '*buf_size' is set to 0 and TCP_WOULD_BLOCK is returned
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
  */
 
@@ -86,7 +180,16 @@ int tcp_receive(tcpsock_t *socket, void *buffer, int *buf_size);
 int tcp_get_ip_addr(tcpsock_t *socket, char **ip_addr);
 
 /* Set '*ip_addr' to the IP address of 'socket' (could be NULL if the IP address is not set)
- * No memory allocation is done (pointer reference assignment!), hence, no free must be called to avoid a memory leak
+ * The address is kept in binary form and only formatted here, into a buffer of the calling thread that
+ * stays valid until its next call; hence, no free must be called to avoid a memory leak
+ * A listener reports the address it is bound to, an accepted socket its peer, a client its own address
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ */
+
+
+int tcp_get_addr(tcpsock_t *socket, struct sockaddr_storage *addr, socklen_t *len);
+
+/* Copies the address of 'socket' (see tcp_get_ip_addr()) into '*addr' and its length into '*len', 0 if not set
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
  */
 
@@ -104,4 +207,90 @@ int tcp_get_sd(tcpsock_t *socket, int *sd);
  */
 
 
+int tcp_get_family(tcpsock_t *socket, int *family);
+/* Return the address family of the 'socket': AF_INET, AF_INET6, or AF_UNIX for sockets of tcp_passive_open_local()
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ */
+
+
+int tcp_parse_addr(const char *ip, int port, struct sockaddr_storage *addr, socklen_t *len);
+
+/* Fills '*addr' with the IPv4 or IPv6 address 'ip' and 'port', or any IPv4 interface if 'ip' is NULL
+ * If 'ip' is not a valid address, TCP_ADDRESS_ERROR is returned
+ */
+
+
+int tcp_addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+/* Returns 1 if 'a' and 'b' are the same family, address and port (or the same Unix socket path)
+ */
+
+
+int tcp_set_nonblocking(tcpsock_t *socket, int enable);
+
+/* Switches 'socket' between blocking (enable == 0) and non-blocking mode
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If fcntl fails, TCP_SOCKOP_ERROR is returned
+ */
+
+
+int tcp_register(tcpsock_t *socket, evloop_t *loop, uint32_t events, tcp_event_cb_t cb, void *arg);
+
+/* Registers 'socket' with 'loop' for 'events'; 'cb' is called with 'arg' whenever the socket is ready
+ * A socket can be registered with at most one loop at a time
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If the registration fails (or 'socket' is already registered), TCP_LOOP_ERROR is returned
+ */
+
+
+int tcp_modify(tcpsock_t *socket, uint32_t events);
+
+/* Changes the event mask of a registered 'socket'
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * If 'socket' is not registered or the modification fails, TCP_LOOP_ERROR is returned
+ */
+
+
+int tcp_unregister(tcpsock_t *socket);
+
+/* Removes 'socket' from its event loop, doing nothing if it isn't registered
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ */
+
+
+int tcp_get_profile(tcp_profile_t profile, tcp_tuning_t *tuning);
+
+/* Fills '*tuning' with the socket options of the named 'profile'
+ * If 'profile' is unknown, TCP_PROFILE_ERROR is returned and '*tuning' holds the default profile
+ */
+
+
+int tcp_profile_from_name(const char *name, tcp_profile_t *profile);
+
+/* Looks up a profile by its name ("default", "low-latency", "high-throughput" or "low-memory")
+ * If 'name' is not a known profile, TCP_PROFILE_ERROR is returned
+ */
+
+
+const char *tcp_profile_name(tcp_profile_t profile);
+/* Returns the name of 'profile', or NULL if it is unknown
+ */
+
+
+int tcp_set_tuning(tcpsock_t *socket, const tcp_tuning_t *tuning);
+
+/* Applies the options in 'tuning' to 'socket'; options set on a listening socket are inherited by the
+ * sockets accepted on it, except TCP_QUICKACK which must be applied to each accepted socket
+ * Local (Unix domain) sockets only take the buffer sizes, the TCP options are skipped
+ * All options are tried, if at least one is rejected by the kernel TCP_SOCKOP_ERROR is returned
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ */
+
+
+int tcp_set_tuning_ex(tcpsock_t *socket, const tcp_tuning_t *tuning, char *rejected, size_t len);
+
+/* Same as tcp_set_tuning(), and writes the rejected options with their reason to 'rejected' ('len' bytes,
+ * e.g. "SO_BUSY_POLL (Operation not permitted)"), an empty string if all were applied
+ */
+
+
 #endif  //__TCPSOCK_H__
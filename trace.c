@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_BUSY      (1u << 30)  // the slot holds a record, cleared once it is written out
+#define TRACE_CLAIM     (1u << 31)  // trace_begin() is filling the slot in
+
+typedef struct {
+    _Atomic uint32_t pending;   // stage bits not stamped yet, with TRACE_BUSY; 0 for a free slot
+    trace_record_t rec;
+} trace_slot_t;
+
+struct trace {
+    FILE *file;
+    pthread_mutex_t lock;       // serializes the appends of the reactors and the shards
+    uint32_t mask;              // rate - 1
+    uint32_t expect;            // bits of the stages stamped after TRACE_PARSED
+    uint8_t missing;            // bits of the stages never stamped
+    trace_slot_t *slots;
+    _Atomic uint64_t sampled;
+    _Atomic uint64_t traced;
+    _Atomic uint64_t skipped;
+};
+
+
+static inline uint64_t trace_hash(sensor_id_t id, sensor_ts_t ts) {
+    uint64_t h = ((uint64_t) id << 48 ^ (uint64_t) ts) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+static void trace_emit(trace_t *t, trace_slot_t *slot) {
+    trace_record_t rec = slot->rec;
+    atomic_store_explicit(&slot->pending, 0, memory_order_release);
+    pthread_mutex_lock(&t->lock);
+    if (fwrite(&rec, sizeof(rec), 1, t->file) == 1) atomic_fetch_add_explicit(&t->traced, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+int trace_create(trace_t **trace, const char *path, uint32_t rate, int persisted) {
+    trace_t *t = calloc(1, sizeof(trace_t));
+    if (t == NULL) return TRACE_MEMORY_ERROR;
+    t->slots = calloc(TRACE_SLOTS, sizeof(trace_slot_t));
+    if (t->slots == NULL) {
+        free(t);
+        return TRACE_MEMORY_ERROR;
+    }
+    uint32_t r = 1;
+    while (r < rate && r < (1u << 31)) r <<= 1;
+    t->mask = r - 1;
+    t->expect = (1u << TRACE_ENQUEUED) | (1u << TRACE_WRITTEN) | (persisted ? 1u << TRACE_PERSISTED : 0);
+    t->missing = persisted ? 0 : 1u << TRACE_PERSISTED;
+    t->file = fopen(path, "wb");
+    if (t->file == NULL) {
+        free(t->slots);
+        free(t);
+        return TRACE_FILE_ERROR;
+    }
+    trace_header_t header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.stages = TRACE_STAGES;
+    header.rate = r;
+    fwrite(&header, sizeof(header), 1, t->file);
+    pthread_mutex_init(&t->lock, NULL);
+    *trace = t;
+    return TRACE_NO_ERROR;
+}
+
+
+void trace_free(trace_t **trace, trace_stats_t *stats) {
+    if (trace == NULL || *trace == NULL) return;
+    trace_t *t = *trace;
+    if (stats != NULL) {
+        stats->sampled = atomic_load(&t->sampled);
+        stats->traced = atomic_load(&t->traced);
+        stats->skipped = atomic_load(&t->skipped);
+    }
+    fclose(t->file);
+    pthread_mutex_destroy(&t->lock);
+    free(t->slots);
+    free(t);
+    *trace = NULL;
+}
+
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+
+int trace_begin(trace_t *t, const sensor_data_t *data, int reactor, uint64_t readable) {
+    uint64_t h = trace_hash(data->id, data->ts);
+    if ((h >> 32) & t->mask) return -1;
+    int index = (int) (h & (TRACE_SLOTS - 1));
+    trace_slot_t *slot = &t->slots[index];
+    uint64_t now = trace_now();
+    uint32_t pending = atomic_load_explicit(&slot->pending, memory_order_acquire);
+    // a busy slot is only taken over from a record that will never complete
+    if ((pending != 0 && (pending & TRACE_CLAIM || now - slot->rec.at[TRACE_READABLE] < TRACE_STALE_NS)) ||
+        !atomic_compare_exchange_strong(&slot->pending, &pending, TRACE_CLAIM)) {
+        atomic_fetch_add_explicit(&t->skipped, 1, memory_order_relaxed);
+        return -1;
+    }
+    memset(&slot->rec, 0, sizeof(slot->rec));
+    slot->rec.id = data->id;
+    slot->rec.ts = data->ts;
+    slot->rec.reactor = (uint8_t) reactor;
+    slot->rec.missing = t->missing;
+    slot->rec.at[TRACE_READABLE] = readable;
+    slot->rec.at[TRACE_PARSED] = now;
+    atomic_store_explicit(&slot->pending, t->expect | TRACE_BUSY, memory_order_release);
+    atomic_fetch_add_explicit(&t->sampled, 1, memory_order_relaxed);
+    return index;
+}
+
+
+void trace_stamp(trace_t *t, int index, int stage) {
+    trace_slot_t *slot = &t->slots[index];
+    uint32_t bit = 1u << stage;
+    slot->rec.at[stage] = trace_now();
+    uint32_t left = atomic_fetch_and_explicit(&slot->pending, ~bit, memory_order_acq_rel) & ~bit;
+    // the last stage writes the record out and frees the slot
+    if (left == TRACE_BUSY) trace_emit(t, slot);
+}
+
+
+void trace_written(trace_t *t, const sensor_data_t *data) {
+    uint64_t h = trace_hash(data->id, data->ts);
+    if ((h >> 32) & t->mask) return;
+    int index = (int) (h & (TRACE_SLOTS - 1));
+    trace_slot_t *slot = &t->slots[index];
+    uint32_t pending = atomic_load_explicit(&slot->pending, memory_order_acquire);
+    if (!(pending & (1u << TRACE_WRITTEN)) || (pending & TRACE_CLAIM)) return;
+    // a duplicate or a hash twin of the traced record is not the one in flight
+    if (slot->rec.id != data->id || slot->rec.ts != data->ts) return;
+    trace_stamp(t, index, TRACE_WRITTEN);
+}
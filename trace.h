@@ -0,0 +1,120 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include "config.h"
+
+#define TRACE_NO_ERROR          0
+#define TRACE_MEMORY_ERROR      1  // mem alloc error
+#define TRACE_FILE_ERROR        2  // the trace file can't be created
+
+/*
+ * Static tracepoints: with <sys/sdt.h> (systemtap-sdt-dev) at build time
+ * every TRACE_PROBEn() is a USDT probe of provider 'connmgr', a single nop
+ * until a tracer (bpftrace, perf, stap) attaches to it. Without the header
+ * they compile to nothing.
+ *   accept(fd, reactor)              a connection or ring was added
+ *   readable(fd, events)             the loop reported the connection
+ *   record(fd, sensor id, ts)        a record was parsed
+ *   enqueue(reactor, shard, sensor)  a record was queued to its writer shard
+ *   persist(reactor, epoch, conns)   an ack epoch became durable in the log
+ *   close(fd, reason, records)       a connection was torn down
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b)        DTRACE_PROBE2(connmgr, name, a, b)
+#define TRACE_PROBE3(name, a, b, c)     DTRACE_PROBE3(connmgr, name, a, b, c)
+#else
+#define TRACE_PROBE2(name, a, b)        do {} while (0)
+#define TRACE_PROBE3(name, a, b, c)     do {} while (0)
+#endif
+
+/*
+ * Sampled record trace: a fraction of the records is timestamped at every
+ * stage of the pipeline and appended to a binary trace file, which
+ * trace_report turns into per stage latency histograms. Whether a record
+ * is sampled follows from a hash of its sensor id and ts, so the writer
+ * shards find its slot again without anything travelling with the record.
+ * Unsampled records cost that hash and one compare.
+ *
+ * The file is a trace_header_t followed by trace_record_t entries, host
+ * byte order. Stages a record never passed (TRACE_PERSISTED without a
+ * write-ahead log) are 0 and flagged in 'missing'.
+ */
+#define TRACE_READABLE      0   // the loop reported its connection readable
+#define TRACE_PARSED        1   // decoded from the socket or taken from a ring
+#define TRACE_ENQUEUED      2   // queued to its writer shard
+#define TRACE_PERSISTED     3   // the reactor learned its ack epoch is durable
+#define TRACE_WRITTEN       4   // appended to the output by its shard
+#define TRACE_STAGES        5
+
+#define TRACE_SLOTS         16384   // records in flight at once, a sample finding its slot taken is skipped
+#define TRACE_STALE_NS      (60 * 1000000000ull)   // a slot never completed (e.g. a dropped duplicate) is reused
+#define TRACE_MAGIC         "CMTRACE1"
+
+typedef struct {
+    char magic[8];              // TRACE_MAGIC
+    uint32_t stages;            // TRACE_STAGES
+    uint32_t rate;              // one record in 'rate' is sampled
+} trace_header_t;
+
+typedef struct {
+    sensor_id_t id;
+    uint8_t reactor;
+    uint8_t missing;            // bit per stage without a timestamp
+    uint32_t reserved;
+    sensor_ts_t ts;
+    uint64_t at[TRACE_STAGES];  // CLOCK_MONOTONIC ns
+} trace_record_t;
+
+typedef struct trace trace_t;
+
+typedef struct {
+    uint64_t sampled;           // records that got a slot
+    uint64_t traced;            // records written to the trace file
+    uint64_t skipped;           // samples whose slot was taken
+} trace_stats_t;
+
+
+int trace_create(trace_t **trace, const char *path, uint32_t rate, int persisted);
+
+/* Creates the trace file 'path' and samples one record in 'rate' (rounded up to a power of two);
+ * 'persisted' tells whether records pass TRACE_PERSISTED, otherwise a trace completes without it
+ * If memory allocation fails, TRACE_MEMORY_ERROR is returned
+ * If the file can't be created, TRACE_FILE_ERROR is returned
+ */
+
+
+void trace_free(trace_t **trace, trace_stats_t *stats);
+
+/* Flushes and closes the trace file, copies the final counters to 'stats' if not NULL, frees all memory
+ * and sets '*trace' to NULL; samples still in flight are lost
+ */
+
+
+uint64_t trace_now();
+/* Returns the CLOCK_MONOTONIC time in ns, the clock of the stages
+ */
+
+
+int trace_begin(trace_t *trace, const sensor_data_t *data, int reactor, uint64_t readable);
+
+/* Starts the trace of 'data' if it is sampled: stamps TRACE_READABLE with 'readable' and TRACE_PARSED now
+ * Returns its slot, or -1 if the record is not sampled or its slot is taken
+ */
+
+
+void trace_stamp(trace_t *trace, int slot, int stage);
+
+/* Stamps 'stage' of the record in 'slot' now; the stage completing the record writes it to the file
+ * Any thread may stamp, every stage exactly once
+ */
+
+
+void trace_written(trace_t *trace, const sensor_data_t *data);
+
+/* Stamps TRACE_WRITTEN if 'data' is a sampled record in flight, called by the writer shards for every record
+ */
+
+
+#endif  //__TRACE_H__
@@ -0,0 +1,118 @@
+/*
+ * Per stage latency of a record trace written by the server with -Y (see
+ * trace.h): for every step of the pipeline the distribution of the time the
+ * sampled records spent in it, as a log2 histogram with its percentiles.
+ *
+ * Usage: trace_report file [sensor id]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+#define REPORT_BUCKETS  40      // log2 buckets of ns, the last one takes everything above
+
+typedef struct {
+    const char *name;
+    int from;
+    int to;
+} report_step_t;
+
+static const report_step_t steps[] = {
+        {"readable -> parsed",    TRACE_READABLE, TRACE_PARSED},
+        {"parsed -> enqueued",    TRACE_PARSED,   TRACE_ENQUEUED},
+        {"enqueued -> persisted", TRACE_ENQUEUED, TRACE_PERSISTED},
+        {"enqueued -> written",   TRACE_ENQUEUED, TRACE_WRITTEN},
+        {"readable -> written",   TRACE_READABLE, TRACE_WRITTEN},
+};
+
+#define REPORT_STEPS    (sizeof(steps) / sizeof(steps[0]))
+
+static int report_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void report_time(char *buf, size_t size, uint64_t ns) {
+    if (ns < 10000) snprintf(buf, size, "%"PRIu64" ns", ns);
+    else if (ns < 10000000) snprintf(buf, size, "%"PRIu64" us", ns / 1000);
+    else snprintf(buf, size, "%"PRIu64" ms", ns / 1000000);
+}
+
+static void report_step(const report_step_t *step, uint64_t *lat, size_t n) {
+    char p50[32], p90[32], p99[32], max[32];
+    printf("\n%s: %zu records\n", step->name, n);
+    if (n == 0) return;
+    qsort(lat, n, sizeof(uint64_t), &report_cmp);
+    report_time(p50, sizeof(p50), lat[n / 2]);
+    report_time(p90, sizeof(p90), lat[n * 90 / 100]);
+    report_time(p99, sizeof(p99), lat[n * 99 / 100]);
+    report_time(max, sizeof(max), lat[n - 1]);
+    printf("  p50 %s, p90 %s, p99 %s, max %s\n", p50, p90, p99, max);
+    size_t hist[REPORT_BUCKETS] = {0}, peak = 0;
+    int first = REPORT_BUCKETS, last = 0;
+    for (size_t i = 0; i < n; i++) {
+        int b = 0;
+        while (b < REPORT_BUCKETS - 1 && lat[i] >> (b + 1)) b++;
+        if (++hist[b] > peak) peak = hist[b];
+        if (b < first) first = b;
+        if (b > last) last = b;
+    }
+    for (int b = first; b <= last; b++) {
+        char low[32];
+        report_time(low, sizeof(low), b == 0 ? 0 : (uint64_t) 1 << b);
+        int bar = (int) (hist[b] * 50 / peak);
+        printf("  >= %-9s %10zu %5.1f%% ", low, hist[b], 100.0 * (double) hist[b] / (double) n);
+        for (int i = 0; i < bar; i++) putchar('#');
+        putchar('\n');
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file [sensor id]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long only = argc > 2 ? atol(argv[2]) : -1;
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.stages != TRACE_STAGES) {
+        fprintf(stderr, "%s is not a record trace\n", argv[1]);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    uint64_t *lat[REPORT_STEPS];
+    size_t n[REPORT_STEPS] = {0}, size = 1024, records = 0;
+    for (size_t s = 0; s < REPORT_STEPS; s++) lat[s] = malloc(sizeof(uint64_t) * size);
+    trace_record_t rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (only >= 0 && rec.id != only) continue;
+        if (records == size) {
+            size *= 2;
+            for (size_t s = 0; s < REPORT_STEPS; s++) lat[s] = realloc(lat[s], sizeof(uint64_t) * size);
+        }
+        records++;
+        for (size_t s = 0; s < REPORT_STEPS; s++) {
+            if (rec.missing & (1u << steps[s].from | 1u << steps[s].to)) continue;
+            // the shard may write a record before its reactor learned it is durable
+            uint64_t from = rec.at[steps[s].from], to = rec.at[steps[s].to];
+            lat[s][n[s]++] = to > from ? to - from : 0;
+        }
+    }
+    fclose(f);
+    printf("%zu records traced, one in %"PRIu32" sampled\n", records, header.rate);
+    for (size_t s = 0; s < REPORT_STEPS; s++) {
+        // skips a stage the server did not pass, e.g. persisted without a log
+        if (records == 0 || n[s] > 0) report_step(&steps[s], lat[s], n[s]);
+        free(lat[s]);
+    }
+    return EXIT_SUCCESS;
+}
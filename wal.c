@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "crc32.h"
+
+#define WAL_HEADER_SIZE     (3 * sizeof(uint32_t))
+#define WAL_READ_BYTES      (1024 * 1024)
+
+typedef struct {
+    int shard;
+    uint64_t seq;
+} wal_segment_t;
+
+struct wal {
+    char *dir;
+    int shard;
+    int nshards;
+    size_t segment_bytes;
+    uint64_t seq;               // sequence number of the current segment
+    int fd;
+    size_t size;                // bytes in the current segment
+    unsigned char *buf;         // appended, not yet written batches
+    size_t len;
+    size_t cap;
+    uint64_t commits;
+    uint64_t bytes;
+    uint64_t failures;
+};
+
+
+static int wal_list(wal_t *wal, wal_segment_t **segments);
+
+static int wal_create_segment(wal_t *wal);
+
+static void wal_path(const wal_t *wal, int shard, uint64_t seq, char *path, size_t len) {
+    snprintf(path, len, "%s/shard-%d-%016"PRIx64".wal", wal->dir, shard, seq);
+}
+
+
+int wal_open(wal_t **wal, const char *dir, int shard, int nshards, size_t segment_bytes) {
+    wal_t *w = calloc(1, sizeof(wal_t));
+    if (w == NULL) return WAL_MEMORY_ERROR;
+    w->dir = strdup(dir);
+    w->shard = shard;
+    w->nshards = nshards;
+    w->segment_bytes = segment_bytes;
+    w->fd = -1;
+    if (w->dir == NULL) {
+        wal_close(&w);
+        return WAL_MEMORY_ERROR;
+    }
+    // the shards of one writer race to create it
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        wal_close(&w);
+        return WAL_FILE_ERROR;
+    }
+    // continue after the newest segment this shard owns, older ones are replayed and deleted
+    wal_segment_t *segments;
+    int n = wal_list(w, &segments);
+    if (n < 0) {
+        wal_close(&w);
+        return WAL_MEMORY_ERROR;
+    }
+    for (int i = 0; i < n; i++) {
+        if (segments[i].seq >= w->seq) w->seq = segments[i].seq + 1;
+    }
+    free(segments);
+    if (wal_create_segment(w) != WAL_NO_ERROR) {
+        wal_close(&w);
+        return WAL_FILE_ERROR;
+    }
+    *wal = w;
+    return WAL_NO_ERROR;
+}
+
+
+void wal_close(wal_t **wal) {
+    if (wal == NULL || *wal == NULL) return;
+    wal_t *w = *wal;
+    if (w->fd >= 0) close(w->fd);
+    free(w->buf);
+    free(w->dir);
+    free(w);
+    *wal = NULL;
+}
+
+
+int wal_replay(wal_t *wal, uint64_t from, wal_replay_cb_t cb, void *arg) {
+    wal_segment_t *segments;
+    int res = WAL_NO_ERROR;
+    int n = wal_list(wal, &segments);
+    if (n < 0) return WAL_MEMORY_ERROR;
+    unsigned char *buf = malloc(WAL_READ_BYTES);
+    if (buf == NULL) {
+        free(segments);
+        return WAL_MEMORY_ERROR;
+    }
+    for (int i = 0; i < n; i++) {
+        char path[4096];
+        if (segments[i].seq < from || (segments[i].shard == wal->shard && segments[i].seq == wal->seq)) continue;
+        wal_path(wal, segments[i].shard, segments[i].seq, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            res = WAL_FILE_ERROR;
+            continue;
+        }
+        size_t len = 0;
+        int valid = 1;
+        while (valid) {
+            ssize_t r = read(fd, buf + len, WAL_READ_BYTES - len);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            len += (size_t) r;
+            size_t pos = 0;
+            while (len - pos >= WAL_HEADER_SIZE) {
+                uint32_t hdr[3];
+                memcpy(hdr, buf + pos, WAL_HEADER_SIZE);
+                size_t body = (size_t) hdr[1] * SENSOR_DATA_WIRE_SIZE;
+                if (hdr[0] != WAL_MAGIC || WAL_HEADER_SIZE + body > WAL_READ_BYTES) {
+                    valid = 0;
+                    break;
+                }
+                if (len - pos < WAL_HEADER_SIZE + body) break;
+                const unsigned char *rec = buf + pos + WAL_HEADER_SIZE;
+                if (crc32_update(0, rec, body) != hdr[2]) {
+                    valid = 0;
+                    break;
+                }
+                for (uint32_t k = 0; k < hdr[1]; k++) {
+                    sensor_data_t data;
+                    sensor_data_unpack(&data, rec + k * SENSOR_DATA_WIRE_SIZE);
+                    cb(&data, arg);
+                }
+                pos += WAL_HEADER_SIZE + body;
+            }
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+        }
+        close(fd);
+    }
+    free(buf);
+    free(segments);
+    return res;
+}
+
+
+int wal_append(wal_t *wal, const sensor_data_t *records, uint32_t n) {
+    size_t need = WAL_HEADER_SIZE + (size_t) n * SENSOR_DATA_WIRE_SIZE;
+    if (wal->len + need > wal->cap) {
+        size_t cap = wal->cap ? wal->cap : 64 * 1024;
+        while (cap < wal->len + need) cap *= 2;
+        unsigned char *b = realloc(wal->buf, cap);
+        if (b == NULL) return WAL_MEMORY_ERROR;
+        wal->buf = b;
+        wal->cap = cap;
+    }
+    unsigned char *rec = wal->buf + wal->len + WAL_HEADER_SIZE;
+    for (uint32_t i = 0; i < n; i++) sensor_data_pack(rec + i * SENSOR_DATA_WIRE_SIZE, &records[i]);
+    uint32_t hdr[3] = {WAL_MAGIC, n, crc32_update(0, rec, (size_t) n * SENSOR_DATA_WIRE_SIZE)};
+    memcpy(wal->buf + wal->len, hdr, WAL_HEADER_SIZE);
+    wal->len += need;
+    return WAL_NO_ERROR;
+}
+
+
+int wal_commit(wal_t *wal) {
+    size_t done = 0;
+    // the segment a failed commit left behind couldn't be replaced yet
+    if (wal->fd < 0 && wal_create_segment(wal) != WAL_NO_ERROR) return WAL_FILE_ERROR;
+    while (done < wal->len) {
+        ssize_t n = write(wal->fd, wal->buf + done, wal->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        done += (size_t) n;
+    }
+    int res = (done == wal->len) ? WAL_NO_ERROR : WAL_FILE_ERROR;
+    // one sync for every batch appended since the previous commit
+    if (done > 0) {
+        wal->commits++;
+        if (fdatasync(wal->fd) != 0) res = WAL_FILE_ERROR;
+    }
+    if (res != WAL_NO_ERROR) {
+        // after a failed write or sync nothing past the last commit can be trusted: cut the torn tail off and
+        // keep the batches for the next commit, in a new segment so the replay of this one ends cleanly
+        wal->failures++;
+        if (ftruncate(wal->fd, (off_t) wal->size) != 0) {}
+        close(wal->fd);
+        wal->seq++;
+        wal_create_segment(wal);    // if it fails too, the next commit tries again
+        return res;
+    }
+    wal->size += done;
+    wal->bytes += done;
+    wal->len = 0;
+    return res;
+}
+
+
+int wal_full(wal_t *wal) {
+    return wal->size >= wal->segment_bytes;
+}
+
+
+int wal_rotate(wal_t *wal) {
+    wal_segment_t *segments;
+    if (wal->fd >= 0) close(wal->fd);
+    wal->fd = -1;
+    wal->len = 0;
+    wal->seq++;
+    if (wal_create_segment(wal) != WAL_NO_ERROR) return WAL_FILE_ERROR;
+    int n = wal_list(wal, &segments);
+    for (int i = 0; i < n; i++) {
+        char path[4096];
+        if (segments[i].shard == wal->shard && segments[i].seq == wal->seq) continue;
+        wal_path(wal, segments[i].shard, segments[i].seq, path, sizeof(path));
+        unlink(path);
+    }
+    if (n >= 0) free(segments);
+    return WAL_NO_ERROR;
+}
+
+
+uint64_t wal_seq(wal_t *wal) {
+    return wal->seq;
+}
+
+
+void wal_get_stats(wal_t *wal, uint64_t *commits, uint64_t *bytes, uint64_t *failures) {
+    *commits = wal->commits;
+    *bytes = wal->bytes;
+    *failures = wal->failures;
+}
+
+
+static int wal_compare(const void *a, const void *b) {
+    const wal_segment_t *x = a, *y = b;
+    if (x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+    return x->shard - y->shard;
+}
+
+/*
+ * Returns the segments owned by this shard sorted by sequence number, or -1.
+ */
+static int wal_list(wal_t *wal, wal_segment_t **segments) {
+    int n = 0, size = 16;
+    wal_segment_t *s = malloc(sizeof(wal_segment_t) * size);
+    if (s == NULL) return -1;
+    DIR *d = opendir(wal->dir);
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        int shard, len = 0;
+        uint64_t seq;
+        if (sscanf(e->d_name, "shard-%d-%"SCNx64".wal%n", &shard, &seq, &len) != 2 ||
+            e->d_name[len] != '\0' || shard < 0 || shard % wal->nshards != wal->shard) {
+            continue;
+        }
+        if (n == size) {
+            wal_segment_t *t = realloc(s, sizeof(wal_segment_t) * size * 2);
+            if (t == NULL) break;
+            s = t;
+            size *= 2;
+        }
+        s[n].shard = shard;
+        s[n].seq = seq;
+        n++;
+    }
+    if (d != NULL) closedir(d);
+    qsort(s, n, sizeof(wal_segment_t), &wal_compare);
+    *segments = s;
+    return n;
+}
+
+static int wal_create_segment(wal_t *wal) {
+    char path[4096];
+    wal_path(wal, wal->shard, wal->seq, path, sizeof(path));
+    wal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    wal->size = 0;
+    if (wal->fd < 0) return WAL_FILE_ERROR;
+    // make the new name durable, the records are synced by every commit
+    int dfd = open(wal->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return WAL_NO_ERROR;
+}
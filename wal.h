@@ -0,0 +1,87 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+
+#define WAL_NO_ERROR        0
+#define WAL_MEMORY_ERROR    1  // mem alloc error
+#define WAL_FILE_ERROR      2  // a segment can't be created, written, synced or read
+
+#define WAL_MAGIC           0x314C4157u     // "WAL1"
+
+/*
+ * A shard logs to segments '<dir>/shard-<shard>-<seq>.wal'. A segment is a
+ * sequence of batches: magic (4), record count (4), CRC-32 of the records
+ * (4), then the packed records. A torn or corrupt batch ends the replay of
+ * its segment.
+ */
+
+typedef struct wal wal_t;
+
+typedef void (*wal_replay_cb_t)(const sensor_data_t *data, void *arg);
+
+
+int wal_open(wal_t **wal, const char *dir, int shard, int nshards, size_t segment_bytes);
+
+/* Starts a new segment for 'shard' in 'dir' after every segment left by a previous run, creating 'dir' if needed
+ * Segments of shard numbers above 'nshards' (a previous run had more shards) are owned by shard 'number % nshards'
+ * If memory allocation fails, WAL_MEMORY_ERROR is returned
+ * If 'dir' or the segment can't be created, WAL_FILE_ERROR is returned
+ */
+
+
+void wal_close(wal_t **wal);
+
+/* Closes the segment without committing, frees all memory and sets '*wal' to NULL
+ */
+
+
+int wal_replay(wal_t *wal, uint64_t from, wal_replay_cb_t cb, void *arg);
+
+/* Calls 'cb' for every record of the segments this shard owns from previous runs, oldest first
+ * Segments numbered below 'from' are skipped, e.g. because a checkpoint already covers them
+ * Returns WAL_FILE_ERROR if a segment can't be read, the remaining segments are still replayed
+ */
+
+
+int wal_append(wal_t *wal, const sensor_data_t *records, uint32_t n);
+
+/* Adds a batch of 'n' records to the log, it is durable after the next wal_commit()
+ * If memory allocation fails, WAL_MEMORY_ERROR is returned
+ */
+
+
+int wal_commit(wal_t *wal);
+
+/* Writes the appended batches and makes them durable with one fdatasync
+ * If the write or the sync fails, WAL_FILE_ERROR is returned: the segment is truncated to its last commit, a new
+ * one is started and the batches stay appended, the next commit writes them again
+ */
+
+
+int wal_full(wal_t *wal);
+/* Returns 1 if the current segment reached the segment size and should be rotated
+ */
+
+
+int wal_rotate(wal_t *wal);
+
+/* Starts a new segment and deletes every older one this shard owns, batches not committed yet are dropped
+ * Only call it when all logged records are durable elsewhere
+ * If the new segment can't be created, WAL_FILE_ERROR is returned
+ */
+
+
+uint64_t wal_seq(wal_t *wal);
+/* Returns the number of the current segment, the next wal_rotate() starts segment wal_seq() + 1
+ */
+
+
+void wal_get_stats(wal_t *wal, uint64_t *commits, uint64_t *bytes, uint64_t *failures);
+/* Returns the number of fdatasync calls, the bytes logged and the commits that failed
+ */
+
+
+#endif  //__WAL_H__
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+
+#include "wheel.h"
+
+struct wheel {
+    uint32_t tick;              // ms per slot
+    uint32_t mask;              // slots - 1, a power of two
+    uint64_t current;           // first tick not expired yet
+    uint64_t next;              // no node is in a tick before this one, from 'current' on
+    size_t count;
+    wheel_node_t *slots;        // list heads, empty when pointing at themselves
+};
+
+
+static inline int wheel_empty(const wheel_node_t *head) {
+    return head->next == head;
+}
+
+int wheel_create(wheel_t **wheel, uint32_t span_ms, uint32_t tick_ms, uint64_t now) {
+    wheel_t *w = malloc(sizeof(wheel_t));
+    if (w == NULL) return WHEEL_MEMORY_ERROR;
+    w->tick = tick_ms > 0 ? tick_ms : 1;
+    // one slot more than the span for the tick in progress, one more for a deadline in the middle of one
+    uint64_t need = (uint64_t) span_ms / w->tick + 2, slots = 1;
+    while (slots < need) slots <<= 1;
+    w->slots = malloc(sizeof(wheel_node_t) * slots);
+    if (w->slots == NULL) {
+        free(w);
+        return WHEEL_MEMORY_ERROR;
+    }
+    for (uint64_t i = 0; i < slots; i++) w->slots[i].next = w->slots[i].prev = &w->slots[i];
+    w->mask = (uint32_t) (slots - 1);
+    w->current = now / w->tick;
+    w->next = w->current;
+    w->count = 0;
+    *wheel = w;
+    return WHEEL_NO_ERROR;
+}
+
+
+void wheel_free(wheel_t **wheel) {
+    if (wheel == NULL || *wheel == NULL) return;
+    free((*wheel)->slots);
+    free(*wheel);
+    *wheel = NULL;
+}
+
+
+void wheel_add(wheel_t *w, wheel_node_t *node, uint64_t deadline) {
+    uint64_t t = deadline / w->tick;
+    if (t < w->current) t = w->current;
+    if (t > w->current + w->mask) t = w->current + w->mask;
+    if (t < w->next) w->next = t;
+    wheel_remove(w, node);
+    wheel_node_t *head = &w->slots[t & w->mask];
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+    w->count++;
+}
+
+
+void wheel_remove(wheel_t *w, wheel_node_t *node) {
+    if (node->prev == NULL) return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+    w->count--;
+}
+
+
+int64_t wheel_advance(wheel_t *w, uint64_t now, wheel_cb_t expired, void *arg) {
+    uint64_t end = now / w->tick;
+    // after a long sleep one turn visits every slot, older ticks are in them as well
+    if (end > w->current + w->mask + 1) w->current = end - w->mask - 1;
+    while (w->current < end) {
+        wheel_node_t *head = &w->slots[w->current & w->mask];
+        w->current++;
+        if (wheel_empty(head)) continue;
+        // move the slot aside first: a callback may add nodes to any slot, this one included
+        wheel_node_t due = {head->next, head->prev};
+        due.next->prev = &due;
+        due.prev->next = &due;
+        head->next = head->prev = head;
+        while (!wheel_empty(&due)) {
+            wheel_node_t *node = due.next;
+            due.next = node->next;
+            node->next->prev = &due;
+            node->next = node->prev = NULL;
+            w->count--;
+            expired(node, arg);
+        }
+    }
+    if (w->count == 0) return -1;
+    if (w->next < w->current) w->next = w->current;
+    while (wheel_empty(&w->slots[w->next & w->mask])) w->next++;
+    uint64_t at = (w->next + 1) * w->tick;
+    return at > now ? (int64_t) (at - now) : 0;
+}
+
+
+size_t wheel_count(wheel_t *w) {
+    return w->count;
+}
@@ -0,0 +1,70 @@
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WHEEL_NO_ERROR          0
+#define WHEEL_MEMORY_ERROR      1  // mem alloc error
+
+/*
+ * Hashed timer wheel: a ring of slots of 'tick' milliseconds, each a
+ * circular list of the timers that expire in it. The timers are nodes
+ * embedded in the caller's own structs, adding, moving and removing one is
+ * a few pointer writes and allocates nothing. Deadlines lie at most one
+ * turn of the wheel ahead, later ones are put in the last slot of the turn;
+ * a timer fires in the tick of its deadline or the one after, never before.
+ */
+
+typedef struct wheel_node wheel_node_t;
+struct wheel_node {
+    wheel_node_t *next;
+    wheel_node_t *prev;         // NULL while the node is in no slot
+};
+
+typedef struct wheel wheel_t;
+
+typedef void (*wheel_cb_t)(wheel_node_t *node, void *arg);
+/* Callback of wheel_advance() for an expired node, already removed; it may add the node again
+ */
+
+
+int wheel_create(wheel_t **wheel, uint32_t span_ms, uint32_t tick_ms, uint64_t now);
+
+/* Creates an empty wheel of 'tick_ms' slots covering at least 'span_ms' from 'now' (ms, monotonic)
+ * If memory allocation fails, WHEEL_MEMORY_ERROR is returned
+ */
+
+
+void wheel_free(wheel_t **wheel);
+
+/* Frees the slots and sets '*wheel' to NULL; nodes still in it are left alone, they belong to the caller
+ */
+
+
+void wheel_add(wheel_t *wheel, wheel_node_t *node, uint64_t deadline);
+
+/* Puts 'node' in the slot of 'deadline', moving it if it is already in one
+ */
+
+
+void wheel_remove(wheel_t *wheel, wheel_node_t *node);
+
+/* Takes 'node' out of its slot, nothing happens if it is in none
+ */
+
+
+int64_t wheel_advance(wheel_t *wheel, uint64_t now, wheel_cb_t expired, void *arg);
+
+/* Calls 'expired' for every node of the slots that ended by 'now' and returns the ms until the end
+ * of the first slot that still holds a node, or -1 if the wheel is empty
+ */
+
+
+size_t wheel_count(wheel_t *wheel);
+
+/* Returns the number of nodes in the wheel
+ */
+
+
+#endif  //__WHEEL_H__
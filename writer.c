@@ -0,0 +1,593 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "writer.h"
+#include "ring.h"
+#include "reorder.h"
+#include "wal.h"
+#include "snapshot.h"
+
+typedef struct {
+    writer_t *writer;
+    int id;
+    pthread_t thread;
+    int started;
+    int efd;                    // doorbell, written by producers only while 'sleeping' is set
+    _Atomic int sleeping;
+    _Atomic int stop;
+    ring_t **rings;             // one queue per producer
+    sensor_data_t *batch;       // records popped in one round, WRITER_BATCH_RECORDS per producer
+    uint32_t *counts;           // records popped per producer in this round
+    unsigned char *held;        // per producer: the batch couldn't be logged, it is retried before popping more
+    int log_failed;             // the last commit failed, reported once until one succeeds
+    wal_t *wal;                 // NULL without write-ahead log
+    uint64_t *logged;           // per producer: records logged since the last commit
+    _Atomic uint64_t *committed;    // per producer: records durable in the log
+    uint64_t last_commit;       // CLOCK_MONOTONIC ms
+    char *snap_path;            // checkpoint of the shard state, next to the log
+    uint64_t last_checkpoint;   // CLOCK_MONOTONIC ms
+    reorder_t *reorder;         // NULL if reordering is disabled
+    rules_eval_t *eval;         // NULL without rules
+    writer_sink_t sink;
+    writer_sink_flush_t sink_flush;
+    void *sink_arg;
+    int alert_fd;
+    size_t alert_len;
+    char *alert;
+    int fd;
+    size_t out_len;
+    unsigned char *out;
+    writer_stats_t stats;
+} writer_shard_t;
+
+struct writer {
+    int nshards;
+    int nproducers;
+    int wal_interval;
+    int checkpoint_interval;
+    writer_commit_t commit;
+    void *commit_arg;
+    writer_save_t save;
+    writer_load_t load;
+    void *sink_arg;
+    writer_shard_t *shards;
+    uint64_t *pushed;           // [producer * nshards + shard], records pushed by each producer
+    unsigned char *dirty;       // [producer * nshards + shard], set by push, cleared by signal
+    uint64_t *stalls;           // per producer
+};
+
+
+static void *writer_run(void *arg);
+
+static void writer_flush(writer_shard_t *shard);
+
+static void writer_emit(const sensor_data_t *data, void *arg);
+
+static void writer_alert(writer_shard_t *s, const sensor_data_t *data, uint32_t mask);
+
+static void writer_process(const sensor_data_t *data, void *arg);
+
+static void writer_replay(const sensor_data_t *data, void *arg);
+
+static void writer_pin(writer_shard_t *s);
+
+static void writer_unpin(writer_shard_t *s);
+
+static void writer_commit(writer_shard_t *s);
+
+static void writer_ack(writer_shard_t *s);
+
+static void writer_checkpoint(writer_shard_t *s);
+
+static uint64_t writer_restore(writer_shard_t *s);
+
+static uint64_t writer_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+
+void writer_config_init(writer_config_t *config) {
+    memset(config, 0, sizeof(writer_config_t));
+    config->shards = 1;
+    config->producers = 1;
+    config->path = "sensor_data_recv";
+    config->reorder_window = 16;
+    config->reorder_lag = 2;
+    config->wal_segment_bytes = 64 * 1024 * 1024;
+}
+
+
+int writer_create(writer_t **writer, const writer_config_t *config) {
+    int shards = config->shards, producers = config->producers;
+    if (shards < 1) shards = 1;
+    if (shards > WRITER_MAX_SHARDS) shards = WRITER_MAX_SHARDS;
+    writer_t *w = calloc(1, sizeof(writer_t));
+    if (w == NULL) return WRITER_MEMORY_ERROR;
+    w->nshards = shards;
+    w->nproducers = producers;
+    w->wal_interval = config->wal_interval;
+    w->checkpoint_interval = config->checkpoint_interval;
+    w->commit = config->commit;
+    w->commit_arg = config->commit_arg;
+    w->save = config->save;
+    w->load = config->load;
+    w->sink_arg = config->sink_arg;
+    w->shards = calloc(shards, sizeof(writer_shard_t));
+    w->dirty = calloc((size_t) shards * producers, 1);
+    w->pushed = calloc((size_t) shards * producers, sizeof(uint64_t));
+    w->stalls = calloc(producers, sizeof(uint64_t));
+    if (w->shards == NULL || w->dirty == NULL || w->pushed == NULL || w->stalls == NULL) {
+        writer_free(&w);
+        return WRITER_MEMORY_ERROR;
+    }
+    for (int i = 0; i < shards; i++) {
+        writer_shard_t *s = &w->shards[i];
+        s->writer = w;
+        s->id = i;
+        s->fd = -1;
+        s->efd = -1;
+        s->alert_fd = -1;
+        s->sink = config->sink;
+        s->sink_flush = config->sink_flush;
+        s->sink_arg = config->sink_arg;
+        atomic_init(&s->sleeping, 0);
+        atomic_init(&s->stop, 0);
+    }
+    for (int i = 0; i < shards; i++) {
+        writer_shard_t *s = &w->shards[i];
+        s->rings = calloc(producers, sizeof(ring_t *));
+        s->batch = malloc(sizeof(sensor_data_t) * WRITER_BATCH_RECORDS * producers);
+        s->counts = calloc(producers, sizeof(uint32_t));
+        s->held = calloc(producers, 1);
+        s->logged = calloc(producers, sizeof(uint64_t));
+        s->committed = calloc(producers, sizeof(_Atomic uint64_t));
+        s->out = malloc(WRITER_OUT_BYTES);
+        if (s->rings == NULL || s->batch == NULL || s->counts == NULL || s->held == NULL || s->logged == NULL || s->committed == NULL ||
+            s->out == NULL) {
+            writer_free(&w);
+            return WRITER_MEMORY_ERROR;
+        }
+        if (config->reorder_window > 0 &&
+            reorder_create(&s->reorder, config->reorder_window, config->reorder_lag) != REORDER_NO_ERROR) {
+            writer_free(&w);
+            return WRITER_MEMORY_ERROR;
+        }
+        for (int p = 0; p < producers; p++) {
+            s->rings[p] = ring_create(WRITER_RING_RECORDS, sizeof(sensor_data_t));
+            if (s->rings[p] == NULL) {
+                writer_free(&w);
+                return WRITER_MEMORY_ERROR;
+            }
+        }
+        // O_APPEND makes every batch land whole at the end of the file, whatever the other shards do
+        s->fd = open(config->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (s->fd < 0) {
+            writer_free(&w);
+            return WRITER_FILE_ERROR;
+        }
+        if (config->rules != NULL) {
+            s->alert = malloc(WRITER_ALERT_BYTES);
+            if (s->alert == NULL || rules_eval_create(&s->eval, config->rules) != RULES_NO_ERROR) {
+                writer_free(&w);
+                return WRITER_MEMORY_ERROR;
+            }
+            s->alert_fd = open(config->alerts, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (s->alert_fd < 0) {
+                writer_free(&w);
+                return WRITER_FILE_ERROR;
+            }
+        }
+        if (config->wal_dir != NULL) {
+            int res = wal_open(&s->wal, config->wal_dir, i, shards, config->wal_segment_bytes);
+            if (res != WAL_NO_ERROR) {
+                writer_free(&w);
+                return res == WAL_MEMORY_ERROR ? WRITER_MEMORY_ERROR : WRITER_FILE_ERROR;
+            }
+            if (asprintf(&s->snap_path, "%s/shard-%d.snap", config->wal_dir, i) < 0) {
+                s->snap_path = NULL;
+                writer_free(&w);
+                return WRITER_MEMORY_ERROR;
+            }
+        }
+        s->efd = eventfd(0, EFD_CLOEXEC);
+        if (s->efd < 0 || pthread_create(&s->thread, NULL, &writer_run, s) != 0) {
+            writer_free(&w);
+            return WRITER_THREAD_ERROR;
+        }
+        s->started = 1;
+    }
+    *writer = w;
+    return WRITER_NO_ERROR;
+}
+
+
+void writer_stop(writer_t *writer) {
+    for (int i = 0; writer->shards != NULL && i < writer->nshards; i++) {
+        writer_shard_t *s = &writer->shards[i];
+        if (!s->started) continue;
+        uint64_t one = 1;
+        atomic_store(&s->stop, 1);
+        if (write(s->efd, &one, sizeof(one)) < 0) {}
+        pthread_join(s->thread, NULL);
+        s->started = 0;
+    }
+}
+
+
+void writer_free(writer_t **writer) {
+    if (writer == NULL || *writer == NULL) return;
+    writer_t *w = *writer;
+    writer_stop(w);
+    for (int i = 0; w->shards != NULL && i < w->nshards; i++) {
+        writer_shard_t *s = &w->shards[i];
+        if (s->fd >= 0) close(s->fd);
+        if (s->efd >= 0) close(s->efd);
+        if (s->alert_fd >= 0) close(s->alert_fd);
+        free(s->alert);
+        rules_eval_free(&s->eval);
+        for (int p = 0; s->rings != NULL && p < w->nproducers; p++) {
+            if (s->rings[p] != NULL) ring_free(&s->rings[p]);
+        }
+        free(s->rings);
+        free(s->batch);
+        free(s->counts);
+        free(s->held);
+        free(s->logged);
+        free(s->committed);
+        wal_close(&s->wal);
+        free(s->snap_path);
+        free(s->out);
+        reorder_free(&s->reorder);
+    }
+    free(w->shards);
+    free(w->dirty);
+    free(w->pushed);
+    free(w->stalls);
+    free(w);
+    *writer = NULL;
+}
+
+
+int writer_shard_of(writer_t *writer, sensor_id_t id) {
+    return writer_shard_hash(id, writer->nshards);
+}
+
+
+int writer_shard_hash(sensor_id_t id, int shards) {
+    // multiplicative hash, so sensors numbered in steps of nshards still spread over all shards
+    return (int) ((((uint32_t) id * 2654435761u) >> 16) % (uint32_t) shards);
+}
+
+
+void writer_push(writer_t *writer, int producer, const sensor_data_t *data) {
+    int shard = writer_shard_of(writer, data->id);
+    writer_shard_t *s = &writer->shards[shard];
+    ring_t *r = s->rings[producer];
+    writer->dirty[producer * writer->nshards + shard] = 1;
+    writer->pushed[producer * writer->nshards + shard]++;
+    if (ring_push(r, data)) return;
+    // backpressure: never drop a reading, let the shard catch up
+    writer->stalls[producer]++;
+    do {
+        writer_signal(writer, producer);
+        sched_yield();
+    } while (!ring_push(r, data));
+    writer->dirty[producer * writer->nshards + shard] = 1;
+}
+
+
+void writer_signal(writer_t *writer, int producer) {
+    unsigned char *dirty = writer->dirty + producer * writer->nshards;
+    for (int i = 0; i < writer->nshards; i++) {
+        if (!dirty[i]) continue;
+        dirty[i] = 0;
+        writer_shard_t *s = &writer->shards[i];
+        // only the producer that finds the shard asleep pays for the system call
+        if (atomic_exchange(&s->sleeping, 0)) {
+            uint64_t one = 1;
+            if (write(s->efd, &one, sizeof(one)) < 0) {}
+        }
+    }
+}
+
+
+void writer_get_stats(writer_t *writer, writer_stats_t *stats) {
+    memset(stats, 0, sizeof(writer_stats_t));
+    for (int i = 0; i < writer->nshards; i++) {
+        writer_stats_t *s = &writer->shards[i].stats;
+        stats->records += s->records;
+        stats->bytes += s->bytes;
+        stats->writes += s->writes;
+        stats->wakeups += s->wakeups;
+        stats->alerts += s->alerts;
+        stats->replayed += s->replayed;
+        stats->checkpoints += s->checkpoints;
+        stats->restored += s->restored;
+        if (writer->shards[i].wal != NULL) {
+            uint64_t commits, bytes, failures;
+            wal_get_stats(writer->shards[i].wal, &commits, &bytes, &failures);
+            stats->commits += commits;
+            stats->logged += bytes;
+            stats->log_errors += failures;
+        }
+        if (writer->shards[i].reorder != NULL) {
+            reorder_stats_t rs;
+            reorder_get_stats(writer->shards[i].reorder, &rs);
+            stats->duplicates += rs.duplicates;
+            stats->late += rs.late;
+        }
+    }
+    for (int p = 0; p < writer->nproducers; p++) stats->stalls += writer->stalls[p];
+}
+
+
+int writer_shards(writer_t *writer) {
+    return writer->nshards;
+}
+
+
+void writer_mark(writer_t *writer, int producer, uint64_t *marks) {
+    memcpy(marks, writer->pushed + producer * writer->nshards, sizeof(uint64_t) * writer->nshards);
+}
+
+
+int writer_durable(writer_t *writer, int producer, const uint64_t *marks) {
+    for (int i = 0; i < writer->nshards; i++) {
+        if (atomic_load(&writer->shards[i].committed[producer]) < marks[i]) return 0;
+    }
+    return 1;
+}
+
+
+static void *writer_run(void *arg) {
+    writer_shard_t *s = (writer_shard_t *) arg;
+    writer_t *w = s->writer;
+    if (s->wal != NULL) {
+        // restart from the last checkpoint and replay only the log written after it
+        wal_replay(s->wal, writer_restore(s), &writer_replay, s);
+        writer_checkpoint(s);
+        s->last_commit = writer_clock();
+    }
+    while (1) {
+        uint32_t total = 0, held = 0;
+        int wait = -1;
+        // readings of slow or silent sensors leave the window on time, not with their next reading
+        if (s->reorder != NULL) {
+            writer_pin(s);
+            wait = reorder_expire(s->reorder, writer_clock(), &writer_emit, s);
+            writer_unpin(s);
+        }
+        for (int p = 0; p < w->nproducers; p++) {
+            if (!s->held[p]) {
+                s->counts[p] = ring_pop(s->rings[p], s->batch + p * WRITER_BATCH_RECORDS, WRITER_BATCH_RECORDS);
+            }
+            s->held[p] = 0;
+            if (s->counts[p] > 0 && s->wal != NULL) {
+                // a batch that can't be logged is neither processed nor acknowledged, its queue fills up instead
+                if (wal_append(s->wal, s->batch + p * WRITER_BATCH_RECORDS, s->counts[p]) != WAL_NO_ERROR) {
+                    s->held[p] = 1;
+                    held++;
+                    continue;
+                }
+                s->logged[p] += s->counts[p];
+            }
+            total += s->counts[p];
+        }
+        // group commit: one sync per round, or per interval while the producers keep the queues busy
+        if (s->wal != NULL && (total == 0 || w->wal_interval == 0 ||
+                               writer_clock() - s->last_commit >= (uint64_t) w->wal_interval)) {
+            writer_commit(s);
+        }
+        // the rule table is pinned only while records are checked, never across the log or the output file
+        writer_pin(s);
+        for (int p = 0; p < w->nproducers; p++) {
+            if (s->held[p]) continue;
+            for (uint32_t i = 0; i < s->counts[p]; i++) writer_process(&s->batch[p * WRITER_BATCH_RECORDS + i], s);
+        }
+        writer_unpin(s);
+        if (s->wal != NULL && (wal_full(s->wal) || (w->checkpoint_interval > 0 &&
+                                                     writer_clock() - s->last_checkpoint >=
+                                                     (uint64_t) w->checkpoint_interval * 1000))) {
+            writer_checkpoint(s);
+        }
+        if (total > 0) continue;
+        // the queues are empty: write out what we have before going to sleep
+        if (atomic_load(&s->stop)) {
+            // the batches the log refused go out unlogged, the final checkpoint covers them
+            writer_pin(s);
+            for (int p = 0; p < w->nproducers; p++) {
+                if (!s->held[p]) continue;
+                s->held[p] = 0;
+                for (uint32_t i = 0; i < s->counts[p]; i++) writer_process(&s->batch[p * WRITER_BATCH_RECORDS + i], s);
+            }
+            // nothing can overtake the held records anymore
+            if (s->reorder != NULL) reorder_flush(s->reorder, &writer_emit, s);
+            writer_unpin(s);
+            writer_flush(s);
+            if (s->wal != NULL) writer_checkpoint(s);       // a clean stop leaves nothing to replay
+            break;
+        }
+        writer_flush(s);
+        if (held > 0) {
+            // no doorbell rings for a batch we hold, retry once the log had a moment
+            struct timespec pause = {0, WRITER_RETRY_MS * 1000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        atomic_store(&s->sleeping, 1);
+        int pending = 0;
+        for (int p = 0; p < w->nproducers && !pending; p++) pending = ring_count(s->rings[p]) > 0;
+        if (pending || atomic_load(&s->stop)) {
+            atomic_store(&s->sleeping, 0);
+            continue;
+        }
+        // sleep until a producer rings or the next held record falls due
+        uint64_t value;
+        struct pollfd pfd = {.fd = s->efd, .events = POLLIN};
+        if (poll(&pfd, 1, wait) > 0 && read(s->efd, &value, sizeof(value)) > 0) s->stats.wakeups++;
+        else atomic_store(&s->sleeping, 0);
+    }
+    return NULL;
+}
+
+static void writer_process(const sensor_data_t *data, void *arg) {
+    writer_shard_t *s = (writer_shard_t *) arg;
+    if (s->reorder != NULL) reorder_push(s->reorder, data, &writer_emit, s);
+    else writer_emit(data, s);
+}
+
+static void writer_replay(const sensor_data_t *data, void *arg) {
+    writer_shard_t *s = (writer_shard_t *) arg;
+    s->stats.replayed++;
+    // the log is read between the records, don't keep the rules pinned across it
+    writer_pin(s);
+    writer_process(data, s);
+    writer_unpin(s);
+}
+
+static void writer_pin(writer_shard_t *s) {
+    if (s->eval != NULL) rules_begin(s->eval);
+}
+
+static void writer_unpin(writer_shard_t *s) {
+    if (s->eval != NULL) rules_end(s->eval);
+}
+
+static void writer_commit(writer_shard_t *s) {
+    s->last_commit = writer_clock();
+    if (wal_commit(s->wal) != WAL_NO_ERROR) {
+        // no acknowledgement for what isn't durable: the batches stay in the log and are committed again
+        if (!s->log_failed) fprintf(stderr, "Write-ahead log of shard %d failed, acknowledgements wait\n", s->id);
+        s->log_failed = 1;
+        return;
+    }
+    if (s->log_failed) fprintf(stderr, "Write-ahead log of shard %d recovered\n", s->id);
+    s->log_failed = 0;
+    writer_ack(s);
+}
+
+static void writer_ack(writer_shard_t *s) {
+    writer_t *w = s->writer;
+    for (int p = 0; p < w->nproducers; p++) {
+        if (s->logged[p] == 0) continue;
+        atomic_fetch_add(&s->committed[p], s->logged[p]);
+        s->logged[p] = 0;
+        if (w->commit != NULL) w->commit(p, w->commit_arg);
+    }
+}
+
+/*
+ * Every logged record is now either durable in the output file or part of
+ * the shard state (held by a reorder window, counted by the rules), so once
+ * that state is saved the segments holding them can go.
+ */
+static void writer_checkpoint(writer_shard_t *s) {
+    writer_t *w = s->writer;
+    snapshot_t *snap;
+    s->last_checkpoint = writer_clock();
+    writer_commit(s);
+    writer_flush(s);
+    if (fdatasync(s->fd) != 0) return;
+    // the snapshot covers every segment up to the current one
+    if (snapshot_create(&snap, s->snap_path, (uint32_t) w->nshards, wal_seq(s->wal) + 1) != SNAPSHOT_NO_ERROR) return;
+    if (s->eval != NULL) rules_eval_save(s->eval, snap);
+    if (w->save != NULL) w->save(s->id, snap, w->sink_arg);
+    if (s->reorder != NULL) reorder_save(s->reorder, snap);
+    if (snapshot_commit(&snap) != SNAPSHOT_NO_ERROR) return;
+    s->stats.checkpoints++;
+    // what a failed commit left appended is durable now too
+    wal_rotate(s->wal);
+    writer_ack(s);
+}
+
+/*
+ * Loads the state of the last checkpoint and returns the first segment it
+ * doesn't cover, 0 to replay the whole log without a usable snapshot.
+ */
+static uint64_t writer_restore(writer_shard_t *s) {
+    writer_t *w = s->writer;
+    snapshot_map_t *map;
+    uint32_t nshards, tag;
+    uint64_t seq;
+    const void *data;
+    size_t len;
+    if (snapshot_open(&map, s->snap_path) != SNAPSHOT_NO_ERROR) return 0;
+    snapshot_info(map, &nshards, &seq);
+    // with another number of shards the sensors of this one were spread differently
+    if (nshards != (uint32_t) w->nshards) {
+        snapshot_close(&map);
+        return 0;
+    }
+    while (snapshot_next(map, &tag, &data, &len)) {
+        if (tag == SNAPSHOT_REORDER && s->reorder != NULL) {
+            writer_pin(s);
+            reorder_load(s->reorder, data, len, &writer_emit, s);
+            writer_unpin(s);
+        }
+        else if (tag == SNAPSHOT_RULES && s->eval != NULL) rules_eval_load(s->eval, data, len);
+        else if (w->load != NULL) w->load(s->id, tag, data, len, w->sink_arg);
+    }
+    snapshot_close(&map);
+    s->stats.restored++;
+    return seq;
+}
+
+static void writer_emit(const sensor_data_t *data, void *arg) {
+    writer_shard_t *s = (writer_shard_t *) arg;
+    if (s->out_len + SENSOR_DATA_WIRE_SIZE > WRITER_OUT_BYTES) writer_flush(s);
+    sensor_data_pack(s->out + s->out_len, data);
+    s->out_len += SENSOR_DATA_WIRE_SIZE;
+    s->stats.records++;
+    if (s->sink != NULL) s->sink(s->id, data, s->sink_arg);
+    if (s->eval != NULL) {
+        uint32_t mask = rules_check(s->eval, data);
+        if (mask != 0) writer_alert(s, data, mask);
+    }
+}
+
+static void writer_alert(writer_shard_t *s, const sensor_data_t *data, uint32_t mask) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%ld %"PRIu16" %g", (long) data->ts, data->id, data->value);
+    for (uint32_t bit = 1; bit <= mask && len < (int) sizeof(line) - 16; bit <<= 1) {
+        if (mask & bit) len += snprintf(line + len, sizeof(line) - len, " %s", rules_name(bit));
+    }
+    line[len++] = '\n';
+    if (s->alert_len + len > WRITER_ALERT_BYTES) writer_flush(s);
+    memcpy(s->alert + s->alert_len, line, len);
+    s->alert_len += len;
+    s->stats.alerts++;
+}
+
+static void writer_flush(writer_shard_t *s) {
+    size_t done = 0;
+    while (done < s->out_len) {
+        ssize_t n = write(s->fd, s->out + done, s->out_len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;  // disk full or I/O error: the batch is lost, keep serving
+        }
+        done += (size_t) n;
+    }
+    if (s->out_len > 0) s->stats.writes++;
+    s->stats.bytes += done;
+    s->out_len = 0;
+    // whole lines per write, so the alerts of the shards never interleave
+    if (s->alert_len > 0 && write(s->alert_fd, s->alert, s->alert_len) < 0) {}
+    s->alert_len = 0;
+    if (s->sink_flush != NULL) s->sink_flush(s->id, s->sink_arg);
+}
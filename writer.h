@@ -0,0 +1,165 @@
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "rules.h"
+#include "snapshot.h"
+
+#define WRITER_NO_ERROR         0
+#define WRITER_MEMORY_ERROR     1  // mem alloc error
+#define WRITER_FILE_ERROR       2  // the output file can't be opened
+#define WRITER_THREAD_ERROR     3  // a shard thread or its doorbell can't be created
+
+#define WRITER_MAX_SHARDS       64
+#define WRITER_RING_RECORDS     65536   // records queued per (producer, shard) pair
+#define WRITER_BATCH_RECORDS    1024    // records a shard takes from one queue at once
+#define WRITER_OUT_BYTES        (64 * 1024)
+#define WRITER_RETRY_MS         10      // pause before a batch the write-ahead log refused is appended again
+#define WRITER_ALERT_BYTES      (16 * 1024)
+
+typedef struct writer writer_t;
+
+typedef void (*writer_sink_t)(int shard, const sensor_data_t *data, void *arg);
+/* Called by shard thread 'shard' for every record it writes, concurrently for sensors of different shards
+ */
+
+typedef void (*writer_sink_flush_t)(int shard, void *arg);
+/* Called by shard thread 'shard' after every batch it wrote, e.g. to wake the consumers of the sink once
+ */
+
+typedef void (*writer_commit_t)(int producer, void *arg);
+/* Called by a shard thread after records of 'producer' became durable in the write-ahead log
+ */
+
+typedef void (*writer_save_t)(int shard, snapshot_t *snap, void *arg);
+/* Called by shard thread 'shard' while it checkpoints, to add the sink's state of its sensors to 'snap'
+ */
+
+typedef void (*writer_load_t)(int shard, uint32_t tag, const void *data, size_t len, void *arg);
+/* Called by shard thread 'shard' on start for every section of its checkpoint the writer doesn't own
+ */
+
+typedef struct {
+    int shards;                 // writer threads
+    int producers;              // threads calling writer_push()
+    const char *path;           // output file, records are appended
+    int reorder_window;         // records held per sensor to restore ts order, 0 disables reordering and dedup
+    int reorder_lag;            // seconds a record waits at most for older readings of its sensor
+    rules_t *rules;             // alert rules checked on every written record, NULL for none
+    const char *alerts;         // file the alerts are appended to, required with 'rules'
+    writer_sink_t sink;         // optional consumer of the written records
+    writer_sink_flush_t sink_flush;
+    void *sink_arg;
+    const char *wal_dir;        // directory of the write-ahead log segments, NULL disables the log
+    size_t wal_segment_bytes;   // size at which a shard starts a new segment
+    int wal_interval;           // ms between commits while records keep coming in, 0 commits every round
+    int checkpoint_interval;    // seconds between checkpoints of the shard state, 0 only when a segment is full
+    writer_commit_t commit;     // optional, see writer_durable()
+    void *commit_arg;
+    writer_save_t save;         // optional, with 'sink_arg'
+    writer_load_t load;
+} writer_config_t;
+
+typedef struct {
+    uint64_t records;       // records written to the output file
+    uint64_t bytes;
+    uint64_t writes;        // write() calls on the output file
+    uint64_t wakeups;       // times a sleeping shard was woken by a producer
+    uint64_t stalls;        // pushes that found a full queue and had to wait
+    uint64_t duplicates;    // retransmitted records dropped by the reorder window
+    uint64_t late;          // records written after a newer reading of the same sensor
+    uint64_t alerts;        // records that fired at least one rule
+    uint64_t commits;       // write-ahead log syncs
+    uint64_t logged;        // bytes written to the write-ahead log
+    uint64_t log_errors;    // commits that failed, their batches were committed again later
+    uint64_t replayed;      // records recovered from the log of a previous run
+    uint64_t checkpoints;   // snapshots of the shard state written
+    uint64_t restored;      // shards that started from a snapshot
+} writer_stats_t;
+
+
+void writer_config_init(writer_config_t *config);
+/* Fills 'config' with the defaults: one shard, one producer, sensor_data_recv, a 16 record window and 2 s lag,
+ * no write-ahead log (64 MiB segments, a commit every round once enabled)
+ */
+
+
+int writer_create(writer_t **writer, const writer_config_t *config);
+
+/* Starts the shard threads appending to 'config->path', fed by 'config->producers' producer threads
+ * Every producer owns a private lock-free queue per shard, so producers never contend with each other
+ * Each shard passes the records of its sensors through a reorder window (see reorder.h) before writing
+ * and checks the written records against 'config->rules', alerts are lines appended to 'config->alerts'
+ * With 'config->wal_dir', every record is logged and committed before it is processed; when a segment is full,
+ * every 'checkpoint_interval' and on stop a shard syncs the output and saves its state (reorder windows, rule
+ * history, the sections of 'config->save') to '<wal_dir>/shard-<n>.snap', then drops the older segments
+ * On start each shard loads its snapshot and replays the segments written after it (at least once: records
+ * the output already had may repeat)
+ * If memory allocation fails, WRITER_MEMORY_ERROR is returned
+ * If 'path' can't be opened for appending, WRITER_FILE_ERROR is returned
+ * If a thread or eventfd can't be created, WRITER_THREAD_ERROR is returned
+ */
+
+
+void writer_stop(writer_t *writer);
+
+/* Lets every shard drain its queues, release its reorder windows and flush, then joins the threads
+ * No producer may push anymore when this is called; the statistics stay readable until writer_free()
+ */
+
+
+void writer_free(writer_t **writer);
+
+/* Stops the shards if still running, frees all memory and sets '*writer' to NULL
+ */
+
+
+int writer_shard_of(writer_t *writer, sensor_id_t id);
+/* Returns the shard that handles sensor 'id'; all readings of one sensor go to the same shard
+ */
+
+
+int writer_shard_hash(sensor_id_t id, int shards);
+/* Same as writer_shard_of() for a writer with 'shards' shards, usable before writer_create() returned
+ */
+
+
+void writer_push(writer_t *writer, int producer, const sensor_data_t *data);
+
+/* Queues 'data' from 'producer' (0 .. producers - 1) on the shard of its sensor id
+ * Only the thread owning 'producer' may call this; if the queue is full it wakes the shard and waits
+ * The shard is not woken for each record, call writer_signal() once per batch
+ */
+
+
+void writer_signal(writer_t *writer, int producer);
+
+/* Wakes the sleeping shards that received records from 'producer' since its previous signal
+ */
+
+
+int writer_shards(writer_t *writer);
+/* Returns the number of shards
+ */
+
+
+void writer_mark(writer_t *writer, int producer, uint64_t *marks);
+
+/* Copies the number of records 'producer' pushed to each shard into 'marks' (writer_shards() entries)
+ * Only the thread owning 'producer' may call this
+ */
+
+
+int writer_durable(writer_t *writer, int producer, const uint64_t *marks);
+
+/* Returns 1 if every record counted by an earlier writer_mark() of 'producer' is durable in the log
+ */
+
+
+void writer_get_stats(writer_t *writer, writer_stats_t *stats);
+/* Sums the statistics of all shards into '*stats'
+ */
+
+
+#endif  //__WRITER_H__